@@ -0,0 +1,127 @@
+#!/bin/bash
+
+# Measure bfc compile times and the speed and size of the programs it
+# generates. Results are written to bench_output.txt as tab-separated
+# program, metric and value columns.
+#
+# Usage: ./benchmark.sh [BASELINE_FILE]
+#
+# If a baseline (a previous bench_output.txt) is given, any metric
+# that is more than BENCH_THRESHOLD percent (default 10) worse than
+# the baseline is reported, and the script exits with status 1.
+#
+# Every run's output is compared with the expected output in
+# sample_programs/, and the script also exits with status 1 if any
+# differ.
+
+GREEN=$(tput setaf 2)
+RED=$(tput setaf 1)
+WHITE=$(tput setaf 7)
+
+BOLD=$(tput bold)
+RESET=$(tput sgr0)
+
+function summary {
+    echo -e "$BOLD$GREEN==>$WHITE ${1}$RESET"
+}
+
+BFC=./target/release/bfc
+OUTPUT=bench_output.txt
+BASELINE=$1
+THRESHOLD=${BENCH_THRESHOLD:-10}
+RUN_OUTPUT=$(mktemp)
+WRONG_OUTPUT=0
+
+# Print the wall time, in seconds, taken to run the command given. Its
+# stdout is saved in RUN_OUTPUT.
+function seconds {
+    local TIMEFORMAT=%R
+    { time "$@" > $RUN_OUTPUT 2> /dev/null ; } 2>&1
+}
+
+# Report whether the last command run by seconds printed the contents
+# of the file given.
+function check_output {
+    if ! cmp -s $RUN_OUTPUT $2; then
+        echo "$RED  $1: output differs from $2$RESET"
+        WRONG_OUTPUT=1
+    fi
+}
+
+function record {
+    echo -e "$1\t$2\t$3" >> $OUTPUT
+    echo "  $2: $3"
+}
+
+function benchmark_program {
+    local label=$1
+    local program=$2
+    local input=$3
+    local expected=$4
+    local source=sample_programs/$program
+    local executable="${program%.*}"
+
+    summary "Benchmarking $label"
+
+    for opt in 0 1 2; do
+        record $label compile_O${opt}_s $(seconds $BFC --opt=$opt $source)
+    done
+
+    # The last compile was at the default --opt=2.
+    record $label binary_bytes $(wc -c < $executable | tr -d ' ')
+    record $label runtime_s $(seconds sh -c "./$executable < $input")
+    check_output runtime_s $expected
+    record $label interpret_s $(seconds sh -c "$BFC --interpret $source < $input")
+    check_output interpret_s $expected
+    record $label jit_s $(seconds sh -c "$BFC --run $source < $input")
+    check_output jit_s $expected
+
+    rm -f $executable
+}
+
+# Print every metric that's worse than the baseline by more than
+# THRESHOLD percent. Returns non-zero if there were any.
+function compare_to_baseline {
+    summary "Comparing with $BASELINE"
+    awk -F'\t' -v threshold=$THRESHOLD -v red="$RED" -v reset="$RESET" '
+        NR == FNR { baseline[$1 "\t" $2] = $3; next }
+        ($1 "\t" $2) in baseline {
+            old = baseline[$1 "\t" $2]
+            if (old > 0 && $3 > old * (1 + threshold / 100)) {
+                printf "%s%s %s: %s -> %s%s\n", red, $1, $2, old, $3, reset
+                regressed = 1
+            }
+        }
+        END { exit regressed }
+    ' $BASELINE $OUTPUT
+}
+
+if [ ! -x $BFC ]; then
+    echo "$BFC not found, run cargo build --release first."
+    exit 1
+fi
+
+rm -f $OUTPUT
+
+# Factoring large numbers takes much longer than the sample input.
+long_factor_input=$(mktemp)
+long_factor_output=$(mktemp)
+printf '123456789\n999999937\n' > $long_factor_input
+printf '123456789: 3 3 3607 3803\n999999937: 999999937\n' > $long_factor_output
+
+for program in bangbang.bf hello_world.bf bottles.bf factor.bf mandelbrot.bf life.bf; do
+    input=sample_programs/${program}.in
+    if [ ! -f $input ]; then
+        input=/dev/null
+    fi
+    benchmark_program $program $program $input sample_programs/${program}.out
+done
+
+benchmark_program factor.bf-long-input factor.bf $long_factor_input $long_factor_output
+rm -f $long_factor_input $long_factor_output $RUN_OUTPUT
+
+if [ -n "$BASELINE" ]; then
+    compare_to_baseline || exit 1
+fi
+
+exit $WRONG_OUTPUT
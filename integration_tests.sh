@@ -21,8 +21,8 @@ failed=0
 function compile_and_run {
     local test_program=$1
 
-    # Compile the file.
-    ./target/release/bfc sample_programs/$test_program
+    # Compile the file, passing any other arguments to bfc.
+    ./target/release/bfc sample_programs/$test_program "${@:2}"
     if [[ $? -ne 0 ]]; then
         echo "Compilation failed!"
         failed=1
@@ -57,8 +57,8 @@ function compile_and_run {
 }
 
 function check_program {
-    summary "Testing $1"
-    compile_and_run $1
+    summary "Testing $*"
+    compile_and_run "$@"
 
     # Cleanup.
     rm -f ${1%.*} output.txt
@@ -71,4 +71,10 @@ check_program factor.bf
 check_program mandelbrot.bf
 check_program life.bf
 
+if [[ $(uname -s -m) == "Linux x86_64" ]]; then
+    check_program hello_world.bf --linker=builtin
+    check_program factor.bf --linker=builtin
+    check_program mandelbrot.bf --linker=builtin --tape=guarded
+fi
+
 exit $failed
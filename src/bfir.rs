@@ -5,7 +5,6 @@
 //! It also provides functions for generating ASTs from source code,
 //! producing good error messages on malformed inputs.
 
-use std::collections::HashMap;
 use std::fmt;
 use std::num::Wrapping;
 
@@ -15,12 +14,49 @@ use pretty_assertions::assert_eq;
 use self::AstNode::*;
 
 /// A cell is the fundamental BF datatype that we work with. BF
-/// requires this to be at least one byte, we provide a cell of
-/// exactly one byte.
-pub type Cell = Wrapping<i8>;
+/// requires this to be at least one byte, and we support cells of
+/// one, two or four bytes (see `CellWidth`).
+///
+/// Amounts in the AST are stored at the widest width. Wrapping
+/// addition and multiplication give the same low bits at any width,
+/// so the IR and peephole optimisations are valid for every width, and
+/// amounts are only truncated when executing or generating code.
+pub type Cell = Wrapping<i32>;
+
+/// The number of bits in each cell of the compiled program.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum CellWidth {
+    Bits8,
+    Bits16,
+    Bits32,
+}
+
+impl CellWidth {
+    pub fn bits(self) -> u32 {
+        match self {
+            CellWidth::Bits8 => 8,
+            CellWidth::Bits16 => 16,
+            CellWidth::Bits32 => 32,
+        }
+    }
+
+    pub fn bytes(self) -> usize {
+        self.bits() as usize / 8
+    }
+
+    /// Truncate `value` to this width, sign extending the result,
+    /// so each cell value has exactly one representation.
+    pub fn wrap(self, value: Cell) -> Cell {
+        match self {
+            CellWidth::Bits8 => Wrapping(i32::from(value.0 as i8)),
+            CellWidth::Bits16 => Wrapping(i32::from(value.0 as i16)),
+            CellWidth::Bits32 => value,
+        }
+    }
+}
 
 /// An inclusive range used for tracking positions in source code.
-#[derive(PartialEq, Eq, Clone, Copy)]
+#[derive(PartialEq, Eq, Hash, Clone, Copy)]
 pub struct Position {
     pub start: usize,
     pub end: usize,
@@ -67,7 +103,7 @@ impl Combine<Option<Position>> for Option<Position> {
 }
 
 /// `AstNode` represents a node in our BF AST.
-#[derive(PartialEq, Eq, Debug, Clone)]
+#[derive(PartialEq, Eq, Hash, Debug, Clone)]
 pub enum AstNode {
     Increment {
         amount: Cell,
@@ -95,8 +131,17 @@ pub enum AstNode {
         offset: isize,
         position: Option<Position>,
     },
+    /// Zero the current cell, adding its value multiplied by each
+    /// factor to the cell at that offset. `changes` is sorted by
+    /// offset, and doesn't include offset 0.
     MultiplyMove {
-        changes: HashMap<isize, Cell>,
+        changes: Vec<(isize, Cell)>,
+        position: Option<Position>,
+    },
+    /// Move the pointer by `stride` until the current cell is
+    /// zero, e.g. `[>]` or `[<<]`.
+    Scan {
+        stride: isize,
         position: Option<Position>,
     },
 }
@@ -141,18 +186,123 @@ pub fn get_position(instr: &AstNode) -> Option<Position> {
         Loop { position, .. } => position,
         Set { position, .. } => position,
         MultiplyMove { position, .. } => position,
+        Scan { position, .. } => position,
     }
 }
 
+/// The total number of nodes in `instrs`, including loop bodies.
+pub fn count_nodes(instrs: &[AstNode]) -> usize {
+    instrs
+        .iter()
+        .map(|instr| match instr {
+            Loop { body, .. } => 1 + count_nodes(body),
+            _ => 1,
+        })
+        .sum()
+}
+
+/// Remove source positions from `instrs`, so we can compare
+/// instructions regardless of where they appear in the source.
+pub fn strip_positions(instrs: Vec<AstNode>) -> Vec<AstNode> {
+    instrs
+        .into_iter()
+        .map(|instr| match instr {
+            Increment { amount, offset, .. } => Increment {
+                amount,
+                offset,
+                position: None,
+            },
+            PointerIncrement { amount, .. } => PointerIncrement {
+                amount,
+                position: None,
+            },
+            Read { .. } => Read { position: None },
+            Write { .. } => Write { position: None },
+            Loop { body, .. } => Loop {
+                body: strip_positions(body),
+                position: None,
+            },
+            Set { amount, offset, .. } => Set {
+                amount,
+                offset,
+                position: None,
+            },
+            MultiplyMove { changes, .. } => MultiplyMove {
+                changes,
+                position: None,
+            },
+            Scan { stride, .. } => Scan {
+                stride,
+                position: None,
+            },
+        })
+        .collect()
+}
+
 #[derive(Debug)]
 pub struct ParseError {
     pub message: String,
     pub position: Position,
 }
 
+/// Append an Increment for the `+` or `-` at `index`. If the previous
+/// instruction is an Increment that ends immediately before `index`,
+/// extend it instead, so runs like `+++` only produce one node.
+fn push_increment(instrs: &mut Vec<AstNode>, amount: Cell, index: usize) {
+    if let Some(Increment {
+        amount: prev_amount,
+        position: Some(position),
+        ..
+    }) = instrs.last_mut()
+    {
+        if position.end + 1 == index {
+            *prev_amount += amount;
+            position.end = index;
+            return;
+        }
+    }
+
+    instrs.push(Increment {
+        amount,
+        offset: 0,
+        position: Some(Position {
+            start: index,
+            end: index,
+        }),
+    });
+}
+
+/// Append a PointerIncrement for the `>` or `<` at `index`, merging
+/// runs in the same way as `push_increment`.
+fn push_ptr_increment(instrs: &mut Vec<AstNode>, amount: isize, index: usize) {
+    if let Some(PointerIncrement {
+        amount: prev_amount,
+        position: Some(position),
+    }) = instrs.last_mut()
+    {
+        if position.end + 1 == index {
+            *prev_amount += amount;
+            position.end = index;
+            return;
+        }
+    }
+
+    instrs.push(PointerIncrement {
+        amount,
+        position: Some(Position {
+            start: index,
+            end: index,
+        }),
+    });
+}
+
 /// Given a string of BF source code, parse and return our BF IR
 /// representation. If parsing fails, return an Info describing what
 /// went wrong.
+///
+/// Positions are byte offsets into `source`. Adjacent `+-` and `<>`
+/// characters are merged as we go, so large machine-generated
+/// programs don't need a node for every character.
 pub fn parse(source: &str) -> Result<Vec<AstNode>, ParseError> {
     // AstNodes in the current loop (or toplevel).
     let mut instructions = vec![];
@@ -160,55 +310,31 @@ pub fn parse(source: &str) -> Result<Vec<AstNode>, ParseError> {
     // and the starting indices of the loops.
     let mut stack = vec![];
 
-    for (index, c) in source.chars().enumerate() {
+    // BF commands are all ASCII, so we can work on bytes and skip
+    // over any multi-byte characters in comments.
+    for (index, c) in source.bytes().enumerate() {
         match c {
-            '+' => instructions.push(Increment {
-                amount: Wrapping(1),
-                offset: 0,
-                position: Some(Position {
-                    start: index,
-                    end: index,
-                }),
-            }),
-            '-' => instructions.push(Increment {
-                amount: Wrapping(-1),
-                offset: 0,
-                position: Some(Position {
-                    start: index,
-                    end: index,
-                }),
-            }),
-            '>' => instructions.push(PointerIncrement {
-                amount: 1,
-                position: Some(Position {
-                    start: index,
-                    end: index,
-                }),
-            }),
-            '<' => instructions.push(PointerIncrement {
-                amount: -1,
-                position: Some(Position {
-                    start: index,
-                    end: index,
-                }),
-            }),
-            ',' => instructions.push(Read {
+            b'+' => push_increment(&mut instructions, Wrapping(1), index),
+            b'-' => push_increment(&mut instructions, Wrapping(-1), index),
+            b'>' => push_ptr_increment(&mut instructions, 1, index),
+            b'<' => push_ptr_increment(&mut instructions, -1, index),
+            b',' => instructions.push(Read {
                 position: Some(Position {
                     start: index,
                     end: index,
                 }),
             }),
-            '.' => instructions.push(Write {
+            b'.' => instructions.push(Write {
                 position: Some(Position {
                     start: index,
                     end: index,
                 }),
             }),
-            '[' => {
+            b'[' => {
                 stack.push((instructions, index));
                 instructions = vec![];
             }
-            ']' => {
+            b']' => {
                 if let Some((mut parent_instr, open_index)) = stack.pop() {
                     parent_instr.push(Loop {
                         body: instructions,
@@ -246,6 +372,37 @@ pub fn parse(source: &str) -> Result<Vec<AstNode>, ParseError> {
     Ok(instructions)
 }
 
+#[test]
+fn count_nodes_in_loops() {
+    let instrs = parse("+[>[.]]").unwrap();
+    assert_eq!(count_nodes(&instrs), 5);
+}
+
+#[test]
+fn strip_positions_recursively() {
+    let instrs = parse("+[>.]").unwrap();
+    assert_eq!(
+        strip_positions(instrs),
+        [
+            Increment {
+                amount: Wrapping(1),
+                offset: 0,
+                position: None,
+            },
+            Loop {
+                body: vec![
+                    PointerIncrement {
+                        amount: 1,
+                        position: None,
+                    },
+                    Write { position: None }
+                ],
+                position: None,
+            }
+        ]
+    );
+}
+
 #[test]
 fn parse_increment() {
     assert_eq!(
@@ -258,21 +415,67 @@ fn parse_increment() {
     );
     assert_eq!(
         parse("++").unwrap(),
+        [Increment {
+            amount: Wrapping(2),
+            offset: 0,
+            position: Some(Position { start: 0, end: 1 }),
+        }]
+    );
+}
+
+#[test]
+fn parse_merges_adjacent_increments() {
+    assert_eq!(
+        parse("++- +").unwrap(),
         [
             Increment {
                 amount: Wrapping(1),
                 offset: 0,
-                position: Some(Position { start: 0, end: 0 }),
+                position: Some(Position { start: 0, end: 2 }),
             },
             Increment {
                 amount: Wrapping(1),
                 offset: 0,
-                position: Some(Position { start: 1, end: 1 }),
+                position: Some(Position { start: 4, end: 4 }),
             }
         ]
     );
 }
 
+#[test]
+fn parse_merges_adjacent_ptr_increments() {
+    assert_eq!(
+        parse(">><+>").unwrap(),
+        [
+            PointerIncrement {
+                amount: 1,
+                position: Some(Position { start: 0, end: 2 }),
+            },
+            Increment {
+                amount: Wrapping(1),
+                offset: 0,
+                position: Some(Position { start: 3, end: 3 }),
+            },
+            PointerIncrement {
+                amount: 1,
+                position: Some(Position { start: 4, end: 4 }),
+            }
+        ]
+    );
+}
+
+/// Positions are byte offsets, so they match the offsets that
+/// diagnostics use to find lines and columns.
+#[test]
+fn parse_positions_are_byte_offsets() {
+    assert_eq!(
+        parse("é.").unwrap(),
+        [Write {
+            position: Some(Position { start: 2, end: 2 }),
+        }]
+    );
+}
+
 #[test]
 fn parse_decrement() {
     assert_eq!(
@@ -423,3 +626,12 @@ fn test_combine_pos_overlap() {
 
     assert_eq!(pos1.combine(pos2), Some(Position { start: 1, end: 3 }));
 }
+
+#[test]
+fn cell_width_wrap() {
+    assert_eq!(CellWidth::Bits8.wrap(Wrapping(300)), Wrapping(44));
+    assert_eq!(CellWidth::Bits8.wrap(Wrapping(200)), Wrapping(-56));
+    assert_eq!(CellWidth::Bits16.wrap(Wrapping(300)), Wrapping(300));
+    assert_eq!(CellWidth::Bits16.wrap(Wrapping(65535)), Wrapping(-1));
+    assert_eq!(CellWidth::Bits32.wrap(Wrapping(-1)), Wrapping(-1));
+}
@@ -7,8 +7,6 @@ use pretty_assertions::assert_eq;
 #[cfg(test)]
 use quickcheck::quickcheck;
 #[cfg(test)]
-use std::collections::HashMap;
-#[cfg(test)]
 use std::num::Wrapping;
 
 use std::cmp::{max, Ord, Ordering};
@@ -41,6 +39,70 @@ pub fn highest_cell_index(instrs: &[AstNode]) -> usize {
     }
 }
 
+/// Return true if we can prove that every cell accessed during
+/// program execution is within a tape of `num_cells` cells, so
+/// runtime bounds checks are unnecessary.
+pub fn is_statically_bounded(instrs: &[AstNode], num_cells: usize) -> bool {
+    // The lowest cell accessed is the highest cell accessed by the
+    // program with every movement reversed.
+    let (highest_index, _) = overall_movement(instrs);
+    let (highest_reversed_index, _) = overall_movement(&reverse_movement(instrs));
+
+    highest_index < SaturatingInt::Number(num_cells as i64)
+        && highest_reversed_index == SaturatingInt::Number(0)
+}
+
+/// Return a copy of `instrs` where every pointer movement and offset
+/// goes in the opposite direction.
+fn reverse_movement(instrs: &[AstNode]) -> Vec<AstNode> {
+    instrs
+        .iter()
+        .map(|instr| match *instr {
+            PointerIncrement { amount, position } => PointerIncrement {
+                amount: -amount,
+                position,
+            },
+            Increment {
+                amount,
+                offset,
+                position,
+            } => Increment {
+                amount,
+                offset: -offset,
+                position,
+            },
+            Set {
+                amount,
+                offset,
+                position,
+            } => Set {
+                amount,
+                offset: -offset,
+                position,
+            },
+            MultiplyMove {
+                ref changes,
+                position,
+            } => MultiplyMove {
+                changes: changes
+                    .iter()
+                    .map(|&(offset, factor)| (-offset, factor))
+                    .collect(),
+                position,
+            },
+            Scan { stride, position } => Scan {
+                stride: -stride,
+                position,
+            },
+            Loop { ref body, position } => Loop {
+                body: reverse_movement(body),
+                position,
+            },
+            ref other => other.clone(),
+        })
+        .collect()
+}
+
 /// Saturating arithmetic: we have normal integers that work as
 /// expected, but Max is bigger than any Number.
 #[derive(Eq, PartialEq, Clone, Copy, Debug)]
@@ -116,9 +178,9 @@ fn movement(instr: &AstNode) -> (SaturatingInt, SaturatingInt) {
         ),
         MultiplyMove { ref changes, .. } => {
             let mut highest_affected = 0;
-            for cell in changes.keys() {
-                if *cell > highest_affected {
-                    highest_affected = *cell;
+            for &(cell, _) in changes {
+                if cell > highest_affected {
+                    highest_affected = cell;
                 }
             }
             (
@@ -150,6 +212,15 @@ fn movement(instr: &AstNode) -> (SaturatingInt, SaturatingInt) {
                 }
             }
         }
+        Scan { stride, .. } => {
+            if stride < 0 {
+                // Like a loop with negative net movement, we
+                // conservatively assume we didn't move.
+                (SaturatingInt::Number(0), SaturatingInt::Number(0))
+            } else {
+                (SaturatingInt::Max, SaturatingInt::Max)
+            }
+        }
         Read { .. } | Write { .. } => (SaturatingInt::Number(0), SaturatingInt::Number(0)),
     }
 }
@@ -186,9 +257,7 @@ fn multiple_ptr_increment_bounds() {
 
 #[test]
 fn multiply_move_bounds() {
-    let mut dest_cells = HashMap::new();
-    dest_cells.insert(1, Wrapping(3));
-    dest_cells.insert(4, Wrapping(1));
+    let dest_cells = vec![(1, Wrapping(3)), (4, Wrapping(1))];
     let instrs = vec![
         MultiplyMove {
             changes: dest_cells,
@@ -210,8 +279,7 @@ fn multiply_move_bounds() {
 /// Verify we add to the current pointer value.
 #[test]
 fn multiply_move_bounds_are_relative() {
-    let mut dest_cells = HashMap::new();
-    dest_cells.insert(1, Wrapping(5));
+    let dest_cells = vec![(1, Wrapping(5))];
     let instrs = vec![
         // Move to cell #2.
         PointerIncrement {
@@ -230,8 +298,7 @@ fn multiply_move_bounds_are_relative() {
 
 #[test]
 fn multiply_move_backwards_bounds() {
-    let mut dest_cells = HashMap::new();
-    dest_cells.insert(-1, Wrapping(2));
+    let dest_cells = vec![(-1, Wrapping(2))];
     let instrs = vec![
         PointerIncrement {
             amount: 1,
@@ -315,3 +382,44 @@ fn set_offset_bounds() {
     ];
     assert_eq!(highest_cell_index(&instrs), 11);
 }
+
+#[test]
+fn scan_bounds() {
+    let instrs = [Scan {
+        stride: 1,
+        position: Some(Position { start: 0, end: 0 }),
+    }];
+    assert_eq!(highest_cell_index(&instrs), MAX_CELL_INDEX);
+
+    let instrs = [
+        PointerIncrement {
+            amount: 2,
+            position: Some(Position { start: 0, end: 0 }),
+        },
+        Scan {
+            stride: -1,
+            position: Some(Position { start: 1, end: 3 }),
+        },
+    ];
+    assert_eq!(highest_cell_index(&instrs), 2);
+}
+
+#[test]
+fn statically_bounded() {
+    let instrs = parse(">>[->+<]<").unwrap();
+    assert!(is_statically_bounded(&instrs, 4));
+    assert!(!is_statically_bounded(&instrs, 3));
+}
+
+#[test]
+fn unbounded_movement_is_not_statically_bounded() {
+    let instrs = parse("+[>+]").unwrap();
+    assert!(!is_statically_bounded(&instrs, 100));
+
+    // Moving left of the first cell isn't bounded either.
+    let instrs = parse("><<").unwrap();
+    assert!(!is_statically_bounded(&instrs, 100));
+
+    let instrs = parse(">+[<]").unwrap();
+    assert!(!is_statically_bounded(&instrs, 100));
+}
@@ -0,0 +1,271 @@
+; The runtime for executables linked with --linker=builtin, on x86-64
+; Linux. It defines the C library functions that compiled programs
+; call, using system calls directly, and the _start entry point.
+;
+; bfc links this into the program's module before optimising it, so
+; there's a single object file to link.
+
+module asm ".globl _start"
+module asm "_start:"
+module asm "  xorl %ebp, %ebp"
+module asm "  andq $-16, %rsp"
+module asm "  callq main"
+module asm "  movl %eax, %edi"
+module asm "  movl $231, %eax"
+module asm "  syscall"
+
+@errno = internal global i32 0
+
+define i32* @__errno_location() #0 {
+  ret i32* @errno
+}
+
+; System calls return -errno on failure, whereas the C library
+; returns -1 and sets errno.
+define internal i64 @syscall_result(i64 %result) #0 {
+entry:
+  %failed = icmp ugt i64 %result, -4096
+  br i1 %failed, label %error, label %done
+
+error:
+  %negated = sub i64 0, %result
+  %code = trunc i64 %negated to i32
+  store i32 %code, i32* @errno
+  ret i64 -1
+
+done:
+  ret i64 %result
+}
+
+define internal i64 @syscall3(i64 %number, i64 %arg1, i64 %arg2, i64 %arg3) #0 {
+  %result = call i64 asm sideeffect "syscall", "={rax},{rax},{rdi},{rsi},{rdx},~{rcx},~{r11},~{memory},~{dirflag},~{fpsr},~{flags}"(i64 %number, i64 %arg1, i64 %arg2, i64 %arg3)
+  %checked = call i64 @syscall_result(i64 %result)
+  ret i64 %checked
+}
+
+define internal i64 @syscall6(i64 %number, i64 %arg1, i64 %arg2, i64 %arg3, i64 %arg4, i64 %arg5, i64 %arg6) #0 {
+  %result = call i64 asm sideeffect "syscall", "={rax},{rax},{rdi},{rsi},{rdx},{r10},{r8},{r9},~{rcx},~{r11},~{memory},~{dirflag},~{fpsr},~{flags}"(i64 %number, i64 %arg1, i64 %arg2, i64 %arg3, i64 %arg4, i64 %arg5, i64 %arg6)
+  %checked = call i64 @syscall_result(i64 %result)
+  ret i64 %checked
+}
+
+define i64 @read(i32 %fd, i8* %buf, i64 %count) #0 {
+  %fd_arg = sext i32 %fd to i64
+  %buf_arg = ptrtoint i8* %buf to i64
+  %result = call i64 @syscall3(i64 0, i64 %fd_arg, i64 %buf_arg, i64 %count)
+  ret i64 %result
+}
+
+define i64 @write(i32 %fd, i8* %buf, i64 %count) #0 {
+  %fd_arg = sext i32 %fd to i64
+  %buf_arg = ptrtoint i8* %buf to i64
+  %result = call i64 @syscall3(i64 1, i64 %fd_arg, i64 %buf_arg, i64 %count)
+  ret i64 %result
+}
+
+define i8* @mmap(i8* %addr, i64 %length, i32 %prot, i32 %flags, i32 %fd, i64 %offset) #0 {
+  %addr_arg = ptrtoint i8* %addr to i64
+  %prot_arg = zext i32 %prot to i64
+  %flags_arg = zext i32 %flags to i64
+  %fd_arg = sext i32 %fd to i64
+  %result = call i64 @syscall6(i64 9, i64 %addr_arg, i64 %length, i64 %prot_arg, i64 %flags_arg, i64 %fd_arg, i64 %offset)
+  %mapping = inttoptr i64 %result to i8*
+  ret i8* %mapping
+}
+
+define i32 @mprotect(i8* %addr, i64 %length, i32 %prot) #0 {
+  %addr_arg = ptrtoint i8* %addr to i64
+  %prot_arg = zext i32 %prot to i64
+  %result = call i64 @syscall3(i64 10, i64 %addr_arg, i64 %length, i64 %prot_arg)
+  %status = trunc i64 %result to i32
+  ret i32 %status
+}
+
+define i32 @munmap(i8* %addr, i64 %length) #0 {
+  %addr_arg = ptrtoint i8* %addr to i64
+  %result = call i64 @syscall3(i64 11, i64 %addr_arg, i64 %length, i64 0)
+  %status = trunc i64 %result to i32
+  ret i32 %status
+}
+
+define void @exit(i32 %status) #0 {
+  %status_arg = sext i32 %status to i64
+  call i64 @syscall3(i64 231, i64 %status_arg, i64 0, i64 0)
+  unreachable
+}
+
+; Anonymous mappings are zeroed, so calloc is just mmap. We store
+; the length of the mapping in a 16 byte header before the memory we
+; return, so free knows how much to unmap.
+define i8* @calloc(i64 %count, i64 %size) #0 {
+entry:
+  %product = call { i64, i1 } @llvm.umul.with.overflow.i64(i64 %count, i64 %size)
+  %overflow = extractvalue { i64, i1 } %product, 1
+  %bytes = extractvalue { i64, i1 } %product, 0
+  %total = call { i64, i1 } @llvm.uadd.with.overflow.i64(i64 %bytes, i64 16)
+  %total_overflow = extractvalue { i64, i1 } %total, 1
+  %length = extractvalue { i64, i1 } %total, 0
+  %too_large = or i1 %overflow, %total_overflow
+  br i1 %too_large, label %failed, label %map
+
+map:
+  ; PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS
+  %mapping = call i8* @mmap(i8* null, i64 %length, i32 3, i32 34, i32 -1, i64 0)
+  %map_failed = icmp eq i8* %mapping, inttoptr (i64 -1 to i8*)
+  br i1 %map_failed, label %failed, label %done
+
+failed:
+  ret i8* null
+
+done:
+  %header = bitcast i8* %mapping to i64*
+  store i64 %length, i64* %header
+  %memory = getelementptr i8, i8* %mapping, i64 16
+  ret i8* %memory
+}
+
+define void @free(i8* %ptr) #0 {
+entry:
+  %is_null = icmp eq i8* %ptr, null
+  br i1 %is_null, label %done, label %unmap
+
+unmap:
+  %mapping = getelementptr i8, i8* %ptr, i64 -16
+  %header = bitcast i8* %mapping to i64*
+  %length = load i64, i64* %header
+  %status = call i32 @munmap(i8* %mapping, i64 %length)
+  br label %done
+
+done:
+  ret void
+}
+
+define i8* @memchr(i8* %s, i32 %c, i64 %n) #0 {
+entry:
+  %byte = trunc i32 %c to i8
+  br label %loop
+
+loop:
+  %i = phi i64 [ 0, %entry ], [ %next, %continue ]
+  %at_end = icmp eq i64 %i, %n
+  br i1 %at_end, label %not_found, label %check
+
+check:
+  %ptr = getelementptr i8, i8* %s, i64 %i
+  %value = load i8, i8* %ptr
+  %found = icmp eq i8 %value, %byte
+  br i1 %found, label %done, label %continue
+
+continue:
+  %next = add i64 %i, 1
+  br label %loop
+
+not_found:
+  ret i8* null
+
+done:
+  ret i8* %ptr
+}
+
+define i8* @memrchr(i8* %s, i32 %c, i64 %n) #0 {
+entry:
+  %byte = trunc i32 %c to i8
+  br label %loop
+
+loop:
+  %remaining = phi i64 [ %n, %entry ], [ %i, %continue ]
+  %at_start = icmp eq i64 %remaining, 0
+  br i1 %at_start, label %not_found, label %check
+
+check:
+  %i = sub i64 %remaining, 1
+  %ptr = getelementptr i8, i8* %s, i64 %i
+  %value = load i8, i8* %ptr
+  %found = icmp eq i8 %value, %byte
+  br i1 %found, label %done, label %continue
+
+continue:
+  br label %loop
+
+not_found:
+  ret i8* null
+
+done:
+  ret i8* %ptr
+}
+
+; LLVM may lower memory intrinsics to calls to memset, memcpy and
+; memmove. "no-builtins" stops it turning these loops back into those
+; calls.
+define i8* @memset(i8* %dest, i32 %c, i64 %n) #1 {
+entry:
+  %byte = trunc i32 %c to i8
+  br label %loop
+
+loop:
+  %i = phi i64 [ 0, %entry ], [ %next, %body ]
+  %at_end = icmp eq i64 %i, %n
+  br i1 %at_end, label %done, label %body
+
+body:
+  %ptr = getelementptr i8, i8* %dest, i64 %i
+  store i8 %byte, i8* %ptr
+  %next = add i64 %i, 1
+  br label %loop
+
+done:
+  ret i8* %dest
+}
+
+define i8* @memcpy(i8* %dest, i8* %src, i64 %n) #1 {
+entry:
+  br label %loop
+
+loop:
+  %i = phi i64 [ 0, %entry ], [ %next, %body ]
+  %at_end = icmp eq i64 %i, %n
+  br i1 %at_end, label %done, label %body
+
+body:
+  %src_ptr = getelementptr i8, i8* %src, i64 %i
+  %value = load i8, i8* %src_ptr
+  %dest_ptr = getelementptr i8, i8* %dest, i64 %i
+  store i8 %value, i8* %dest_ptr
+  %next = add i64 %i, 1
+  br label %loop
+
+done:
+  ret i8* %dest
+}
+
+define i8* @memmove(i8* %dest, i8* %src, i64 %n) #1 {
+entry:
+  %forwards = icmp ule i8* %dest, %src
+  br i1 %forwards, label %copy_forwards, label %backwards
+
+copy_forwards:
+  %copied = call i8* @memcpy(i8* %dest, i8* %src, i64 %n)
+  ret i8* %dest
+
+backwards:
+  %remaining = phi i64 [ %n, %entry ], [ %i, %body ]
+  %at_start = icmp eq i64 %remaining, 0
+  br i1 %at_start, label %done, label %body
+
+body:
+  %i = sub i64 %remaining, 1
+  %src_ptr = getelementptr i8, i8* %src, i64 %i
+  %value = load i8, i8* %src_ptr
+  %dest_ptr = getelementptr i8, i8* %dest, i64 %i
+  store i8 %value, i8* %dest_ptr
+  br label %backwards
+
+done:
+  ret i8* %dest
+}
+
+declare { i64, i1 } @llvm.umul.with.overflow.i64(i64, i64)
+declare { i64, i1 } @llvm.uadd.with.overflow.i64(i64, i64)
+
+attributes #0 = { nounwind }
+attributes #1 = { nounwind "no-builtins" }
@@ -0,0 +1,932 @@
+#![warn(trivial_numeric_casts)]
+
+//! A flat bytecode for BF, with a fast interpreter.
+//!
+//! Walking the `AstNode` tree recursively is convenient for
+//! analysis, but slow to execute: every loop iteration recurses and
+//! re-matches on the node. Here we flatten the optimised AST into a
+//! linear sequence of ops with precomputed jump targets, so execution
+//! is a single dispatch loop.
+
+use std::cmp::{max, min};
+use std::collections::HashMap;
+use std::io::{self, BufWriter, Stdin, Stdout};
+use std::io::{Read as IoRead, Write as IoWrite};
+use std::num::Wrapping;
+
+#[cfg(test)]
+use pretty_assertions::assert_eq;
+
+#[cfg(test)]
+use crate::bfir::parse;
+
+use crate::bfir::AstNode::*;
+use crate::bfir::{get_position, AstNode, Cell, CellWidth};
+use crate::diagnostics::Warning;
+use crate::execution::Outcome;
+use crate::llvm::{EofBehaviour, OutputBuffering};
+
+/// A single bytecode instruction. Ops are `Copy` so the dispatch loop
+/// never needs to follow a pointer to decode one.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum Op {
+    Increment {
+        amount: Cell,
+        offset: isize,
+    },
+    Set {
+        amount: Cell,
+        offset: isize,
+    },
+    PointerIncrement {
+        amount: isize,
+    },
+    /// The changes for this multiply live in
+    /// `Program::multiply_changes[start..start + len]`.
+    MultiplyMove {
+        start: usize,
+        len: usize,
+    },
+    Scan {
+        stride: isize,
+    },
+    Read,
+    Write,
+    /// If the current cell is zero, jump to the op after `end`.
+    LoopStart {
+        end: usize,
+    },
+    /// Jump back to the `LoopStart` at `start`, which re-checks the
+    /// current cell.
+    LoopEnd {
+        start: usize,
+    },
+}
+
+/// A flattened BF program.
+#[derive(Debug)]
+pub struct Program<'a> {
+    pub ops: Vec<Op>,
+    /// The AST node that each op was compiled from. `LoopStart` and
+    /// `LoopEnd` both map to their `Loop`.
+    pub sources: Vec<&'a AstNode>,
+    /// Offsets and factors for all `MultiplyMove` ops, sorted by
+    /// offset within each op.
+    pub multiply_changes: Vec<(isize, Cell)>,
+}
+
+/// Flatten `instrs` into bytecode.
+pub fn compile(instrs: &[AstNode]) -> Program {
+    let mut program = Program {
+        ops: vec![],
+        sources: vec![],
+        multiply_changes: vec![],
+    };
+    compile_into(instrs, &mut program);
+    program
+}
+
+fn compile_into<'a>(instrs: &'a [AstNode], program: &mut Program<'a>) {
+    for instr in instrs {
+        match *instr {
+            Increment { amount, offset, .. } => {
+                program.ops.push(Op::Increment { amount, offset });
+                program.sources.push(instr);
+            }
+            Set { amount, offset, .. } => {
+                program.ops.push(Op::Set { amount, offset });
+                program.sources.push(instr);
+            }
+            PointerIncrement { amount, .. } => {
+                program.ops.push(Op::PointerIncrement { amount });
+                program.sources.push(instr);
+            }
+            MultiplyMove { ref changes, .. } => {
+                let start = program.multiply_changes.len();
+                program.multiply_changes.extend(changes.iter().cloned());
+
+                program.ops.push(Op::MultiplyMove {
+                    start,
+                    len: changes.len(),
+                });
+                program.sources.push(instr);
+            }
+            Scan { stride, .. } => {
+                program.ops.push(Op::Scan { stride });
+                program.sources.push(instr);
+            }
+            Read { .. } => {
+                program.ops.push(Op::Read);
+                program.sources.push(instr);
+            }
+            Write { .. } => {
+                program.ops.push(Op::Write);
+                program.sources.push(instr);
+            }
+            Loop { ref body, .. } => {
+                let start = program.ops.len();
+                // We don't know where the loop ends yet, so patch it
+                // after compiling the body.
+                program.ops.push(Op::LoopStart { end: 0 });
+                program.sources.push(instr);
+
+                compile_into(body, program);
+
+                let end = program.ops.len();
+                program.ops.push(Op::LoopEnd { start });
+                program.sources.push(instr);
+
+                program.ops[start] = Op::LoopStart { end };
+            }
+        }
+    }
+}
+
+/// How the interpreter performs I/O.
+pub trait Io {
+    /// Read a value for the current cell. Return None if we can't
+    /// provide input, which stops execution.
+    fn read(&mut self, current: Cell) -> Option<Cell>;
+    fn write(&mut self, value: Cell);
+}
+
+/// Cells, pointer and program counter of a running program.
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct Machine {
+    pub cells: Vec<Cell>,
+    pub cell_ptr: isize,
+    /// The index of the next op to execute.
+    pub pc: usize,
+    /// The total number of steps executed so far, across all calls
+    /// to `run`.
+    pub steps_executed: u64,
+    /// Cell values are always wrapped to this width.
+    pub cell_width: CellWidth,
+}
+
+impl Machine {
+    pub fn new(num_cells: usize, cell_width: CellWidth) -> Self {
+        Machine {
+            cells: vec![Wrapping(0); num_cells],
+            cell_ptr: 0,
+            pc: 0,
+            steps_executed: 0,
+            cell_width,
+        }
+    }
+}
+
+/// We don't memoise loops that access more cells than this, as
+/// comparing the cells would cost too much.
+const MAX_MEMO_WINDOW: isize = 256;
+
+/// Stop recording loop results once they take this many bytes, so
+/// memory use stays bounded however many windows a loop sees.
+const MAX_MEMO_BYTES: usize = 4 << 20;
+
+/// Roughly how many bytes a loop result for a window of `width`
+/// cells takes: both copies of the window, plus the vectors and
+/// step count that hold them.
+fn result_bytes(width: usize) -> usize {
+    2 * width * std::mem::size_of::<Cell>() + std::mem::size_of::<(Vec<Cell>, Vec<Cell>, u64)>()
+}
+
+/// The results of loops that we've already run, so compile time
+/// execution can skip loops it has seen before.
+///
+/// A loop is pure if it doesn't do I/O or scan, and every loop in
+/// it (including itself) leaves the cell pointer where it started.
+/// Running a pure loop only depends on a fixed window of cells
+/// around the cell pointer, so if we enter it again with the same
+/// cells in the window, we already know the result.
+pub struct LoopMemo {
+    /// For each `LoopStart` of a pure loop, the offsets of the
+    /// lowest and highest cells it accesses.
+    windows: Vec<Option<(isize, isize)>>,
+    /// For each loop, the window after running it and the steps it
+    /// took, for each window we've entered it with.
+    results: HashMap<usize, HashMap<Vec<Cell>, (Vec<Cell>, u64)>>,
+    /// The total `result_bytes` of everything in `results`.
+    num_bytes: usize,
+    /// The pure loops we're currently running: their `LoopStart`,
+    /// their window on entry, and the total steps executed when we
+    /// entered them.
+    active: Vec<(usize, Vec<Cell>, u64)>,
+}
+
+impl LoopMemo {
+    pub fn new(program: &Program) -> Self {
+        LoopMemo {
+            windows: pure_loop_windows(program),
+            results: HashMap::new(),
+            num_bytes: 0,
+            active: vec![],
+        }
+    }
+
+    /// Called when we reach the `LoopStart` at `machine.pc`, before
+    /// executing it. `steps_executed` is the total steps so far.
+    ///
+    /// If we've run this loop with the same window before, apply the
+    /// result, charge the steps it took, and return true.
+    fn loop_start(
+        &mut self,
+        machine: &mut Machine,
+        end: usize,
+        steps_executed: u64,
+        steps_left: &mut u64,
+    ) -> bool {
+        let start = machine.pc;
+        let (lowest, highest) = match self.window(start, machine) {
+            Some(window) => window,
+            None => return false,
+        };
+        let cell_is_zero = machine.cells[machine.cell_ptr as usize].0 == 0;
+
+        if let Some(&(active_start, _, _)) = self.active.last() {
+            if active_start == start {
+                if cell_is_zero {
+                    // We're leaving the loop, so record what it did,
+                    // including the step to leave it.
+                    let (_, entry_cells, entry_steps) = self.active.pop().unwrap();
+                    let exit_cells = machine.cells[lowest..=highest].to_vec();
+                    let steps = steps_executed + 1 - entry_steps;
+                    self.num_bytes += result_bytes(exit_cells.len());
+                    self.results
+                        .entry(start)
+                        .or_insert_with(HashMap::new)
+                        .insert(entry_cells, (exit_cells, steps));
+                }
+                return false;
+            }
+        }
+        if cell_is_zero {
+            return false;
+        }
+
+        let window = &machine.cells[lowest..=highest];
+        let result = self
+            .results
+            .get(&start)
+            .and_then(|loop_results| loop_results.get(window));
+        match result {
+            Some(&(ref exit_cells, steps)) => {
+                // If we'd run out of steps part way through, run the
+                // loop normally so we stop in the same place.
+                if steps > *steps_left {
+                    return false;
+                }
+                machine.cells[lowest..=highest].copy_from_slice(exit_cells);
+                machine.pc = end + 1;
+                *steps_left -= steps;
+                true
+            }
+            None => {
+                if self.num_bytes + result_bytes(window.len()) <= MAX_MEMO_BYTES {
+                    self.active.push((start, window.to_vec(), steps_executed));
+                }
+                false
+            }
+        }
+    }
+
+    /// The cells that the pure loop at `start` accesses, if they're
+    /// all on the tape.
+    fn window(&self, start: usize, machine: &Machine) -> Option<(usize, usize)> {
+        let (lowest, highest) = self.windows[start]?;
+        let lowest = machine.cell_ptr + lowest;
+        let highest = machine.cell_ptr + highest;
+        if lowest < 0 || highest >= machine.cells.len() as isize {
+            return None;
+        }
+        Some((lowest as usize, highest as usize))
+    }
+}
+
+/// Find the window of cells accessed by each pure loop in
+/// `program`, relative to the cell pointer at the start of the loop.
+fn pure_loop_windows(program: &Program) -> Vec<Option<(isize, isize)>> {
+    let ops = &program.ops;
+    let mut windows = vec![None; ops.len()];
+
+    for (start, op) in ops.iter().enumerate() {
+        let end = match *op {
+            Op::LoopStart { end } => end,
+            _ => continue,
+        };
+
+        let mut offset = 0;
+        let mut lowest = 0;
+        let mut highest = 0;
+        // The offset at the start of each inner loop we're in.
+        let mut inner_starts = vec![];
+        let mut is_pure = true;
+
+        for op in &ops[start + 1..end] {
+            let mut accessed = |cell_offset: isize| {
+                lowest = min(lowest, cell_offset);
+                highest = max(highest, cell_offset);
+            };
+            match *op {
+                Op::Increment {
+                    offset: cell_offset,
+                    ..
+                }
+                | Op::Set {
+                    offset: cell_offset,
+                    ..
+                } => accessed(offset + cell_offset),
+                Op::PointerIncrement { amount } => {
+                    offset += amount;
+                    accessed(offset);
+                }
+                Op::MultiplyMove { start, len } => {
+                    for &(change_offset, _) in &program.multiply_changes[start..start + len] {
+                        accessed(offset + change_offset);
+                    }
+                }
+                Op::LoopStart { .. } => inner_starts.push(offset),
+                Op::LoopEnd { .. } => {
+                    if inner_starts.pop() != Some(offset) {
+                        is_pure = false;
+                        break;
+                    }
+                }
+                Op::Scan { .. } | Op::Read | Op::Write => {
+                    is_pure = false;
+                    break;
+                }
+            }
+        }
+
+        if is_pure && offset == 0 && highest - lowest < MAX_MEMO_WINDOW {
+            windows[start] = Some((lowest, highest));
+        }
+    }
+
+    windows
+}
+
+/// Wrap `value` to a cell of `BITS` bits. `BITS` is known at compile
+/// time, so each width gets its own dispatch loop without checking
+/// the width on every op.
+#[inline(always)]
+fn wrap<const BITS: u32>(value: Cell) -> Cell {
+    match BITS {
+        8 => CellWidth::Bits8.wrap(value),
+        16 => CellWidth::Bits16.wrap(value),
+        _ => value,
+    }
+}
+
+/// The current pointer movement would leave the tape.
+fn out_of_bounds(program: &Program, machine: &Machine, cell: isize) -> Outcome {
+    let message = if cell < 0 {
+        format!("This instruction moves the pointer to cell {}.", cell)
+    } else {
+        format!(
+            "This instruction moves the pointer after the last cell ({}), to cell {}.",
+            machine.cells.len() - 1,
+            cell
+        )
+    };
+    Outcome::RuntimeError(Warning {
+        message,
+        position: get_position(program.sources[machine.pc]),
+    })
+}
+
+/// The current instruction tried to modify a cell outside the tape.
+fn bad_cell_access(program: &Program, machine: &Machine, cell: isize) -> Outcome {
+    Outcome::RuntimeError(Warning {
+        message: format!(
+            "This instruction tried to access cell {} (the highest cell is {})",
+            cell,
+            machine.cells.len() - 1
+        ),
+        position: get_position(program.sources[machine.pc]),
+    })
+}
+
+/// Execute `program` from the current state of `machine`, for at
+/// most `steps` steps. Steps are counted the same way as
+/// `execution::execute_with_state`.
+///
+/// When execution stops before the end of the program,
+/// `machine.pc` is the next op that should be executed, so calling
+/// `run` again resumes exactly where we stopped.
+pub fn run<I: Io>(program: &Program, machine: &mut Machine, steps: u64, io: &mut I) -> Outcome {
+    run_with_memo(program, machine, steps, io, None)
+}
+
+/// As `run`, but skip pure loops that `memo` has already seen with
+/// the same cells. This gives the same result in the same number of
+/// steps.
+pub fn run_with_memo<I: Io>(
+    program: &Program,
+    machine: &mut Machine,
+    steps: u64,
+    io: &mut I,
+    memo: Option<&mut LoopMemo>,
+) -> Outcome {
+    let mut steps_left = steps;
+    let outcome = match machine.cell_width {
+        CellWidth::Bits8 => run_steps::<I, 8>(program, machine, &mut steps_left, io, memo),
+        CellWidth::Bits16 => run_steps::<I, 16>(program, machine, &mut steps_left, io, memo),
+        CellWidth::Bits32 => run_steps::<I, 32>(program, machine, &mut steps_left, io, memo),
+    };
+    machine.steps_executed += steps - steps_left;
+    outcome
+}
+
+fn run_steps<I: Io, const BITS: u32>(
+    program: &Program,
+    machine: &mut Machine,
+    steps_left: &mut u64,
+    io: &mut I,
+    mut memo: Option<&mut LoopMemo>,
+) -> Outcome {
+    let ops = &program.ops[..];
+    let num_cells = machine.cells.len() as isize;
+    // The total steps executed is `steps_base - *steps_left`.
+    let steps_base = machine.steps_executed + *steps_left;
+
+    while machine.pc < ops.len() {
+        if *steps_left == 0 {
+            return Outcome::OutOfSteps;
+        }
+
+        match ops[machine.pc] {
+            Op::Increment { amount, offset } => {
+                let target = machine.cell_ptr + offset;
+                if target < 0 || target >= num_cells {
+                    return bad_cell_access(program, machine, target);
+                }
+                let cell = &mut machine.cells[target as usize];
+                *cell = wrap::<BITS>(*cell + amount);
+            }
+            Op::Set { amount, offset } => {
+                let target = machine.cell_ptr + offset;
+                if target < 0 || target >= num_cells {
+                    return bad_cell_access(program, machine, target);
+                }
+                machine.cells[target as usize] = wrap::<BITS>(amount);
+            }
+            Op::PointerIncrement { amount } => {
+                let target = machine.cell_ptr + amount;
+                if target < 0 || target >= num_cells {
+                    return out_of_bounds(program, machine, target);
+                }
+                machine.cell_ptr = target;
+            }
+            Op::MultiplyMove { start, len } => {
+                let cell_ptr = machine.cell_ptr;
+                let cell_value = machine.cells[cell_ptr as usize];
+
+                if cell_value.0 != 0 {
+                    for &(offset, factor) in &program.multiply_changes[start..start + len] {
+                        let dest = cell_ptr + offset;
+                        if dest < 0 {
+                            return Outcome::RuntimeError(Warning {
+                                message: format!(
+                                    "This multiply loop tried to access cell {} \
+                                     (offset {} from current cell {})",
+                                    dest, offset, cell_ptr
+                                ),
+                                position: get_position(program.sources[machine.pc]),
+                            });
+                        }
+                        if dest >= num_cells {
+                            return Outcome::RuntimeError(Warning {
+                                message: format!(
+                                    "This multiply loop tried to access cell {} (the \
+                                     highest cell is {})",
+                                    dest,
+                                    num_cells - 1
+                                ),
+                                position: get_position(program.sources[machine.pc]),
+                            });
+                        }
+                        let dest_cell = &mut machine.cells[dest as usize];
+                        *dest_cell = wrap::<BITS>(*dest_cell + cell_value * factor);
+                    }
+                    machine.cells[cell_ptr as usize] = Wrapping(0);
+                }
+            }
+            Op::Scan { stride } => {
+                let cell_ptr = machine.cell_ptr as usize;
+                let found = match stride {
+                    1 => machine.cells[cell_ptr..]
+                        .iter()
+                        .position(|cell| cell.0 == 0)
+                        .map(|i| (cell_ptr + i) as isize),
+                    -1 => machine.cells[..=cell_ptr]
+                        .iter()
+                        .rposition(|cell| cell.0 == 0)
+                        .map(|i| i as isize),
+                    _ => {
+                        let mut target = machine.cell_ptr;
+                        while target >= 0
+                            && target < num_cells
+                            && machine.cells[target as usize].0 != 0
+                        {
+                            target += stride;
+                        }
+                        if target >= 0 && target < num_cells {
+                            Some(target)
+                        } else {
+                            None
+                        }
+                    }
+                };
+                match found {
+                    Some(target) => machine.cell_ptr = target,
+                    None => {
+                        // We ran off the tape without finding a zero
+                        // cell.
+                        let target = if stride < 0 { -1 } else { num_cells };
+                        return out_of_bounds(program, machine, target);
+                    }
+                }
+            }
+            Op::Read => {
+                let cell_ptr = machine.cell_ptr as usize;
+                match io.read(machine.cells[cell_ptr]) {
+                    Some(value) => {
+                        machine.cells[cell_ptr] = wrap::<BITS>(value);
+                    }
+                    None => {
+                        return Outcome::ReachedRuntimeValue;
+                    }
+                }
+            }
+            Op::Write => {
+                io.write(machine.cells[machine.cell_ptr as usize]);
+            }
+            Op::LoopStart { end } => {
+                if let Some(ref mut memo) = memo {
+                    let steps_executed = steps_base - *steps_left;
+                    if memo.loop_start(machine, end, steps_executed, steps_left) {
+                        continue;
+                    }
+                }
+
+                if machine.cells[machine.cell_ptr as usize].0 == 0 {
+                    // Skipping a loop costs a step, like the AST executor.
+                    machine.pc = end + 1;
+                    *steps_left -= 1;
+                } else {
+                    // Entering the body is free: the step is charged
+                    // at the end of each iteration.
+                    machine.pc += 1;
+                }
+                continue;
+            }
+            Op::LoopEnd { start } => {
+                machine.pc = start;
+                *steps_left -= 1;
+                continue;
+            }
+        }
+
+        machine.pc += 1;
+        *steps_left -= 1;
+    }
+
+    Outcome::Completed(*steps_left)
+}
+
+/// I/O on the real stdin and stdout, used when interpreting a program
+/// instead of compiling it.
+pub struct StdIo {
+    stdin: Stdin,
+    stdout: BufWriter<Stdout>,
+    output_buffering: OutputBuffering,
+    eof_behaviour: EofBehaviour,
+}
+
+impl StdIo {
+    pub fn new(output_buffering: OutputBuffering, eof_behaviour: EofBehaviour) -> Self {
+        StdIo {
+            stdin: io::stdin(),
+            stdout: BufWriter::new(io::stdout()),
+            output_buffering,
+            eof_behaviour,
+        }
+    }
+
+    pub fn flush(&mut self) {
+        let _ = self.stdout.flush();
+    }
+}
+
+impl Io for StdIo {
+    fn read(&mut self, current: Cell) -> Option<Cell> {
+        // Ensure any prompt has been shown before we block on stdin.
+        self.flush();
+
+        let mut byte = [0];
+        match self.stdin.read(&mut byte) {
+            Ok(1) => Some(Wrapping(i32::from(byte[0]))),
+            _ => Some(match self.eof_behaviour {
+                EofBehaviour::Unchanged => current,
+                EofBehaviour::Zero => Wrapping(0),
+                EofBehaviour::MinusOne => Wrapping(-1),
+            }),
+        }
+    }
+
+    fn write(&mut self, value: Cell) {
+        // Like the compiled program, we only output the low byte.
+        let byte = value.0 as u8;
+        let _ = self.stdout.write_all(&[byte]);
+        if self.output_buffering == OutputBuffering::Line && byte == b'\n' {
+            self.flush();
+        }
+    }
+}
+
+impl Drop for StdIo {
+    fn drop(&mut self) {
+        self.flush();
+    }
+}
+
+/// Run the whole program on stdin and stdout.
+pub fn interpret(
+    instrs: &[AstNode],
+    num_cells: usize,
+    cell_width: CellWidth,
+    output_buffering: OutputBuffering,
+    eof_behaviour: EofBehaviour,
+) -> Option<Warning> {
+    let program = compile(instrs);
+    let mut machine = Machine::new(num_cells, cell_width);
+    let mut io = StdIo::new(output_buffering, eof_behaviour);
+
+    match run(&program, &mut machine, u64::MAX, &mut io) {
+        Outcome::RuntimeError(warning) => Some(warning),
+        _ => None,
+    }
+}
+
+/// I/O for tests: reads from a fixed input and records outputs.
+#[cfg(test)]
+struct TestIo {
+    inputs: Vec<i8>,
+    outputs: Vec<i8>,
+}
+
+#[cfg(test)]
+impl Io for TestIo {
+    fn read(&mut self, _: Cell) -> Option<Cell> {
+        if self.inputs.is_empty() {
+            None
+        } else {
+            Some(Wrapping(i32::from(self.inputs.remove(0))))
+        }
+    }
+
+    fn write(&mut self, value: Cell) {
+        self.outputs.push(value.0 as i8);
+    }
+}
+
+#[cfg(test)]
+fn run_test_program(src: &str, inputs: Vec<i8>) -> (Outcome, Machine, Vec<i8>) {
+    run_test_program_with_width(src, inputs, CellWidth::Bits8)
+}
+
+#[cfg(test)]
+fn run_test_program_with_width(
+    src: &str,
+    inputs: Vec<i8>,
+    cell_width: CellWidth,
+) -> (Outcome, Machine, Vec<i8>) {
+    let instrs = parse(src).unwrap();
+    let program = compile(&instrs);
+    let mut machine = Machine::new(10, cell_width);
+    let mut io = TestIo {
+        inputs,
+        outputs: vec![],
+    };
+    let outcome = run(&program, &mut machine, 1000, &mut io);
+    (outcome, machine, io.outputs)
+}
+
+#[test]
+fn compile_loop_jump_targets() {
+    let instrs = parse("+[-[>]]").unwrap();
+    let program = compile(&instrs);
+    assert_eq!(
+        program.ops,
+        vec![
+            Op::Increment {
+                amount: Wrapping(1),
+                offset: 0
+            },
+            Op::LoopStart { end: 6 },
+            Op::Increment {
+                amount: Wrapping(-1),
+                offset: 0
+            },
+            Op::LoopStart { end: 5 },
+            Op::PointerIncrement { amount: 1 },
+            Op::LoopEnd { start: 3 },
+            Op::LoopEnd { start: 1 },
+        ]
+    );
+    assert!(std::ptr::eq(program.sources[1], &instrs[1]));
+    assert!(std::ptr::eq(program.sources[6], &instrs[1]));
+}
+
+#[test]
+fn compile_multiply_move_sorted() {
+    let changes = vec![(-1, Wrapping(1)), (3, Wrapping(2))];
+    let instrs = vec![MultiplyMove {
+        changes,
+        position: None,
+    }];
+
+    let program = compile(&instrs);
+    assert_eq!(program.ops, vec![Op::MultiplyMove { start: 0, len: 2 }]);
+    assert_eq!(
+        program.multiply_changes,
+        vec![(-1, Wrapping(1)), (3, Wrapping(2))]
+    );
+}
+
+#[test]
+fn run_loop() {
+    let (outcome, machine, _) = run_test_program("+++[>++<-]", vec![]);
+    assert!(matches!(outcome, Outcome::Completed(_)));
+    assert_eq!(machine.cells[0], Wrapping(0));
+    assert_eq!(machine.cells[1], Wrapping(6));
+}
+
+#[test]
+fn run_wraps_to_cell_width() {
+    // 16 * 16 = 256, which is zero in an 8-bit cell.
+    let src = "++++++++++++++++[>++++++++++++++++<-]";
+
+    let (_, machine, _) = run_test_program_with_width(src, vec![], CellWidth::Bits8);
+    assert_eq!(machine.cells[1], Wrapping(0));
+
+    let (_, machine, _) = run_test_program_with_width(src, vec![], CellWidth::Bits16);
+    assert_eq!(machine.cells[1], Wrapping(256));
+
+    let (_, machine, _) = run_test_program_with_width("-", vec![], CellWidth::Bits16);
+    assert_eq!(machine.cells[0], Wrapping(-1));
+}
+
+#[test]
+fn run_read_write() {
+    let (outcome, _, outputs) = run_test_program(",+.,", vec![5]);
+    assert_eq!(outcome, Outcome::ReachedRuntimeValue);
+    assert_eq!(outputs, vec![6]);
+}
+
+#[test]
+fn run_out_of_bounds() {
+    let (outcome, machine, _) = run_test_program("+<", vec![]);
+    assert!(matches!(outcome, Outcome::RuntimeError(_)));
+    assert_eq!(machine.pc, 1);
+}
+
+#[test]
+fn run_up_to_step_limit() {
+    let instrs = parse("+ +[-]").unwrap();
+    let program = compile(&instrs);
+    let mut machine = Machine::new(1, CellWidth::Bits8);
+    let mut io = TestIo {
+        inputs: vec![],
+        outputs: vec![],
+    };
+
+    // Same as execution::loop_up_to_step_limit: we stop at the loop
+    // after a single iteration.
+    let outcome = run(&program, &mut machine, 4, &mut io);
+    assert_eq!(outcome, Outcome::OutOfSteps);
+    assert_eq!(machine.cells, vec![Wrapping(1)]);
+    assert!(std::ptr::eq(program.sources[machine.pc], &instrs[2]));
+}
+
+#[test]
+fn run_scan() {
+    let instrs = [Scan {
+        stride: 2,
+        position: None,
+    }];
+    let program = compile(&instrs);
+    let mut machine = Machine::new(6, CellWidth::Bits8);
+    machine.cells = vec![
+        Wrapping(1),
+        Wrapping(0),
+        Wrapping(1),
+        Wrapping(1),
+        Wrapping(0),
+        Wrapping(0),
+    ];
+    let mut io = TestIo {
+        inputs: vec![],
+        outputs: vec![],
+    };
+
+    let outcome = run(&program, &mut machine, 10, &mut io);
+    assert_eq!(outcome, Outcome::Completed(9));
+    assert_eq!(machine.cell_ptr, 4);
+}
+
+#[test]
+fn run_scan_out_of_bounds() {
+    let instrs = [Scan {
+        stride: -1,
+        position: None,
+    }];
+    let program = compile(&instrs);
+    let mut machine = Machine::new(2, CellWidth::Bits8);
+    machine.cells = vec![Wrapping(1), Wrapping(1)];
+    machine.cell_ptr = 1;
+    let mut io = TestIo {
+        inputs: vec![],
+        outputs: vec![],
+    };
+
+    let outcome = run(&program, &mut machine, 10, &mut io);
+    assert!(matches!(outcome, Outcome::RuntimeError(_)));
+    assert_eq!(machine.cell_ptr, 1);
+}
+
+#[test]
+fn pure_loop_windows_balanced_loops() {
+    let instrs = parse("[>+<-][>]+[<<->>[-]-]").unwrap();
+    let program = compile(&instrs);
+    let windows = pure_loop_windows(&program);
+
+    assert_eq!(windows[0], Some((0, 1)));
+    // Loops that move the cell pointer aren't pure.
+    assert_eq!(windows[6], None);
+    let outer_start = program
+        .ops
+        .iter()
+        .rposition(|op| matches!(op, Op::LoopStart { end } if *end == program.ops.len() - 1))
+        .unwrap();
+    assert_eq!(windows[outer_start], Some((-2, 0)));
+}
+
+#[test]
+fn run_with_memo_matches_run() {
+    let instrs = parse("+++[>+++[-]<-]").unwrap();
+    let program = compile(&instrs);
+
+    // Whenever we stop, the memoised run should be in exactly the
+    // same state.
+    for steps in 0..40 {
+        let mut machine = Machine::new(2, CellWidth::Bits8);
+        let mut io = TestIo {
+            inputs: vec![],
+            outputs: vec![],
+        };
+        let outcome = run(&program, &mut machine, steps, &mut io);
+
+        let mut memo = LoopMemo::new(&program);
+        let mut memo_machine = Machine::new(2, CellWidth::Bits8);
+        let memo_outcome =
+            run_with_memo(&program, &mut memo_machine, steps, &mut io, Some(&mut memo));
+
+        assert_eq!(outcome, memo_outcome);
+        assert_eq!(machine, memo_machine);
+    }
+
+    // The inner loop is recorded once, then reused.
+    let mut memo = LoopMemo::new(&program);
+    let mut machine = Machine::new(2, CellWidth::Bits8);
+    let mut io = TestIo {
+        inputs: vec![],
+        outputs: vec![],
+    };
+    run_with_memo(&program, &mut machine, 1000, &mut io, Some(&mut memo));
+    assert_eq!(memo.num_bytes, result_bytes(2) + result_bytes(1));
+}
+
+#[test]
+fn run_with_memo_stops_recording_when_full() {
+    let instrs = parse("+++[>+++[-]<-]").unwrap();
+    let program = compile(&instrs);
+    let mut io = TestIo {
+        inputs: vec![],
+        outputs: vec![],
+    };
+
+    let mut machine = Machine::new(2, CellWidth::Bits8);
+    let outcome = run(&program, &mut machine, 1000, &mut io);
+
+    let mut memo = LoopMemo::new(&program);
+    memo.num_bytes = MAX_MEMO_BYTES - result_bytes(1) + 1;
+    let mut memo_machine = Machine::new(2, CellWidth::Bits8);
+    let memo_outcome = run_with_memo(&program, &mut memo_machine, 1000, &mut io, Some(&mut memo));
+
+    assert_eq!(outcome, memo_outcome);
+    assert_eq!(machine, memo_machine);
+    assert!(memo.results.is_empty());
+}
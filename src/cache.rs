@@ -0,0 +1,261 @@
+//! An on-disk cache of compiled object files. Compiling the same
+//! source with the same options always produces the same object
+//! file, so on a cache hit we can skip straight to linking.
+//!
+//! We also cache snapshots of compile time execution, so raising
+//! the step limit doesn't repeat the steps we've already run.
+
+use std::collections::hash_map::DefaultHasher;
+use std::fs;
+use std::hash::{Hash, Hasher};
+use std::path::{Path, PathBuf};
+use tempfile::NamedTempFile;
+
+use crate::bfir::Position;
+use crate::diagnostics::Warning;
+
+#[cfg(test)]
+use pretty_assertions::assert_eq;
+#[cfg(test)]
+use tempfile::tempdir;
+
+/// A single (possibly missing) file in the cache.
+///
+/// Entries are named after a 64-bit hash of their key, so next to each
+/// entry we store the full key in a `.key` file, and only use the
+/// entry if its key matches. A hash collision, or a hash that changes
+/// between Rust releases, is then just a cache miss.
+pub struct CacheEntry {
+    path: PathBuf,
+    key: String,
+}
+
+impl CacheEntry {
+    /// The object file entry in `cache_dir` for `src` compiled with
+    /// `settings`. `settings` should describe every option that can
+    /// affect the object file we generate.
+    pub fn new(cache_dir: &Path, settings: &str, src: &str) -> Self {
+        CacheEntry::with_extension(cache_dir, settings, src, "o")
+    }
+
+    /// As `new`, but for a file with the extension `ext`, so
+    /// different kinds of entry never collide.
+    pub fn with_extension(cache_dir: &Path, settings: &str, src: &str, ext: &str) -> Self {
+        let mut hasher = DefaultHasher::new();
+        settings.hash(&mut hasher);
+        src.hash(&mut hasher);
+
+        CacheEntry {
+            path: cache_dir.join(format!("{:016x}.{}", hasher.finish(), ext)),
+            // Prefix the settings with their length, so every
+            // settings and source pair has a different key.
+            key: format!("{}\n{}{}", settings.len(), settings, src),
+        }
+    }
+
+    /// The path of the file holding this entry's full key.
+    fn key_path(&self) -> PathBuf {
+        let ext = self.path.extension().unwrap().to_str().unwrap();
+        self.path.with_extension(format!("{}.key", ext))
+    }
+
+    /// Was the entry on disk stored with our key?
+    fn has_matching_key(&self) -> bool {
+        fs::read_to_string(self.key_path()).ok().as_deref() == Some(self.key.as_str())
+    }
+
+    /// The path of the cached object file, if we've compiled this
+    /// entry before.
+    pub fn lookup(&self) -> Option<&Path> {
+        if self.path.is_file() && self.has_matching_key() {
+            Some(&self.path)
+        } else {
+            None
+        }
+    }
+
+    /// The contents of the entry, if we've stored it before.
+    pub fn read(&self) -> Option<Vec<u8>> {
+        if self.has_matching_key() {
+            fs::read(&self.path).ok()
+        } else {
+            None
+        }
+    }
+
+    /// Save `bytes` as the contents of the entry.
+    pub fn store_bytes(&self, bytes: &[u8]) -> Result<(), String> {
+        self.write_with(|tmp_path| fs::write(tmp_path, bytes))
+    }
+
+    /// Write the entry using `write`, which is given a temporary
+    /// path to write to, along with its key.
+    fn write_with<F>(&self, write: F) -> Result<(), String>
+    where
+        F: FnOnce(&Path) -> std::io::Result<()>,
+    {
+        let key_path = self.key_path();
+        write_file_with(&key_path, |tmp_path| fs::write(tmp_path, &self.key))?;
+        write_file_with(&self.path, write)
+    }
+}
+
+/// Serialise the warnings from a compilation, so we can show them
+/// again when we reuse its object file. Each warning is a line
+/// containing its position (or `-`) and its message.
+pub fn warnings_to_bytes(warnings: &[Warning]) -> Vec<u8> {
+    let mut s = String::new();
+    for warning in warnings {
+        match warning.position {
+            Some(position) => s += &format!("{} {} ", position.start, position.end),
+            None => s += "- ",
+        }
+        s += &warning.message.replace('\\', "\\\\").replace('\n', "\\n");
+        s += "\n";
+    }
+    s.into_bytes()
+}
+
+/// The inverse of `warnings_to_bytes`. Returns `None` if `bytes`
+/// isn't a valid list of warnings.
+pub fn warnings_from_bytes(bytes: &[u8]) -> Option<Vec<Warning>> {
+    let s = std::str::from_utf8(bytes).ok()?;
+    let mut warnings = vec![];
+    for line in s.lines() {
+        let (position, message) = if let Some(message) = line.strip_prefix("- ") {
+            (None, message)
+        } else {
+            let mut parts = line.splitn(3, ' ');
+            let start = parts.next()?.parse().ok()?;
+            let end = parts.next()?.parse().ok()?;
+            (Some(Position { start, end }), parts.next()?)
+        };
+        warnings.push(Warning {
+            message: unescape_message(message),
+            position,
+        });
+    }
+    Some(warnings)
+}
+
+/// Undo the escaping of backslashes and newlines in
+/// `warnings_to_bytes`.
+fn unescape_message(message: &str) -> String {
+    let mut result = String::new();
+    let mut chars = message.chars();
+    while let Some(c) = chars.next() {
+        if c == '\\' {
+            match chars.next() {
+                Some('n') => result.push('\n'),
+                Some(other) => result.push(other),
+                None => result.push(c),
+            }
+        } else {
+            result.push(c);
+        }
+    }
+    result
+}
+
+/// Write the file at `path` using `write`, which is given a temporary
+/// path to write to.
+fn write_file_with<F>(path: &Path, write: F) -> Result<(), String>
+where
+    F: FnOnce(&Path) -> std::io::Result<()>,
+{
+    let cache_dir = path.parent().unwrap();
+    if let Err(e) = fs::create_dir_all(cache_dir) {
+        return Err(format!(
+            "Could not create cache directory {}: {}",
+            cache_dir.display(),
+            e
+        ));
+    }
+
+    // Write to a unique temporary file and rename it into place,
+    // so concurrent builds (or threads) never see a partially
+    // written entry. The temporary file is removed if we fail.
+    let result = NamedTempFile::new_in(cache_dir).and_then(|tmp_file| {
+        write(tmp_file.path())?;
+        tmp_file.persist(path).map_err(|e| e.error)?;
+        Ok(())
+    });
+    if let Err(e) = result {
+        return Err(format!(
+            "Could not write cache entry {}: {}",
+            path.display(),
+            e
+        ));
+    }
+    Ok(())
+}
+
+#[test]
+fn entry_depends_on_settings_and_source() {
+    let dir = Path::new("cache");
+    let entry = CacheEntry::new(dir, "opt=2", "+.");
+
+    assert_eq!(entry.path, CacheEntry::new(dir, "opt=2", "+.").path);
+    assert_ne!(entry.path, CacheEntry::new(dir, "opt=1", "+.").path);
+    assert_ne!(entry.path, CacheEntry::new(dir, "opt=2", "-.").path);
+}
+
+#[test]
+fn lookup_after_store() {
+    let dir = tempdir().unwrap();
+    let cache_dir = dir.path().join("cache");
+    let entry = CacheEntry::new(&cache_dir, "opt=2", "+.");
+    assert_eq!(entry.lookup(), None);
+
+    entry.store_bytes(b"object").unwrap();
+
+    let cached_path = entry.lookup().unwrap();
+    assert_eq!(fs::read(cached_path).unwrap(), b"object");
+}
+
+#[test]
+fn read_after_store_bytes() {
+    let dir = tempdir().unwrap();
+    let entry = CacheEntry::with_extension(dir.path(), "opt=2", "+.", "snapshot");
+    assert_eq!(entry.read(), None);
+    assert_ne!(entry.path, CacheEntry::new(dir.path(), "opt=2", "+.").path);
+
+    entry.store_bytes(b"pc 0").unwrap();
+    assert_eq!(entry.read(), Some(b"pc 0".to_vec()));
+}
+
+#[test]
+fn entry_with_different_key_is_a_miss() {
+    let dir = tempdir().unwrap();
+    let entry = CacheEntry::with_extension(dir.path(), "opt=2", "+.", "snapshot");
+    entry.store_bytes(b"pc 0").unwrap();
+
+    // Simulate a hash collision with another program.
+    let colliding = CacheEntry {
+        path: entry.path.clone(),
+        key: "other".to_owned(),
+    };
+    assert_eq!(colliding.read(), None);
+    assert_eq!(colliding.lookup(), None);
+    assert_eq!(entry.read(), Some(b"pc 0".to_vec()));
+}
+
+#[test]
+fn warnings_round_trip() {
+    let warnings = vec![
+        Warning {
+            message: "These instructions have no effect.".to_owned(),
+            position: Some(Position { start: 2, end: 5 }),
+        },
+        Warning {
+            message: "Ignoring profile a\\b\nc".to_owned(),
+            position: None,
+        },
+    ];
+    let bytes = warnings_to_bytes(&warnings);
+    assert_eq!(bytes.iter().filter(|&&b| b == b'\n').count(), 2);
+    assert_eq!(warnings_from_bytes(&bytes), Some(warnings));
+
+    assert_eq!(warnings_from_bytes(b""), Some(vec![]));
+    assert_eq!(warnings_from_bytes(b"2 x oops\n"), None);
+}
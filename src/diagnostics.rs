@@ -5,7 +5,7 @@ use std::fmt;
 
 use crate::bfir::Position;
 
-#[derive(Debug, PartialEq, Eq)]
+#[derive(Debug, Clone, PartialEq, Eq)]
 pub struct Warning {
     pub message: String,
     pub position: Option<Position>,
@@ -17,22 +17,24 @@ pub struct Warning {
 pub enum Level {
     Warning,
     Error,
+    Note,
 }
 
 /// Info represents a message to the user, a warning or an error with
-/// an optional reference to a position in the BF source.
+/// an optional reference to a position in the BF source. The source
+/// is borrowed, so reporting several warnings doesn't copy it.
 #[derive(Debug)]
-pub struct Info {
+pub struct Info<'a> {
     pub level: Level,
     pub filename: String,
     pub message: String,
     pub position: Option<Position>,
-    pub source: Option<String>,
+    pub source: Option<&'a str>,
 }
 
 // Given an index into a string, return the line number and column
 // count (both zero-indexed).
-fn position(s: &str, i: usize) -> (usize, usize) {
+pub fn position(s: &str, i: usize) -> (usize, usize) {
     let mut char_count = 0;
     for (line_idx, line) in s.split('\n').enumerate() {
         let line_length = line.len();
@@ -46,13 +48,13 @@ fn position(s: &str, i: usize) -> (usize, usize) {
     unreachable!()
 }
 
-impl fmt::Display for Info {
+impl fmt::Display for Info<'_> {
     fn fmt(&self, f: &mut fmt::Formatter) -> Result<(), fmt::Error> {
         let mut file_text = self.filename.to_owned();
 
         // Find line and column offsets, if we have an index.
         let offsets = match (&self.position, &self.source) {
-            (&Some(range), &Some(ref source)) => {
+            (&Some(range), &Some(source)) => {
                 debug_assert!(range.start <= range.end);
 
                 let (line_idx, column_idx) = position(source, range.start);
@@ -71,11 +73,14 @@ impl fmt::Display for Info {
             Level::Error => {
                 level_text = " error: ".red();
             }
+            Level::Note => {
+                level_text = " note: ".cyan();
+            }
         }
 
         let mut context_line = "".to_owned();
         let mut caret_line = "".to_owned();
-        if let (Some((line_idx, column_idx, width)), &Some(ref source)) = (offsets, &self.source) {
+        if let (Some((line_idx, column_idx, width)), Some(source)) = (offsets, self.source) {
             // The faulty line of code.
             let line = source.split('\n').nth(line_idx).unwrap();
             context_line = "\n".to_owned() + line;
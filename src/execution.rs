@@ -2,10 +2,11 @@
 
 //! Compile time execution of BF programs.
 
-#[cfg(test)]
-use std::collections::HashMap;
+use std::cmp::min;
 use std::env;
+use std::mem;
 use std::num::Wrapping;
+use std::time::{Duration, Instant};
 
 #[cfg(test)]
 use pretty_assertions::assert_eq;
@@ -15,8 +16,10 @@ use quickcheck::quickcheck;
 #[cfg(test)]
 use crate::bfir::{parse, Position};
 
+#[cfg(test)]
 use crate::bfir::AstNode::*;
-use crate::bfir::{AstNode, Cell};
+use crate::bfir::{AstNode, Cell, CellWidth};
+use crate::bytecode::{self, Io, LoopMemo, Machine};
 
 use crate::diagnostics::Warning;
 
@@ -30,7 +33,8 @@ pub struct ExecutionState<'a> {
     pub start_instr: Option<&'a AstNode>,
     pub cells: Vec<Cell>,
     pub cell_ptr: isize,
-    pub outputs: Vec<i8>,
+    /// The bytes written so far.
+    pub outputs: Vec<u8>,
 }
 
 impl<'a> ExecutionState<'a> {
@@ -66,12 +70,73 @@ pub fn max_steps() -> u64 {
     steps
 }
 
+/// Limits on how much work compile time execution may do. We stop
+/// at whichever limit is reached first.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct Budget {
+    pub steps: u64,
+    /// Wall-clock limit. Step counts vary a lot in cost, so this
+    /// bounds compile latency more reliably.
+    pub time: Option<Duration>,
+}
+
+/// How far compile time execution got. This helps users tune the
+/// budget for a given program.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct Report {
+    pub steps: u64,
+    pub outputs: usize,
+    /// The number of input bytes we read.
+    pub inputs: usize,
+    /// We stopped because we ran out of wall-clock time.
+    pub timed_out: bool,
+}
+
+/// How many steps to run between checks of the wall-clock budget.
+const STEPS_PER_TIME_CHECK: u64 = 100_000;
+
 /// Compile time speculative execution of instructions. We return the
 /// final state of the cells, any print side effects, and the point in
 /// the code we reached.
+#[cfg(test)]
 pub fn execute(instrs: &[AstNode], steps: u64) -> (ExecutionState, Option<Warning>) {
+    let (state, warning, _) =
+        execute_with_budget(instrs, Budget { steps, time: None }, CellWidth::Bits8, &[]);
+    (state, warning)
+}
+
+/// As `execute`, but stop at whichever limit in `budget` is hit
+/// first, and report how far we got. Cells are `cell_width` bits.
+///
+/// Reads consume bytes from `input`. When it runs out, we stop at
+/// the next read, so the rest of the input can be read at runtime.
+pub fn execute_with_budget<'a>(
+    instrs: &'a [AstNode],
+    budget: Budget,
+    cell_width: CellWidth,
+    input: &[u8],
+) -> (ExecutionState<'a>, Option<Warning>, Report) {
+    let (state, warning, report, _) = resume_with_budget(instrs, budget, cell_width, input, None);
+    (state, warning, report)
+}
+
+/// As `execute_with_budget`, but continue from `snapshot` if it's
+/// a snapshot of an earlier execution of `instrs` that ran no more
+/// than `budget.steps` steps. Other snapshots are ignored.
+///
+/// Returns a snapshot of where we stopped, so a later compilation
+/// with a larger budget can continue from here.
+pub fn resume_with_budget<'a>(
+    instrs: &'a [AstNode],
+    budget: Budget,
+    cell_width: CellWidth,
+    input: &[u8],
+    snapshot: Option<&Snapshot>,
+) -> (ExecutionState<'a>, Option<Warning>, Report, Snapshot) {
     let mut state = ExecutionState::initial(instrs);
-    let outcome = execute_with_state(instrs, &mut state, steps, None);
+    let (outcome, report, snapshot) = execute_with_state_and_budget(
+        instrs, &mut state, budget, cell_width, input, None, snapshot,
+    );
 
     // Sanity check: if we have a start instruction we
     // can't have executed the entire program at compile time.
@@ -81,8 +146,110 @@ pub fn execute(instrs: &[AstNode], steps: u64) -> (ExecutionState, Option<Warnin
     }
 
     match outcome {
-        Outcome::RuntimeError(warning) => (state, Some(warning)),
-        _ => (state, None),
+        Outcome::RuntimeError(warning) => (state, Some(warning), report, snapshot),
+        _ => (state, None, report, snapshot),
+    }
+}
+
+/// The complete state of compile time execution when it stopped,
+/// so we can resume without repeating the work.
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct Snapshot {
+    /// The index of the next bytecode op to execute.
+    pub pc: usize,
+    pub steps: u64,
+    pub inputs: usize,
+    pub cell_ptr: isize,
+    pub cells: Vec<Cell>,
+    pub outputs: Vec<u8>,
+}
+
+impl Snapshot {
+    /// Serialise the snapshot as text, with one field per line.
+    pub fn to_bytes(&self) -> Vec<u8> {
+        let cells: Vec<String> = self.cells.iter().map(|cell| cell.0.to_string()).collect();
+        let outputs: String = self
+            .outputs
+            .iter()
+            .map(|byte| format!("{:02x}", byte))
+            .collect();
+
+        format!(
+            "pc {}\nsteps {}\ninputs {}\ncell_ptr {}\ncells {}\noutputs {}\n",
+            self.pc,
+            self.steps,
+            self.inputs,
+            self.cell_ptr,
+            cells.join(" "),
+            outputs
+        )
+        .into_bytes()
+    }
+
+    /// Parse a snapshot written by `to_bytes`. Returns `None` if
+    /// `bytes` isn't a well-formed snapshot.
+    pub fn from_bytes(bytes: &[u8]) -> Option<Self> {
+        let text = std::str::from_utf8(bytes).ok()?;
+        let mut lines = text.lines();
+        let mut field = |name: &str| {
+            let line = lines.next()?;
+            if line == name {
+                return Some("");
+            }
+            line.strip_prefix(name)?.strip_prefix(' ')
+        };
+
+        let pc = field("pc")?.parse().ok()?;
+        let steps = field("steps")?.parse().ok()?;
+        let inputs = field("inputs")?.parse().ok()?;
+        let cell_ptr = field("cell_ptr")?.parse().ok()?;
+        let cells = field("cells")?
+            .split_whitespace()
+            .map(|value| value.parse().ok().map(Wrapping))
+            .collect::<Option<Vec<Cell>>>()?;
+        let hex = field("outputs")?;
+        if hex.len() % 2 != 0 || !hex.is_ascii() {
+            return None;
+        }
+        let outputs = (0..hex.len())
+            .step_by(2)
+            .map(|i| u8::from_str_radix(&hex[i..i + 2], 16).ok())
+            .collect::<Option<Vec<u8>>>()?;
+
+        Some(Snapshot {
+            pc,
+            steps,
+            inputs,
+            cell_ptr,
+            cells,
+            outputs,
+        })
+    }
+}
+
+/// Writes are recorded in the execution state. Reads are satisfied
+/// from the known input, then from the dummy value if we've been
+/// given one.
+struct CompileTimeIo<'s> {
+    outputs: &'s mut Vec<u8>,
+    input: &'s [u8],
+    inputs_read: usize,
+    dummy_read_value: Option<i8>,
+}
+
+impl<'s> Io for CompileTimeIo<'s> {
+    fn read(&mut self, _: Cell) -> Option<Cell> {
+        if let Some(&byte) = self.input.get(self.inputs_read) {
+            self.inputs_read += 1;
+            return Some(Wrapping(i32::from(byte)));
+        }
+
+        self.dummy_read_value
+            .map(|value| Wrapping(i32::from(value)))
+    }
+
+    fn write(&mut self, value: Cell) {
+        self.outputs.push(value.0 as u8);
     }
 }
 
@@ -91,176 +258,118 @@ pub fn execute(instrs: &[AstNode], steps: u64) -> (ExecutionState, Option<Warnin
 ///
 /// Execution also stops if we encounter a read instruction.  Users may
 /// alternatively pass in a dummy value for the read (used in testing).
+#[cfg(test)]
 pub fn execute_with_state<'a>(
     instrs: &'a [AstNode],
     state: &mut ExecutionState<'a>,
     steps: u64,
     dummy_read_value: Option<i8>,
 ) -> Outcome {
-    let mut steps_left = steps;
-    let mut instr_idx = 0;
-    while instr_idx < instrs.len() && steps_left > 0 {
-        let cell_ptr = state.cell_ptr as usize;
-
-        match instrs[instr_idx] {
-            Increment { amount, offset, .. } => {
-                let target_cell_ptr = (cell_ptr as isize + offset) as usize;
-                state.cells[target_cell_ptr] += amount;
-                instr_idx += 1;
-            }
-            Set { amount, offset, .. } => {
-                let target_cell_ptr = (cell_ptr as isize + offset) as usize;
-                state.cells[target_cell_ptr] = amount;
-                instr_idx += 1;
-            }
-            PointerIncrement {
-                amount, position, ..
-            } => {
-                let new_cell_ptr = state.cell_ptr + amount;
-                if new_cell_ptr < 0 || new_cell_ptr >= state.cells.len() as isize {
-                    // We can't execute this instruction, so we'll
-                    // execute it at runtime (it'll probably be an
-                    // error).
-                    state.start_instr = Some(&instrs[instr_idx]);
-
-                    let message = if new_cell_ptr < 0 {
-                        format!(
-                            "This instruction moves the pointer to cell {}.",
-                            new_cell_ptr
-                        )
-                    } else {
-                        format!(
-                            "This instruction moves the pointer after the last cell ({}), to \
-                             cell {}.",
-                            state.cells.len() - 1,
-                            new_cell_ptr
-                        )
-                    };
-                    return Outcome::RuntimeError(Warning { message, position });
-                } else {
-                    state.cell_ptr = new_cell_ptr;
-                    instr_idx += 1;
-                }
-            }
-            MultiplyMove {
-                ref changes,
-                position,
-                ..
-            } => {
-                let cell_value = state.cells[cell_ptr];
-
-                if cell_value.0 != 0 {
-                    // We will multiply by the current cell value.
-
-                    for (cell_offset, factor) in changes {
-                        let dest_ptr = cell_ptr as isize + *cell_offset;
-                        if dest_ptr < 0 {
-                            // Tried to access a cell before cell #0.
-                            state.start_instr = Some(&instrs[instr_idx]);
-
-                            // TODO: would be nice to have a Hint: message too in compiler warnings.
-                            let message = format!(
-                                "This multiply loop tried to access cell {} \
-                                 (offset {} from current cell {})",
-                                dest_ptr, *cell_offset, cell_ptr
-                            );
-
-                            return Outcome::RuntimeError(Warning {
-                                message,
-                                position,
-                            });
-                        }
-                        if dest_ptr as usize >= state.cells.len() {
-                            state.start_instr = Some(&instrs[instr_idx]);
-                            return Outcome::RuntimeError(Warning {
-                                message: format!(
-                                    "This multiply loop tried to access cell {} (the \
-                                     highest cell is {})",
-                                    dest_ptr,
-                                    state.cells.len() - 1
-                                ),
-                                position,
-                            });
-                        }
-
-                        let current_val = state.cells[dest_ptr as usize];
-                        state.cells[dest_ptr as usize] = current_val + cell_value * (*factor);
-                    }
-
-                    // Finally, zero the cell we used.
-                    state.cells[cell_ptr] = Wrapping(0);
-                }
-
-                instr_idx += 1;
-            }
-            Write { .. } => {
-                let cell_value = state.cells[state.cell_ptr as usize];
-                state.outputs.push(cell_value.0);
-                instr_idx += 1;
-            }
-            Read { .. } => {
-                if let Some(read_value) = dummy_read_value {
-                    // If we're given a dummy value to use for the
-                    // read, pretend that we've read that value.
-                    state.cells[state.cell_ptr as usize] = Wrapping(read_value);
-                    instr_idx += 1
-                } else {
-                    // Otherwise, we cannot proceed at compile time,
-                    // so ensure runtime execution starts from here.
-                    state.start_instr = Some(&instrs[instr_idx]);
-                    return Outcome::ReachedRuntimeValue;
-                }
-            }
-            Loop { ref body, .. } => {
-                if state.cells[state.cell_ptr as usize].0 == 0 {
-                    // Step over the loop because the current cell is
-                    // zero.
-                    instr_idx += 1;
-                } else {
-                    // Execute the loop body.
-                    let loop_outcome =
-                        execute_with_state(body, state, steps_left, dummy_read_value);
-                    match loop_outcome {
-                        Outcome::Completed(remaining_steps) => {
-                            // We've run several steps during the loop
-                            // body, so ensure steps_left reflects
-                            // that.
-                            steps_left = remaining_steps;
-                        }
-                        Outcome::ReachedRuntimeValue
-                        | Outcome::RuntimeError(..)
-                        | Outcome::OutOfSteps => {
-                            // If we ran out of steps after a complete
-                            // loop iteration, start_instr will still
-                            // be None, so we set it to the current loop.
-                            if state.start_instr == None {
-                                state.start_instr = Some(&instrs[instr_idx]);
-                            }
-                            return loop_outcome;
-                        }
-                    }
-                }
-            }
-        }
-
-        steps_left -= 1;
+    execute_with_state_and_budget(
+        instrs,
+        state,
+        Budget { steps, time: None },
+        CellWidth::Bits8,
+        &[],
+        dummy_read_value,
+        None,
+    )
+    .0
+}
+
+fn execute_with_state_and_budget<'a>(
+    instrs: &'a [AstNode],
+    state: &mut ExecutionState<'a>,
+    budget: Budget,
+    cell_width: CellWidth,
+    input: &[u8],
+    dummy_read_value: Option<i8>,
+    snapshot: Option<&Snapshot>,
+) -> (Outcome, Report, Snapshot) {
+    let program = bytecode::compile(instrs);
+    let mut machine = Machine {
+        cells: mem::take(&mut state.cells),
+        cell_ptr: state.cell_ptr,
+        pc: 0,
+        steps_executed: 0,
+        cell_width,
+    };
+    let mut inputs_read = 0;
+
+    // A snapshot is only usable if it's from this program and
+    // didn't run further than we're allowed to.
+    let snapshot = snapshot.filter(|snapshot| {
+        snapshot.steps <= budget.steps
+            && snapshot.pc <= program.ops.len()
+            && snapshot.cells.len() == machine.cells.len()
+            && snapshot.inputs <= input.len()
+            && snapshot.cell_ptr >= 0
+            && (snapshot.cell_ptr as usize) < machine.cells.len()
+    });
+    if let Some(snapshot) = snapshot {
+        machine.cells.copy_from_slice(&snapshot.cells);
+        machine.cell_ptr = snapshot.cell_ptr;
+        machine.pc = snapshot.pc;
+        machine.steps_executed = snapshot.steps;
+        inputs_read = snapshot.inputs;
+        state.outputs = snapshot.outputs.clone();
     }
 
-    // If we've run out of steps, runtime execution should start
-    // from the next instruction.
-    if steps_left == 0 {
-        // If the next instruction is in the current loop, use that.
-        if instr_idx < instrs.len() {
-            state.start_instr = Some(&instrs[instr_idx]);
+    let mut io = CompileTimeIo {
+        outputs: &mut state.outputs,
+        input,
+        inputs_read,
+        dummy_read_value,
+    };
+    let mut memo = LoopMemo::new(&program);
+
+    let deadline = budget.time.map(|time| Instant::now() + time);
+    let mut timed_out = false;
+    let outcome = loop {
+        let steps_left = budget.steps - machine.steps_executed;
+        let chunk = match deadline {
+            Some(_) => min(steps_left, STEPS_PER_TIME_CHECK),
+            None => steps_left,
+        };
+
+        let outcome =
+            bytecode::run_with_memo(&program, &mut machine, chunk, &mut io, Some(&mut memo));
+        if outcome != Outcome::OutOfSteps || machine.steps_executed == budget.steps {
+            break outcome;
+        }
+        if let Some(deadline) = deadline {
+            if Instant::now() >= deadline {
+                timed_out = true;
+                break outcome;
+            }
         }
-        // Otherwise, we've run out of steps after executing a
-        // complete loop iteration. We'll set the start instruction as
-        // the loop.
+    };
 
-        Outcome::OutOfSteps
-    } else {
-        Outcome::Completed(steps_left)
+    // If we stopped part way through, runtime execution should
+    // start from the op we reached. A loop end maps to its loop,
+    // which re-checks the loop condition.
+    if machine.pc < program.ops.len() {
+        state.start_instr = Some(program.sources[machine.pc]);
     }
+    let inputs_read = io.inputs_read;
+    state.cells = machine.cells;
+    state.cell_ptr = machine.cell_ptr;
+
+    let report = Report {
+        steps: machine.steps_executed,
+        outputs: state.outputs.len(),
+        inputs: inputs_read,
+        timed_out,
+    };
+    let snapshot = Snapshot {
+        pc: machine.pc,
+        steps: machine.steps_executed,
+        inputs: inputs_read,
+        cell_ptr: state.cell_ptr,
+        cells: state.cells.clone(),
+        outputs: state.outputs.clone(),
+    };
+    (outcome, report, snapshot)
 }
 
 /// We can't evaluate outputs of runtime values at compile time.
@@ -298,9 +407,7 @@ fn increment_executed() {
 
 #[test]
 fn multiply_move_executed() {
-    let mut changes = HashMap::new();
-    changes.insert(1, Wrapping(2));
-    changes.insert(3, Wrapping(3));
+    let changes = vec![(1, Wrapping(2)), (3, Wrapping(3))];
 
     let instrs = [
         // Initial cells: [2, 1, 0, 0]
@@ -345,8 +452,7 @@ fn multiply_move_executed() {
 /// undefined behaviour when we have a multiply move instruction.
 #[test]
 fn multiply_move_when_current_cell_is_zero() {
-    let mut changes = HashMap::new();
-    changes.insert(-1, Wrapping(2));
+    let changes = vec![(-1, Wrapping(2))];
 
     let instrs = [MultiplyMove {
         changes,
@@ -368,8 +474,7 @@ fn multiply_move_when_current_cell_is_zero() {
 
 #[test]
 fn multiply_move_wrapping() {
-    let mut changes = HashMap::new();
-    changes.insert(1, Wrapping(3));
+    let changes = vec![(1, Wrapping(3))];
     let instrs = [
         Increment {
             amount: Wrapping(100),
@@ -397,8 +502,7 @@ fn multiply_move_wrapping() {
 
 #[test]
 fn multiply_move_offset_too_high() {
-    let mut changes: HashMap<isize, Cell> = HashMap::new();
-    changes.insert(MAX_CELL_INDEX as isize + 1, Wrapping(1));
+    let changes = vec![(MAX_CELL_INDEX as isize + 1, Wrapping(1))];
     let instrs = [
         Increment {
             amount: Wrapping(1),
@@ -427,8 +531,7 @@ fn multiply_move_offset_too_high() {
 
 #[test]
 fn multiply_move_offset_too_low() {
-    let mut changes = HashMap::new();
-    changes.insert(-1, Wrapping(1));
+    let changes = vec![(-1, Wrapping(1))];
     let instrs = [
         Increment {
             amount: Wrapping(1),
@@ -572,7 +675,8 @@ fn ptr_out_of_range() {
 
 #[test]
 fn limit_to_steps_specified() {
-    let instrs = parse("++++").unwrap();
+    // Spaces stop the parser merging these into a single increment.
+    let instrs = parse("+ + + +").unwrap();
     let final_state = execute(&instrs, 2).0;
 
     assert_eq!(
@@ -694,7 +798,7 @@ fn partially_execute_complete_toplevel_loop() {
 
 #[test]
 fn partially_execute_up_to_step_limit() {
-    let instrs = parse("+[++++]").unwrap();
+    let instrs = parse("+[+ + + +]").unwrap();
     let final_state = execute(&instrs, 3).0;
 
     let start_instr = match instrs[1] {
@@ -715,7 +819,7 @@ fn partially_execute_up_to_step_limit() {
 
 #[test]
 fn loop_up_to_step_limit() {
-    let instrs = parse("++[-]").unwrap();
+    let instrs = parse("+ +[-]").unwrap();
     // Assuming we take one step to enter the loop, we will execute
     // the loop body once.
     let final_state = execute(&instrs, 4).0;
@@ -763,7 +867,7 @@ fn loop_with_read_body() {
 
 #[test]
 fn up_to_infinite_loop_executed() {
-    let instrs = parse("++[]").unwrap();
+    let instrs = parse("+ +[]").unwrap();
     let final_state = execute(&instrs, 20).0;
 
     assert_eq!(
@@ -810,3 +914,96 @@ fn arithmetic_error_nested_loops() {
     let instrs = parse("+[[>>>>>>>>>]+>>>>>>>>>-]").unwrap();
     execute(&instrs, max_steps());
 }
+
+#[test]
+fn report_steps_and_outputs() {
+    let instrs = parse("+.+.,").unwrap();
+    let budget = Budget {
+        steps: max_steps(),
+        time: None,
+    };
+    let (state, _, report) = execute_with_budget(&instrs, budget, CellWidth::Bits8, &[]);
+
+    assert_eq!(state.start_instr, Some(&instrs[4]));
+    assert_eq!(
+        report,
+        Report {
+            steps: 4,
+            outputs: 2,
+            inputs: 0,
+            timed_out: false,
+        }
+    );
+}
+
+#[test]
+fn stop_when_out_of_time() {
+    let instrs = parse("+[]").unwrap();
+    let budget = Budget {
+        steps: u64::MAX,
+        time: Some(Duration::from_millis(1)),
+    };
+    let (state, warning, report) = execute_with_budget(&instrs, budget, CellWidth::Bits8, &[]);
+
+    assert_eq!(warning, None);
+    assert_eq!(state.start_instr, Some(&instrs[1]));
+    assert!(report.timed_out);
+}
+
+#[test]
+fn read_known_input() {
+    let instrs = parse(",.,.,").unwrap();
+    let budget = Budget {
+        steps: max_steps(),
+        time: None,
+    };
+    let (state, _, report) = execute_with_budget(&instrs, budget, CellWidth::Bits8, b"ab");
+
+    // We stop at the read after the input runs out.
+    assert_eq!(state.start_instr, Some(&instrs[4]));
+    assert_eq!(state.outputs, b"ab".to_vec());
+    assert_eq!(report.inputs, 2);
+}
+
+#[test]
+fn snapshot_round_trip() {
+    let snapshot = Snapshot {
+        pc: 3,
+        steps: 100,
+        inputs: 1,
+        cell_ptr: 1,
+        cells: vec![Wrapping(0), Wrapping(-1), Wrapping(70000)],
+        outputs: b"hi\n".to_vec(),
+    };
+    assert_eq!(Snapshot::from_bytes(&snapshot.to_bytes()), Some(snapshot));
+
+    assert_eq!(Snapshot::from_bytes(b"pc 3\nsteps"), None);
+}
+
+#[test]
+fn resume_matches_fresh_execution() {
+    let instrs = parse(",>+++[<.+>-]<[>++<-]+[]").unwrap();
+    let budget = |steps| Budget { steps, time: None };
+
+    let (_, _, _, snapshot) = resume_with_budget(&instrs, budget(6), CellWidth::Bits8, b"a", None);
+    let (resumed_state, _, resumed_report, _) = resume_with_budget(
+        &instrs,
+        budget(1000),
+        CellWidth::Bits8,
+        b"a",
+        Some(&snapshot),
+    );
+    let (fresh_state, _, fresh_report) =
+        execute_with_budget(&instrs, budget(1000), CellWidth::Bits8, b"a");
+
+    assert_eq!(resumed_state, fresh_state);
+    assert_eq!(resumed_report, fresh_report);
+
+    // We can't resume from a snapshot that has run too many steps.
+    let (_, _, _, snapshot) =
+        resume_with_budget(&instrs, budget(1000), CellWidth::Bits8, b"a", None);
+    let (state, _, report, _) =
+        resume_with_budget(&instrs, budget(6), CellWidth::Bits8, b"a", Some(&snapshot));
+    assert_eq!(report.steps, 6);
+    assert_ne!(state.start_instr, fresh_state.start_instr);
+}
@@ -0,0 +1,722 @@
+//! A minimal static linker for x86-64 Linux, so `--linker=builtin`
+//! can write executables without running `clang`.
+//!
+//! This only handles what LLVM emits for a bfc module that includes
+//! the builtin runtime: a single relocatable object, with no shared
+//! libraries, thread locals or constructors. The executable has one
+//! read-only segment for the code and constants, and one writable
+//! segment for data, the GOT and zero initialised data.
+
+use std::collections::HashMap;
+use std::convert::TryFrom;
+use std::convert::TryInto;
+
+#[cfg(test)]
+use pretty_assertions::assert_eq;
+
+/// The address we load executables at, the usual base address for
+/// non-PIE executables on x86-64.
+const BASE_ADDRESS: u64 = 0x40_0000;
+const PAGE_SIZE: u64 = 0x1000;
+
+const ELF_HEADER_SIZE: u64 = 64;
+const PROGRAM_HEADER_SIZE: u64 = 56;
+const SECTION_HEADER_SIZE: u64 = 64;
+const SYMBOL_SIZE: u64 = 24;
+const RELA_SIZE: u64 = 24;
+const GOT_ENTRY_SIZE: u64 = 8;
+
+const ELFCLASS64: u8 = 2;
+const ELFDATA2LSB: u8 = 1;
+const ET_REL: u16 = 1;
+const ET_EXEC: u16 = 2;
+const EM_X86_64: u16 = 62;
+
+const SHT_SYMTAB: u32 = 2;
+const SHT_RELA: u32 = 4;
+const SHT_NOBITS: u32 = 8;
+const SHT_REL: u32 = 9;
+const SHT_INIT_ARRAY: u32 = 14;
+const SHT_FINI_ARRAY: u32 = 15;
+const SHT_PREINIT_ARRAY: u32 = 16;
+
+const SHF_WRITE: u64 = 0x1;
+const SHF_ALLOC: u64 = 0x2;
+const SHF_TLS: u64 = 0x400;
+
+const SHN_UNDEF: u16 = 0;
+const SHN_LORESERVE: u16 = 0xff00;
+const SHN_ABS: u16 = 0xfff1;
+
+const STB_WEAK: u8 = 2;
+const STT_TLS: u8 = 6;
+
+const PT_LOAD: u32 = 1;
+const PT_GNU_STACK: u32 = 0x6474_e551;
+const PF_X: u32 = 0x1;
+const PF_W: u32 = 0x2;
+const PF_R: u32 = 0x4;
+
+const R_X86_64_NONE: u32 = 0;
+const R_X86_64_64: u32 = 1;
+const R_X86_64_PC32: u32 = 2;
+const R_X86_64_PLT32: u32 = 4;
+const R_X86_64_GOTPCREL: u32 = 9;
+const R_X86_64_32: u32 = 10;
+const R_X86_64_32S: u32 = 11;
+const R_X86_64_PC64: u32 = 24;
+const R_X86_64_GOTPCRELX: u32 = 41;
+const R_X86_64_REX_GOTPCRELX: u32 = 42;
+
+/// A section header from the object file.
+#[derive(Debug, Clone)]
+struct Section {
+    kind: u32,
+    flags: u64,
+    offset: u64,
+    size: u64,
+    link: u32,
+    info: u32,
+    align: u64,
+}
+
+impl Section {
+    /// Is this section part of the program's memory image?
+    fn is_loaded(&self) -> bool {
+        self.flags & SHF_ALLOC != 0
+    }
+
+    /// Is this section writable at runtime? We treat zero
+    /// initialised sections as writable, as they go after the
+    /// initialised data.
+    fn is_writable(&self) -> bool {
+        self.flags & SHF_WRITE != 0 || self.kind == SHT_NOBITS
+    }
+}
+
+#[derive(Debug, Clone)]
+struct Symbol {
+    name: String,
+    bind: u8,
+    kind: u8,
+    section: u16,
+    value: u64,
+}
+
+#[derive(Debug, Clone)]
+struct Relocation {
+    /// The section we're patching.
+    section: usize,
+    offset: u64,
+    symbol: usize,
+    kind: u32,
+    addend: i64,
+}
+
+/// Link the relocatable x86-64 ELF `object` into a static executable,
+/// starting at `_start`. Every symbol the object references must be
+/// defined in it.
+pub fn link_static(object: &[u8]) -> Result<Vec<u8>, String> {
+    check_header(object)?;
+    let sections = read_sections(object)?;
+    for section in &sections {
+        if section.is_loaded() && section.flags & SHF_TLS != 0 {
+            return Err("The builtin linker does not support thread locals".to_owned());
+        }
+        // Nothing would call constructors or destructors, as there's
+        // no C library startup code.
+        if [SHT_INIT_ARRAY, SHT_FINI_ARRAY, SHT_PREINIT_ARRAY].contains(&section.kind) {
+            return Err("The builtin linker does not support constructors".to_owned());
+        }
+    }
+
+    let symbols = read_symbols(object, &sections)?;
+    let relocations = read_relocations(object, &sections)?;
+
+    // Give every symbol that's accessed through the GOT a slot.
+    let mut got_slots: HashMap<usize, u64> = HashMap::new();
+    let mut got_symbols = vec![];
+    for relocation in &relocations {
+        if uses_got(relocation.kind) && !got_slots.contains_key(&relocation.symbol) {
+            got_slots.insert(relocation.symbol, got_symbols.len() as u64);
+            got_symbols.push(relocation.symbol);
+        }
+    }
+
+    let has_data_segment = !got_symbols.is_empty()
+        || sections
+            .iter()
+            .any(|section| section.is_loaded() && section.is_writable());
+    let num_program_headers = if has_data_segment { 3 } else { 2 };
+
+    // Lay out the read-only sections straight after the headers.
+    // Every address is BASE_ADDRESS plus the file offset, so the
+    // segments can be mapped directly from the file.
+    let mut addresses: Vec<Option<u64>> = vec![None; sections.len()];
+    let mut end = ELF_HEADER_SIZE + num_program_headers * PROGRAM_HEADER_SIZE;
+    for (i, section) in sections.iter().enumerate() {
+        if section.is_loaded() && !section.is_writable() {
+            end = align_up(end, section.align);
+            addresses[i] = Some(BASE_ADDRESS + end);
+            end += section.size;
+        }
+    }
+    let text_size = end;
+
+    // The writable segment starts on a new page, so we can map it
+    // with different permissions.
+    let data_offset = align_up(end, PAGE_SIZE);
+    end = data_offset;
+    for (i, section) in sections.iter().enumerate() {
+        if section.is_loaded() && section.is_writable() && section.kind != SHT_NOBITS {
+            end = align_up(end, section.align);
+            addresses[i] = Some(BASE_ADDRESS + end);
+            end += section.size;
+        }
+    }
+    end = align_up(end, GOT_ENTRY_SIZE);
+    let got_address = BASE_ADDRESS + end;
+    end += got_symbols.len() as u64 * GOT_ENTRY_SIZE;
+    let file_size = end;
+    for (i, section) in sections.iter().enumerate() {
+        if section.is_loaded() && section.kind == SHT_NOBITS {
+            end = align_up(end, section.align);
+            addresses[i] = Some(BASE_ADDRESS + end);
+            end += section.size;
+        }
+    }
+    let memory_size = end;
+
+    let mut executable = vec![0; to_usize(file_size)?];
+    for (section, address) in sections.iter().zip(&addresses) {
+        if let Some(address) = *address {
+            if section.kind != SHT_NOBITS {
+                let contents = read_bytes(object, section.offset, section.size)?;
+                let start = to_usize(address - BASE_ADDRESS)?;
+                executable[start..start + contents.len()].copy_from_slice(contents);
+            }
+        }
+    }
+
+    for (slot, &symbol) in got_symbols.iter().enumerate() {
+        let address = symbol_address(&symbols, symbol, &addresses)?;
+        let offset = got_address - BASE_ADDRESS + slot as u64 * GOT_ENTRY_SIZE;
+        write_bytes(&mut executable, offset, &address.to_le_bytes());
+    }
+
+    for relocation in &relocations {
+        let section_address = match addresses[relocation.section] {
+            Some(address) if sections[relocation.section].kind != SHT_NOBITS => address,
+            _ => continue,
+        };
+        let width = match relocation.kind {
+            R_X86_64_NONE => 0,
+            R_X86_64_64 | R_X86_64_PC64 => 8,
+            _ => 4,
+        };
+        if relocation.offset.saturating_add(width) > sections[relocation.section].size {
+            return Err("Relocation is outside its section".to_owned());
+        }
+        let place = section_address + relocation.offset;
+        let offset = place - BASE_ADDRESS;
+        let addend = relocation.addend;
+
+        match relocation.kind {
+            R_X86_64_NONE => {}
+            R_X86_64_64 => {
+                let symbol = symbol_address(&symbols, relocation.symbol, &addresses)?;
+                let value = symbol.wrapping_add(addend as u64);
+                write_bytes(&mut executable, offset, &value.to_le_bytes());
+            }
+            R_X86_64_PC64 => {
+                let symbol = symbol_address(&symbols, relocation.symbol, &addresses)?;
+                let value = symbol.wrapping_add(addend as u64).wrapping_sub(place);
+                write_bytes(&mut executable, offset, &value.to_le_bytes());
+            }
+            R_X86_64_PC32 | R_X86_64_PLT32 => {
+                let symbol = symbol_address(&symbols, relocation.symbol, &addresses)?;
+                let value = symbol as i64 + addend - place as i64;
+                write_i32(&mut executable, offset, value)?;
+            }
+            R_X86_64_32 => {
+                let symbol = symbol_address(&symbols, relocation.symbol, &addresses)?;
+                let value = u32::try_from(symbol as i64 + addend)
+                    .map_err(|_| "Relocation target is out of range".to_owned())?;
+                write_bytes(&mut executable, offset, &value.to_le_bytes());
+            }
+            R_X86_64_32S => {
+                let symbol = symbol_address(&symbols, relocation.symbol, &addresses)?;
+                write_i32(&mut executable, offset, symbol as i64 + addend)?;
+            }
+            kind if uses_got(kind) => {
+                let slot = got_address + got_slots[&relocation.symbol] * GOT_ENTRY_SIZE;
+                let value = slot as i64 + addend - place as i64;
+                write_i32(&mut executable, offset, value)?;
+            }
+            kind => {
+                return Err(format!(
+                    "The builtin linker does not support relocation type {}",
+                    kind
+                ));
+            }
+        }
+    }
+
+    let entry = match symbols.iter().position(|symbol| symbol.name == "_start") {
+        Some(index) => symbol_address(&symbols, index, &addresses)?,
+        None => return Err("No _start symbol to use as the entry point".to_owned()),
+    };
+
+    write_elf_header(&mut executable, entry, num_program_headers as u16);
+    let mut program_headers = vec![ProgramHeader {
+        kind: PT_LOAD,
+        flags: PF_R | PF_X,
+        offset: 0,
+        file_size: text_size,
+        memory_size: text_size,
+        align: PAGE_SIZE,
+    }];
+    if has_data_segment {
+        program_headers.push(ProgramHeader {
+            kind: PT_LOAD,
+            flags: PF_R | PF_W,
+            offset: data_offset,
+            file_size: file_size - data_offset,
+            memory_size: memory_size - data_offset,
+            align: PAGE_SIZE,
+        });
+    }
+    // Without this, the kernel makes the stack executable.
+    program_headers.push(ProgramHeader {
+        kind: PT_GNU_STACK,
+        flags: PF_R | PF_W,
+        offset: 0,
+        file_size: 0,
+        memory_size: 0,
+        align: 16,
+    });
+    for (i, header) in program_headers.iter().enumerate() {
+        header.write(
+            &mut executable,
+            ELF_HEADER_SIZE + i as u64 * PROGRAM_HEADER_SIZE,
+        );
+    }
+
+    Ok(executable)
+}
+
+fn check_header(object: &[u8]) -> Result<(), String> {
+    let ident = read_bytes(object, 0, 16)?;
+    if &ident[..4] != b"\x7fELF" {
+        return Err("Object file is not an ELF file".to_owned());
+    }
+    if ident[4] != ELFCLASS64 || ident[5] != ELFDATA2LSB {
+        return Err("Object file is not 64-bit little endian ELF".to_owned());
+    }
+    if read_u16(object, 16)? != ET_REL {
+        return Err("Object file is not relocatable".to_owned());
+    }
+    if read_u16(object, 18)? != EM_X86_64 {
+        return Err("The builtin linker only supports x86-64".to_owned());
+    }
+    Ok(())
+}
+
+fn read_sections(object: &[u8]) -> Result<Vec<Section>, String> {
+    let table_offset = read_u64(object, 40)?;
+    let num_sections = read_u16(object, 60)? as u64;
+
+    let mut sections = vec![];
+    for i in 0..num_sections {
+        let header = table_offset + i * SECTION_HEADER_SIZE;
+        sections.push(Section {
+            kind: read_u32(object, header + 4)?,
+            flags: read_u64(object, header + 8)?,
+            offset: read_u64(object, header + 24)?,
+            size: read_u64(object, header + 32)?,
+            link: read_u32(object, header + 40)?,
+            info: read_u32(object, header + 44)?,
+            align: read_u64(object, header + 48)?,
+        });
+    }
+    Ok(sections)
+}
+
+fn read_symbols(object: &[u8], sections: &[Section]) -> Result<Vec<Symbol>, String> {
+    let symtab = match sections.iter().find(|section| section.kind == SHT_SYMTAB) {
+        Some(symtab) => symtab,
+        None => return Err("Object file has no symbol table".to_owned()),
+    };
+    let strtab = match sections.get(symtab.link as usize) {
+        Some(strtab) => read_bytes(object, strtab.offset, strtab.size)?,
+        None => return Err("Object file has no string table".to_owned()),
+    };
+
+    let mut symbols = vec![];
+    for i in 0..symtab.size / SYMBOL_SIZE {
+        let entry = symtab.offset + i * SYMBOL_SIZE;
+        let name_start = to_usize(read_u32(object, entry)? as u64)?;
+        let name = match strtab.get(name_start..) {
+            Some(name) => name.split(|&b| b == 0).next().unwrap_or(&[]),
+            None => return Err("Object file has an invalid symbol name".to_owned()),
+        };
+        let info = read_bytes(object, entry + 4, 1)?[0];
+        symbols.push(Symbol {
+            name: String::from_utf8_lossy(name).into_owned(),
+            bind: info >> 4,
+            kind: info & 0xf,
+            section: read_u16(object, entry + 6)?,
+            value: read_u64(object, entry + 8)?,
+        });
+    }
+    Ok(symbols)
+}
+
+/// Read the relocations that apply to loaded sections. We don't load
+/// any other sections, so we ignore relocations for them.
+fn read_relocations(object: &[u8], sections: &[Section]) -> Result<Vec<Relocation>, String> {
+    let mut relocations = vec![];
+    for section in sections {
+        let target = section.info as usize;
+        if !sections.get(target).map_or(false, Section::is_loaded) {
+            continue;
+        }
+        if section.kind == SHT_REL {
+            return Err("The builtin linker does not support SHT_REL relocations".to_owned());
+        }
+        if section.kind != SHT_RELA {
+            continue;
+        }
+
+        for i in 0..section.size / RELA_SIZE {
+            let entry = section.offset + i * RELA_SIZE;
+            let info = read_u64(object, entry + 8)?;
+            relocations.push(Relocation {
+                section: target,
+                offset: read_u64(object, entry)?,
+                symbol: (info >> 32) as usize,
+                kind: info as u32,
+                addend: read_u64(object, entry + 16)? as i64,
+            });
+        }
+    }
+    Ok(relocations)
+}
+
+/// Is this relocation relative to a GOT slot for the symbol?
+fn uses_got(kind: u32) -> bool {
+    kind == R_X86_64_GOTPCREL || kind == R_X86_64_GOTPCRELX || kind == R_X86_64_REX_GOTPCRELX
+}
+
+/// The runtime address of the symbol at `index`.
+fn symbol_address(
+    symbols: &[Symbol],
+    index: usize,
+    addresses: &[Option<u64>],
+) -> Result<u64, String> {
+    let symbol = match symbols.get(index) {
+        Some(symbol) => symbol,
+        None => return Err("Relocation refers to an invalid symbol".to_owned()),
+    };
+    if symbol.kind == STT_TLS {
+        return Err("The builtin linker does not support thread locals".to_owned());
+    }
+    match symbol.section {
+        SHN_UNDEF if symbol.bind == STB_WEAK => Ok(0),
+        SHN_UNDEF => Err(format!("Undefined symbol {}", symbol.name)),
+        SHN_ABS => Ok(symbol.value),
+        section if section >= SHN_LORESERVE => Err(format!(
+            "Symbol {} is in an unsupported section {:#x}",
+            symbol.name, section
+        )),
+        section => match addresses.get(section as usize) {
+            Some(Some(address)) => Ok(address + symbol.value),
+            _ => Err(format!("Symbol {} is not in a loaded section", symbol.name)),
+        },
+    }
+}
+
+/// A segment in the executable.
+struct ProgramHeader {
+    kind: u32,
+    flags: u32,
+    offset: u64,
+    file_size: u64,
+    memory_size: u64,
+    align: u64,
+}
+
+impl ProgramHeader {
+    fn write(&self, executable: &mut [u8], at: u64) {
+        let address = BASE_ADDRESS + self.offset;
+        write_bytes(executable, at, &self.kind.to_le_bytes());
+        write_bytes(executable, at + 4, &self.flags.to_le_bytes());
+        write_bytes(executable, at + 8, &self.offset.to_le_bytes());
+        write_bytes(executable, at + 16, &address.to_le_bytes());
+        write_bytes(executable, at + 24, &address.to_le_bytes());
+        write_bytes(executable, at + 32, &self.file_size.to_le_bytes());
+        write_bytes(executable, at + 40, &self.memory_size.to_le_bytes());
+        write_bytes(executable, at + 48, &self.align.to_le_bytes());
+    }
+}
+
+/// Write the ELF header for an executable with no section headers.
+fn write_elf_header(executable: &mut [u8], entry: u64, num_program_headers: u16) {
+    write_bytes(
+        executable,
+        0,
+        &[0x7f, b'E', b'L', b'F', ELFCLASS64, ELFDATA2LSB, 1],
+    );
+    write_bytes(executable, 16, &ET_EXEC.to_le_bytes());
+    write_bytes(executable, 18, &EM_X86_64.to_le_bytes());
+    write_bytes(executable, 20, &1u32.to_le_bytes());
+    write_bytes(executable, 24, &entry.to_le_bytes());
+    write_bytes(executable, 32, &ELF_HEADER_SIZE.to_le_bytes());
+    write_bytes(executable, 52, &(ELF_HEADER_SIZE as u16).to_le_bytes());
+    write_bytes(executable, 54, &(PROGRAM_HEADER_SIZE as u16).to_le_bytes());
+    write_bytes(executable, 56, &num_program_headers.to_le_bytes());
+}
+
+fn align_up(value: u64, align: u64) -> u64 {
+    if align <= 1 {
+        value
+    } else {
+        (value + align - 1) / align * align
+    }
+}
+
+fn to_usize(value: u64) -> Result<usize, String> {
+    usize::try_from(value).map_err(|_| "Object file is too large".to_owned())
+}
+
+fn read_bytes(object: &[u8], offset: u64, len: u64) -> Result<&[u8], String> {
+    let start = to_usize(offset)?;
+    let end = start.checked_add(to_usize(len)?);
+    match end.and_then(|end| object.get(start..end)) {
+        Some(bytes) => Ok(bytes),
+        None => Err("Object file is truncated".to_owned()),
+    }
+}
+
+fn read_u16(object: &[u8], offset: u64) -> Result<u16, String> {
+    let bytes = read_bytes(object, offset, 2)?;
+    Ok(u16::from_le_bytes(bytes.try_into().unwrap()))
+}
+
+fn read_u32(object: &[u8], offset: u64) -> Result<u32, String> {
+    let bytes = read_bytes(object, offset, 4)?;
+    Ok(u32::from_le_bytes(bytes.try_into().unwrap()))
+}
+
+fn read_u64(object: &[u8], offset: u64) -> Result<u64, String> {
+    let bytes = read_bytes(object, offset, 8)?;
+    Ok(u64::from_le_bytes(bytes.try_into().unwrap()))
+}
+
+fn write_bytes(executable: &mut [u8], offset: u64, bytes: &[u8]) {
+    let start = offset as usize;
+    executable[start..start + bytes.len()].copy_from_slice(bytes);
+}
+
+fn write_i32(executable: &mut [u8], offset: u64, value: i64) -> Result<(), String> {
+    let value = i32::try_from(value).map_err(|_| "Relocation target is out of range".to_owned())?;
+    write_bytes(executable, offset, &value.to_le_bytes());
+    Ok(())
+}
+
+/// Build a relocatable object with a `.text` section defining
+/// `_start`, and a `.data` section defining `value`. It also
+/// references an undefined symbol `missing`. Each relocation is
+/// `(offset, type, symbol, addend)` in `.text`.
+#[cfg(test)]
+fn test_object(text: &[u8], data: &[u8], relocations: &[(u64, u32, u64, i64)]) -> Vec<u8> {
+    let mut rela = vec![];
+    for &(offset, kind, symbol, addend) in relocations {
+        rela.extend_from_slice(&offset.to_le_bytes());
+        rela.extend_from_slice(&(symbol << 32 | kind as u64).to_le_bytes());
+        rela.extend_from_slice(&addend.to_le_bytes());
+    }
+    let strtab = b"\0value\0_start\0missing\0";
+    // (name, info, section, value)
+    let mut symtab = vec![0; SYMBOL_SIZE as usize];
+    for &(name, info, section, value) in &[
+        (1u32, 0x01u8, 2u16, 0u64),
+        (7, 0x12, 1, 0),
+        (14, 0x10, 0, 0),
+    ] {
+        symtab.extend_from_slice(&name.to_le_bytes());
+        symtab.extend_from_slice(&[info, 0]);
+        symtab.extend_from_slice(&section.to_le_bytes());
+        symtab.extend_from_slice(&value.to_le_bytes());
+        symtab.extend_from_slice(&0u64.to_le_bytes());
+    }
+
+    let mut object = vec![0; ELF_HEADER_SIZE as usize];
+    // (type, flags, contents, link, info, align, entry size)
+    let contents: Vec<(u32, u64, &[u8], u32, u32, u64, u64)> = vec![
+        (1, 0x6, text, 0, 0, 16, 0),
+        (1, 0x3, data, 0, 0, 8, 0),
+        (SHT_RELA, 0, &rela, 4, 1, 8, RELA_SIZE),
+        (SHT_SYMTAB, 0, &symtab, 5, 3, 8, SYMBOL_SIZE),
+        (3, 0, strtab, 0, 0, 1, 0),
+    ];
+    let mut headers = vec![0; SECTION_HEADER_SIZE as usize];
+    for (kind, flags, bytes, link, info, align, entry_size) in contents {
+        let mut header = vec![0; SECTION_HEADER_SIZE as usize];
+        write_bytes(&mut header, 4, &kind.to_le_bytes());
+        write_bytes(&mut header, 8, &flags.to_le_bytes());
+        write_bytes(&mut header, 24, &(object.len() as u64).to_le_bytes());
+        write_bytes(&mut header, 32, &(bytes.len() as u64).to_le_bytes());
+        write_bytes(&mut header, 40, &link.to_le_bytes());
+        write_bytes(&mut header, 44, &info.to_le_bytes());
+        write_bytes(&mut header, 48, &align.to_le_bytes());
+        write_bytes(&mut header, 56, &entry_size.to_le_bytes());
+        headers.extend(header);
+        object.extend_from_slice(bytes);
+    }
+
+    let section_table = object.len() as u64;
+    object.extend(headers);
+    write_bytes(
+        &mut object,
+        0,
+        &[0x7f, b'E', b'L', b'F', ELFCLASS64, ELFDATA2LSB, 1],
+    );
+    write_bytes(&mut object, 16, &ET_REL.to_le_bytes());
+    write_bytes(&mut object, 18, &EM_X86_64.to_le_bytes());
+    write_bytes(&mut object, 40, &section_table.to_le_bytes());
+    write_bytes(&mut object, 58, &(SECTION_HEADER_SIZE as u16).to_le_bytes());
+    write_bytes(&mut object, 60, &6u16.to_le_bytes());
+    object
+}
+
+/// The address of `_start` in executables linked from `test_object`:
+/// the first 16 byte aligned address after the ELF header and three
+/// program headers.
+#[cfg(test)]
+const TEST_START_ADDRESS: u64 = BASE_ADDRESS + 0xf0;
+
+/// The address of `value` in executables linked from `test_object`.
+#[cfg(test)]
+const TEST_VALUE_ADDRESS: u64 = BASE_ADDRESS + PAGE_SIZE;
+
+#[test]
+fn link_static_writes_executable() {
+    let object = test_object(&[0xc3], &[0; 8], &[]);
+    let executable = link_static(&object).unwrap();
+
+    assert_eq!(&executable[..4], b"\x7fELF");
+    assert_eq!(read_u16(&executable, 16), Ok(ET_EXEC));
+    assert_eq!(read_u64(&executable, 24), Ok(TEST_START_ADDRESS));
+    assert_eq!(read_u16(&executable, 56), Ok(3));
+    assert_eq!(
+        executable[(TEST_START_ADDRESS - BASE_ADDRESS) as usize],
+        0xc3
+    );
+}
+
+#[test]
+fn link_static_pc32() {
+    // mov edi, [rip + value]
+    let text = [0x8b, 0x3d, 0, 0, 0, 0];
+    let object = test_object(&text, &[0; 8], &[(2, R_X86_64_PC32, 1, -4)]);
+    let executable = link_static(&object).unwrap();
+
+    let displacement = read_u32(&executable, TEST_START_ADDRESS - BASE_ADDRESS + 2).unwrap();
+    let next_instr = TEST_START_ADDRESS + text.len() as u64;
+    assert_eq!(
+        displacement as i32 as i64,
+        (TEST_VALUE_ADDRESS - next_instr) as i64
+    );
+}
+
+#[test]
+fn link_static_got() {
+    // mov rax, [rip + value@GOTPCREL]
+    let text = [0x48, 0x8b, 0x05, 0, 0, 0, 0];
+    let object = test_object(&text, &[0; 8], &[(3, R_X86_64_REX_GOTPCRELX, 1, -4)]);
+    let executable = link_static(&object).unwrap();
+
+    // The GOT follows .data, and its slot holds the address of value.
+    let got_address = TEST_VALUE_ADDRESS + 8;
+    assert_eq!(
+        read_u64(&executable, got_address - BASE_ADDRESS),
+        Ok(TEST_VALUE_ADDRESS)
+    );
+    let displacement = read_u32(&executable, TEST_START_ADDRESS - BASE_ADDRESS + 3).unwrap();
+    let next_instr = TEST_START_ADDRESS + text.len() as u64;
+    assert_eq!(
+        displacement as i32 as i64,
+        (got_address - next_instr) as i64
+    );
+}
+
+#[test]
+fn link_static_undefined_symbol() {
+    let text = [0xe8, 0, 0, 0, 0];
+    let object = test_object(&text, &[0; 8], &[(1, R_X86_64_PLT32, 3, -4)]);
+    assert_eq!(
+        link_static(&object),
+        Err("Undefined symbol missing".to_owned())
+    );
+}
+
+#[test]
+fn link_static_relocation_outside_section() {
+    let object = test_object(&[0xc3], &[0; 8], &[(0, R_X86_64_PC32, 1, -4)]);
+    assert_eq!(
+        link_static(&object),
+        Err("Relocation is outside its section".to_owned())
+    );
+}
+
+#[test]
+fn link_static_requires_relocatable_object() {
+    let mut object = test_object(&[0xc3], &[0; 8], &[]);
+    write_bytes(&mut object, 16, &ET_EXEC.to_le_bytes());
+    assert_eq!(
+        link_static(&object),
+        Err("Object file is not relocatable".to_owned())
+    );
+}
+
+#[test]
+fn link_static_truncated_object() {
+    let object = test_object(&[0xc3], &[0; 8], &[]);
+    assert_eq!(
+        link_static(&object[..100]),
+        Err("Object file is truncated".to_owned())
+    );
+}
+
+#[cfg(all(target_os = "linux", target_arch = "x86_64"))]
+#[test]
+fn link_static_runs() {
+    use std::os::unix::fs::PermissionsExt;
+    use std::process::Command;
+
+    let text = [
+        // mov rax, [rip + value@GOTPCREL]
+        0x48, 0x8b, 0x05, 0, 0, 0, 0, //
+        // mov edi, [rax]
+        0x8b, 0x38, //
+        // mov eax, 60 (exit)
+        0xb8, 60, 0, 0, 0, //
+        // syscall
+        0x0f, 0x05,
+    ];
+    let object = test_object(
+        &text,
+        &42u64.to_le_bytes(),
+        &[(3, R_X86_64_GOTPCRELX, 1, -4)],
+    );
+    let executable = link_static(&object).unwrap();
+
+    let dir = tempfile::tempdir().unwrap();
+    let path = dir.path().join("exit_42");
+    std::fs::write(&path, &executable).unwrap();
+    std::fs::set_permissions(&path, std::fs::Permissions::from_mode(0o755)).unwrap();
+
+    let status = Command::new(&path).status().unwrap();
+    assert_eq!(status.code(), Some(42));
+}
@@ -2,22 +2,41 @@
 
 use itertools::Itertools;
 use llvm_sys::core::*;
+use llvm_sys::debuginfo::{LLVMMetadataReplaceAllUsesWith, LLVMTemporaryMDNode};
+use llvm_sys::execution_engine::*;
+use llvm_sys::ir_reader::LLVMParseIRInContext;
+use llvm_sys::linker::LLVMLinkModules2;
 use llvm_sys::prelude::*;
 use llvm_sys::target::*;
 use llvm_sys::target_machine::*;
-use llvm_sys::transforms::pass_manager_builder::*;
-use llvm_sys::{LLVMBuilder, LLVMIntPredicate, LLVMModule};
-
+use llvm_sys::transforms::instcombine::*;
+use llvm_sys::transforms::scalar::*;
+use llvm_sys::transforms::util::*;
+use llvm_sys::transforms::vectorize::*;
+use llvm_sys::{
+    LLVMAttributeFunctionIndex, LLVMBuilder, LLVMIntPredicate, LLVMLinkage, LLVMModule,
+};
+
+use std::cell::RefCell;
+use std::cmp::{max, min};
+use std::collections::{HashMap, HashSet};
 use std::ffi::{CStr, CString};
+use std::mem;
 use std::os::raw::{c_uint, c_ulonglong};
 use std::ptr::null_mut;
+use std::rc::Rc;
+use std::slice;
 use std::str;
+use std::sync::Once;
+use std::time::Instant;
 
-use std::collections::HashMap;
 use std::num::Wrapping;
 
 use crate::bfir::AstNode::*;
-use crate::bfir::{AstNode, Cell};
+use crate::bfir::{count_nodes, get_position, strip_positions, AstNode, Cell, CellWidth, Position};
+use crate::bounds::is_statically_bounded;
+use crate::diagnostics;
+use crate::peephole::PassStats;
 
 use crate::execution::ExecutionState;
 
@@ -29,6 +48,9 @@ const LLVM_TRUE: LLVMBool = 1;
 pub struct Module {
     module: *mut LLVMModule,
     strings: Vec<CString>,
+    /// An integer type as wide as a pointer on this module's target,
+    /// for C's `size_t` and `off_t`, and for cell indexes.
+    int_ptr_type: LLVMTypeRef,
 }
 
 impl Module {
@@ -74,6 +96,33 @@ impl Drop for Module {
     }
 }
 
+/// Owns an LLVM context. Contexts aren't thread safe, so each thread
+/// compiles in its own context, and threads can compile different
+/// files at the same time.
+struct Context {
+    context: LLVMContextRef,
+}
+
+impl Drop for Context {
+    fn drop(&mut self) {
+        // Rust requires that drop() is a safe function.
+        unsafe {
+            LLVMContextDispose(self.context);
+        }
+    }
+}
+
+thread_local! {
+    static CONTEXT: Context = Context {
+        context: unsafe { LLVMContextCreate() },
+    };
+}
+
+/// The LLVM context for the current thread.
+fn context() -> LLVMContextRef {
+    CONTEXT.with(|context| context.context)
+}
+
 /// Wraps LLVM's builder class to provide a nicer API and ensure we
 /// always dispose correctly.
 struct Builder {
@@ -81,11 +130,11 @@ struct Builder {
 }
 
 impl Builder {
-    /// Create a new Builder in LLVM's global context.
+    /// Create a new Builder in this thread's LLVM context.
     fn new() -> Self {
         unsafe {
             Builder {
-                builder: LLVMCreateBuilder(),
+                builder: LLVMCreateBuilderInContext(context()),
             }
         }
     }
@@ -106,39 +155,379 @@ impl Drop for Builder {
     }
 }
 
+/// How the compiled program should buffer its output before handing
+/// it to the OS.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum OutputBuffering {
+    /// Flush whenever we write a newline, so interactive programs
+    /// behave like a terminal would.
+    Line,
+    /// Only flush when the buffer is full, before a read or on exit.
+    Full,
+}
+
+/// What a `,` should do to the current cell when stdin is exhausted.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum EofBehaviour {
+    /// Leave the current cell as it was.
+    Unchanged,
+    /// Set the current cell to 0.
+    Zero,
+    /// Set the current cell to -1 (255), matching `getchar` returning EOF.
+    MinusOne,
+}
+
+/// How the compiled program allocates its cells.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum Tape {
+    /// `calloc` exactly as many cells as bounds analysis allows.
+    Fixed,
+    /// `mmap` a large region surrounded by inaccessible guard pages.
+    /// The OS only provides pages as they're touched, and running off
+    /// either end of the tape crashes rather than corrupting memory.
+    Guarded,
+}
+
+/// Whether the compiled program checks that the cell index stays on
+/// the tape.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum Bounds {
+    /// Trust bounds analysis, and don't check at runtime.
+    Unchecked,
+    /// Unless bounds analysis proves every access is on the tape,
+    /// check the range of cells each loop iteration and straight-line
+    /// run of instructions can access, and trap if it's out of bounds.
+    Check,
+}
+
+/// Where the compiled program gets the C library functions it calls.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum Runtime {
+    /// Link against the system C library.
+    Libc,
+    /// Include bfc's own runtime in the module, which makes system
+    /// calls directly and provides the `_start` entry point. The
+    /// result is a static executable that doesn't need a C library.
+    /// This is only supported on x86-64 Linux, and not with profiles.
+    Builtin,
+}
+
+/// Options that control the runtime behaviour of the generated code.
+#[derive(Debug, Clone)]
+pub struct CompileOptions {
+    pub output_buffering: OutputBuffering,
+    pub eof_behaviour: EofBehaviour,
+    pub tape: Tape,
+    pub bounds: Bounds,
+    pub cell_width: CellWidth,
+    /// If set, count how often each loop, multiply and write runs,
+    /// and write the counts to this path on exit.
+    pub profile_path: Option<String>,
+    /// Execution counts from a previous `--profile` run, used to
+    /// weight loop branches and choose which loops to unroll.
+    pub profile_counts: Option<HashMap<Position, u64>>,
+    /// Input that the program reads before stdin. This is the part
+    /// of `--ct-input` that compile time execution didn't consume.
+    pub initial_input: Vec<u8>,
+    /// The program source, so runtime errors can give line and
+    /// column numbers rather than byte offsets. This is shared
+    /// rather than copied, as programs can be large.
+    pub source: Option<Rc<str>>,
+    pub runtime: Runtime,
+}
+
+impl Default for CompileOptions {
+    fn default() -> Self {
+        CompileOptions {
+            output_buffering: OutputBuffering::Full,
+            eof_behaviour: EofBehaviour::MinusOne,
+            tape: Tape::Fixed,
+            bounds: Bounds::Unchecked,
+            cell_width: CellWidth::Bits8,
+            profile_path: None,
+            profile_counts: None,
+            initial_input: vec![],
+            source: None,
+            runtime: Runtime::Libc,
+        }
+    }
+}
+
+/// The size of a guarded tape, in bytes.
+const GUARDED_TAPE_SIZE: c_ulonglong = 1 << 28;
+/// The size of the guard region either side of a guarded tape. This is
+/// a multiple of the page size on every target we support.
+const GUARDED_TAPE_GUARD_SIZE: c_ulonglong = 1 << 16;
+
+const PROT_NONE: c_ulonglong = 0;
+const PROT_READ_WRITE: c_ulonglong = 0x3;
+const MAP_PRIVATE: c_ulonglong = 0x2;
+
+/// The size of the runtime output buffer, in bytes.
+const OUTPUT_BUFFER_SIZE: c_ulonglong = 4096;
+
+/// The globals that hold the runtime output buffer, so we can call
+/// `write` once per buffer rather than once per `.`.
+#[derive(Clone)]
+struct OutputBuffer {
+    buf: LLVMValueRef,
+    len: LLVMValueRef,
+    buffering: OutputBuffering,
+}
+
+/// The size of the runtime input buffer, in bytes.
+const INPUT_BUFFER_SIZE: c_ulonglong = 4096;
+
+/// The `errno` value for a call interrupted by a signal. This is the
+/// same on Linux and macOS.
+const EINTR: c_ulonglong = 4;
+
+/// The globals that hold the runtime input buffer, so we can call
+/// `read` once per buffer rather than once per `,`.
+#[derive(Clone)]
+struct InputBuffer {
+    buf: LLVMValueRef,
+    pos: LLVMValueRef,
+    len: LLVMValueRef,
+    eof_behaviour: EofBehaviour,
+}
+
+/// The size of each record in a profile: the start and end of the
+/// source position, followed by the execution count, as 64-bit
+/// integers.
+pub const PROFILE_RECORD_SIZE: usize = 24;
+
+/// The runtime execution counters for `--profile`.
+#[derive(Clone)]
+struct Profile {
+    /// A global array of `[start, end, count]` records.
+    counts: LLVMValueRef,
+    /// The record for each profiled instruction.
+    indices: Rc<HashMap<*const AstNode, usize>>,
+}
+
+/// How often a loop ran in a previous profile.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+struct LoopWeights {
+    /// How many times we reached the loop.
+    entries: u64,
+    /// How many times we executed the loop body.
+    iterations: u64,
+    /// Whether this loop is a significant part of the program's
+    /// runtime.
+    hot: bool,
+}
+
+/// A loop is hot if it accounts for at least 1/HOT_LOOP_DIVISOR of
+/// all loop iterations.
+const HOT_LOOP_DIVISOR: u64 = 100;
+
+/// Loop bodies with fewer nodes than this are always inlined, as the
+/// call would cost more than the code it saves.
+const OUTLINE_MIN_NODES: usize = 32;
+
+/// Runs of cell updates on fewer cells than this are compiled to
+/// scalar loads and stores.
+const VECTOR_MIN_CELLS: usize = 4;
+
+/// The widest vector we use for a run of cell updates.
+const VECTOR_MAX_CELLS: usize = 64;
+
 #[derive(Clone)]
 struct CompileContext {
     cells: LLVMValueRef,
+    num_cells: c_ulonglong,
     cell_index_ptr: LLVMValueRef,
+    /// The type of cell indexes, which is pointer sized so
+    /// `getelementptr` doesn't need to sign extend them.
+    index_type: LLVMTypeRef,
+    cell_width: CellWidth,
+    /// Whether to check cell accesses are on the tape at runtime.
+    check_bounds: bool,
     main_fn: LLVMValueRef,
+    output: Option<OutputBuffer>,
+    input: Option<InputBuffer>,
+    profile: Option<Profile>,
+    loop_weights: Option<Rc<HashMap<*const AstNode, LoopWeights>>>,
+    outlined: Rc<OutlinedLoops>,
+    source: Option<Rc<str>>,
+}
+
+/// Loops whose bodies occur several times in the program are compiled
+/// once, to an internal function, and called from each occurrence.
+#[derive(Default)]
+struct OutlinedLoops {
+    /// The function number of each loop we outline. Loops with the
+    /// same body share a number.
+    ids: HashMap<*const AstNode, usize>,
+    /// The functions we've generated so far.
+    compiled: RefCell<HashSet<usize>>,
+}
+
+/// Where the current cell is, relative to the value in
+/// `cell_index_ptr`.
+///
+/// Pointer increments are folded into `offset` at compile time, and
+/// we only store the index back to `cell_index_ptr` where control flow
+/// merges (loop headers and entry points). In straight-line code, each
+/// instruction then addresses its cell with a constant offset from the
+/// same loaded index.
+///
+/// We don't build phi nodes for the index ourselves. `cell_index_ptr`
+/// is a scalar alloca in the entry block, so mem2reg always promotes
+/// it, and only adds phis where the index actually changes.
+#[derive(Debug, Clone, Copy)]
+struct CellIndex {
+    /// The value of `cell_index_ptr`, if we've already loaded it in a
+    /// basic block that dominates the current one.
+    base: Option<LLVMValueRef>,
+    /// The total of the pointer increments since `base`.
+    offset: isize,
+}
+
+impl CellIndex {
+    /// A cell index that must be loaded from `cell_index_ptr` before
+    /// it's used.
+    fn unknown() -> Self {
+        CellIndex {
+            base: None,
+            offset: 0,
+        }
+    }
+}
+
+/// A constant cell index or offset of `index_type`.
+fn index_const(index_type: LLVMTypeRef, val: isize) -> LLVMValueRef {
+    unsafe { LLVMConstInt(index_type, val as c_ulonglong, LLVM_FALSE) }
 }
 
 /// Convert this integer to LLVM's representation of a constant
 /// integer.
 unsafe fn int8(val: c_ulonglong) -> LLVMValueRef {
-    LLVMConstInt(LLVMInt8Type(), val, LLVM_FALSE)
+    LLVMConstInt(int8_type(), val, LLVM_FALSE)
 }
 /// Convert this integer to LLVM's representation of a constant
 /// integer.
 // TODO: this should be a machine word size rather than hard-coding 32-bits.
 fn int32(val: c_ulonglong) -> LLVMValueRef {
-    unsafe { LLVMConstInt(LLVMInt32Type(), val, LLVM_FALSE) }
+    unsafe { LLVMConstInt(int32_type(), val, LLVM_FALSE) }
+}
+
+fn int64(val: c_ulonglong) -> LLVMValueRef {
+    unsafe { LLVMConstInt(int64_type(), val, LLVM_FALSE) }
 }
 
 fn int1_type() -> LLVMTypeRef {
-    unsafe { LLVMInt1Type() }
+    unsafe { LLVMInt1TypeInContext(context()) }
 }
 
 fn int8_type() -> LLVMTypeRef {
-    unsafe { LLVMInt8Type() }
+    unsafe { LLVMInt8TypeInContext(context()) }
+}
+
+fn cell_type(cell_width: CellWidth) -> LLVMTypeRef {
+    unsafe { LLVMIntTypeInContext(context(), cell_width.bits()) }
+}
+
+/// Convert this cell value to a constant of the cell type,
+/// truncating it to `cell_width`.
+fn cell_const(cell_width: CellWidth, val: Cell) -> LLVMValueRef {
+    unsafe { LLVMConstInt(cell_type(cell_width), val.0 as c_ulonglong, LLVM_FALSE) }
+}
+
+/// Cast the `i8*` returned by an allocator to a pointer to cells.
+/// This is a no-op for 8-bit cells.
+unsafe fn cast_to_cells_ptr(
+    module: &mut Module,
+    bb: LLVMBasicBlockRef,
+    ptr: LLVMValueRef,
+    cell_width: CellWidth,
+) -> LLVMValueRef {
+    let builder = Builder::new();
+    builder.position_at_end(bb);
+
+    LLVMBuildPointerCast(
+        builder.builder,
+        ptr,
+        LLVMPointerType(cell_type(cell_width), 0),
+        module.new_string_ptr("typed_cells"),
+    )
+}
+
+/// A constant vector of cell values.
+unsafe fn cell_vector_const(cell_width: CellWidth, vals: &[Cell]) -> LLVMValueRef {
+    let mut elements: Vec<_> = vals
+        .iter()
+        .map(|&val| cell_const(cell_width, val))
+        .collect();
+    LLVMConstVector(elements.as_mut_ptr(), elements.len() as c_uint)
+}
+
+/// Cast a pointer to a cell to a pointer to the vector of `lanes`
+/// cells starting there.
+unsafe fn cast_to_vector_ptr(
+    module: &mut Module,
+    bb: LLVMBasicBlockRef,
+    cell_ptr: LLVMValueRef,
+    lanes: usize,
+    cell_width: CellWidth,
+    name: &str,
+) -> LLVMValueRef {
+    let builder = Builder::new();
+    builder.position_at_end(bb);
+
+    let vector_type = LLVMVectorType(cell_type(cell_width), lanes as c_uint);
+    LLVMBuildBitCast(
+        builder.builder,
+        cell_ptr,
+        LLVMPointerType(vector_type, 0),
+        module.new_string_ptr(name),
+    )
+}
+
+/// Should we update the cells at these sorted offsets with a single
+/// vector load and store? Cells in the range that don't change are
+/// stored back unchanged, so most of the range must change (at least
+/// half of it).
+///
+/// The first and last cells are always accessed, and the tape is
+/// contiguous, so the whole range is in bounds whenever the scalar
+/// accesses would be.
+fn should_vectorise(offsets: &[isize]) -> bool {
+    match (offsets.first(), offsets.last()) {
+        (Some(&first), Some(&last)) => {
+            let lanes = (last - first + 1) as usize;
+            offsets.len() >= VECTOR_MIN_CELLS
+                && lanes <= VECTOR_MAX_CELLS
+                && lanes <= 2 * offsets.len()
+        }
+        _ => false,
+    }
 }
 
 fn int32_type() -> LLVMTypeRef {
-    unsafe { LLVMInt32Type() }
+    unsafe { LLVMInt32TypeInContext(context()) }
+}
+
+fn int64_type() -> LLVMTypeRef {
+    unsafe { LLVMInt64TypeInContext(context()) }
+}
+
+fn void_type() -> LLVMTypeRef {
+    unsafe { LLVMVoidTypeInContext(context()) }
 }
 
 fn int8_ptr_type() -> LLVMTypeRef {
-    unsafe { LLVMPointerType(LLVMInt8Type(), 0) }
+    unsafe { LLVMPointerType(int8_type(), 0) }
+}
+
+/// Add a basic block called `name` to the end of `function`.
+unsafe fn append_basic_block(
+    module: &mut Module,
+    function: LLVMValueRef,
+    name: &str,
+) -> LLVMBasicBlockRef {
+    LLVMAppendBasicBlockInContext(context(), function, module.new_string_ptr(name))
 }
 
 fn add_function(
@@ -154,10 +543,7 @@ fn add_function(
 }
 
 fn add_c_declarations(module: &mut Module) {
-    let void;
-    unsafe {
-        void = LLVMVoidType();
-    }
+    let void = void_type();
 
     add_function(
         module,
@@ -172,20 +558,30 @@ fn add_c_declarations(module: &mut Module) {
         void,
     );
 
-    add_function(module, "malloc", &mut [int32_type()], int8_ptr_type());
+    // size_t and ssize_t are as wide as a pointer.
+    let size_type = module.int_ptr_type;
+    add_function(
+        module,
+        "calloc",
+        &mut [size_type, size_type],
+        int8_ptr_type(),
+    );
 
     add_function(module, "free", &mut [int8_ptr_type()], void);
 
     add_function(
         module,
         "write",
-        &mut [int32_type(), int8_ptr_type(), int32_type()],
-        int32_type(),
+        &mut [int32_type(), int8_ptr_type(), size_type],
+        size_type,
     );
 
-    add_function(module, "putchar", &mut [int32_type()], int32_type());
-
-    add_function(module, "getchar", &mut [], int32_type());
+    add_function(
+        module,
+        "read",
+        &mut [int32_type(), int8_ptr_type(), size_type],
+        size_type,
+    );
 }
 
 unsafe fn add_function_call(
@@ -229,26 +625,81 @@ where
 }
 
 fn add_cells_init(
-    init_values: &[Wrapping<i8>],
+    init_values: &[Cell],
+    cell_width: CellWidth,
     module: &mut Module,
     bb: LLVMBasicBlockRef,
 ) -> LLVMValueRef {
+    unsafe {
+        // cell* cells = calloc(num_cells, sizeof(cell));
+        let size_type = module.int_ptr_type;
+        let num_cells = LLVMConstInt(size_type, init_values.len() as c_ulonglong, LLVM_FALSE);
+        let cell_size = LLVMConstInt(size_type, cell_width.bytes() as c_ulonglong, LLVM_FALSE);
+        let mut calloc_args = vec![num_cells, cell_size];
+        let cells_ptr = add_function_call(module, bb, "calloc", &mut calloc_args, "cells");
+        let cells_ptr = cast_to_cells_ptr(module, bb, cells_ptr, cell_width);
+
+        add_cells_values(init_values, cell_width, cells_ptr, module, bb);
+
+        cells_ptr
+    }
+}
+
+/// If every byte of `val` is the same at `cell_width`, return that
+/// byte, so we can set a run of cells to `val` with memset.
+fn memset_byte(cell_width: CellWidth, val: Cell) -> Option<u8> {
+    let bytes = val.0.to_le_bytes();
+    let bytes = &bytes[..cell_width.bytes()];
+    if bytes.iter().all(|&byte| byte == bytes[0]) {
+        Some(bytes[0])
+    } else {
+        None
+    }
+}
+
+/// Runs of initial cell values shorter than this are written with
+/// individual stores rather than a memset call.
+const MEMSET_MIN_RUN: usize = 8;
+
+/// Write `init_values` to the start of the tape. The tape is already
+/// zeroed, so we only write the non-zero runs.
+unsafe fn add_cells_values(
+    init_values: &[Cell],
+    cell_width: CellWidth,
+    cells_ptr: LLVMValueRef,
+    module: &mut Module,
+    bb: LLVMBasicBlockRef,
+) {
     let builder = Builder::new();
     builder.position_at_end(bb);
 
-    unsafe {
-        // char* cells = malloc(num_cells);
-        let num_cells = int32(init_values.len() as c_ulonglong);
-        let mut malloc_args = vec![num_cells];
-        let cells_ptr = add_function_call(module, bb, "malloc", &mut malloc_args, "cells");
+    let one = int32(1);
+    let false_ = LLVMConstInt(int1_type(), 1, LLVM_FALSE);
 
-        let one = int32(1);
-        let false_ = LLVMConstInt(int1_type(), 1, LLVM_FALSE);
+    let mut offset = 0;
+    for (cell_val, cell_count) in run_length_encode(init_values) {
+        if cell_val.0 == 0 {
+            offset += cell_count;
+            continue;
+        }
 
-        let mut offset = 0;
-        for (cell_val, cell_count) in run_length_encode(init_values) {
-            let llvm_cell_val = int8(cell_val.0 as c_ulonglong);
-            let llvm_cell_count = int32(cell_count as c_ulonglong);
+        let llvm_cell_val = cell_const(cell_width, cell_val);
+
+        let memset_val = memset_byte(cell_width, cell_val);
+        if cell_count < MEMSET_MIN_RUN || memset_val.is_none() {
+            for i in 0..cell_count {
+                let mut offset_vec = vec![int32((offset + i) as c_ulonglong)];
+                let offset_cell_ptr = LLVMBuildGEP(
+                    builder.builder,
+                    cells_ptr,
+                    offset_vec.as_mut_ptr(),
+                    offset_vec.len() as u32,
+                    module.new_string_ptr("offset_cell_ptr"),
+                );
+                LLVMBuildStore(builder.builder, llvm_cell_val, offset_cell_ptr);
+            }
+        } else {
+            let llvm_byte_count = int32((cell_count * cell_width.bytes()) as c_ulonglong);
 
             // TODO: factor out a build_gep function.
             let mut offset_vec = vec![int32(offset as c_ulonglong)];
@@ -259,408 +710,1982 @@ fn add_cells_init(
                 offset_vec.len() as u32,
                 module.new_string_ptr("offset_cell_ptr"),
             );
+            let offset_byte_ptr = LLVMBuildPointerCast(
+                builder.builder,
+                offset_cell_ptr,
+                int8_ptr_type(),
+                module.new_string_ptr("offset_byte_ptr"),
+            );
 
+            let llvm_byte_val = int8(c_ulonglong::from(memset_val.unwrap()));
             let mut memset_args =
-                vec![offset_cell_ptr, llvm_cell_val, llvm_cell_count, one, false_];
+                vec![offset_byte_ptr, llvm_byte_val, llvm_byte_count, one, false_];
             add_function_call(module, bb, "llvm.memset.p0i8.i32", &mut memset_args, "");
-
-            offset += cell_count;
         }
 
-        cells_ptr
+        offset += cell_count;
     }
 }
 
-fn add_cells_cleanup(module: &mut Module, bb: LLVMBasicBlockRef, cells: LLVMValueRef) {
-    let builder = Builder::new();
-    builder.position_at_end(bb);
-
-    unsafe {
-        // free(cells);
-        let mut free_args = vec![cells];
-        add_function_call(module, bb, "free", &mut free_args, "");
+/// The `MAP_ANONYMOUS | MAP_NORESERVE` flags for `mmap` on this
+/// target, if we know them. The values differ between platforms, so
+/// we only support guarded tapes where we've checked them.
+fn mmap_anonymous_flags(target_triple: &str) -> Option<c_ulonglong> {
+    if target_triple.contains("linux") {
+        Some(0x20 | 0x4000)
+    } else if target_triple.contains("darwin") || target_triple.contains("macos") {
+        // macOS always reserves lazily.
+        Some(0x1000)
+    } else {
+        None
     }
 }
 
-fn create_module(module_name: &str, target_triple: Option<String>) -> Module {
-    let c_module_name = CString::new(module_name).unwrap();
-    let module_name_char_ptr = c_module_name.to_bytes_with_nul().as_ptr() as *const _;
-
-    let llvm_module;
-    unsafe {
-        llvm_module = LLVMModuleCreateWithName(module_name_char_ptr);
-    }
-    let mut module = Module {
-        module: llvm_module,
-        strings: vec![c_module_name],
-    };
-
-    let target_triple_cstring = if let Some(target_triple) = target_triple {
-        CString::new(target_triple).unwrap()
-    } else {
-        get_default_target_triple()
-    };
+/// Can we compile programs with a guarded tape for this target?
+pub fn target_supports_guarded_tape(target_triple: &str) -> bool {
+    mmap_anonymous_flags(target_triple).is_some()
+}
 
-    // This is necessary for maximum LLVM performance, see
-    // http://llvm.org/docs/Frontend/PerformanceTips.html
+/// An integer type as wide as a pointer on `target_triple`. This
+/// creates a target machine, so `create_module` does it once and
+/// stores the result on the `Module`.
+fn target_int_ptr_type(target_triple: &CStr) -> LLVMTypeRef {
+    init_llvm();
     unsafe {
-        LLVMSetTarget(llvm_module, target_triple_cstring.as_ptr() as *const _);
+        match TargetMachine::new(target_triple.as_ptr()) {
+            Ok(target_machine) => {
+                let data_layout = LLVMCreateTargetDataLayout(target_machine.tm);
+                let int_ptr_type = LLVMIntPtrTypeInContext(context(), data_layout);
+                LLVMDisposeTargetData(data_layout);
+                int_ptr_type
+            }
+            // We can't emit code for an unknown target anyway, so
+            // emit_object reports the error.
+            Err(_) => int64_type(),
+        }
     }
-    // TODO: add a function to the LLVM C API that gives us the
-    // data layout from the target machine.
-
-    add_c_declarations(&mut module);
-    module
 }
 
-fn add_main_fn(module: &mut Module) -> LLVMValueRef {
-    let mut main_args = vec![];
-    unsafe {
-        let main_type = LLVMFunctionType(int32_type(), main_args.as_mut_ptr(), 0, LLVM_FALSE);
-        // TODO: use add_function() here instead.
-        LLVMAddFunction(module.module, module.new_string_ptr("main"), main_type)
-    }
+/// Declare the C functions used to allocate a guarded tape.
+fn add_guarded_tape_declarations(module: &mut Module) {
+    let size_type = module.int_ptr_type;
+    add_function(
+        module,
+        "mmap",
+        &mut [
+            int8_ptr_type(),
+            size_type,
+            int32_type(),
+            int32_type(),
+            int32_type(),
+            size_type,
+        ],
+        int8_ptr_type(),
+    );
+    add_function(
+        module,
+        "mprotect",
+        &mut [int8_ptr_type(), size_type, int32_type()],
+        int32_type(),
+    );
+    add_function(
+        module,
+        "munmap",
+        &mut [int8_ptr_type(), size_type],
+        int32_type(),
+    );
+    add_function(module, "exit", &mut [int32_type()], void_type());
 }
 
-/// Set up the initial basic blocks for appending instructions.
-fn add_initial_bbs(
-    module: &mut Module,
-    main_fn: LLVMValueRef,
-) -> (LLVMBasicBlockRef, LLVMBasicBlockRef) {
-    unsafe {
-        // This basic block is empty, but we will add a branch during
-        // compilation according to InstrPosition.
-        let init_bb = LLVMAppendBasicBlock(main_fn, module.new_string_ptr("init"));
+/// Add an internal `map_tape` function that maps a guarded tape and
+/// returns the start of the mapping (including the leading guard). If
+/// we can't map the tape, the program exits with status 1.
+unsafe fn add_map_tape_fn(module: &mut Module) {
+    add_guarded_tape_declarations(module);
 
-        // We'll begin by appending instructions here.
-        let beginning_bb = LLVMAppendBasicBlock(main_fn, module.new_string_ptr("beginning"));
+    let target_triple = CStr::from_ptr(LLVMGetTarget(module.module))
+        .to_string_lossy()
+        .into_owned();
+    let map_flags = mmap_anonymous_flags(&target_triple).expect("guarded tape not supported");
 
-        (init_bb, beginning_bb)
-    }
-}
+    add_function(module, "map_tape", &mut [], int8_ptr_type());
+    let map_tape_fn = LLVMGetNamedFunction(module.module, module.new_string_ptr("map_tape"));
+    LLVMSetLinkage(map_tape_fn, LLVMLinkage::LLVMInternalLinkage);
 
-// TODO: name our pointers cell_base and
-// cell_offset_ptr.
-/// Initialise the value that contains the current cell index.
-unsafe fn add_cell_index_init(
-    init_value: isize,
-    bb: LLVMBasicBlockRef,
-    module: &mut Module,
-) -> LLVMValueRef {
+    let bb = append_basic_block(module, map_tape_fn, "entry");
+    let map_failed_bb = append_basic_block(module, map_tape_fn, "map_failed");
+    let mapped_bb = append_basic_block(module, map_tape_fn, "mapped");
     let builder = Builder::new();
     builder.position_at_end(bb);
 
-    // int cell_index = 0;
-    let cell_index_ptr = LLVMBuildAlloca(
+    // Reserve the whole region as inaccessible, then make the cells
+    // between the guards readable and writable.
+    // char* tape_mapping = mmap(NULL, mapping_size, PROT_NONE, flags, -1, 0);
+    let size_type = module.int_ptr_type;
+    let mapping_size = GUARDED_TAPE_SIZE + 2 * GUARDED_TAPE_GUARD_SIZE;
+    let tape_mapping = add_function_call(
+        module,
+        bb,
+        "mmap",
+        &mut [
+            LLVMConstNull(int8_ptr_type()),
+            LLVMConstInt(size_type, mapping_size, LLVM_FALSE),
+            int32(PROT_NONE),
+            int32(MAP_PRIVATE | map_flags),
+            LLVMConstAllOnes(int32_type()),
+            LLVMConstInt(size_type, 0, LLVM_FALSE),
+        ],
+        "tape_mapping",
+    );
+
+    let mut indices = vec![int32(GUARDED_TAPE_GUARD_SIZE)];
+    let cells_ptr = LLVMBuildGEP(
         builder.builder,
-        int32_type(),
-        module.new_string_ptr("cell_index_ptr"),
+        tape_mapping,
+        indices.as_mut_ptr(),
+        indices.len() as c_uint,
+        module.new_string_ptr("cells"),
+    );
+    let protect_result = add_function_call(
+        module,
+        bb,
+        "mprotect",
+        &mut [
+            cells_ptr,
+            LLVMConstInt(size_type, GUARDED_TAPE_SIZE, LLVM_FALSE),
+            int32(PROT_READ_WRITE),
+        ],
+        "protect_result",
     );
-    let cell_ptr_init = int32(init_value as c_ulonglong);
-    LLVMBuildStore(builder.builder, cell_ptr_init, cell_index_ptr);
 
-    cell_index_ptr
-}
+    // mmap reports failure by returning MAP_FAILED (-1), and
+    // mprotect by returning -1.
+    let mapping_failed = LLVMBuildICmp(
+        builder.builder,
+        LLVMIntPredicate::LLVMIntEQ,
+        tape_mapping,
+        // inttoptr truncates, so this is -1 on any pointer width.
+        LLVMConstIntToPtr(LLVMConstAllOnes(int64_type()), int8_ptr_type()),
+        module.new_string_ptr("mapping_failed"),
+    );
+    let protect_failed = LLVMBuildICmp(
+        builder.builder,
+        LLVMIntPredicate::LLVMIntNE,
+        protect_result,
+        int32(0),
+        module.new_string_ptr("protect_failed"),
+    );
+    let failed = LLVMBuildOr(
+        builder.builder,
+        mapping_failed,
+        protect_failed,
+        module.new_string_ptr("failed"),
+    );
+    LLVMBuildCondBr(builder.builder, failed, map_failed_bb, mapped_bb);
 
-/// Add prologue to main function.
-unsafe fn add_main_cleanup(bb: LLVMBasicBlockRef) {
-    let builder = Builder::new();
-    builder.position_at_end(bb);
+    add_function_call(module, map_failed_bb, "exit", &mut [int32(1)], "");
+    builder.position_at_end(map_failed_bb);
+    LLVMBuildUnreachable(builder.builder);
 
-    let zero = int32(0);
-    LLVMBuildRet(builder.builder, zero);
+    builder.position_at_end(mapped_bb);
+    LLVMBuildRet(builder.builder, tape_mapping);
 }
 
-/// Add LLVM IR instructions for accessing the current cell, and
-/// return a reference to the current cell, and to a current cell pointer.
-unsafe fn add_current_cell_access(
+/// Map a guarded tape and write `init_values` to it. Returns the
+/// start of the mapping and a pointer to cell #0.
+///
+/// Pages from an anonymous mapping are zeroed by the OS, just like
+/// `calloc`.
+unsafe fn add_guarded_tape_init(
+    init_values: &[Cell],
+    cell_width: CellWidth,
     module: &mut Module,
     bb: LLVMBasicBlockRef,
-    cells: LLVMValueRef,
-    cell_index_ptr: LLVMValueRef,
 ) -> (LLVMValueRef, LLVMValueRef) {
+    add_map_tape_fn(module);
+
     let builder = Builder::new();
     builder.position_at_end(bb);
 
-    let cell_index = LLVMBuildLoad(
+    let tape_mapping = add_function_call(module, bb, "map_tape", &mut [], "tape_mapping");
+    let mut indices = vec![int32(GUARDED_TAPE_GUARD_SIZE)];
+    let cells_ptr = LLVMBuildGEP(
         builder.builder,
-        cell_index_ptr,
+        tape_mapping,
+        indices.as_mut_ptr(),
+        indices.len() as c_uint,
+        module.new_string_ptr("cells"),
+    );
+    let cells_ptr = cast_to_cells_ptr(module, bb, cells_ptr, cell_width);
+
+    add_cells_values(init_values, cell_width, cells_ptr, module, bb);
+
+    (tape_mapping, cells_ptr)
+}
+
+fn add_guarded_tape_cleanup(
+    module: &mut Module,
+    bb: LLVMBasicBlockRef,
+    tape_mapping: LLVMValueRef,
+) {
+    unsafe {
+        // munmap(tape_mapping, mapping_size);
+        let mapping_size = GUARDED_TAPE_SIZE + 2 * GUARDED_TAPE_GUARD_SIZE;
+        let mapping_size = LLVMConstInt(module.int_ptr_type, mapping_size, LLVM_FALSE);
+        let mut munmap_args = vec![tape_mapping, mapping_size];
+        add_function_call(module, bb, "munmap", &mut munmap_args, "");
+    }
+}
+
+fn add_cells_cleanup(module: &mut Module, bb: LLVMBasicBlockRef, cells: LLVMValueRef) {
+    let builder = Builder::new();
+    builder.position_at_end(bb);
+
+    unsafe {
+        // free(cells);
+        let cells = LLVMBuildPointerCast(
+            builder.builder,
+            cells,
+            int8_ptr_type(),
+            module.new_string_ptr("cells_bytes"),
+        );
+        let mut free_args = vec![cells];
+        add_function_call(module, bb, "free", &mut free_args, "");
+    }
+}
+
+/// Add the runtime output buffer to the module, along with a
+/// `flush_output` function that writes its contents to stdout.
+fn add_output_buffer(module: &mut Module, buffering: OutputBuffering) -> OutputBuffer {
+    unsafe {
+        // char output_buffer[OUTPUT_BUFFER_SIZE];
+        let buf_type = LLVMArrayType(int8_type(), OUTPUT_BUFFER_SIZE as c_uint);
+        let buf = LLVMAddGlobal(
+            module.module,
+            buf_type,
+            module.new_string_ptr("output_buffer"),
+        );
+        LLVMSetInitializer(buf, LLVMConstNull(buf_type));
+        LLVMSetLinkage(buf, LLVMLinkage::LLVMInternalLinkage);
+
+        // int output_buffer_len = 0;
+        let len = LLVMAddGlobal(
+            module.module,
+            int32_type(),
+            module.new_string_ptr("output_buffer_len"),
+        );
+        LLVMSetInitializer(len, int32(0));
+        LLVMSetLinkage(len, LLVMLinkage::LLVMInternalLinkage);
+
+        // void flush_output() {
+        //   if (output_buffer_len > 0) {
+        //     write_all(output_buffer, output_buffer_len);
+        //     output_buffer_len = 0;
+        //   }
+        // }
+        add_write_all(module);
+        add_function(module, "flush_output", &mut [], void_type());
+        let flush_fn = LLVMGetNamedFunction(module.module, module.new_string_ptr("flush_output"));
+        LLVMSetLinkage(flush_fn, LLVMLinkage::LLVMInternalLinkage);
+
+        let entry = append_basic_block(module, flush_fn, "entry");
+        let bb = append_basic_block(module, flush_fn, "flush");
+        let flush_after = append_basic_block(module, flush_fn, "flush_after");
+        let builder = Builder::new();
+        builder.position_at_end(entry);
+
+        // Programs often flush with nothing buffered, e.g. at exit,
+        // so skip the system call.
+        let output_len = LLVMBuildLoad(builder.builder, len, module.new_string_ptr("output_len"));
+        let has_output = LLVMBuildICmp(
+            builder.builder,
+            LLVMIntPredicate::LLVMIntSGT,
+            output_len,
+            int32(0),
+            module.new_string_ptr("has_output"),
+        );
+        LLVMBuildCondBr(builder.builder, has_output, bb, flush_after);
+
+        builder.position_at_end(bb);
+        let buf_ptr = LLVMBuildPointerCast(
+            builder.builder,
+            buf,
+            int8_ptr_type(),
+            module.new_string_ptr("output_buffer_ptr"),
+        );
+
+        let output_len = LLVMBuildZExtOrBitCast(
+            builder.builder,
+            output_len,
+            module.int_ptr_type,
+            module.new_string_ptr("output_size"),
+        );
+        add_function_call(module, bb, "write_all", &mut [buf_ptr, output_len], "");
+
+        builder.position_at_end(bb);
+        LLVMBuildStore(builder.builder, int32(0), len);
+        LLVMBuildBr(builder.builder, flush_after);
+
+        builder.position_at_end(flush_after);
+        LLVMBuildRetVoid(builder.builder);
+
+        OutputBuffer {
+            buf,
+            len,
+            buffering,
+        }
+    }
+}
+
+/// Add the runtime input buffer to the module, along with a
+/// `refill_input` function that reads the next chunk of stdin.
+fn add_input_buffer(
+    module: &mut Module,
+    eof_behaviour: EofBehaviour,
+    initial_input: &[u8],
+) -> InputBuffer {
+    unsafe {
+        // char input_buffer[INPUT_BUFFER_SIZE];
+        //
+        // Any initial input starts in the buffer, so we only call
+        // `read` once it's used up.
+        let buf_size = max(INPUT_BUFFER_SIZE as usize, initial_input.len());
+        let buf_type = LLVMArrayType(int8_type(), buf_size as c_uint);
+        let buf = LLVMAddGlobal(
+            module.module,
+            buf_type,
+            module.new_string_ptr("input_buffer"),
+        );
+        if initial_input.is_empty() {
+            LLVMSetInitializer(buf, LLVMConstNull(buf_type));
+        } else {
+            let mut contents = initial_input.to_vec();
+            contents.resize(buf_size, 0);
+            let init = LLVMConstStringInContext(
+                context(),
+                contents.as_ptr() as *const _,
+                contents.len() as c_uint,
+                LLVM_TRUE,
+            );
+            LLVMSetInitializer(buf, init);
+        }
+        LLVMSetLinkage(buf, LLVMLinkage::LLVMInternalLinkage);
+
+        // int input_buffer_pos = 0;
+        let pos = LLVMAddGlobal(
+            module.module,
+            int32_type(),
+            module.new_string_ptr("input_buffer_pos"),
+        );
+        LLVMSetInitializer(pos, int32(0));
+        LLVMSetLinkage(pos, LLVMLinkage::LLVMInternalLinkage);
+
+        // int input_buffer_len = sizeof(initial_input);
+        let len = LLVMAddGlobal(
+            module.module,
+            int32_type(),
+            module.new_string_ptr("input_buffer_len"),
+        );
+        LLVMSetInitializer(len, int32(initial_input.len() as c_ulonglong));
+        LLVMSetLinkage(len, LLVMLinkage::LLVMInternalLinkage);
+
+        // int refill_input() {
+        //   do {
+        //     input_buffer_len = read(0, input_buffer, INPUT_BUFFER_SIZE);
+        //   } while (input_buffer_len == -1 && errno == EINTR);
+        //   input_buffer_pos = 0;
+        //   return input_buffer_len;
+        // }
+        let errno_fn = errno_location_fn(module);
+        add_function(module, errno_fn, &mut [], LLVMPointerType(int32_type(), 0));
+        add_function(module, "refill_input", &mut [], int32_type());
+        let refill_fn = LLVMGetNamedFunction(module.module, module.new_string_ptr("refill_input"));
+        LLVMSetLinkage(refill_fn, LLVMLinkage::LLVMInternalLinkage);
+
+        let entry = append_basic_block(module, refill_fn, "entry");
+        let bb = append_basic_block(module, refill_fn, "read_input");
+        let read_error = append_basic_block(module, refill_fn, "read_error");
+        let read_done = append_basic_block(module, refill_fn, "read_done");
+        let builder = Builder::new();
+        builder.position_at_end(entry);
+        LLVMBuildBr(builder.builder, bb);
+        builder.position_at_end(bb);
+
+        let buf_ptr = LLVMBuildPointerCast(
+            builder.builder,
+            buf,
+            int8_ptr_type(),
+            module.new_string_ptr("input_buffer_ptr"),
+        );
+
+        let stdin_fd = int32(0);
+        let size_type = module.int_ptr_type;
+        let read_result = add_function_call(
+            module,
+            bb,
+            "read",
+            &mut [
+                stdin_fd,
+                buf_ptr,
+                LLVMConstInt(size_type, INPUT_BUFFER_SIZE, LLVM_FALSE),
+            ],
+            "read_result",
+        );
+
+        // A signal may interrupt `read` before it reads anything, so
+        // try again rather than treating it as EOF.
+        builder.position_at_end(bb);
+        let read_failed = LLVMBuildICmp(
+            builder.builder,
+            LLVMIntPredicate::LLVMIntEQ,
+            read_result,
+            LLVMConstAllOnes(size_type),
+            module.new_string_ptr("read_failed"),
+        );
+        LLVMBuildCondBr(builder.builder, read_failed, read_error, read_done);
+
+        let errno_ptr = add_function_call(module, read_error, errno_fn, &mut [], "errno_ptr");
+        builder.position_at_end(read_error);
+        let errno = LLVMBuildLoad(builder.builder, errno_ptr, module.new_string_ptr("errno"));
+        let read_interrupted = LLVMBuildICmp(
+            builder.builder,
+            LLVMIntPredicate::LLVMIntEQ,
+            errno,
+            int32(EINTR),
+            module.new_string_ptr("read_interrupted"),
+        );
+        LLVMBuildCondBr(builder.builder, read_interrupted, bb, read_done);
+
+        // We read at most INPUT_BUFFER_SIZE bytes, so this fits.
+        builder.position_at_end(read_done);
+        let input_len = LLVMBuildTruncOrBitCast(
+            builder.builder,
+            read_result,
+            int32_type(),
+            module.new_string_ptr("input_len"),
+        );
+        LLVMBuildStore(builder.builder, input_len, len);
+        LLVMBuildStore(builder.builder, int32(0), pos);
+        LLVMBuildRet(builder.builder, input_len);
+
+        InputBuffer {
+            buf,
+            pos,
+            len,
+            eof_behaviour,
+        }
+    }
+}
+
+/// Does the C library on this target provide `memrchr`? It's a GNU
+/// extension, so we only rely on it on Linux.
+fn target_has_memrchr(module: &Module) -> bool {
+    let target_triple = unsafe { CStr::from_ptr(LLVMGetTarget(module.module)) };
+    target_triple.to_string_lossy().contains("linux")
+}
+
+/// The C library function that returns a pointer to `errno`. glibc
+/// and musl call it `__errno_location`, whilst macOS and the BSDs
+/// call it `__error`.
+fn errno_location_fn(module: &Module) -> &'static str {
+    let target_triple = unsafe { CStr::from_ptr(LLVMGetTarget(module.module)) };
+    if target_triple.to_string_lossy().contains("linux") {
+        "__errno_location"
+    } else {
+        "__error"
+    }
+}
+
+/// Declare the C functions used to lower `Scan` instructions.
+fn add_scan_declarations(module: &mut Module) {
+    let size_type = module.int_ptr_type;
+    add_function(
+        module,
+        "memchr",
+        &mut [int8_ptr_type(), int32_type(), size_type],
+        int8_ptr_type(),
+    );
+
+    if target_has_memrchr(module) {
+        add_function(
+            module,
+            "memrchr",
+            &mut [int8_ptr_type(), int32_type(), size_type],
+            int8_ptr_type(),
+        );
+    }
+}
+
+fn add_bounds_check_declarations(module: &mut Module) {
+    add_function(module, "llvm.trap", &mut [], void_type());
+}
+
+/// Does this program contain an instruction matching `pred`
+/// (including inside loops)?
+fn contains_instr<F>(instrs: &[AstNode], pred: &F) -> bool
+where
+    F: Fn(&AstNode) -> bool,
+{
+    instrs.iter().any(|instr| match *instr {
+        Loop { ref body, .. } => contains_instr(body, pred),
+        ref instr => pred(instr),
+    })
+}
+
+fn create_module(module_name: &str, target_triple: Option<String>) -> Module {
+    let c_module_name = CString::new(module_name).unwrap();
+    let module_name_char_ptr = c_module_name.to_bytes_with_nul().as_ptr() as *const _;
+
+    let llvm_module;
+    unsafe {
+        llvm_module = LLVMModuleCreateWithNameInContext(module_name_char_ptr, context());
+    }
+    let target_triple_cstring = if let Some(target_triple) = target_triple {
+        CString::new(target_triple).unwrap()
+    } else {
+        get_default_target_triple()
+    };
+
+    let mut module = Module {
+        module: llvm_module,
+        strings: vec![c_module_name],
+        int_ptr_type: target_int_ptr_type(&target_triple_cstring),
+    };
+
+    // This is necessary for maximum LLVM performance, see
+    // http://llvm.org/docs/Frontend/PerformanceTips.html
+    unsafe {
+        LLVMSetTarget(llvm_module, target_triple_cstring.as_ptr() as *const _);
+    }
+    // TODO: add a function to the LLVM C API that gives us the
+    // data layout from the target machine.
+
+    add_c_declarations(&mut module);
+    module
+}
+
+fn add_main_fn(module: &mut Module) -> LLVMValueRef {
+    let mut main_args = vec![];
+    unsafe {
+        let main_type = LLVMFunctionType(int32_type(), main_args.as_mut_ptr(), 0, LLVM_FALSE);
+        // TODO: use add_function() here instead.
+        LLVMAddFunction(module.module, module.new_string_ptr("main"), main_type)
+    }
+}
+
+/// Set up the initial basic blocks for appending instructions.
+fn add_initial_bbs(
+    module: &mut Module,
+    main_fn: LLVMValueRef,
+) -> (LLVMBasicBlockRef, LLVMBasicBlockRef) {
+    unsafe {
+        // This basic block is empty, but we will add a branch during
+        // compilation according to InstrPosition.
+        let init_bb = append_basic_block(module, main_fn, "init");
+
+        // We'll begin by appending instructions here.
+        let beginning_bb = append_basic_block(module, main_fn, "beginning");
+
+        (init_bb, beginning_bb)
+    }
+}
+
+// TODO: name our pointers cell_base and
+// cell_offset_ptr.
+/// Initialise the value that contains the current cell index.
+unsafe fn add_cell_index_init(
+    init_value: isize,
+    index_type: LLVMTypeRef,
+    bb: LLVMBasicBlockRef,
+    module: &mut Module,
+) -> LLVMValueRef {
+    let builder = Builder::new();
+    builder.position_at_end(bb);
+
+    // intptr_t cell_index = 0;
+    let cell_index_ptr = LLVMBuildAlloca(
+        builder.builder,
+        index_type,
+        module.new_string_ptr("cell_index_ptr"),
+    );
+    let cell_ptr_init = index_const(index_type, init_value);
+    LLVMBuildStore(builder.builder, cell_ptr_init, cell_index_ptr);
+
+    cell_index_ptr
+}
+
+/// Add prologue to main function. If the program has an output
+/// buffer, we flush it before returning.
+unsafe fn add_main_cleanup(module: &mut Module, bb: LLVMBasicBlockRef, flush_output: bool) {
+    if flush_output {
+        add_function_call(module, bb, "flush_output", &mut [], "");
+    }
+
+    let builder = Builder::new();
+    builder.position_at_end(bb);
+
+    let zero = int32(0);
+    LLVMBuildRet(builder.builder, zero);
+}
+
+/// Return the value of `cell_index_ptr`, loading it if this is the
+/// first access since control flow merged.
+unsafe fn cell_index_base(
+    module: &mut Module,
+    bb: LLVMBasicBlockRef,
+    ctx: &CompileContext,
+    index: &mut CellIndex,
+) -> LLVMValueRef {
+    if let Some(base) = index.base {
+        return base;
+    }
+
+    let builder = Builder::new();
+    builder.position_at_end(bb);
+
+    let base = LLVMBuildLoad(
+        builder.builder,
+        ctx.cell_index_ptr,
         module.new_string_ptr("cell_index"),
     );
+    index.base = Some(base);
+    base
+}
+
+/// Return the index of the cell `offset` cells after the current
+/// cell.
+unsafe fn cell_index_at(
+    module: &mut Module,
+    bb: LLVMBasicBlockRef,
+    ctx: &CompileContext,
+    index: &mut CellIndex,
+    offset: isize,
+) -> LLVMValueRef {
+    let base = cell_index_base(module, bb, ctx, index);
+
+    let total_offset = index.offset + offset;
+    if total_offset == 0 {
+        return base;
+    }
+
+    let builder = Builder::new();
+    builder.position_at_end(bb);
+
+    LLVMBuildAdd(
+        builder.builder,
+        base,
+        index_const(ctx.index_type, total_offset),
+        module.new_string_ptr("offset_cell_index"),
+    )
+}
+
+/// Store any pending pointer increments to `cell_index_ptr`, so the
+/// index is correct in the basic blocks we branch to.
+unsafe fn flush_cell_index(
+    module: &mut Module,
+    bb: LLVMBasicBlockRef,
+    ctx: &CompileContext,
+    index: &mut CellIndex,
+) {
+    if index.offset == 0 {
+        return;
+    }
+
+    let base = cell_index_base(module, bb, ctx, index);
+
+    let builder = Builder::new();
+    builder.position_at_end(bb);
+
+    let new_cell_index = LLVMBuildAdd(
+        builder.builder,
+        base,
+        index_const(ctx.index_type, index.offset),
+        module.new_string_ptr("new_cell_index"),
+    );
+    LLVMBuildStore(builder.builder, new_cell_index, ctx.cell_index_ptr);
+
+    index.base = Some(new_cell_index);
+    index.offset = 0;
+}
+
+/// Return a pointer to the cell `offset` cells after the current
+/// cell.
+unsafe fn add_cell_ptr(
+    module: &mut Module,
+    bb: LLVMBasicBlockRef,
+    ctx: &CompileContext,
+    index: &mut CellIndex,
+    offset: isize,
+) -> LLVMValueRef {
+    let cell_index = cell_index_at(module, bb, ctx, index, offset);
+
+    let builder = Builder::new();
+    builder.position_at_end(bb);
+
+    let mut indices = vec![cell_index];
+    LLVMBuildGEP(
+        builder.builder,
+        ctx.cells,
+        indices.as_mut_ptr(),
+        indices.len() as c_uint,
+        module.new_string_ptr("current_cell_ptr"),
+    )
+}
+
+/// Add LLVM IR instructions for accessing the current cell, and
+/// return a reference to the current cell, and to a current cell pointer.
+unsafe fn add_current_cell_access(
+    module: &mut Module,
+    bb: LLVMBasicBlockRef,
+    ctx: &CompileContext,
+    index: &mut CellIndex,
+) -> (LLVMValueRef, LLVMValueRef) {
+    let current_cell_ptr = add_cell_ptr(module, bb, ctx, index, 0);
+
+    let builder = Builder::new();
+    builder.position_at_end(bb);
+
+    let current_cell = LLVMBuildLoad(
+        builder.builder,
+        current_cell_ptr,
+        module.new_string_ptr("cell_value"),
+    );
+
+    (current_cell, current_cell_ptr)
+}
+
+/// The smallest position that covers both `a` and `b`.
+fn span_positions(a: Option<Position>, b: Option<Position>) -> Option<Position> {
+    match (a, b) {
+        (Some(a), Some(b)) => Some(Position {
+            start: min(a.start, b.start),
+            end: max(a.end, b.end),
+        }),
+        (a, None) => a,
+        (None, b) => b,
+    }
+}
+
+/// Return the lowest and highest cell offsets accessed by `instrs`
+/// before the next loop or scan (including its first access), along
+/// with the source position of those instructions. The current cell
+/// is always included, but multiply targets are not.
+///
+/// We stop before `start_instr`, as we need to check again when we
+/// start execution there.
+fn accessed_offsets(instrs: &[AstNode], start_instr: &AstNode) -> (isize, isize, Option<Position>) {
+    let mut cell_offset = 0;
+    let mut lowest = 0;
+    let mut highest = 0;
+    let mut position = None;
+
+    for (i, instr) in instrs.iter().enumerate() {
+        if i > 0 && ptr_equal(instr, start_instr) {
+            break;
+        }
+        position = span_positions(position, get_position(instr));
+
+        let mut offsets = vec![];
+        match *instr {
+            Increment { offset, .. } | Set { offset, .. } => offsets.push(offset),
+            // We only access the targets if the current cell is
+            // nonzero, so compile_multiply_move checks them.
+            MultiplyMove { .. } => offsets.push(0),
+            PointerIncrement { amount, .. } => cell_offset += amount,
+            Read { .. } | Write { .. } | Loop { .. } | Scan { .. } => offsets.push(0),
+        }
+        for offset in offsets {
+            lowest = min(lowest, cell_offset + offset);
+            highest = max(highest, cell_offset + offset);
+        }
+
+        if matches!(*instr, Loop { .. } | Scan { .. }) {
+            break;
+        }
+    }
+
+    (lowest, highest, position)
+}
+
+/// Branch to an error if `cell_index` isn't less than `limit`,
+/// treating it as unsigned so negative indexes fail too. Return the
+/// basic block to continue in.
+unsafe fn add_bounds_check(
+    module: &mut Module,
+    bb: LLVMBasicBlockRef,
+    ctx: &CompileContext,
+    cell_index: LLVMValueRef,
+    limit: c_ulonglong,
+    position: Option<Position>,
+) -> LLVMBasicBlockRef {
+    let in_bounds = append_basic_block(module, ctx.main_fn, "in_bounds");
+    let out_of_bounds = append_basic_block(module, ctx.main_fn, "out_of_bounds");
+
+    let builder = Builder::new();
+    builder.position_at_end(bb);
+
+    let is_in_bounds = LLVMBuildICmp(
+        builder.builder,
+        LLVMIntPredicate::LLVMIntULT,
+        cell_index,
+        LLVMConstInt(LLVMTypeOf(cell_index), limit, LLVM_FALSE),
+        module.new_string_ptr("cell_index_in_bounds"),
+    );
+    LLVMBuildCondBr(builder.builder, is_in_bounds, in_bounds, out_of_bounds);
+
+    // out_of_bounds:
+    //   flush_output();
+    //   write(2, message, message_len);
+    //   llvm.trap();
+    if ctx.output.is_some() {
+        add_function_call(module, out_of_bounds, "flush_output", &mut [], "");
+    }
+
+    let message = match (position, &ctx.source) {
+        (Some(position), Some(source)) => {
+            let (line_idx, column_idx) = diagnostics::position(source, position.start);
+            format!(
+                "Cell index out of bounds at line {}, column {}\n",
+                line_idx + 1,
+                column_idx + 1
+            )
+        }
+        (Some(position), None) => format!(
+            "Cell index out of bounds in source bytes {}-{}\n",
+            position.start, position.end
+        ),
+        (None, _) => "Cell index out of bounds\n".to_owned(),
+    };
+    builder.position_at_end(out_of_bounds);
+    let message_ptr = LLVMBuildGlobalStringPtr(
+        builder.builder,
+        module.new_string_ptr(&message),
+        module.new_string_ptr("bounds_error_message"),
+    );
+    let stderr_fd = int32(2);
+    let size_type = module.int_ptr_type;
+    let message_len = LLVMConstInt(size_type, message.len() as c_ulonglong, LLVM_FALSE);
+    add_function_call(
+        module,
+        out_of_bounds,
+        "write",
+        &mut [stderr_fd, message_ptr, message_len],
+        "",
+    );
+    add_function_call(module, out_of_bounds, "llvm.trap", &mut [], "");
+
+    builder.position_at_end(out_of_bounds);
+    LLVMBuildUnreachable(builder.builder);
+
+    in_bounds
+}
+
+/// Check that every cell `instrs` accesses before the next loop or
+/// scan is on the tape, so the instructions themselves don't need
+/// checks. `position` is included in the error, in addition to the
+/// position of the instructions.
+unsafe fn compile_bounds_check(
+    instrs: &[AstNode],
+    start_instr: &AstNode,
+    position: Option<Position>,
+    module: &mut Module,
+    bb: LLVMBasicBlockRef,
+    ctx: &CompileContext,
+    index: &mut CellIndex,
+) -> LLVMBasicBlockRef {
+    let (lowest_offset, highest_offset, instrs_position) = accessed_offsets(instrs, start_instr);
+
+    // If the lowest cell is at most num_cells - span, every cell up
+    // to the highest is on the tape.
+    let lowest_index = cell_index_at(module, bb, ctx, index, lowest_offset);
+    let span = (highest_offset - lowest_offset) as c_ulonglong;
+    let limit = ctx.num_cells.saturating_sub(span);
+
+    add_bounds_check(
+        module,
+        bb,
+        ctx,
+        lowest_index,
+        limit,
+        span_positions(position, instrs_position),
+    )
+}
+
+unsafe fn compile_increment(
+    amount: Cell,
+    offset: isize,
+    module: &mut Module,
+    bb: LLVMBasicBlockRef,
+    ctx: CompileContext,
+    index: &mut CellIndex,
+) -> LLVMBasicBlockRef {
+    let current_cell_ptr = add_cell_ptr(module, bb, &ctx, index, offset);
+
+    let builder = Builder::new();
+    builder.position_at_end(bb);
+
+    let cell_val = LLVMBuildLoad(
+        builder.builder,
+        current_cell_ptr,
+        module.new_string_ptr("cell_value"),
+    );
+
+    let increment_amount = cell_const(ctx.cell_width, amount);
+    let new_cell_val = LLVMBuildAdd(
+        builder.builder,
+        cell_val,
+        increment_amount,
+        module.new_string_ptr("new_cell_value"),
+    );
+
+    LLVMBuildStore(builder.builder, new_cell_val, current_cell_ptr);
+    bb
+}
+
+unsafe fn compile_set(
+    amount: Cell,
+    offset: isize,
+    module: &mut Module,
+    bb: LLVMBasicBlockRef,
+    ctx: CompileContext,
+    index: &mut CellIndex,
+) -> LLVMBasicBlockRef {
+    let current_cell_ptr = add_cell_ptr(module, bb, &ctx, index, offset);
+
+    let builder = Builder::new();
+    builder.position_at_end(bb);
+
+    LLVMBuildStore(
+        builder.builder,
+        cell_const(ctx.cell_width, amount),
+        current_cell_ptr,
+    );
+    bb
+}
+
+/// The combined effect of a run of `Increment` and `Set` instructions
+/// on a single cell.
+#[derive(Debug, Clone, Copy)]
+enum CellUpdate {
+    Increment(Cell),
+    Set(Cell),
+}
+
+/// Find the run of `Increment` and `Set` instructions at the start of
+/// `instrs`. Return how many instructions are in the run, and the
+/// update to each cell, sorted by offset.
+///
+/// The run stops before `start_instr`, because we need to be able to
+/// start execution there, and before it gets too wide for a vector.
+fn cell_update_run(instrs: &[AstNode], start_instr: &AstNode) -> (usize, Vec<(isize, CellUpdate)>) {
+    let mut updates: HashMap<isize, CellUpdate> = HashMap::new();
+    let mut run_length = 0;
+    let mut min_offset = isize::MAX;
+    let mut max_offset = isize::MIN;
+
+    for (i, instr) in instrs.iter().enumerate() {
+        if i > 0 && ptr_equal(instr, start_instr) {
+            break;
+        }
+        let (offset, update) = match *instr {
+            Increment { amount, offset, .. } => (offset, CellUpdate::Increment(amount)),
+            Set { amount, offset, .. } => (offset, CellUpdate::Set(amount)),
+            _ => break,
+        };
+
+        if max(max_offset, offset) - min(min_offset, offset) + 1 > VECTOR_MAX_CELLS as isize {
+            break;
+        }
+        min_offset = min(min_offset, offset);
+        max_offset = max(max_offset, offset);
+
+        let combined = match (updates.get(&offset), update) {
+            (Some(&CellUpdate::Increment(prev)), CellUpdate::Increment(amount)) => {
+                CellUpdate::Increment(prev + amount)
+            }
+            (Some(&CellUpdate::Set(prev)), CellUpdate::Increment(amount)) => {
+                CellUpdate::Set(prev + amount)
+            }
+            (_, update) => update,
+        };
+        updates.insert(offset, combined);
+        run_length += 1;
+    }
+
+    let mut updates: Vec<_> = updates.into_iter().collect();
+    updates.sort_by_key(|&(offset, _)| offset);
+    (run_length, updates)
+}
+
+/// Apply a run of cell updates with a single vector load and store.
+/// Increments become a vector add, and sets mask out the old value
+/// before the add.
+unsafe fn compile_cell_updates(
+    updates: &[(isize, CellUpdate)],
+    module: &mut Module,
+    bb: LLVMBasicBlockRef,
+    ctx: &CompileContext,
+    index: &mut CellIndex,
+) -> LLVMBasicBlockRef {
+    let first_offset = updates[0].0;
+    let lanes = (updates[updates.len() - 1].0 - first_offset + 1) as usize;
+
+    let mut deltas = vec![Wrapping(0); lanes];
+    let mut keep_mask = vec![Wrapping(-1); lanes];
+    for &(offset, update) in updates {
+        let lane = (offset - first_offset) as usize;
+        match update {
+            CellUpdate::Increment(amount) => deltas[lane] = amount,
+            CellUpdate::Set(amount) => {
+                deltas[lane] = amount;
+                keep_mask[lane] = Wrapping(0);
+            }
+        }
+    }
+
+    let first_cell_ptr = add_cell_ptr(module, bb, ctx, index, first_offset);
+    let vector_ptr = cast_to_vector_ptr(
+        module,
+        bb,
+        first_cell_ptr,
+        lanes,
+        ctx.cell_width,
+        "cells_vector_ptr",
+    );
+    let alignment = ctx.cell_width.bytes() as c_uint;
+
+    let builder = Builder::new();
+    builder.position_at_end(bb);
+
+    let new_vector = if keep_mask.iter().all(|&keep| keep == Wrapping(0)) {
+        // Every cell is set, so we don't need the old values.
+        cell_vector_const(ctx.cell_width, &deltas)
+    } else {
+        let mut vector = LLVMBuildLoad(
+            builder.builder,
+            vector_ptr,
+            module.new_string_ptr("cells_vector"),
+        );
+        LLVMSetAlignment(vector, alignment);
+
+        if keep_mask.iter().any(|&keep| keep == Wrapping(0)) {
+            vector = LLVMBuildAnd(
+                builder.builder,
+                vector,
+                cell_vector_const(ctx.cell_width, &keep_mask),
+                module.new_string_ptr("kept_cells_vector"),
+            );
+        }
+        LLVMBuildAdd(
+            builder.builder,
+            vector,
+            cell_vector_const(ctx.cell_width, &deltas),
+            module.new_string_ptr("new_cells_vector"),
+        )
+    };
+
+    let store = LLVMBuildStore(builder.builder, new_vector, vector_ptr);
+    LLVMSetAlignment(store, alignment);
+    bb
+}
+
+unsafe fn compile_multiply_move(
+    changes: &[(isize, Cell)],
+    position: Option<Position>,
+    module: &mut Module,
+    bb: LLVMBasicBlockRef,
+    ctx: CompileContext,
+    index: &mut CellIndex,
+) -> LLVMBasicBlockRef {
+    let multiply_body = append_basic_block(module, ctx.main_fn, "multiply_body");
+    let multiply_after = append_basic_block(module, ctx.main_fn, "multiply_after");
+
+    let builder = Builder::new();
+    builder.position_at_end(bb);
+
+    // First, get the current cell value.
+    let (cell_val, cell_val_ptr) = add_current_cell_access(module, bb, &ctx, index);
+
+    // Find the lowest target cell here, as this block dominates
+    // everything after the multiply.
+    let lowest_target = changes.iter().map(|&(target, _)| target).fold(0, min);
+    let highest_target = changes.iter().map(|&(target, _)| target).fold(0, max);
+    let lowest_index = if ctx.check_bounds {
+        Some(cell_index_at(module, bb, &ctx, index, lowest_target))
+    } else {
+        None
+    };
+
+    // Check if the current cell is zero, as we only do the multiply
+    // if it's non-zero.
+    let zero = cell_const(ctx.cell_width, Wrapping(0));
+    let cell_val_is_zero = LLVMBuildICmp(
+        builder.builder,
+        LLVMIntPredicate::LLVMIntEQ,
+        zero,
+        cell_val,
+        module.new_string_ptr("cell_value_is_zero"),
+    );
+    LLVMBuildCondBr(
+        builder.builder,
+        cell_val_is_zero,
+        multiply_after,
+        multiply_body,
+    );
+
+    // In the multiply body, check the targets are on the tape, then
+    // do the mulitply.
+    let mut multiply_body = multiply_body;
+    if let Some(lowest_index) = lowest_index {
+        let span = (highest_target - lowest_target) as c_ulonglong;
+        multiply_body = add_bounds_check(
+            module,
+            multiply_body,
+            &ctx,
+            lowest_index,
+            ctx.num_cells.saturating_sub(span),
+            position,
+        );
+    }
+    builder.position_at_end(multiply_body);
+
+    // Zero the current cell.
+    LLVMBuildStore(builder.builder, zero, cell_val_ptr);
+
+    let offsets: Vec<_> = changes.iter().map(|&(target, _)| target).collect();
+    if should_vectorise(&offsets) {
+        compile_multiply_move_vector(changes, module, multiply_body, &ctx, cell_val, cell_val_ptr);
+        builder.position_at_end(multiply_body);
+        LLVMBuildBr(builder.builder, multiply_after);
+        return multiply_after;
+    }
+
+    // For each cell that we should change, multiply the current cell
+    // value then add it.
+    for &(target, factor) in changes {
+        // Calculate the position of this target cell.
+        let mut indices = vec![int32(target as c_ulonglong)];
+        let target_cell_ptr = LLVMBuildGEP(
+            builder.builder,
+            cell_val_ptr,
+            indices.as_mut_ptr(),
+            indices.len() as c_uint,
+            module.new_string_ptr("target_cell_ptr"),
+        );
+
+        // Get the current value of the target cell.
+        let target_cell_val = LLVMBuildLoad(
+            builder.builder,
+            target_cell_ptr,
+            module.new_string_ptr("target_cell_val"),
+        );
+
+        // Calculate the new value.
+        let additional_val = LLVMBuildMul(
+            builder.builder,
+            cell_val,
+            cell_const(ctx.cell_width, factor),
+            module.new_string_ptr("additional_val"),
+        );
+        let new_target_val = LLVMBuildAdd(
+            builder.builder,
+            target_cell_val,
+            additional_val,
+            module.new_string_ptr("new_target_val"),
+        );
+        LLVMBuildStore(builder.builder, new_target_val, target_cell_ptr);
+    }
+
+    // Finally, continue execution from multiply after.
+    LLVMBuildBr(builder.builder, multiply_after);
+
+    multiply_after
+}
+
+/// Add the current cell value, multiplied by each factor, to the
+/// target cells with a single vector load and store. If the source
+/// cell is in the range, its factor is zero, and it's already zeroed.
+unsafe fn compile_multiply_move_vector(
+    changes: &[(isize, Cell)],
+    module: &mut Module,
+    bb: LLVMBasicBlockRef,
+    ctx: &CompileContext,
+    cell_val: LLVMValueRef,
+    cell_val_ptr: LLVMValueRef,
+) {
+    let first_offset = changes[0].0;
+    let lanes = (changes[changes.len() - 1].0 - first_offset + 1) as usize;
+
+    let mut factors = vec![Wrapping(0); lanes];
+    for &(target, factor) in changes {
+        factors[(target - first_offset) as usize] = factor;
+    }
+
+    let builder = Builder::new();
+    builder.position_at_end(bb);
+
+    let mut indices = vec![int32(first_offset as c_ulonglong)];
+    let target_cells_ptr = LLVMBuildGEP(
+        builder.builder,
+        cell_val_ptr,
+        indices.as_mut_ptr(),
+        indices.len() as c_uint,
+        module.new_string_ptr("target_cells_ptr"),
+    );
+    let vector_ptr = cast_to_vector_ptr(
+        module,
+        bb,
+        target_cells_ptr,
+        lanes,
+        ctx.cell_width,
+        "target_vector_ptr",
+    );
+    let alignment = ctx.cell_width.bytes() as c_uint;
+
+    let target_vector = LLVMBuildLoad(
+        builder.builder,
+        vector_ptr,
+        module.new_string_ptr("target_vector"),
+    );
+    LLVMSetAlignment(target_vector, alignment);
+
+    // Broadcast the current cell value to every lane.
+    let vector_type = LLVMVectorType(cell_type(ctx.cell_width), lanes as c_uint);
+    let cell_val_vector = LLVMBuildInsertElement(
+        builder.builder,
+        LLVMGetUndef(vector_type),
+        cell_val,
+        int32(0),
+        module.new_string_ptr("cell_value_vector"),
+    );
+    let cell_val_splat = LLVMBuildShuffleVector(
+        builder.builder,
+        cell_val_vector,
+        LLVMGetUndef(vector_type),
+        LLVMConstNull(LLVMVectorType(int32_type(), lanes as c_uint)),
+        module.new_string_ptr("cell_value_splat"),
+    );
+
+    let additional_vector = LLVMBuildMul(
+        builder.builder,
+        cell_val_splat,
+        cell_vector_const(ctx.cell_width, &factors),
+        module.new_string_ptr("additional_vector"),
+    );
+    let new_target_vector = LLVMBuildAdd(
+        builder.builder,
+        target_vector,
+        additional_vector,
+        module.new_string_ptr("new_target_vector"),
+    );
+    let store = LLVMBuildStore(builder.builder, new_target_vector, vector_ptr);
+    LLVMSetAlignment(store, alignment);
+}
+
+/// Pointer increments don't generate any instructions: we just
+/// adjust the offset that later instructions use.
+fn compile_ptr_increment(
+    amount: isize,
+    bb: LLVMBasicBlockRef,
+    index: &mut CellIndex,
+) -> LLVMBasicBlockRef {
+    index.offset += amount;
+    bb
+}
+
+/// Move the cell index to the zero cell found by `memchr` or
+/// `memrchr`.
+unsafe fn compile_scan_with_libc(
+    stride: isize,
+    position: Option<Position>,
+    module: &mut Module,
+    mut bb: LLVMBasicBlockRef,
+    ctx: CompileContext,
+    index: &mut CellIndex,
+) -> LLVMBasicBlockRef {
+    let cell_index = cell_index_at(module, bb, &ctx, index, 0);
+
+    let builder = Builder::new();
+    builder.position_at_end(bb);
 
     let mut indices = vec![cell_index];
     let current_cell_ptr = LLVMBuildGEP(
         builder.builder,
-        cells,
+        ctx.cells,
         indices.as_mut_ptr(),
-        indices.len() as u32,
+        indices.len() as c_uint,
         module.new_string_ptr("current_cell_ptr"),
     );
-    let current_cell = LLVMBuildLoad(
+
+    let zero_cell_ptr = if stride > 0 {
+        // memchr(current_cell_ptr, 0, num_cells - cell_index)
+        let search_len = LLVMBuildSub(
+            builder.builder,
+            index_const(ctx.index_type, ctx.num_cells as isize),
+            cell_index,
+            module.new_string_ptr("search_len"),
+        );
+        add_function_call(
+            module,
+            bb,
+            "memchr",
+            &mut [current_cell_ptr, int32(0), search_len],
+            "zero_cell_ptr",
+        )
+    } else {
+        // memrchr(cells, 0, cell_index + 1)
+        let search_len = LLVMBuildAdd(
+            builder.builder,
+            cell_index,
+            index_const(ctx.index_type, 1),
+            module.new_string_ptr("search_len"),
+        );
+        add_function_call(
+            module,
+            bb,
+            "memrchr",
+            &mut [ctx.cells, int32(0), search_len],
+            "zero_cell_ptr",
+        )
+    };
+
+    // cell_index = zero_cell_ptr - cells;
+    let offset = LLVMBuildPtrDiff(
         builder.builder,
-        current_cell_ptr,
-        module.new_string_ptr("cell_value"),
+        zero_cell_ptr,
+        ctx.cells,
+        module.new_string_ptr("zero_cell_offset"),
+    );
+    if ctx.check_bounds {
+        // If there's no zero cell, memchr returns null, so the offset
+        // is out of bounds.
+        bb = add_bounds_check(module, bb, &ctx, offset, ctx.num_cells, position);
+        builder.position_at_end(bb);
+    }
+    // The offset is always 64 bits, so this is a no-op on 64-bit
+    // targets.
+    let new_cell_index = LLVMBuildTruncOrBitCast(
+        builder.builder,
+        offset,
+        ctx.index_type,
+        module.new_string_ptr("new_cell_index"),
     );
+    LLVMBuildStore(builder.builder, new_cell_index, ctx.cell_index_ptr);
+    *index = CellIndex {
+        base: Some(new_cell_index),
+        offset: 0,
+    };
 
-    (current_cell, current_cell_ptr)
+    bb
 }
 
-unsafe fn compile_increment(
-    amount: Cell,
-    offset: isize,
+/// Move the cell index by `stride` until we reach a zero cell. Unlike
+/// a general loop, the index stays in a register for the whole scan.
+unsafe fn compile_scan_loop(
+    stride: isize,
+    position: Option<Position>,
     module: &mut Module,
     bb: LLVMBasicBlockRef,
     ctx: CompileContext,
+    index: &mut CellIndex,
 ) -> LLVMBasicBlockRef {
+    let scan_header = append_basic_block(module, ctx.main_fn, "scan_header");
+    let scan_body = append_basic_block(module, ctx.main_fn, "scan_body");
+    let scan_after = append_basic_block(module, ctx.main_fn, "scan_after");
+
+    let initial_index = cell_index_at(module, bb, &ctx, index, 0);
+
     let builder = Builder::new();
     builder.position_at_end(bb);
+    LLVMBuildBr(builder.builder, scan_header);
 
-    let cell_index = LLVMBuildLoad(
-        builder.builder,
-        ctx.cell_index_ptr,
-        module.new_string_ptr("cell_index"),
-    );
-
-    let offset_cell_index = LLVMBuildAdd(
+    // scan_header:
+    //   %scan_index = phi [%cell_index, %bb], [%next_scan_index, %scan_body]
+    //   br %cell_value_is_zero, %scan_after, %scan_body
+    builder.position_at_end(scan_header);
+    let scan_index = LLVMBuildPhi(
         builder.builder,
-        cell_index,
-        int32(offset as c_ulonglong),
-        module.new_string_ptr("offset_cell_index"),
+        ctx.index_type,
+        module.new_string_ptr("scan_index"),
     );
-
-    let mut indices = vec![offset_cell_index];
-    let current_cell_ptr = LLVMBuildGEP(
+    let scan_check = if ctx.check_bounds {
+        add_bounds_check(
+            module,
+            scan_header,
+            &ctx,
+            scan_index,
+            ctx.num_cells,
+            position,
+        )
+    } else {
+        scan_header
+    };
+    builder.position_at_end(scan_check);
+    let mut indices = vec![scan_index];
+    let scan_cell_ptr = LLVMBuildGEP(
         builder.builder,
         ctx.cells,
         indices.as_mut_ptr(),
         indices.len() as c_uint,
-        module.new_string_ptr("current_cell_ptr"),
+        module.new_string_ptr("scan_cell_ptr"),
     );
-
-    let cell_val = LLVMBuildLoad(
+    let scan_cell = LLVMBuildLoad(
         builder.builder,
-        current_cell_ptr,
-        module.new_string_ptr("cell_value"),
+        scan_cell_ptr,
+        module.new_string_ptr("scan_cell_value"),
+    );
+    let cell_val_is_zero = LLVMBuildICmp(
+        builder.builder,
+        LLVMIntPredicate::LLVMIntEQ,
+        cell_const(ctx.cell_width, Wrapping(0)),
+        scan_cell,
+        module.new_string_ptr("cell_value_is_zero"),
     );
+    LLVMBuildCondBr(builder.builder, cell_val_is_zero, scan_after, scan_body);
 
-    let increment_amount = int8(amount.0 as c_ulonglong);
-    let new_cell_val = LLVMBuildAdd(
+    builder.position_at_end(scan_body);
+    let next_scan_index = LLVMBuildAdd(
         builder.builder,
-        cell_val,
-        increment_amount,
-        module.new_string_ptr("new_cell_value"),
+        scan_index,
+        index_const(ctx.index_type, stride),
+        module.new_string_ptr("next_scan_index"),
+    );
+    LLVMBuildBr(builder.builder, scan_header);
+
+    let mut incoming_values = vec![initial_index, next_scan_index];
+    let mut incoming_blocks = vec![bb, scan_body];
+    LLVMAddIncoming(
+        scan_index,
+        incoming_values.as_mut_ptr(),
+        incoming_blocks.as_mut_ptr(),
+        incoming_values.len() as c_uint,
     );
 
-    LLVMBuildStore(builder.builder, new_cell_val, current_cell_ptr);
-    bb
+    builder.position_at_end(scan_after);
+    LLVMBuildStore(builder.builder, scan_index, ctx.cell_index_ptr);
+    *index = CellIndex {
+        base: Some(scan_index),
+        offset: 0,
+    };
+
+    scan_after
 }
 
-unsafe fn compile_set(
-    amount: Cell,
-    offset: isize,
+unsafe fn compile_scan(
+    stride: isize,
+    position: Option<Position>,
+    module: &mut Module,
+    bb: LLVMBasicBlockRef,
+    ctx: CompileContext,
+    index: &mut CellIndex,
+) -> LLVMBasicBlockRef {
+    // memchr and memrchr search for a zero byte, so they only work
+    // for 8-bit cells.
+    let libc_stride = stride == 1 || (stride == -1 && target_has_memrchr(module));
+    if libc_stride && ctx.cell_width == CellWidth::Bits8 {
+        compile_scan_with_libc(stride, position, module, bb, ctx, index)
+    } else {
+        compile_scan_loop(stride, position, module, bb, ctx, index)
+    }
+}
+
+unsafe fn compile_read(
     module: &mut Module,
     bb: LLVMBasicBlockRef,
     ctx: CompileContext,
+    index: &mut CellIndex,
 ) -> LLVMBasicBlockRef {
+    let input = ctx
+        .input
+        .clone()
+        .expect("Read instructions require an input buffer");
+
+    let current_cell_ptr = add_cell_ptr(module, bb, &ctx, index, 0);
+
     let builder = Builder::new();
     builder.position_at_end(bb);
 
-    let cell_index = LLVMBuildLoad(
+    let read_refill = append_basic_block(module, ctx.main_fn, "read_refill");
+    let read_byte = append_basic_block(module, ctx.main_fn, "read_byte");
+    let read_eof = append_basic_block(module, ctx.main_fn, "read_eof");
+    let read_after = append_basic_block(module, ctx.main_fn, "read_after");
+
+    // If we still have buffered input, we can read it directly.
+    let input_pos = LLVMBuildLoad(
         builder.builder,
-        ctx.cell_index_ptr,
-        module.new_string_ptr("cell_index"),
+        input.pos,
+        module.new_string_ptr("input_pos"),
+    );
+    let input_len = LLVMBuildLoad(
+        builder.builder,
+        input.len,
+        module.new_string_ptr("input_len"),
     );
+    let has_input = LLVMBuildICmp(
+        builder.builder,
+        LLVMIntPredicate::LLVMIntSLT,
+        input_pos,
+        input_len,
+        module.new_string_ptr("has_input"),
+    );
+    LLVMBuildCondBr(builder.builder, has_input, read_byte, read_refill);
 
-    let offset_cell_index = LLVMBuildAdd(
+    // Otherwise, read the next chunk of stdin. If there's nothing
+    // left, we've reached EOF. We might block here, so ensure any
+    // prompt has been shown first.
+    if ctx.output.is_some() {
+        add_function_call(module, read_refill, "flush_output", &mut [], "");
+    }
+    let refilled_len =
+        add_function_call(module, read_refill, "refill_input", &mut [], "refilled_len");
+    builder.position_at_end(read_refill);
+    let refilled = LLVMBuildICmp(
         builder.builder,
-        cell_index,
-        int32(offset as c_ulonglong),
-        module.new_string_ptr("offset_cell_index"),
+        LLVMIntPredicate::LLVMIntSGT,
+        refilled_len,
+        int32(0),
+        module.new_string_ptr("refilled"),
     );
+    LLVMBuildCondBr(builder.builder, refilled, read_byte, read_eof);
 
-    let mut indices = vec![offset_cell_index];
-    let current_cell_ptr = LLVMBuildGEP(
+    // *current_cell_ptr = input_buffer[input_buffer_pos++];
+    builder.position_at_end(read_byte);
+    let byte_pos = LLVMBuildLoad(
         builder.builder,
-        ctx.cells,
+        input.pos,
+        module.new_string_ptr("byte_pos"),
+    );
+    let mut indices = vec![int32(0), byte_pos];
+    let input_byte_ptr = LLVMBuildGEP(
+        builder.builder,
+        input.buf,
         indices.as_mut_ptr(),
         indices.len() as c_uint,
-        module.new_string_ptr("current_cell_ptr"),
+        module.new_string_ptr("input_byte_ptr"),
     );
-
-    LLVMBuildStore(
+    let input_byte = LLVMBuildLoad(
         builder.builder,
-        int8(amount.0 as c_ulonglong),
-        current_cell_ptr,
+        input_byte_ptr,
+        module.new_string_ptr("input_byte"),
     );
-    bb
+    let new_input_pos = LLVMBuildAdd(
+        builder.builder,
+        byte_pos,
+        int32(1),
+        module.new_string_ptr("new_input_pos"),
+    );
+    LLVMBuildStore(builder.builder, new_input_pos, input.pos);
+    let input_cell = LLVMBuildZExt(
+        builder.builder,
+        input_byte,
+        cell_type(ctx.cell_width),
+        module.new_string_ptr("input_cell"),
+    );
+    LLVMBuildStore(builder.builder, input_cell, current_cell_ptr);
+    LLVMBuildBr(builder.builder, read_after);
+
+    builder.position_at_end(read_eof);
+    match input.eof_behaviour {
+        EofBehaviour::Unchanged => {}
+        EofBehaviour::Zero => {
+            LLVMBuildStore(
+                builder.builder,
+                cell_const(ctx.cell_width, Wrapping(0)),
+                current_cell_ptr,
+            );
+        }
+        EofBehaviour::MinusOne => {
+            LLVMBuildStore(
+                builder.builder,
+                cell_const(ctx.cell_width, Wrapping(-1)),
+                current_cell_ptr,
+            );
+        }
+    }
+    LLVMBuildBr(builder.builder, read_after);
+
+    read_after
 }
 
-unsafe fn compile_multiply_move(
-    changes: &HashMap<isize, Cell>,
+unsafe fn compile_write(
     module: &mut Module,
     bb: LLVMBasicBlockRef,
     ctx: CompileContext,
+    index: &mut CellIndex,
 ) -> LLVMBasicBlockRef {
-    let multiply_body = LLVMAppendBasicBlock(ctx.main_fn, module.new_string_ptr("multiply_body"));
-    let multiply_after = LLVMAppendBasicBlock(ctx.main_fn, module.new_string_ptr("multiply_after"));
+    let output = ctx
+        .output
+        .clone()
+        .expect("Write instructions require an output buffer");
 
     let builder = Builder::new();
     builder.position_at_end(bb);
 
-    // First, get the current cell value.
-    let (cell_val, cell_val_ptr) =
-        add_current_cell_access(module, bb, ctx.cells, ctx.cell_index_ptr);
-
-    // Check if the current cell is zero, as we only do the multiply
-    // if it's non-zero.
-    let zero = int8(0);
-    let cell_val_is_zero = LLVMBuildICmp(
+    let cell_val = add_current_cell_access(module, bb, &ctx, index).0;
+    // We only output the low byte of wider cells.
+    let output_byte = LLVMBuildTrunc(
         builder.builder,
-        LLVMIntPredicate::LLVMIntEQ,
-        zero,
         cell_val,
-        module.new_string_ptr("cell_value_is_zero"),
+        int8_type(),
+        module.new_string_ptr("output_byte"),
     );
-    LLVMBuildCondBr(
+
+    // output_buffer[output_buffer_len] = output_byte;
+    let output_len = LLVMBuildLoad(
         builder.builder,
-        cell_val_is_zero,
-        multiply_after,
-        multiply_body,
+        output.len,
+        module.new_string_ptr("output_len"),
     );
+    let mut indices = vec![int32(0), output_len];
+    let output_slot_ptr = LLVMBuildGEP(
+        builder.builder,
+        output.buf,
+        indices.as_mut_ptr(),
+        indices.len() as c_uint,
+        module.new_string_ptr("output_slot_ptr"),
+    );
+    LLVMBuildStore(builder.builder, output_byte, output_slot_ptr);
 
-    // In the multiply body, do the mulitply
-    builder.position_at_end(multiply_body);
-
-    // Zero the current cell.
-    LLVMBuildStore(builder.builder, int8(0), cell_val_ptr);
-
-    let mut targets: Vec<_> = changes.keys().collect();
-    targets.sort();
+    // output_buffer_len++;
+    let new_output_len = LLVMBuildAdd(
+        builder.builder,
+        output_len,
+        int32(1),
+        module.new_string_ptr("new_output_len"),
+    );
+    LLVMBuildStore(builder.builder, new_output_len, output.len);
 
-    // For each cell that we should change, multiply the current cell
-    // value then add it.
-    for target in targets {
-        // Calculate the position of this target cell.
-        let mut indices = vec![int32(*target as c_ulonglong)];
-        let target_cell_ptr = LLVMBuildGEP(
+    let mut should_flush = LLVMBuildICmp(
+        builder.builder,
+        LLVMIntPredicate::LLVMIntEQ,
+        new_output_len,
+        int32(OUTPUT_BUFFER_SIZE),
+        module.new_string_ptr("output_is_full"),
+    );
+    if output.buffering == OutputBuffering::Line {
+        let is_newline = LLVMBuildICmp(
             builder.builder,
-            cell_val_ptr,
-            indices.as_mut_ptr(),
-            indices.len() as c_uint,
-            module.new_string_ptr("target_cell_ptr"),
+            LLVMIntPredicate::LLVMIntEQ,
+            output_byte,
+            int8(u64::from(b'\n')),
+            module.new_string_ptr("output_is_newline"),
         );
-
-        // Get the current value of the target cell.
-        let target_cell_val = LLVMBuildLoad(
+        should_flush = LLVMBuildOr(
             builder.builder,
-            target_cell_ptr,
-            module.new_string_ptr("target_cell_val"),
+            should_flush,
+            is_newline,
+            module.new_string_ptr("should_flush"),
         );
+    }
 
-        // Calculate the new value.
-        let factor = *changes.get(target).unwrap();
-        let additional_val = LLVMBuildMul(
-            builder.builder,
-            cell_val,
-            int8(factor.0 as c_ulonglong),
-            module.new_string_ptr("additional_val"),
+    let write_flush = append_basic_block(module, ctx.main_fn, "write_flush");
+    let write_after = append_basic_block(module, ctx.main_fn, "write_after");
+    LLVMBuildCondBr(builder.builder, should_flush, write_flush, write_after);
+
+    add_function_call(module, write_flush, "flush_output", &mut [], "");
+    builder.position_at_end(write_flush);
+    LLVMBuildBr(builder.builder, write_after);
+
+    write_after
+}
+
+/// Append the instructions in `instrs` that we count in a profile to
+/// `result`, including those in loop bodies.
+fn profiled_instrs<'a>(instrs: &'a [AstNode], result: &mut Vec<&'a AstNode>) {
+    for instr in instrs {
+        match *instr {
+            Loop { ref body, .. } => {
+                result.push(instr);
+                profiled_instrs(body, result);
+            }
+            MultiplyMove { .. } | Write { .. } => result.push(instr),
+            _ => {}
+        }
+    }
+}
+
+/// Add the global array of profile counters, with a record for each
+/// loop, multiply and write in `instrs`.
+fn add_profile(module: &mut Module, instrs: &[AstNode]) -> Profile {
+    let mut profiled = vec![];
+    profiled_instrs(instrs, &mut profiled);
+
+    unsafe {
+        let mut records = vec![];
+        let mut indices = HashMap::new();
+        for (i, instr) in profiled.iter().enumerate() {
+            // Instructions without a position can't be shown in a
+            // report, so mark them with an impossible position.
+            let (start, end) = match get_position(instr) {
+                Some(position) => (position.start as c_ulonglong, position.end as c_ulonglong),
+                None => (c_ulonglong::MAX, c_ulonglong::MAX),
+            };
+            let mut fields = vec![int64(start), int64(end), int64(0)];
+            records.push(LLVMConstArray(
+                int64_type(),
+                fields.as_mut_ptr(),
+                fields.len() as c_uint,
+            ));
+            indices.insert(*instr as *const AstNode, i);
+        }
+
+        // i64 profile_counts[N][3] = {{start, end, 0}, ...};
+        let record_type = LLVMArrayType(int64_type(), 3);
+        let counts_type = LLVMArrayType(record_type, records.len() as c_uint);
+        let counts = LLVMAddGlobal(
+            module.module,
+            counts_type,
+            module.new_string_ptr("profile_counts"),
         );
-        let new_target_val = LLVMBuildAdd(
-            builder.builder,
-            target_cell_val,
-            additional_val,
-            module.new_string_ptr("new_target_val"),
+        LLVMSetInitializer(
+            counts,
+            LLVMConstArray(record_type, records.as_mut_ptr(), records.len() as c_uint),
         );
-        LLVMBuildStore(builder.builder, new_target_val, target_cell_ptr);
-    }
+        LLVMSetLinkage(counts, LLVMLinkage::LLVMInternalLinkage);
 
-    // Finally, continue execution from multiply after.
-    LLVMBuildBr(builder.builder, multiply_after);
+        add_function(
+            module,
+            "fopen",
+            &mut [int8_ptr_type(), int8_ptr_type()],
+            int8_ptr_type(),
+        );
+        let size_type = module.int_ptr_type;
+        add_function(
+            module,
+            "fwrite",
+            &mut [int8_ptr_type(), size_type, size_type, int8_ptr_type()],
+            size_type,
+        );
+        add_function(module, "fclose", &mut [int8_ptr_type()], int32_type());
 
-    multiply_after
+        Profile {
+            counts,
+            indices: Rc::new(indices),
+        }
+    }
 }
 
-unsafe fn compile_ptr_increment(
-    amount: isize,
+/// If we're profiling, increment the counter for `instr`.
+unsafe fn add_profile_count(
     module: &mut Module,
     bb: LLVMBasicBlockRef,
-    ctx: CompileContext,
-) -> LLVMBasicBlockRef {
+    ctx: &CompileContext,
+    instr: &AstNode,
+) {
+    let profile = match ctx.profile {
+        Some(ref profile) => profile,
+        None => return,
+    };
+    let record_index = profile.indices[&(instr as *const AstNode)];
+
     let builder = Builder::new();
     builder.position_at_end(bb);
 
-    let cell_index = LLVMBuildLoad(
+    // profile_counts[record_index][2]++;
+    let mut indices = vec![int32(0), int32(record_index as c_ulonglong), int32(2)];
+    let count_ptr = LLVMBuildInBoundsGEP(
         builder.builder,
-        ctx.cell_index_ptr,
-        module.new_string_ptr("cell_index"),
+        profile.counts,
+        indices.as_mut_ptr(),
+        indices.len() as c_uint,
+        module.new_string_ptr("profile_count_ptr"),
     );
-
-    let new_cell_index = LLVMBuildAdd(
+    let count = LLVMBuildLoad(
         builder.builder,
-        cell_index,
-        int32(amount as c_ulonglong),
-        module.new_string_ptr("new_cell_index"),
+        count_ptr,
+        module.new_string_ptr("profile_count"),
     );
-
-    LLVMBuildStore(builder.builder, new_cell_index, ctx.cell_index_ptr);
-    bb
+    let new_count = LLVMBuildAdd(
+        builder.builder,
+        count,
+        int64(1),
+        module.new_string_ptr("new_profile_count"),
+    );
+    LLVMBuildStore(builder.builder, new_count, count_ptr);
 }
 
-unsafe fn compile_read(
+/// Write the profile counters to `path`. If the file can't be
+/// opened, we silently skip writing the profile, so the program's
+/// exit status is unchanged.
+unsafe fn add_profile_dump(
     module: &mut Module,
     bb: LLVMBasicBlockRef,
-    ctx: CompileContext,
+    main_fn: LLVMValueRef,
+    profile: &Profile,
+    path: &str,
 ) -> LLVMBasicBlockRef {
     let builder = Builder::new();
     builder.position_at_end(bb);
 
-    let cell_index = LLVMBuildLoad(
+    // FILE *profile_file = fopen(path, "wb");
+    let llvm_path = LLVMBuildGlobalStringPtr(
         builder.builder,
-        ctx.cell_index_ptr,
-        module.new_string_ptr("cell_index"),
+        module.new_string_ptr(path),
+        module.new_string_ptr("profile_path"),
+    );
+    let mode = LLVMBuildGlobalStringPtr(
+        builder.builder,
+        module.new_string_ptr("wb"),
+        module.new_string_ptr("profile_mode"),
     );
+    let profile_file =
+        add_function_call(module, bb, "fopen", &mut [llvm_path, mode], "profile_file");
 
-    let mut indices = vec![cell_index];
-    let current_cell_ptr = LLVMBuildGEP(
+    let profile_file_is_null = LLVMBuildICmp(
         builder.builder,
-        ctx.cells,
-        indices.as_mut_ptr(),
-        indices.len() as u32,
-        module.new_string_ptr("current_cell_ptr"),
+        LLVMIntPredicate::LLVMIntEQ,
+        profile_file,
+        LLVMConstNull(int8_ptr_type()),
+        module.new_string_ptr("profile_file_is_null"),
+    );
+    let profile_write = append_basic_block(module, main_fn, "profile_write");
+    let profile_done = append_basic_block(module, main_fn, "profile_done");
+    LLVMBuildCondBr(
+        builder.builder,
+        profile_file_is_null,
+        profile_done,
+        profile_write,
+    );
+
+    // fwrite(profile_counts, PROFILE_RECORD_SIZE, N, profile_file);
+    // fclose(profile_file);
+    builder.position_at_end(profile_write);
+    let counts_ptr = LLVMBuildPointerCast(
+        builder.builder,
+        profile.counts,
+        int8_ptr_type(),
+        module.new_string_ptr("profile_counts_ptr"),
+    );
+    let size_type = module.int_ptr_type;
+    let record_size = LLVMConstInt(size_type, PROFILE_RECORD_SIZE as c_ulonglong, LLVM_FALSE);
+    let num_records = LLVMConstInt(size_type, profile.indices.len() as c_ulonglong, LLVM_FALSE);
+    add_function_call(
+        module,
+        profile_write,
+        "fwrite",
+        &mut [counts_ptr, record_size, num_records, profile_file],
+        "",
     );
+    add_function_call(module, profile_write, "fclose", &mut [profile_file], "");
+
+    builder.position_at_end(profile_write);
+    LLVMBuildBr(builder.builder, profile_done);
+
+    profile_done
+}
+
+/// Work out how often each loop in `instrs` ran, given the number of
+/// times each loop header executed in a profile.
+///
+/// BF has no conditionals other than loops, so every instruction in
+/// a loop body runs once per iteration. Each time a loop is reached,
+/// its header runs once more than its body.
+fn loop_weights(
+    instrs: &[AstNode],
+    counts: &HashMap<Position, u64>,
+) -> HashMap<*const AstNode, LoopWeights> {
+    fn add_weights(
+        instrs: &[AstNode],
+        entries: u64,
+        counts: &HashMap<Position, u64>,
+        result: &mut HashMap<*const AstNode, LoopWeights>,
+    ) {
+        for instr in instrs {
+            if let Loop { ref body, .. } = *instr {
+                let header_count = get_position(instr)
+                    .and_then(|position| counts.get(&position))
+                    .cloned()
+                    .unwrap_or(0);
+                let iterations = header_count.saturating_sub(entries);
+                result.insert(
+                    instr as *const AstNode,
+                    LoopWeights {
+                        entries,
+                        iterations,
+                        hot: false,
+                    },
+                );
+                add_weights(body, iterations, counts, result);
+            }
+        }
+    }
+
+    let mut result = HashMap::new();
+    add_weights(instrs, 1, counts, &mut result);
 
-    let mut getchar_args = vec![];
-    let input_char = add_function_call(module, bb, "getchar", &mut getchar_args, "input_char");
-    let input_byte = LLVMBuildTrunc(
-        builder.builder,
-        input_char,
-        int8_type(),
-        module.new_string_ptr("input_byte"),
-    );
+    let total_iterations: u64 = result.values().map(|weights| weights.iterations).sum();
+    for weights in result.values_mut() {
+        weights.hot =
+            weights.iterations > 0 && weights.iterations * HOT_LOOP_DIVISOR >= total_iterations;
+    }
+    result
+}
 
-    LLVMBuildStore(builder.builder, input_byte, current_cell_ptr);
-    bb
+/// Scale `weights` so they fit in the 32-bit branch weights LLVM
+/// expects, keeping their ratio.
+fn scale_branch_weights(weights: &[u64]) -> Vec<u64> {
+    let max = weights.iter().cloned().max().unwrap_or(0);
+    let scale = max / u64::from(u32::MAX) + 1;
+    weights.iter().map(|weight| weight / scale).collect()
 }
 
-unsafe fn compile_write(
-    module: &mut Module,
-    bb: LLVMBasicBlockRef,
-    ctx: CompileContext,
-) -> LLVMBasicBlockRef {
-    let builder = Builder::new();
-    builder.position_at_end(bb);
+/// Tell LLVM how often each successor of the conditional branch
+/// `branch` was taken in the profile.
+unsafe fn add_branch_weights(module: &mut Module, branch: LLVMValueRef, weights: &[u64]) {
+    let context = context();
+
+    // !{!"branch_weights", i32 w1, i32 w2, ...}
+    let mut operands = vec![LLVMMDStringInContext(
+        context,
+        module.new_string_ptr("branch_weights"),
+        "branch_weights".len() as c_uint,
+    )];
+    for weight in scale_branch_weights(weights) {
+        operands.push(int32(weight));
+    }
+    let node = LLVMMDNodeInContext(context, operands.as_mut_ptr(), operands.len() as c_uint);
 
-    let cell_val = add_current_cell_access(module, bb, ctx.cells, ctx.cell_index_ptr).0;
-    let cell_val_as_char = LLVMBuildSExt(
-        builder.builder,
-        cell_val,
-        int32_type(),
-        module.new_string_ptr("cell_val_as_char"),
+    let kind = LLVMGetMDKindIDInContext(
+        context,
+        module.new_string_ptr("prof"),
+        "prof".len() as c_uint,
     );
+    LLVMSetMetadata(branch, kind, node);
+}
 
-    let mut putchar_args = vec![cell_val_as_char];
-    add_function_call(module, bb, "putchar", &mut putchar_args, "");
-    bb
+/// Attach the loop hint `hint` (e.g. "llvm.loop.unroll.enable") to
+/// `backedge`, the branch from the end of a loop body to its header.
+unsafe fn add_loop_hint(module: &mut Module, backedge: LLVMValueRef, hint: &str) {
+    let context = context();
+
+    let mut hint_operands = vec![LLVMMDStringInContext(
+        context,
+        module.new_string_ptr(hint),
+        hint.len() as c_uint,
+    )];
+    let hint_node = LLVMMDNodeInContext(
+        context,
+        hint_operands.as_mut_ptr(),
+        hint_operands.len() as c_uint,
+    );
+
+    // Loop IDs must refer to themselves: !0 = distinct !{!0, !hint}. We
+    // create the node with a temporary first operand, then replace it.
+    let temp = LLVMTemporaryMDNode(context, null_mut(), 0);
+    let mut loop_operands = vec![LLVMMetadataAsValue(context, temp), hint_node];
+    let loop_id = LLVMMDNodeInContext(
+        context,
+        loop_operands.as_mut_ptr(),
+        loop_operands.len() as c_uint,
+    );
+    LLVMMetadataReplaceAllUsesWith(temp, LLVMValueAsMetadata(loop_id));
+
+    let kind = LLVMGetMDKindIDInContext(
+        context,
+        module.new_string_ptr("llvm.loop"),
+        "llvm.loop".len() as c_uint,
+    );
+    LLVMSetMetadata(backedge, kind, loop_id);
 }
 
 fn ptr_equal<T>(a: *const T, b: *const T) -> bool {
@@ -668,23 +2693,27 @@ fn ptr_equal<T>(a: *const T, b: *const T) -> bool {
 }
 
 unsafe fn compile_loop(
+    loop_instr: &AstNode,
     loop_body: &[AstNode],
     start_instr: &AstNode,
     module: &mut Module,
     main_fn: LLVMValueRef,
     bb: LLVMBasicBlockRef,
     ctx: CompileContext,
+    index: &mut CellIndex,
 ) -> LLVMBasicBlockRef {
     let builder = Builder::new();
 
     // First, we branch into the loop header from the previous basic
-    // block.
-    let loop_header_bb = LLVMAppendBasicBlock(ctx.main_fn, module.new_string_ptr("loop_header"));
+    // block. The loop header is reached from the end of the loop body
+    // too, so the cell index must be stored first.
+    flush_cell_index(module, bb, &ctx, index);
+    let loop_header_bb = append_basic_block(module, ctx.main_fn, "loop_header");
     builder.position_at_end(bb);
     LLVMBuildBr(builder.builder, loop_header_bb);
 
-    let mut loop_body_bb = LLVMAppendBasicBlock(ctx.main_fn, module.new_string_ptr("loop_body"));
-    let loop_after = LLVMAppendBasicBlock(ctx.main_fn, module.new_string_ptr("loop_after"));
+    let loop_body_bb = append_basic_block(module, ctx.main_fn, "loop_body");
+    let loop_after = append_basic_block(module, ctx.main_fn, "loop_after");
 
     // loop_header:
     //   %cell_value = ...
@@ -692,10 +2721,31 @@ unsafe fn compile_loop(
     //   br %cell_value_is_zero, %loop_after, %loop_body
     builder.position_at_end(loop_header_bb);
 
-    let cell_val =
-        add_current_cell_access(module, &mut *loop_header_bb, ctx.cells, ctx.cell_index_ptr).0;
+    add_profile_count(module, loop_header_bb, &ctx, loop_instr);
+    *index = CellIndex::unknown();
+
+    // Check the loop cell on every iteration. The cells the body
+    // accesses are checked in the body, so a loop that doesn't run
+    // can't fail.
+    let mut header_bb = loop_header_bb;
+    if ctx.check_bounds {
+        let cell_index = cell_index_at(module, header_bb, &ctx, index, 0);
+        header_bb = add_bounds_check(
+            module,
+            header_bb,
+            &ctx,
+            cell_index,
+            ctx.num_cells,
+            get_position(loop_instr),
+        );
+        builder.position_at_end(header_bb);
+    }
+
+    let cell_val = add_current_cell_access(module, header_bb, &ctx, index).0;
+    // The loop header dominates both the loop body and loop_after.
+    let header_index = *index;
 
-    let zero = int8(0);
+    let zero = cell_const(ctx.cell_width, Wrapping(0));
     let cell_val_is_zero = LLVMBuildICmp(
         builder.builder,
         LLVMIntPredicate::LLVMIntEQ,
@@ -703,33 +2753,255 @@ unsafe fn compile_loop(
         cell_val,
         module.new_string_ptr("cell_value_is_zero"),
     );
-    LLVMBuildCondBr(builder.builder, cell_val_is_zero, loop_after, loop_body_bb);
-
-    // Recursively compile instructions in the loop body.
-    for instr in loop_body {
-        if ptr_equal(instr, start_instr) {
-            // This is the point we want to start execution from.
-            loop_body_bb = set_entry_point_after(module, main_fn, loop_body_bb);
+    let header_branch =
+        LLVMBuildCondBr(builder.builder, cell_val_is_zero, loop_after, loop_body_bb);
+
+    let weights = ctx
+        .loop_weights
+        .as_ref()
+        .and_then(|loop_weights| loop_weights.get(&(loop_instr as *const AstNode)))
+        .cloned();
+    if let Some(weights) = weights {
+        if weights.entries + weights.iterations > 0 {
+            add_branch_weights(
+                module,
+                header_branch,
+                &[weights.entries, weights.iterations],
+            );
         }
-
-        loop_body_bb = compile_instr(
-            instr,
-            start_instr,
-            module,
-            main_fn,
-            loop_body_bb,
-            ctx.clone(),
-        );
     }
 
+    // Recursively compile instructions in the loop body.
+    loop_body_bb = compile_instrs(
+        loop_body,
+        start_instr,
+        true,
+        module,
+        main_fn,
+        loop_body_bb,
+        &ctx,
+        index,
+    );
+
     // When the loop is finished, jump back to the beginning of the
     // loop.
+    flush_cell_index(module, loop_body_bb, &ctx, index);
     builder.position_at_end(loop_body_bb);
-    LLVMBuildBr(builder.builder, loop_header_bb);
+    let backedge = LLVMBuildBr(builder.builder, loop_header_bb);
+
+    // Let LLVM unroll hot loops more aggressively, and don't waste
+    // code size unrolling loops that never ran.
+    if let Some(weights) = weights {
+        if weights.hot {
+            add_loop_hint(module, backedge, "llvm.loop.unroll.enable");
+        } else if weights.iterations == 0 {
+            add_loop_hint(module, backedge, "llvm.loop.unroll.disable");
+        }
+    }
 
+    *index = header_index;
     &mut *loop_after
 }
 
+/// Does `instrs` contain `target` (including inside loops)?
+fn contains_ptr(instrs: &[AstNode], target: &AstNode) -> bool {
+    instrs.iter().any(|instr| {
+        ptr_equal(instr, target)
+            || match *instr {
+                Loop { ref body, .. } => contains_ptr(body, target),
+                _ => false,
+            }
+    })
+}
+
+/// If `instr` is a loop we could outline, return its body without
+/// positions, so equal bodies compare equal.
+fn outline_key(instr: &AstNode, start_instr: &AstNode) -> Option<Vec<AstNode>> {
+    match *instr {
+        Loop { ref body, .. } => {
+            // We can't start execution in the middle of a function.
+            if count_nodes(body) < OUTLINE_MIN_NODES || contains_ptr(body, start_instr) {
+                None
+            } else {
+                Some(strip_positions(body.clone()))
+            }
+        }
+        _ => None,
+    }
+}
+
+/// Choose which loops to outline: those that are large enough, and
+/// whose body occurs more than once. Return the function number
+/// for each of them.
+fn find_outlined_loops(
+    instrs: &[AstNode],
+    start_instr: &AstNode,
+) -> HashMap<*const AstNode, usize> {
+    fn count_bodies(
+        instrs: &[AstNode],
+        start_instr: &AstNode,
+        counts: &mut HashMap<Vec<AstNode>, usize>,
+    ) {
+        for instr in instrs {
+            if let Loop { ref body, .. } = *instr {
+                if let Some(key) = outline_key(instr, start_instr) {
+                    let count = counts.entry(key).or_insert(0);
+                    *count += 1;
+                    // If we outline this body, we only compile the
+                    // first occurrence, so loops in the others don't
+                    // need their own call sites.
+                    if *count > 1 {
+                        continue;
+                    }
+                }
+                count_bodies(body, start_instr, counts);
+            }
+        }
+    }
+
+    fn assign_ids(
+        instrs: &[AstNode],
+        start_instr: &AstNode,
+        counts: &HashMap<Vec<AstNode>, usize>,
+        key_ids: &mut HashMap<Vec<AstNode>, usize>,
+        ids: &mut HashMap<*const AstNode, usize>,
+    ) {
+        for instr in instrs {
+            if let Loop { ref body, .. } = *instr {
+                let key = outline_key(instr, start_instr).filter(|key| counts[key] > 1);
+                if let Some(key) = key {
+                    let next_id = key_ids.len();
+                    let is_first = !key_ids.contains_key(&key);
+                    let id = *key_ids.entry(key).or_insert(next_id);
+                    ids.insert(instr as *const AstNode, id);
+
+                    // We only compile the body of the first
+                    // occurrence, so only outline loops inside that.
+                    if !is_first {
+                        continue;
+                    }
+                }
+                assign_ids(body, start_instr, counts, key_ids, ids);
+            }
+        }
+    }
+
+    let mut counts = HashMap::new();
+    count_bodies(instrs, start_instr, &mut counts);
+
+    let mut ids = HashMap::new();
+    assign_ids(instrs, start_instr, &counts, &mut HashMap::new(), &mut ids);
+    ids
+}
+
+/// Add an internal function that runs `loop_instr`, taking the cells
+/// and the cell index, and returning the cell index afterwards.
+unsafe fn add_outlined_loop_fn(
+    loop_instr: &AstNode,
+    loop_body: &[AstNode],
+    id: usize,
+    start_instr: &AstNode,
+    module: &mut Module,
+    ctx: &CompileContext,
+) {
+    let fn_name = format!("loop_{}", id);
+    add_function(
+        module,
+        &fn_name,
+        &mut [
+            LLVMPointerType(cell_type(ctx.cell_width), 0),
+            ctx.index_type,
+        ],
+        ctx.index_type,
+    );
+    let function = LLVMGetNamedFunction(module.module, module.new_string_ptr(&fn_name));
+    LLVMSetLinkage(function, LLVMLinkage::LLVMInternalLinkage);
+
+    // We've already decided this loop is too large to inline.
+    let noinline_name = "noinline";
+    let noinline =
+        LLVMGetEnumAttributeKindForName(module.new_string_ptr(noinline_name), noinline_name.len());
+    LLVMAddAttributeToFunction(
+        function,
+        LLVMAttributeFunctionIndex,
+        LLVMCreateEnumAttribute(context(), noinline, 0),
+    );
+
+    let entry_bb = append_basic_block(module, function, "entry");
+    let builder = Builder::new();
+    builder.position_at_end(entry_bb);
+
+    // The loop header loads the index from cell_index_ptr, so the
+    // function needs its own.
+    let cell_index_ptr = LLVMBuildAlloca(
+        builder.builder,
+        ctx.index_type,
+        module.new_string_ptr("cell_index_ptr"),
+    );
+    LLVMBuildStore(builder.builder, LLVMGetParam(function, 1), cell_index_ptr);
+
+    let fn_ctx = CompileContext {
+        cells: LLVMGetParam(function, 0),
+        cell_index_ptr,
+        main_fn: function,
+        ..ctx.clone()
+    };
+    let mut index = CellIndex::unknown();
+    let bb = compile_loop(
+        loop_instr,
+        loop_body,
+        start_instr,
+        module,
+        function,
+        entry_bb,
+        fn_ctx.clone(),
+        &mut index,
+    );
+
+    let new_cell_index = cell_index_at(module, bb, &fn_ctx, &mut index, 0);
+    builder.position_at_end(bb);
+    LLVMBuildRet(builder.builder, new_cell_index);
+}
+
+/// Call the outlined function for this loop, generating it if this
+/// is the first occurrence.
+unsafe fn compile_outlined_loop(
+    loop_instr: &AstNode,
+    loop_body: &[AstNode],
+    id: usize,
+    start_instr: &AstNode,
+    module: &mut Module,
+    bb: LLVMBasicBlockRef,
+    ctx: CompileContext,
+    index: &mut CellIndex,
+) -> LLVMBasicBlockRef {
+    let is_compiled = ctx.outlined.compiled.borrow().contains(&id);
+    if !is_compiled {
+        ctx.outlined.compiled.borrow_mut().insert(id);
+        add_outlined_loop_fn(loop_instr, loop_body, id, start_instr, module, &ctx);
+    }
+
+    let cell_index = cell_index_at(module, bb, &ctx, index, 0);
+    let new_cell_index = add_function_call(
+        module,
+        bb,
+        &format!("loop_{}", id),
+        &mut [ctx.cells, cell_index],
+        "outlined_cell_index",
+    );
+
+    // Later loop headers load the index from cell_index_ptr.
+    let builder = Builder::new();
+    builder.position_at_end(bb);
+    LLVMBuildStore(builder.builder, new_cell_index, ctx.cell_index_ptr);
+    *index = CellIndex {
+        base: Some(new_cell_index),
+        offset: 0,
+    };
+
+    bb
+}
+
 /// Append LLVM IR instructions to bb acording to the BF instruction
 /// passed in.
 unsafe fn compile_instr(
@@ -739,33 +3011,215 @@ unsafe fn compile_instr(
     main_fn: LLVMValueRef,
     bb: LLVMBasicBlockRef,
     ctx: CompileContext,
+    index: &mut CellIndex,
 ) -> LLVMBasicBlockRef {
     match *instr {
-        Increment { amount, offset, .. } => compile_increment(amount, offset, module, bb, ctx),
-        Set { amount, offset, .. } => compile_set(amount, offset, module, bb, ctx),
-        MultiplyMove { ref changes, .. } => compile_multiply_move(changes, module, bb, ctx),
-        PointerIncrement { amount, .. } => compile_ptr_increment(amount, module, bb, ctx),
-        Read { .. } => compile_read(module, bb, ctx),
-        Write { .. } => compile_write(module, bb, ctx),
-        Loop { ref body, .. } => compile_loop(body, start_instr, module, main_fn, bb, ctx),
+        Increment { amount, offset, .. } => {
+            compile_increment(amount, offset, module, bb, ctx, index)
+        }
+        Set { amount, offset, .. } => compile_set(amount, offset, module, bb, ctx, index),
+        MultiplyMove {
+            ref changes,
+            position,
+        } => {
+            add_profile_count(module, bb, &ctx, instr);
+            compile_multiply_move(changes, position, module, bb, ctx, index)
+        }
+        PointerIncrement { amount, .. } => compile_ptr_increment(amount, bb, index),
+        Scan { stride, position } => compile_scan(stride, position, module, bb, ctx, index),
+        Read { .. } => compile_read(module, bb, ctx, index),
+        Write { .. } => {
+            add_profile_count(module, bb, &ctx, instr);
+            compile_write(module, bb, ctx, index)
+        }
+        Loop { ref body, .. } => match ctx.outlined.ids.get(&(instr as *const AstNode)) {
+            Some(&id) => {
+                compile_outlined_loop(instr, body, id, start_instr, module, bb, ctx, index)
+            }
+            None => compile_loop(instr, body, start_instr, module, main_fn, bb, ctx, index),
+        },
     }
 }
 
-fn compile_static_outputs(module: &mut Module, bb: LLVMBasicBlockRef, outputs: &[i8]) {
-    unsafe {
-        let builder = Builder::new();
-        builder.position_at_end(bb);
+/// Append LLVM IR instructions to bb for a sequence of BF
+/// instructions, starting execution at `start_instr` if it's in this
+/// sequence. Dense runs of `Increment` and `Set` are compiled to
+/// vector operations.
+///
+/// When checking bounds, we check the cells accessed by each run of
+/// instructions between loops. `check_at_start` is false if the
+/// caller has already checked the first run.
+unsafe fn compile_instrs(
+    instrs: &[AstNode],
+    start_instr: &AstNode,
+    check_at_start: bool,
+    module: &mut Module,
+    main_fn: LLVMValueRef,
+    mut bb: LLVMBasicBlockRef,
+    ctx: &CompileContext,
+    index: &mut CellIndex,
+) -> LLVMBasicBlockRef {
+    let mut needs_check = check_at_start;
+    // A scan may not find a zero cell, so include it in the position
+    // of the next check.
+    let mut previous_scan_position = None;
+
+    let mut i = 0;
+    while i < instrs.len() {
+        let instr = &instrs[i];
+        if ptr_equal(instr, start_instr) {
+            // This is the point we want to start execution from.
+            bb = set_entry_point_after(module, main_fn, bb, ctx, index);
+            needs_check = true;
+        }
+
+        if needs_check && ctx.check_bounds {
+            bb = compile_bounds_check(
+                &instrs[i..],
+                start_instr,
+                previous_scan_position,
+                module,
+                bb,
+                ctx,
+                index,
+            );
+        }
+        needs_check = false;
+        previous_scan_position = None;
+
+        match *instr {
+            // The cell index after a loop is the index we checked at
+            // the loop header, but the following cells aren't checked.
+            Loop { .. } => needs_check = true,
+            Scan { position, .. } => {
+                needs_check = true;
+                previous_scan_position = position;
+            }
+            _ => {}
+        }
 
-        let mut llvm_outputs = vec![];
-        for value in outputs {
-            llvm_outputs.push(int8(*value as c_ulonglong));
+        let (run_length, updates) = cell_update_run(&instrs[i..], start_instr);
+        let offsets: Vec<_> = updates.iter().map(|&(offset, _)| offset).collect();
+        if should_vectorise(&offsets) {
+            bb = compile_cell_updates(&updates, module, bb, ctx, index);
+            i += run_length;
+        } else {
+            bb = compile_instr(instr, start_instr, module, main_fn, bb, ctx.clone(), index);
+            i += 1;
         }
+    }
+    bb
+}
 
-        let output_buf_type = LLVMArrayType(int8_type(), llvm_outputs.len() as c_uint);
-        let llvm_outputs_arr = LLVMConstArray(
-            int8_type(),
-            llvm_outputs.as_mut_ptr(),
-            llvm_outputs.len() as c_uint,
+/// Add a `write_all` function that writes a buffer to stdout,
+/// calling `write` again after partial writes. Does nothing if the
+/// module already has one.
+unsafe fn add_write_all(module: &mut Module) {
+    if !LLVMGetNamedFunction(module.module, module.new_string_ptr("write_all")).is_null() {
+        return;
+    }
+
+    add_function(
+        module,
+        "write_all",
+        &mut [int8_ptr_type(), module.int_ptr_type],
+        void_type(),
+    );
+    let write_all_fn = LLVMGetNamedFunction(module.module, module.new_string_ptr("write_all"));
+    LLVMSetLinkage(write_all_fn, LLVMLinkage::LLVMInternalLinkage);
+    let buf = LLVMGetParam(write_all_fn, 0);
+    let len = LLVMGetParam(write_all_fn, 1);
+
+    let entry = append_basic_block(module, write_all_fn, "entry");
+    let write_header = append_basic_block(module, write_all_fn, "write_header");
+    let write_body = append_basic_block(module, write_all_fn, "write_body");
+    let write_after = append_basic_block(module, write_all_fn, "write_after");
+
+    let builder = Builder::new();
+    builder.position_at_end(entry);
+    LLVMBuildBr(builder.builder, write_header);
+
+    // write_header:
+    //   %write_pos = phi [0, %entry], [%new_write_pos, %write_body]
+    //   br %has_remaining, %write_body, %write_after
+    builder.position_at_end(write_header);
+    let size_type = module.int_ptr_type;
+    let write_pos = LLVMBuildPhi(
+        builder.builder,
+        size_type,
+        module.new_string_ptr("write_pos"),
+    );
+    let write_remaining = LLVMBuildSub(
+        builder.builder,
+        len,
+        write_pos,
+        module.new_string_ptr("write_remaining"),
+    );
+    let has_remaining = LLVMBuildICmp(
+        builder.builder,
+        LLVMIntPredicate::LLVMIntSGT,
+        write_remaining,
+        LLVMConstInt(size_type, 0, LLVM_FALSE),
+        module.new_string_ptr("has_remaining"),
+    );
+    LLVMBuildCondBr(builder.builder, has_remaining, write_body, write_after);
+
+    // Give up if `write` fails, rather than retrying forever.
+    builder.position_at_end(write_body);
+    let mut indices = vec![write_pos];
+    let write_ptr = LLVMBuildGEP(
+        builder.builder,
+        buf,
+        indices.as_mut_ptr(),
+        indices.len() as c_uint,
+        module.new_string_ptr("write_ptr"),
+    );
+    let written = add_function_call(
+        module,
+        write_body,
+        "write",
+        &mut [int32(1), write_ptr, write_remaining],
+        "written",
+    );
+    builder.position_at_end(write_body);
+    let new_write_pos = LLVMBuildAdd(
+        builder.builder,
+        write_pos,
+        written,
+        module.new_string_ptr("new_write_pos"),
+    );
+    let write_succeeded = LLVMBuildICmp(
+        builder.builder,
+        LLVMIntPredicate::LLVMIntSGT,
+        written,
+        LLVMConstInt(size_type, 0, LLVM_FALSE),
+        module.new_string_ptr("write_succeeded"),
+    );
+    LLVMBuildCondBr(builder.builder, write_succeeded, write_header, write_after);
+
+    let mut incoming_values = vec![LLVMConstInt(size_type, 0, LLVM_FALSE), new_write_pos];
+    let mut incoming_blocks = vec![entry, write_body];
+    LLVMAddIncoming(
+        write_pos,
+        incoming_values.as_mut_ptr(),
+        incoming_blocks.as_mut_ptr(),
+        incoming_values.len() as c_uint,
+    );
+
+    builder.position_at_end(write_after);
+    LLVMBuildRetVoid(builder.builder);
+}
+
+fn compile_static_outputs(module: &mut Module, bb: LLVMBasicBlockRef, outputs: &[u8]) {
+    unsafe {
+        // Large outputs are common, so build the constant directly
+        // from the bytes rather than from a constant per byte.
+        let output_buf_type = LLVMArrayType(int8_type(), outputs.len() as c_uint);
+        let llvm_outputs_arr = LLVMConstStringInContext(
+            context(),
+            outputs.as_ptr() as *const _,
+            outputs.len() as c_uint,
+            LLVM_TRUE,
         );
 
         let known_outputs = LLVMAddGlobal(
@@ -776,9 +3230,11 @@ fn compile_static_outputs(module: &mut Module, bb: LLVMBasicBlockRef, outputs: &
         LLVMSetInitializer(known_outputs, llvm_outputs_arr);
         LLVMSetGlobalConstant(known_outputs, LLVM_TRUE);
 
-        let stdout_fd = int32(1);
-        let llvm_num_outputs = int32(outputs.len() as c_ulonglong);
+        let size_type = module.int_ptr_type;
+        let llvm_num_outputs = LLVMConstInt(size_type, outputs.len() as c_ulonglong, LLVM_FALSE);
 
+        let builder = Builder::new();
+        builder.position_at_end(bb);
         let known_outputs_ptr = LLVMBuildPointerCast(
             builder.builder,
             known_outputs,
@@ -786,11 +3242,12 @@ fn compile_static_outputs(module: &mut Module, bb: LLVMBasicBlockRef, outputs: &
             module.new_string_ptr("known_outputs_ptr"),
         );
 
+        add_write_all(module);
         add_function_call(
             module,
             bb,
-            "write",
-            &mut [stdout_fd, known_outputs_ptr, llvm_num_outputs],
+            "write_all",
+            &mut [known_outputs_ptr, llvm_num_outputs],
             "",
         );
     }
@@ -801,8 +3258,15 @@ unsafe fn set_entry_point_after(
     module: &mut Module,
     main_fn: LLVMValueRef,
     bb: LLVMBasicBlockRef,
+    ctx: &CompileContext,
+    index: &mut CellIndex,
 ) -> LLVMBasicBlockRef {
-    let after_init_bb = LLVMAppendBasicBlock(main_fn, module.new_string_ptr("after_init"));
+    // after_init is also reached from init, so the cell index must
+    // be loaded again there.
+    flush_cell_index(module, bb, ctx, index);
+    *index = CellIndex::unknown();
+
+    let after_init_bb = append_basic_block(module, main_fn, "after_init");
 
     // From the current bb, we want to continue execution in after_init.
     let builder = Builder::new();
@@ -823,6 +3287,7 @@ pub fn compile_to_module(
     target_triple: Option<String>,
     instrs: &[AstNode],
     initial_state: &ExecutionState,
+    options: &CompileOptions,
 ) -> Module {
     let mut module = create_module(module_name, target_triple);
     let main_fn = add_main_fn(&mut module);
@@ -833,6 +3298,8 @@ pub fn compile_to_module(
         compile_static_outputs(&mut module, init_bb, &initial_state.outputs);
     }
 
+    let mut output = None;
+
     unsafe {
         // If there's no start instruction, then we executed all
         // instructions at compile time and we don't need to do anything here.
@@ -840,26 +3307,109 @@ pub fn compile_to_module(
             Some(start_instr) => {
                 // TODO: decide on a consistent order between module and init_bb as
                 // parameters.
-                let llvm_cells = add_cells_init(&initial_state.cells, &mut module, init_bb);
+                let (llvm_cells, tape_mapping, num_cells) = match options.tape {
+                    Tape::Fixed => {
+                        let llvm_cells = add_cells_init(
+                            &initial_state.cells,
+                            options.cell_width,
+                            &mut module,
+                            init_bb,
+                        );
+                        (llvm_cells, None, initial_state.cells.len() as c_ulonglong)
+                    }
+                    Tape::Guarded => {
+                        let (tape_mapping, llvm_cells) = add_guarded_tape_init(
+                            &initial_state.cells,
+                            options.cell_width,
+                            &mut module,
+                            init_bb,
+                        );
+                        let num_cells =
+                            GUARDED_TAPE_SIZE / options.cell_width.bytes() as c_ulonglong;
+                        (llvm_cells, Some(tape_mapping), num_cells)
+                    }
+                };
+                let index_type = module.int_ptr_type;
                 let llvm_cell_index =
-                    add_cell_index_init(initial_state.cell_ptr, init_bb, &mut module);
+                    add_cell_index_init(initial_state.cell_ptr, index_type, init_bb, &mut module);
+
+                if contains_instr(instrs, &|instr| matches!(*instr, Write { .. })) {
+                    output = Some(add_output_buffer(&mut module, options.output_buffering));
+                }
+                let input = if contains_instr(instrs, &|instr| matches!(*instr, Read { .. })) {
+                    Some(add_input_buffer(
+                        &mut module,
+                        options.eof_behaviour,
+                        &options.initial_input,
+                    ))
+                } else {
+                    None
+                };
+                if contains_instr(instrs, &|instr| matches!(*instr, Scan { .. })) {
+                    add_scan_declarations(&mut module);
+                }
+                let check_bounds = options.bounds == Bounds::Check
+                    && !is_statically_bounded(instrs, num_cells as usize);
+                if check_bounds {
+                    add_bounds_check_declarations(&mut module);
+                }
+                let profile = if options.profile_path.is_some() {
+                    Some(add_profile(&mut module, instrs))
+                } else {
+                    None
+                };
+
+                // Profiles count each occurrence of a loop separately,
+                // so we can't share their code.
+                let outlined = if options.profile_path.is_none() && options.profile_counts.is_none()
+                {
+                    OutlinedLoops {
+                        ids: find_outlined_loops(instrs, start_instr),
+                        ..OutlinedLoops::default()
+                    }
+                } else {
+                    OutlinedLoops::default()
+                };
 
                 let ctx = CompileContext {
                     cells: llvm_cells,
+                    num_cells,
                     cell_index_ptr: llvm_cell_index,
+                    index_type,
+                    cell_width: options.cell_width,
+                    check_bounds,
                     main_fn,
+                    output: output.clone(),
+                    input,
+                    profile: profile.clone(),
+                    loop_weights: options
+                        .profile_counts
+                        .as_ref()
+                        .map(|counts| Rc::new(loop_weights(instrs, counts))),
+                    outlined: Rc::new(outlined),
+                    source: options.source.clone(),
                 };
 
-                for instr in instrs {
-                    if ptr_equal(instr, start_instr) {
-                        // This is the point we want to start execution from.
-                        bb = set_entry_point_after(&mut module, main_fn, bb);
-                    }
+                let mut index = CellIndex::unknown();
+                bb = compile_instrs(
+                    instrs,
+                    start_instr,
+                    true,
+                    &mut module,
+                    main_fn,
+                    bb,
+                    &ctx,
+                    &mut index,
+                );
 
-                    bb = compile_instr(instr, start_instr, &mut module, main_fn, bb, ctx.clone());
+                if let (Some(profile), Some(path)) = (profile, &options.profile_path) {
+                    bb = add_profile_dump(&mut module, bb, main_fn, &profile, path);
                 }
 
-                add_cells_cleanup(&mut module, bb, llvm_cells);
+                match tape_mapping {
+                    Some(tape_mapping) => add_guarded_tape_cleanup(&mut module, bb, tape_mapping),
+                    None => add_cells_cleanup(&mut module, bb, llvm_cells),
+                }
             }
             None => {
                 // We won't have called set_entry_point_after, so set
@@ -870,32 +3420,260 @@ pub fn compile_to_module(
             }
         }
 
-        add_main_cleanup(bb);
+        add_main_cleanup(&mut module, bb, output.is_some());
+
+        if options.runtime == Runtime::Builtin {
+            link_builtin_runtime(&mut module);
+        }
 
         module
     }
 }
 
-pub fn optimise_ir(module: &mut Module, llvm_opt: i64) {
-    // TODO: add a verifier pass too.
+/// The runtime for `Runtime::Builtin`, as LLVM IR.
+const BUILTIN_RUNTIME: &str = include_str!("builtin_runtime.ll");
+
+/// Add the definitions from `builtin_runtime.ll` to `module`. We do
+/// this before optimising, so the program and its runtime are a
+/// single object file.
+fn link_builtin_runtime(module: &mut Module) {
     unsafe {
-        let builder = LLVMPassManagerBuilderCreate();
-        // E.g. if llvm_opt is 3, we want a pass equivalent to -O3.
-        LLVMPassManagerBuilderSetOptLevel(builder, llvm_opt as u32);
+        let buffer = LLVMCreateMemoryBufferWithMemoryRangeCopy(
+            BUILTIN_RUNTIME.as_ptr() as *const _,
+            BUILTIN_RUNTIME.len(),
+            module.new_string_ptr("builtin_runtime.ll"),
+        );
+
+        // LLVMParseIRInContext takes ownership of the buffer.
+        let mut runtime = null_mut();
+        let mut err_msg_ptr = null_mut();
+        if LLVMParseIRInContext(context(), buffer, &mut runtime, &mut err_msg_ptr) != 0 {
+            let err_msg = CStr::from_ptr(err_msg_ptr as *const _).to_string_lossy();
+            panic!("Could not parse builtin_runtime.ll: {}", err_msg);
+        }
+
+        // LLVMLinkModules2 disposes of the runtime module.
+        if LLVMLinkModules2(module.module, runtime) != 0 {
+            panic!("Could not link builtin_runtime.ll");
+        }
+    }
+}
+
+/// An LLVM optimisation pass that we can run on BF programs.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum LlvmPass {
+    Sroa,
+    Mem2Reg,
+    EarlyCse,
+    InstCombine,
+    SimplifyCfg,
+    Reassociate,
+    LoopRotate,
+    Licm,
+    IndVars,
+    LoopUnroll,
+    Gvn,
+    Sccp,
+    Dse,
+    MemCpyOpt,
+    Adce,
+    LoopVectorize,
+    SlpVectorize,
+}
+
+/// The name of each pass in `--llvm-passes`. These match the names
+/// used by LLVM's `opt`.
+const LLVM_PASS_NAMES: &[(&str, LlvmPass)] = &[
+    ("sroa", LlvmPass::Sroa),
+    ("mem2reg", LlvmPass::Mem2Reg),
+    ("early-cse", LlvmPass::EarlyCse),
+    ("instcombine", LlvmPass::InstCombine),
+    ("simplifycfg", LlvmPass::SimplifyCfg),
+    ("reassociate", LlvmPass::Reassociate),
+    ("loop-rotate", LlvmPass::LoopRotate),
+    ("licm", LlvmPass::Licm),
+    ("indvars", LlvmPass::IndVars),
+    ("loop-unroll", LlvmPass::LoopUnroll),
+    ("gvn", LlvmPass::Gvn),
+    ("sccp", LlvmPass::Sccp),
+    ("dse", LlvmPass::Dse),
+    ("memcpyopt", LlvmPass::MemCpyOpt),
+    ("adce", LlvmPass::Adce),
+    ("loop-vectorize", LlvmPass::LoopVectorize),
+    ("slp-vectorizer", LlvmPass::SlpVectorize),
+];
+
+/// A quick pipeline that keeps the cell index in registers and
+/// cleans up the IR we generate, for fast builds.
+pub const FAST_LLVM_PASSES: &[LlvmPass] = &[
+    LlvmPass::Sroa,
+    LlvmPass::EarlyCse,
+    LlvmPass::InstCombine,
+    LlvmPass::SimplifyCfg,
+];
+
+/// The pipeline for release binaries. BF programs are dominated by
+/// loops over the cells, so we spend our time on loop and memory
+/// optimisations, and run the loop passes again once GVN has
+/// removed redundant loads.
+pub const MAX_LLVM_PASSES: &[LlvmPass] = &[
+    LlvmPass::Sroa,
+    LlvmPass::EarlyCse,
+    LlvmPass::SimplifyCfg,
+    LlvmPass::InstCombine,
+    LlvmPass::Reassociate,
+    LlvmPass::LoopRotate,
+    LlvmPass::Licm,
+    LlvmPass::IndVars,
+    LlvmPass::LoopUnroll,
+    LlvmPass::InstCombine,
+    LlvmPass::Gvn,
+    LlvmPass::MemCpyOpt,
+    LlvmPass::Sccp,
+    LlvmPass::Dse,
+    LlvmPass::Licm,
+    LlvmPass::LoopUnroll,
+    LlvmPass::LoopVectorize,
+    LlvmPass::SlpVectorize,
+    LlvmPass::InstCombine,
+    LlvmPass::SimplifyCfg,
+    LlvmPass::Adce,
+];
+
+impl LlvmPass {
+    pub fn name(self) -> &'static str {
+        LLVM_PASS_NAMES
+            .iter()
+            .find(|&&(_, pass)| pass == self)
+            .map(|&(name, _)| name)
+            .unwrap()
+    }
+
+    unsafe fn add_to(self, pass_manager: LLVMPassManagerRef) {
+        match self {
+            LlvmPass::Sroa => LLVMAddScalarReplAggregatesPass(pass_manager),
+            LlvmPass::Mem2Reg => LLVMAddPromoteMemoryToRegisterPass(pass_manager),
+            LlvmPass::EarlyCse => LLVMAddEarlyCSEPass(pass_manager),
+            LlvmPass::InstCombine => LLVMAddInstructionCombiningPass(pass_manager),
+            LlvmPass::SimplifyCfg => LLVMAddCFGSimplificationPass(pass_manager),
+            LlvmPass::Reassociate => LLVMAddReassociatePass(pass_manager),
+            LlvmPass::LoopRotate => LLVMAddLoopRotatePass(pass_manager),
+            LlvmPass::Licm => LLVMAddLICMPass(pass_manager),
+            LlvmPass::IndVars => LLVMAddIndVarSimplifyPass(pass_manager),
+            LlvmPass::LoopUnroll => LLVMAddLoopUnrollPass(pass_manager),
+            LlvmPass::Gvn => LLVMAddGVNPass(pass_manager),
+            LlvmPass::Sccp => LLVMAddSCCPPass(pass_manager),
+            LlvmPass::Dse => LLVMAddDeadStoreEliminationPass(pass_manager),
+            LlvmPass::MemCpyOpt => LLVMAddMemCpyOptPass(pass_manager),
+            LlvmPass::Adce => LLVMAddAggressiveDCEPass(pass_manager),
+            LlvmPass::LoopVectorize => LLVMAddLoopVectorizePass(pass_manager),
+            LlvmPass::SlpVectorize => LLVMAddSLPVectorizePass(pass_manager),
+        }
+    }
+}
+
+/// Parse a `--llvm-passes` value. This is either `fast`, `max`, or a
+/// comma-separated list of pass names, which run in the order given.
+pub fn parse_llvm_passes(spec: &str) -> Result<Vec<LlvmPass>, String> {
+    match spec {
+        "fast" => return Ok(FAST_LLVM_PASSES.to_vec()),
+        "max" => return Ok(MAX_LLVM_PASSES.to_vec()),
+        "" => return Ok(vec![]),
+        _ => {}
+    }
+
+    spec.split(',')
+        .map(|name| {
+            LLVM_PASS_NAMES
+                .iter()
+                .find(|&&(pass_name, _)| pass_name == name)
+                .map(|&(_, pass)| pass)
+                .ok_or_else(|| {
+                    let names: Vec<_> = LLVM_PASS_NAMES.iter().map(|&(name, _)| name).collect();
+                    format!(
+                        "Unrecognised LLVM pass '{}' (expected fast, max or a list of: {})",
+                        name,
+                        names.join(", ")
+                    )
+                })
+        })
+        .collect()
+}
 
-        let pass_manager = LLVMCreatePassManager();
-        LLVMPassManagerBuilderPopulateModulePassManager(builder, pass_manager);
+/// The default pipeline for `--llvm-opt` level `llvm_opt`.
+pub fn default_llvm_passes(llvm_opt: i64) -> Vec<LlvmPass> {
+    match llvm_opt {
+        0 => vec![],
+        1 => FAST_LLVM_PASSES.to_vec(),
+        _ => MAX_LLVM_PASSES.to_vec(),
+    }
+}
 
-        LLVMPassManagerBuilderDispose(builder);
+/// Run `passes` on `module`, in order. If `stats` is given, record
+/// how long each pass took and how it changed the number of LLVM
+/// instructions.
+pub fn optimise_ir(
+    module: &mut Module,
+    passes: &[LlvmPass],
+    mut stats: Option<&mut Vec<PassStats>>,
+) {
+    // TODO: add a verifier pass too.
+    unsafe {
+        // The vectorisers and the unroller need to know the costs
+        // for the target. If we can't create a target machine, we
+        // report the error when we write the object file.
+        let target_machine = TargetMachine::new(LLVMGetTarget(module.module)).ok();
+
+        // Each pass gets its own pass manager, so we can time them
+        // separately.
+        for &pass in passes {
+            let pass_manager = LLVMCreatePassManager();
+            if let Some(ref target_machine) = target_machine {
+                LLVMAddAnalysisPasses(target_machine.tm, pass_manager);
+            }
+            pass.add_to(pass_manager);
+
+            match stats {
+                Some(ref mut stats) => {
+                    let instrs_before = count_instructions(module);
+                    let start = Instant::now();
+                    LLVMRunPassManager(pass_manager, module.module);
+                    stats.push(PassStats {
+                        name: pass.name(),
+                        time: start.elapsed(),
+                        nodes_before: instrs_before,
+                        nodes_after: count_instructions(module),
+                    });
+                }
+                None => {
+                    LLVMRunPassManager(pass_manager, module.module);
+                }
+            }
 
-        // Run twice. This is a hack, we should really work out which
-        // optimisations need to run twice. See
-        // http://llvm.org/docs/Frontend/PerformanceTips.html#pass-ordering
-        LLVMRunPassManager(pass_manager, module.module);
-        LLVMRunPassManager(pass_manager, module.module);
+            LLVMDisposePassManager(pass_manager);
+        }
+    }
+}
 
-        LLVMDisposePassManager(pass_manager);
+/// The number of LLVM instructions in every function in `module`.
+pub fn count_instructions(module: &Module) -> usize {
+    let mut count = 0;
+    unsafe {
+        let mut func = LLVMGetFirstFunction(module.module);
+        while !func.is_null() {
+            let mut bb = LLVMGetFirstBasicBlock(func);
+            while !bb.is_null() {
+                let mut instr = LLVMGetFirstInstruction(bb);
+                while !instr.is_null() {
+                    count += 1;
+                    instr = LLVMGetNextInstruction(instr);
+                }
+                bb = LLVMGetNextBasicBlock(bb);
+            }
+            func = LLVMGetNextFunction(func);
+        }
     }
+    count
 }
 
 pub fn get_default_target_triple() -> CString {
@@ -961,34 +3739,105 @@ impl Drop for TargetMachine {
     }
 }
 
+/// Register LLVM's targets. This is safe to call from several
+/// threads, and only initialises them once.
 pub fn init_llvm() {
-    unsafe {
+    static INIT: Once = Once::new();
+    INIT.call_once(|| unsafe {
         // TODO: are all these necessary? Are there docs?
         LLVM_InitializeAllTargetInfos();
         LLVM_InitializeAllTargets();
         LLVM_InitializeAllTargetMCs();
         LLVM_InitializeAllAsmParsers();
         LLVM_InitializeAllAsmPrinters();
-    }
+    });
 }
 
-pub fn write_object_file(module: &mut Module, path: &str) -> Result<(), String> {
+/// Compile the module to an object file in memory, so we can cache
+/// it without writing it to disk and reading it back.
+pub fn emit_object(module: &mut Module) -> Result<Vec<u8>, String> {
     unsafe {
         let target_triple = LLVMGetTarget(module.module);
         let target_machine = TargetMachine::new(target_triple)?;
 
-        let mut obj_error = module.new_mut_string_ptr("Writing object file failed.");
-        let result = LLVMTargetMachineEmitToFile(
+        let mut buffer = null_mut();
+        let mut err_msg_ptr = null_mut();
+        if LLVMTargetMachineEmitToMemoryBuffer(
             target_machine.tm,
             module.module,
-            module.new_string_ptr(path) as *mut i8,
             LLVMCodeGenFileType::LLVMObjectFile,
-            &mut obj_error,
-        );
+            &mut err_msg_ptr,
+            &mut buffer,
+        ) != 0
+        {
+            let err_msg = CStr::from_ptr(err_msg_ptr as *const _)
+                .to_string_lossy()
+                .into_owned();
+            LLVMDisposeMessage(err_msg_ptr);
+            return Err(format!("Could not emit object file: {}", err_msg));
+        }
+
+        let object = slice::from_raw_parts(
+            LLVMGetBufferStart(buffer) as *const u8,
+            LLVMGetBufferSize(buffer),
+        )
+        .to_vec();
+        LLVMDisposeMemoryBuffer(buffer);
+        Ok(object)
+    }
+}
+
+/// Compile the module in memory and run its `main` function in the
+/// current process, without writing an object file or linking.
+pub fn run_jit(module: &mut Module) -> Result<(), String> {
+    unsafe {
+        LLVMLinkInMCJIT();
+
+        // Use the same data layout that we'd use when emitting an
+        // object file for this target.
+        let target_triple = LLVMGetTarget(module.module);
+        let target_machine = TargetMachine::new(target_triple)?;
+        let data_layout = LLVMCreateTargetDataLayout(target_machine.tm);
+        LLVMSetModuleDataLayout(module.module, data_layout);
+        LLVMDisposeTargetData(data_layout);
+
+        let mut options: LLVMMCJITCompilerOptions = mem::zeroed();
+        let options_size = mem::size_of::<LLVMMCJITCompilerOptions>();
+        LLVMInitializeMCJITCompilerOptions(&mut options, options_size);
+        // Match the LLVMCodeGenLevelAggressive we use for object files.
+        options.OptLevel = 3;
+
+        let mut engine = null_mut();
+        let mut err_msg_ptr = null_mut();
+        if LLVMCreateMCJITCompilerForModule(
+            &mut engine,
+            module.module,
+            &mut options,
+            options_size,
+            &mut err_msg_ptr,
+        ) != 0
+        {
+            let err_msg = CStr::from_ptr(err_msg_ptr as *const _)
+                .to_string_lossy()
+                .into_owned();
+            LLVMDisposeMessage(err_msg_ptr);
+            return Err(err_msg);
+        }
 
-        if result != 0 {
-            panic!("obj_error: {:?}", CStr::from_ptr(obj_error as *const _));
+        let main_addr = LLVMGetFunctionAddress(engine, module.new_string_ptr("main"));
+        if main_addr == 0 {
+            LLVMDisposeExecutionEngine(engine);
+            return Err("JIT compilation did not produce a main function".to_owned());
         }
+
+        let main_fn: extern "C" fn() -> i32 = mem::transmute(main_addr as usize);
+        main_fn();
+
+        // The execution engine owns the module, so take it back
+        // before disposing the engine. Module::drop will dispose it.
+        let mut removed_module = null_mut();
+        LLVMRemoveModule(engine, module.module, &mut removed_module, &mut err_msg_ptr);
+        LLVMDisposeExecutionEngine(engine);
     }
     Ok(())
 }
@@ -1,11 +1,15 @@
 use std::collections::HashMap;
 use std::ffi::CString;
 use std::num::Wrapping;
+use std::rc::Rc;
 
 use crate::bfir::AstNode::*;
-use crate::bfir::Position;
+use crate::bfir::{CellWidth, Position};
 use crate::execution::ExecutionState;
-use crate::llvm::compile_to_module;
+use crate::llvm::{
+    compile_to_module, parse_llvm_passes, Bounds, CompileOptions, LlvmPass, OutputBuffering,
+    Runtime, Tape, FAST_LLVM_PASSES,
+};
 
 use pretty_assertions::assert_eq;
 
@@ -45,6 +49,7 @@ fn compile_loop() {
             cell_ptr: 0,
             outputs: vec![],
         },
+        &CompileOptions::default(),
     );
     let expected = "; ModuleID = \'foo\'
 source_filename = \"foo\"
@@ -53,21 +58,185 @@ target triple = \"i686-pc-linux-gnu\"
 ; Function Attrs: argmemonly nounwind willreturn
 declare void @llvm.memset.p0i8.i32(i8* nocapture writeonly, i8, i32, i32 immarg, i1) #0
 
-declare i8* @malloc(i32)
+declare i8* @calloc(i32, i32)
 
 declare void @free(i8*)
 
 declare i32 @write(i32, i8*, i32)
 
-declare i32 @putchar(i32)
+declare i32 @read(i32, i8*, i32)
 
-declare i32 @getchar()
+define i32 @main() {
+init:
+  %cells = call i8* @calloc(i32 1, i32 1)
+  %cell_index_ptr = alloca i32
+  store i32 0, i32* %cell_index_ptr
+  br label %after_init
+
+beginning:                                        ; No predecessors!
+  br label %after_init
+
+after_init:                                       ; preds = %init, %beginning
+  br label %loop_header
+
+loop_header:                                      ; preds = %loop_body, %after_init
+  %cell_index = load i32, i32* %cell_index_ptr
+  %current_cell_ptr = getelementptr i8, i8* %cells, i32 %cell_index
+  %cell_value = load i8, i8* %current_cell_ptr
+  %cell_value_is_zero = icmp eq i8 0, %cell_value
+  br i1 %cell_value_is_zero, label %loop_after, label %loop_body
+
+loop_body:                                        ; preds = %loop_header
+  %current_cell_ptr1 = getelementptr i8, i8* %cells, i32 %cell_index
+  %cell_value2 = load i8, i8* %current_cell_ptr1
+  %new_cell_value = add i8 %cell_value2, 1
+  store i8 %new_cell_value, i8* %current_cell_ptr1
+  br label %loop_header
+
+loop_after:                                       ; preds = %loop_header
+  call void @free(i8* %cells)
+  ret i32 0
+}
+
+attributes #0 = { argmemonly nounwind willreturn }
+";
+    assert_cstring_eq!(result.to_cstring(), CString::new(expected).unwrap());
+}
+
+#[test]
+fn compile_loop_with_profile_counts() {
+    let instrs = vec![Loop {
+        body: vec![Increment {
+            amount: Wrapping(1),
+            offset: 0,
+            position: Some(Position { start: 1, end: 1 }),
+        }],
+        position: Some(Position { start: 0, end: 2 }),
+    }];
+
+    // The loop ran once, and its body ran three times.
+    let mut profile_counts = HashMap::new();
+    profile_counts.insert(Position { start: 0, end: 2 }, 4);
+
+    let result = compile_to_module(
+        "foo",
+        Some("i686-pc-linux-gnu".to_owned()),
+        &instrs,
+        &ExecutionState {
+            start_instr: Some(&instrs[0]),
+            cells: vec![Wrapping(0)],
+            cell_ptr: 0,
+            outputs: vec![],
+        },
+        &CompileOptions {
+            profile_counts: Some(profile_counts),
+            ..CompileOptions::default()
+        },
+    );
+    let expected = "; ModuleID = \'foo\'
+source_filename = \"foo\"
+target triple = \"i686-pc-linux-gnu\"
+
+; Function Attrs: argmemonly nounwind willreturn
+declare void @llvm.memset.p0i8.i32(i8* nocapture writeonly, i8, i32, i32 immarg, i1) #0
+
+declare i8* @calloc(i32, i32)
+
+declare void @free(i8*)
+
+declare i32 @write(i32, i8*, i32)
+
+declare i32 @read(i32, i8*, i32)
 
 define i32 @main() {
 init:
-  %cells = call i8* @malloc(i32 1)
-  %offset_cell_ptr = getelementptr i8, i8* %cells, i32 0
-  call void @llvm.memset.p0i8.i32(i8* %offset_cell_ptr, i8 0, i32 1, i32 1, i1 true)
+  %cells = call i8* @calloc(i32 1, i32 1)
+  %cell_index_ptr = alloca i32
+  store i32 0, i32* %cell_index_ptr
+  br label %after_init
+
+beginning:                                        ; No predecessors!
+  br label %after_init
+
+after_init:                                       ; preds = %init, %beginning
+  br label %loop_header
+
+loop_header:                                      ; preds = %loop_body, %after_init
+  %cell_index = load i32, i32* %cell_index_ptr
+  %current_cell_ptr = getelementptr i8, i8* %cells, i32 %cell_index
+  %cell_value = load i8, i8* %current_cell_ptr
+  %cell_value_is_zero = icmp eq i8 0, %cell_value
+  br i1 %cell_value_is_zero, label %loop_after, label %loop_body, !prof !0
+
+loop_body:                                        ; preds = %loop_header
+  %current_cell_ptr1 = getelementptr i8, i8* %cells, i32 %cell_index
+  %cell_value2 = load i8, i8* %current_cell_ptr1
+  %new_cell_value = add i8 %cell_value2, 1
+  store i8 %new_cell_value, i8* %current_cell_ptr1
+  br label %loop_header, !llvm.loop !1
+
+loop_after:                                       ; preds = %loop_header
+  call void @free(i8* %cells)
+  ret i32 0
+}
+
+attributes #0 = { argmemonly nounwind willreturn }
+
+!0 = !{!\"branch_weights\", i32 1, i32 3}
+!1 = distinct !{!1, !2}
+!2 = !{!\"llvm.loop.unroll.enable\"}
+";
+    assert_cstring_eq!(result.to_cstring(), CString::new(expected).unwrap());
+}
+
+#[test]
+fn compile_loop_with_profile() {
+    let instrs = vec![Loop {
+        body: vec![Increment {
+            amount: Wrapping(1),
+            offset: 0,
+            position: Some(Position { start: 1, end: 1 }),
+        }],
+        position: Some(Position { start: 0, end: 2 }),
+    }];
+
+    let result = compile_to_module(
+        "foo",
+        Some("i686-pc-linux-gnu".to_owned()),
+        &instrs,
+        &ExecutionState {
+            start_instr: Some(&instrs[0]),
+            cells: vec![Wrapping(0)],
+            cell_ptr: 0,
+            outputs: vec![],
+        },
+        &CompileOptions {
+            profile_path: Some("foo.profile".to_owned()),
+            ..CompileOptions::default()
+        },
+    );
+    let expected = "; ModuleID = \'foo\'
+source_filename = \"foo\"
+target triple = \"i686-pc-linux-gnu\"
+
+@profile_counts = internal global [1 x [3 x i64]] [[3 x i64] [i64 0, i64 2, i64 0]]
+@profile_path = private unnamed_addr constant [12 x i8] c\"foo.profile\\00\", align 1
+@profile_mode = private unnamed_addr constant [3 x i8] c\"wb\\00\", align 1
+
+; Function Attrs: argmemonly nounwind willreturn
+declare void @llvm.memset.p0i8.i32(i8* nocapture writeonly, i8, i32, i32 immarg, i1) #0
+
+declare i8* @calloc(i32, i32)
+
+declare void @free(i8*)
+
+declare i32 @write(i32, i8*, i32)
+
+declare i32 @read(i32, i8*, i32)
+
+define i32 @main() {
+init:
+  %cells = call i8* @calloc(i32 1, i32 1)
   %cell_index_ptr = alloca i32
   store i32 0, i32* %cell_index_ptr
   br label %after_init
@@ -79,6 +248,9 @@ after_init:                                       ; preds = %init, %beginning
   br label %loop_header
 
 loop_header:                                      ; preds = %loop_body, %after_init
+  %profile_count = load i64, i64* getelementptr inbounds ([1 x [3 x i64]], [1 x [3 x i64]]* @profile_counts, i32 0, i32 0, i32 2)
+  %new_profile_count = add i64 %profile_count, 1
+  store i64 %new_profile_count, i64* getelementptr inbounds ([1 x [3 x i64]], [1 x [3 x i64]]* @profile_counts, i32 0, i32 0, i32 2)
   %cell_index = load i32, i32* %cell_index_ptr
   %current_cell_ptr = getelementptr i8, i8* %cells, i32 %cell_index
   %cell_value = load i8, i8* %current_cell_ptr
@@ -86,19 +258,33 @@ loop_header:                                      ; preds = %loop_body, %after_i
   br i1 %cell_value_is_zero, label %loop_after, label %loop_body
 
 loop_body:                                        ; preds = %loop_header
-  %cell_index1 = load i32, i32* %cell_index_ptr
-  %offset_cell_index = add i32 %cell_index1, 0
-  %current_cell_ptr2 = getelementptr i8, i8* %cells, i32 %offset_cell_index
-  %cell_value3 = load i8, i8* %current_cell_ptr2
-  %new_cell_value = add i8 %cell_value3, 1
-  store i8 %new_cell_value, i8* %current_cell_ptr2
+  %current_cell_ptr1 = getelementptr i8, i8* %cells, i32 %cell_index
+  %cell_value2 = load i8, i8* %current_cell_ptr1
+  %new_cell_value = add i8 %cell_value2, 1
+  store i8 %new_cell_value, i8* %current_cell_ptr1
   br label %loop_header
 
 loop_after:                                       ; preds = %loop_header
+  %profile_file = call i8* @fopen(i8* getelementptr inbounds ([12 x i8], [12 x i8]* @profile_path, i32 0, i32 0), i8* getelementptr inbounds ([3 x i8], [3 x i8]* @profile_mode, i32 0, i32 0))
+  %profile_file_is_null = icmp eq i8* %profile_file, null
+  br i1 %profile_file_is_null, label %profile_done, label %profile_write
+
+profile_write:                                    ; preds = %loop_after
+  %0 = call i32 @fwrite(i8* bitcast ([1 x [3 x i64]]* @profile_counts to i8*), i32 24, i32 1, i8* %profile_file)
+  %1 = call i32 @fclose(i8* %profile_file)
+  br label %profile_done
+
+profile_done:                                     ; preds = %profile_write, %loop_after
   call void @free(i8* %cells)
   ret i32 0
 }
 
+declare i8* @fopen(i8*, i8*)
+
+declare i32 @fwrite(i8*, i32, i32, i8*)
+
+declare i32 @fclose(i8*)
+
 attributes #0 = { argmemonly nounwind willreturn }
 ";
     assert_cstring_eq!(result.to_cstring(), CString::new(expected).unwrap());
@@ -116,6 +302,7 @@ fn compile_empty_program() {
             cell_ptr: 0,
             outputs: vec![],
         },
+        &CompileOptions::default(),
     );
     let expected = "; ModuleID = \'foo\'
 source_filename = \"foo\"
@@ -124,15 +311,13 @@ target triple = \"i686-pc-linux-gnu\"
 ; Function Attrs: argmemonly nounwind willreturn
 declare void @llvm.memset.p0i8.i32(i8* nocapture writeonly, i8, i32, i32 immarg, i1) #0
 
-declare i8* @malloc(i32)
+declare i8* @calloc(i32, i32)
 
 declare void @free(i8*)
 
 declare i32 @write(i32, i8*, i32)
 
-declare i32 @putchar(i32)
-
-declare i32 @getchar()
+declare i32 @read(i32, i8*, i32)
 
 define i32 @main() {
 init:
@@ -164,6 +349,7 @@ fn compile_set_with_offset() {
             cell_ptr: 0,
             outputs: vec![],
         },
+        &CompileOptions::default(),
     );
     let expected = "; ModuleID = \'foo\'
 source_filename = \"foo\"
@@ -172,21 +358,17 @@ target triple = \"i686-pc-linux-gnu\"
 ; Function Attrs: argmemonly nounwind willreturn
 declare void @llvm.memset.p0i8.i32(i8* nocapture writeonly, i8, i32, i32 immarg, i1) #0
 
-declare i8* @malloc(i32)
+declare i8* @calloc(i32, i32)
 
 declare void @free(i8*)
 
 declare i32 @write(i32, i8*, i32)
 
-declare i32 @putchar(i32)
-
-declare i32 @getchar()
+declare i32 @read(i32, i8*, i32)
 
 define i32 @main() {
 init:
-  %cells = call i8* @malloc(i32 50)
-  %offset_cell_ptr = getelementptr i8, i8* %cells, i32 0
-  call void @llvm.memset.p0i8.i32(i8* %offset_cell_ptr, i8 0, i32 50, i32 1, i1 true)
+  %cells = call i8* @calloc(i32 50, i32 1)
   %cell_index_ptr = alloca i32
   store i32 0, i32* %cell_index_ptr
   br label %after_init
@@ -223,30 +405,31 @@ fn compile_read() {
             cell_ptr: 0,
             outputs: vec![],
         },
+        &CompileOptions::default(),
     );
 
-    let expected = "; ModuleID = 'foo'
+    let expected = "; ModuleID = \'foo\'
 source_filename = \"foo\"
 target triple = \"i686-pc-linux-gnu\"
 
+@input_buffer = internal global [4096 x i8] zeroinitializer
+@input_buffer_pos = internal global i32 0
+@input_buffer_len = internal global i32 0
+
 ; Function Attrs: argmemonly nounwind willreturn
 declare void @llvm.memset.p0i8.i32(i8* nocapture writeonly, i8, i32, i32 immarg, i1) #0
 
-declare i8* @malloc(i32)
+declare i8* @calloc(i32, i32)
 
 declare void @free(i8*)
 
 declare i32 @write(i32, i8*, i32)
 
-declare i32 @putchar(i32)
-
-declare i32 @getchar()
+declare i32 @read(i32, i8*, i32)
 
 define i32 @main() {
 init:
-  %cells = call i8* @malloc(i32 1)
-  %offset_cell_ptr = getelementptr i8, i8* %cells, i32 0
-  call void @llvm.memset.p0i8.i32(i8* %offset_cell_ptr, i8 0, i32 1, i32 1, i1 true)
+  %cells = call i8* @calloc(i32 1, i32 1)
   %cell_index_ptr = alloca i32
   store i32 0, i32* %cell_index_ptr
   br label %after_init
@@ -257,13 +440,57 @@ beginning:                                        ; No predecessors!
 after_init:                                       ; preds = %init, %beginning
   %cell_index = load i32, i32* %cell_index_ptr
   %current_cell_ptr = getelementptr i8, i8* %cells, i32 %cell_index
-  %input_char = call i32 @getchar()
-  %input_byte = trunc i32 %input_char to i8
+  %input_pos = load i32, i32* @input_buffer_pos
+  %input_len = load i32, i32* @input_buffer_len
+  %has_input = icmp slt i32 %input_pos, %input_len
+  br i1 %has_input, label %read_byte, label %read_refill
+
+read_refill:                                      ; preds = %after_init
+  %refilled_len = call i32 @refill_input()
+  %refilled = icmp sgt i32 %refilled_len, 0
+  br i1 %refilled, label %read_byte, label %read_eof
+
+read_byte:                                        ; preds = %read_refill, %after_init
+  %byte_pos = load i32, i32* @input_buffer_pos
+  %input_byte_ptr = getelementptr [4096 x i8], [4096 x i8]* @input_buffer, i32 0, i32 %byte_pos
+  %input_byte = load i8, i8* %input_byte_ptr
+  %new_input_pos = add i32 %byte_pos, 1
+  store i32 %new_input_pos, i32* @input_buffer_pos
   store i8 %input_byte, i8* %current_cell_ptr
+  br label %read_after
+
+read_eof:                                         ; preds = %read_refill
+  store i8 -1, i8* %current_cell_ptr
+  br label %read_after
+
+read_after:                                       ; preds = %read_eof, %read_byte
   call void @free(i8* %cells)
   ret i32 0
 }
 
+declare i32* @__errno_location()
+
+define internal i32 @refill_input() {
+entry:
+  br label %read_input
+
+read_input:                                       ; preds = %read_error, %entry
+  %read_result = call i32 @read(i32 0, i8* getelementptr inbounds ([4096 x i8], [4096 x i8]* @input_buffer, i32 0, i32 0), i32 4096)
+  %read_failed = icmp eq i32 %read_result, -1
+  br i1 %read_failed, label %read_error, label %read_done
+
+read_error:                                       ; preds = %read_input
+  %errno_ptr = call i32* @__errno_location()
+  %errno = load i32, i32* %errno_ptr
+  %read_interrupted = icmp eq i32 %errno, 4
+  br i1 %read_interrupted, label %read_input, label %read_done
+
+read_done:                                        ; preds = %read_error, %read_input
+  store i32 %read_result, i32* @input_buffer_len
+  store i32 0, i32* @input_buffer_pos
+  ret i32 %read_result
+}
+
 attributes #0 = { argmemonly nounwind willreturn }
 ";
 
@@ -271,6 +498,34 @@ attributes #0 = { argmemonly nounwind willreturn }
     assert_cstring_eq!(result.to_cstring(), CString::new(expected).unwrap());
 }
 
+#[test]
+fn compile_read_with_initial_input() {
+    let instrs = vec![Read { position: None }];
+
+    let result = compile_to_module(
+        "foo",
+        Some("i686-pc-linux-gnu".to_owned()),
+        &instrs,
+        &ExecutionState {
+            start_instr: Some(&instrs[0]),
+            cells: vec![Wrapping(0)],
+            cell_ptr: 0,
+            outputs: vec![],
+        },
+        &CompileOptions {
+            initial_input: b"ab".to_vec(),
+            ..CompileOptions::default()
+        },
+    );
+    let ir = result.to_cstring().to_string_lossy().into_owned();
+
+    // The input starts in the buffer, so we don't call `read` until
+    // the program has consumed it.
+    assert!(ir.contains("@input_buffer = internal global [4096 x i8] c\"ab\\00\\00"));
+    assert!(ir.contains("@input_buffer_pos = internal global i32 0\n"));
+    assert!(ir.contains("@input_buffer_len = internal global i32 2\n"));
+}
+
 #[test]
 fn compile_write() {
     let instrs = vec![Write { position: None }];
@@ -285,30 +540,142 @@ fn compile_write() {
             cell_ptr: 0,
             outputs: vec![],
         },
+        &CompileOptions::default(),
     );
 
-    let expected = "; ModuleID = 'foo'
+    let expected = "; ModuleID = \'foo\'
 source_filename = \"foo\"
 target triple = \"i686-pc-linux-gnu\"
 
+@output_buffer = internal global [4096 x i8] zeroinitializer
+@output_buffer_len = internal global i32 0
+
 ; Function Attrs: argmemonly nounwind willreturn
 declare void @llvm.memset.p0i8.i32(i8* nocapture writeonly, i8, i32, i32 immarg, i1) #0
 
-declare i8* @malloc(i32)
+declare i8* @calloc(i32, i32)
 
 declare void @free(i8*)
 
 declare i32 @write(i32, i8*, i32)
 
-declare i32 @putchar(i32)
+declare i32 @read(i32, i8*, i32)
+
+define i32 @main() {
+init:
+  %cells = call i8* @calloc(i32 1, i32 1)
+  %cell_index_ptr = alloca i32
+  store i32 0, i32* %cell_index_ptr
+  br label %after_init
+
+beginning:                                        ; No predecessors!
+  br label %after_init
+
+after_init:                                       ; preds = %init, %beginning
+  %cell_index = load i32, i32* %cell_index_ptr
+  %current_cell_ptr = getelementptr i8, i8* %cells, i32 %cell_index
+  %cell_value = load i8, i8* %current_cell_ptr
+  %output_len = load i32, i32* @output_buffer_len
+  %output_slot_ptr = getelementptr [4096 x i8], [4096 x i8]* @output_buffer, i32 0, i32 %output_len
+  store i8 %cell_value, i8* %output_slot_ptr
+  %new_output_len = add i32 %output_len, 1
+  store i32 %new_output_len, i32* @output_buffer_len
+  %output_is_full = icmp eq i32 %new_output_len, 4096
+  br i1 %output_is_full, label %write_flush, label %write_after
+
+write_flush:                                      ; preds = %after_init
+  call void @flush_output()
+  br label %write_after
+
+write_after:                                      ; preds = %write_flush, %after_init
+  call void @free(i8* %cells)
+  call void @flush_output()
+  ret i32 0
+}
+
+define internal void @write_all(i8* %0, i32 %1) {
+entry:
+  br label %write_header
+
+write_header:                                     ; preds = %write_body, %entry
+  %write_pos = phi i32 [ 0, %entry ], [ %new_write_pos, %write_body ]
+  %write_remaining = sub i32 %1, %write_pos
+  %has_remaining = icmp sgt i32 %write_remaining, 0
+  br i1 %has_remaining, label %write_body, label %write_after
+
+write_body:                                       ; preds = %write_header
+  %write_ptr = getelementptr i8, i8* %0, i32 %write_pos
+  %written = call i32 @write(i32 1, i8* %write_ptr, i32 %write_remaining)
+  %new_write_pos = add i32 %write_pos, %written
+  %write_succeeded = icmp sgt i32 %written, 0
+  br i1 %write_succeeded, label %write_header, label %write_after
+
+write_after:                                      ; preds = %write_body, %write_header
+  ret void
+}
+
+define internal void @flush_output() {
+entry:
+  %output_len = load i32, i32* @output_buffer_len
+  %has_output = icmp sgt i32 %output_len, 0
+  br i1 %has_output, label %flush, label %flush_after
+
+flush:                                            ; preds = %entry
+  call void @write_all(i8* getelementptr inbounds ([4096 x i8], [4096 x i8]* @output_buffer, i32 0, i32 0), i32 %output_len)
+  store i32 0, i32* @output_buffer_len
+  br label %flush_after
+
+flush_after:                                      ; preds = %flush, %entry
+  ret void
+}
+
+attributes #0 = { argmemonly nounwind willreturn }
+";
+
+    assert_cstring_eq!(result.to_cstring(), CString::new(expected).unwrap());
+}
+
+#[test]
+fn compile_write_line_buffered() {
+    let instrs = vec![Write { position: None }];
+
+    let result = compile_to_module(
+        "foo",
+        Some("i686-pc-linux-gnu".to_owned()),
+        &instrs,
+        &ExecutionState {
+            start_instr: Some(&instrs[0]),
+            cells: vec![Wrapping(0)],
+            cell_ptr: 0,
+            outputs: vec![],
+        },
+        &CompileOptions {
+            output_buffering: OutputBuffering::Line,
+            ..CompileOptions::default()
+        },
+    );
+
+    let expected = "; ModuleID = \'foo\'
+source_filename = \"foo\"
+target triple = \"i686-pc-linux-gnu\"
+
+@output_buffer = internal global [4096 x i8] zeroinitializer
+@output_buffer_len = internal global i32 0
+
+; Function Attrs: argmemonly nounwind willreturn
+declare void @llvm.memset.p0i8.i32(i8* nocapture writeonly, i8, i32, i32 immarg, i1) #0
+
+declare i8* @calloc(i32, i32)
+
+declare void @free(i8*)
+
+declare i32 @write(i32, i8*, i32)
 
-declare i32 @getchar()
+declare i32 @read(i32, i8*, i32)
 
 define i32 @main() {
 init:
-  %cells = call i8* @malloc(i32 1)
-  %offset_cell_ptr = getelementptr i8, i8* %cells, i32 0
-  call void @llvm.memset.p0i8.i32(i8* %offset_cell_ptr, i8 0, i32 1, i32 1, i1 true)
+  %cells = call i8* @calloc(i32 1, i32 1)
   %cell_index_ptr = alloca i32
   store i32 0, i32* %cell_index_ptr
   br label %after_init
@@ -320,12 +687,62 @@ after_init:                                       ; preds = %init, %beginning
   %cell_index = load i32, i32* %cell_index_ptr
   %current_cell_ptr = getelementptr i8, i8* %cells, i32 %cell_index
   %cell_value = load i8, i8* %current_cell_ptr
-  %cell_val_as_char = sext i8 %cell_value to i32
-  %0 = call i32 @putchar(i32 %cell_val_as_char)
+  %output_len = load i32, i32* @output_buffer_len
+  %output_slot_ptr = getelementptr [4096 x i8], [4096 x i8]* @output_buffer, i32 0, i32 %output_len
+  store i8 %cell_value, i8* %output_slot_ptr
+  %new_output_len = add i32 %output_len, 1
+  store i32 %new_output_len, i32* @output_buffer_len
+  %output_is_full = icmp eq i32 %new_output_len, 4096
+  %output_is_newline = icmp eq i8 %cell_value, 10
+  %should_flush = or i1 %output_is_full, %output_is_newline
+  br i1 %should_flush, label %write_flush, label %write_after
+
+write_flush:                                      ; preds = %after_init
+  call void @flush_output()
+  br label %write_after
+
+write_after:                                      ; preds = %write_flush, %after_init
   call void @free(i8* %cells)
+  call void @flush_output()
   ret i32 0
 }
 
+define internal void @write_all(i8* %0, i32 %1) {
+entry:
+  br label %write_header
+
+write_header:                                     ; preds = %write_body, %entry
+  %write_pos = phi i32 [ 0, %entry ], [ %new_write_pos, %write_body ]
+  %write_remaining = sub i32 %1, %write_pos
+  %has_remaining = icmp sgt i32 %write_remaining, 0
+  br i1 %has_remaining, label %write_body, label %write_after
+
+write_body:                                       ; preds = %write_header
+  %write_ptr = getelementptr i8, i8* %0, i32 %write_pos
+  %written = call i32 @write(i32 1, i8* %write_ptr, i32 %write_remaining)
+  %new_write_pos = add i32 %write_pos, %written
+  %write_succeeded = icmp sgt i32 %written, 0
+  br i1 %write_succeeded, label %write_header, label %write_after
+
+write_after:                                      ; preds = %write_body, %write_header
+  ret void
+}
+
+define internal void @flush_output() {
+entry:
+  %output_len = load i32, i32* @output_buffer_len
+  %has_output = icmp sgt i32 %output_len, 0
+  br i1 %has_output, label %flush, label %flush_after
+
+flush:                                            ; preds = %entry
+  call void @write_all(i8* getelementptr inbounds ([4096 x i8], [4096 x i8]* @output_buffer, i32 0, i32 0), i32 %output_len)
+  store i32 0, i32* @output_buffer_len
+  br label %flush_after
+
+flush_after:                                      ; preds = %flush, %entry
+  ret void
+}
+
 attributes #0 = { argmemonly nounwind willreturn }
 ";
 
@@ -348,6 +765,7 @@ fn respect_initial_cell_ptr() {
             cell_ptr: 8,
             outputs: vec![],
         },
+        &CompileOptions::default(),
     );
     let expected = "; ModuleID = \'foo\'
 source_filename = \"foo\"
@@ -356,21 +774,17 @@ target triple = \"i686-pc-linux-gnu\"
 ; Function Attrs: argmemonly nounwind willreturn
 declare void @llvm.memset.p0i8.i32(i8* nocapture writeonly, i8, i32, i32 immarg, i1) #0
 
-declare i8* @malloc(i32)
+declare i8* @calloc(i32, i32)
 
 declare void @free(i8*)
 
 declare i32 @write(i32, i8*, i32)
 
-declare i32 @putchar(i32)
-
-declare i32 @getchar()
+declare i32 @read(i32, i8*, i32)
 
 define i32 @main() {
 init:
-  %cells = call i8* @malloc(i32 10)
-  %offset_cell_ptr = getelementptr i8, i8* %cells, i32 0
-  call void @llvm.memset.p0i8.i32(i8* %offset_cell_ptr, i8 0, i32 10, i32 1, i1 true)
+  %cells = call i8* @calloc(i32 10, i32 1)
   %cell_index_ptr = alloca i32
   store i32 8, i32* %cell_index_ptr
   br label %after_init
@@ -379,9 +793,6 @@ beginning:                                        ; No predecessors!
   br label %after_init
 
 after_init:                                       ; preds = %init, %beginning
-  %cell_index = load i32, i32* %cell_index_ptr
-  %new_cell_index = add i32 %cell_index, 1
-  store i32 %new_cell_index, i32* %cell_index_ptr
   call void @free(i8* %cells)
   ret i32 0
 }
@@ -394,9 +805,7 @@ attributes #0 = { argmemonly nounwind willreturn }
 
 #[test]
 fn compile_multiply_move() {
-    let mut changes = HashMap::new();
-    changes.insert(1, Wrapping(2));
-    changes.insert(2, Wrapping(3));
+    let changes = vec![(1, Wrapping(2)), (2, Wrapping(3))];
     let instrs = vec![MultiplyMove {
         changes,
         position: Some(Position { start: 0, end: 0 }),
@@ -412,6 +821,7 @@ fn compile_multiply_move() {
             cell_ptr: 0,
             outputs: vec![],
         },
+        &CompileOptions::default(),
     );
     let expected = "; ModuleID = \'foo\'
 source_filename = \"foo\"
@@ -420,21 +830,17 @@ target triple = \"i686-pc-linux-gnu\"
 ; Function Attrs: argmemonly nounwind willreturn
 declare void @llvm.memset.p0i8.i32(i8* nocapture writeonly, i8, i32, i32 immarg, i1) #0
 
-declare i8* @malloc(i32)
+declare i8* @calloc(i32, i32)
 
 declare void @free(i8*)
 
 declare i32 @write(i32, i8*, i32)
 
-declare i32 @putchar(i32)
-
-declare i32 @getchar()
+declare i32 @read(i32, i8*, i32)
 
 define i32 @main() {
 init:
-  %cells = call i8* @malloc(i32 3)
-  %offset_cell_ptr = getelementptr i8, i8* %cells, i32 0
-  call void @llvm.memset.p0i8.i32(i8* %offset_cell_ptr, i8 0, i32 3, i32 1, i1 true)
+  %cells = call i8* @calloc(i32 3, i32 1)
   %cell_index_ptr = alloca i32
   store i32 0, i32* %cell_index_ptr
   br label %after_init
@@ -474,18 +880,180 @@ attributes #0 = { argmemonly nounwind willreturn }
     assert_cstring_eq!(result.to_cstring(), CString::new(expected).unwrap());
 }
 
+/// Dense runs of increments and sets are applied with a single vector
+/// load and store. Cell #3 isn't changed, so it's stored unchanged.
 #[test]
-fn set_initial_cell_values() {
-    let instrs = vec![PointerIncrement {
-        amount: 1,
-        position: Some(Position { start: 0, end: 0 }),
-    }];
-    let result = compile_to_module(
-        "foo",
-        Some("i686-pc-linux-gnu".to_owned()),
-        &instrs,
-        &ExecutionState {
-            start_instr: Some(&instrs[0]),
+fn compile_cell_updates_as_vector() {
+    let instrs = vec![
+        Increment {
+            amount: Wrapping(1),
+            offset: 0,
+            position: Some(Position { start: 0, end: 0 }),
+        },
+        Increment {
+            amount: Wrapping(2),
+            offset: 1,
+            position: Some(Position { start: 1, end: 1 }),
+        },
+        Set {
+            amount: Wrapping(5),
+            offset: 2,
+            position: Some(Position { start: 2, end: 2 }),
+        },
+        Increment {
+            amount: Wrapping(4),
+            offset: 4,
+            position: Some(Position { start: 3, end: 3 }),
+        },
+    ];
+
+    let result = compile_to_module(
+        "foo",
+        Some("i686-pc-linux-gnu".to_owned()),
+        &instrs,
+        &ExecutionState {
+            start_instr: Some(&instrs[0]),
+            cells: vec![Wrapping(0); 5],
+            cell_ptr: 0,
+            outputs: vec![],
+        },
+        &CompileOptions::default(),
+    );
+    let expected = "; ModuleID = \'foo\'
+source_filename = \"foo\"
+target triple = \"i686-pc-linux-gnu\"
+
+; Function Attrs: argmemonly nounwind willreturn
+declare void @llvm.memset.p0i8.i32(i8* nocapture writeonly, i8, i32, i32 immarg, i1) #0
+
+declare i8* @calloc(i32, i32)
+
+declare void @free(i8*)
+
+declare i32 @write(i32, i8*, i32)
+
+declare i32 @read(i32, i8*, i32)
+
+define i32 @main() {
+init:
+  %cells = call i8* @calloc(i32 5, i32 1)
+  %cell_index_ptr = alloca i32
+  store i32 0, i32* %cell_index_ptr
+  br label %after_init
+
+beginning:                                        ; No predecessors!
+  br label %after_init
+
+after_init:                                       ; preds = %init, %beginning
+  %cell_index = load i32, i32* %cell_index_ptr
+  %current_cell_ptr = getelementptr i8, i8* %cells, i32 %cell_index
+  %cells_vector_ptr = bitcast i8* %current_cell_ptr to <5 x i8>*
+  %cells_vector = load <5 x i8>, <5 x i8>* %cells_vector_ptr, align 1
+  %kept_cells_vector = and <5 x i8> %cells_vector, <i8 -1, i8 -1, i8 0, i8 -1, i8 -1>
+  %new_cells_vector = add <5 x i8> %kept_cells_vector, <i8 1, i8 2, i8 5, i8 0, i8 4>
+  store <5 x i8> %new_cells_vector, <5 x i8>* %cells_vector_ptr, align 1
+  call void @free(i8* %cells)
+  ret i32 0
+}
+
+attributes #0 = { argmemonly nounwind willreturn }
+";
+
+    assert_cstring_eq!(result.to_cstring(), CString::new(expected).unwrap());
+}
+
+#[test]
+fn compile_multiply_move_as_vector() {
+    let changes = vec![
+        (1, Wrapping(2)),
+        (2, Wrapping(3)),
+        (3, Wrapping(4)),
+        (4, Wrapping(5)),
+    ];
+    let instrs = vec![MultiplyMove {
+        changes,
+        position: Some(Position { start: 0, end: 0 }),
+    }];
+
+    let result = compile_to_module(
+        "foo",
+        Some("i686-pc-linux-gnu".to_owned()),
+        &instrs,
+        &ExecutionState {
+            start_instr: Some(&instrs[0]),
+            cells: vec![Wrapping(0); 5],
+            cell_ptr: 0,
+            outputs: vec![],
+        },
+        &CompileOptions::default(),
+    );
+    let expected = "; ModuleID = \'foo\'
+source_filename = \"foo\"
+target triple = \"i686-pc-linux-gnu\"
+
+; Function Attrs: argmemonly nounwind willreturn
+declare void @llvm.memset.p0i8.i32(i8* nocapture writeonly, i8, i32, i32 immarg, i1) #0
+
+declare i8* @calloc(i32, i32)
+
+declare void @free(i8*)
+
+declare i32 @write(i32, i8*, i32)
+
+declare i32 @read(i32, i8*, i32)
+
+define i32 @main() {
+init:
+  %cells = call i8* @calloc(i32 5, i32 1)
+  %cell_index_ptr = alloca i32
+  store i32 0, i32* %cell_index_ptr
+  br label %after_init
+
+beginning:                                        ; No predecessors!
+  br label %after_init
+
+after_init:                                       ; preds = %init, %beginning
+  %cell_index = load i32, i32* %cell_index_ptr
+  %current_cell_ptr = getelementptr i8, i8* %cells, i32 %cell_index
+  %cell_value = load i8, i8* %current_cell_ptr
+  %cell_value_is_zero = icmp eq i8 0, %cell_value
+  br i1 %cell_value_is_zero, label %multiply_after, label %multiply_body
+
+multiply_body:                                    ; preds = %after_init
+  store i8 0, i8* %current_cell_ptr
+  %target_cells_ptr = getelementptr i8, i8* %current_cell_ptr, i32 1
+  %target_vector_ptr = bitcast i8* %target_cells_ptr to <4 x i8>*
+  %target_vector = load <4 x i8>, <4 x i8>* %target_vector_ptr, align 1
+  %cell_value_vector = insertelement <4 x i8> undef, i8 %cell_value, i32 0
+  %cell_value_splat = shufflevector <4 x i8> %cell_value_vector, <4 x i8> undef, <4 x i32> zeroinitializer
+  %additional_vector = mul <4 x i8> %cell_value_splat, <i8 2, i8 3, i8 4, i8 5>
+  %new_target_vector = add <4 x i8> %target_vector, %additional_vector
+  store <4 x i8> %new_target_vector, <4 x i8>* %target_vector_ptr, align 1
+  br label %multiply_after
+
+multiply_after:                                   ; preds = %multiply_body, %after_init
+  call void @free(i8* %cells)
+  ret i32 0
+}
+
+attributes #0 = { argmemonly nounwind willreturn }
+";
+
+    assert_cstring_eq!(result.to_cstring(), CString::new(expected).unwrap());
+}
+
+#[test]
+fn set_initial_cell_values() {
+    let instrs = vec![PointerIncrement {
+        amount: 1,
+        position: Some(Position { start: 0, end: 0 }),
+    }];
+    let result = compile_to_module(
+        "foo",
+        Some("i686-pc-linux-gnu".to_owned()),
+        &instrs,
+        &ExecutionState {
+            start_instr: Some(&instrs[0]),
             cells: vec![
                 Wrapping(1),
                 Wrapping(1),
@@ -497,6 +1065,7 @@ fn set_initial_cell_values() {
             cell_ptr: 0,
             outputs: vec![],
         },
+        &CompileOptions::default(),
     );
     let expected = "; ModuleID = \'foo\'
 source_filename = \"foo\"
@@ -505,25 +1074,81 @@ target triple = \"i686-pc-linux-gnu\"
 ; Function Attrs: argmemonly nounwind willreturn
 declare void @llvm.memset.p0i8.i32(i8* nocapture writeonly, i8, i32, i32 immarg, i1) #0
 
-declare i8* @malloc(i32)
+declare i8* @calloc(i32, i32)
 
 declare void @free(i8*)
 
 declare i32 @write(i32, i8*, i32)
 
-declare i32 @putchar(i32)
+declare i32 @read(i32, i8*, i32)
+
+define i32 @main() {
+init:
+  %cells = call i8* @calloc(i32 6, i32 1)
+  %offset_cell_ptr = getelementptr i8, i8* %cells, i32 0
+  store i8 1, i8* %offset_cell_ptr
+  %offset_cell_ptr1 = getelementptr i8, i8* %cells, i32 1
+  store i8 1, i8* %offset_cell_ptr1
+  %offset_cell_ptr2 = getelementptr i8, i8* %cells, i32 2
+  store i8 2, i8* %offset_cell_ptr2
+  %cell_index_ptr = alloca i32
+  store i32 0, i32* %cell_index_ptr
+  br label %after_init
+
+beginning:                                        ; No predecessors!
+  br label %after_init
+
+after_init:                                       ; preds = %init, %beginning
+  call void @free(i8* %cells)
+  ret i32 0
+}
+
+attributes #0 = { argmemonly nounwind willreturn }
+";
+
+    assert_cstring_eq!(result.to_cstring(), CString::new(expected).unwrap());
+}
+
+#[test]
+fn set_long_initial_run_with_memset() {
+    let instrs = vec![PointerIncrement {
+        amount: 1,
+        position: Some(Position { start: 0, end: 0 }),
+    }];
+    let mut cells = vec![Wrapping(3); 10];
+    cells.push(Wrapping(0));
+    let result = compile_to_module(
+        "foo",
+        Some("i686-pc-linux-gnu".to_owned()),
+        &instrs,
+        &ExecutionState {
+            start_instr: Some(&instrs[0]),
+            cells,
+            cell_ptr: 0,
+            outputs: vec![],
+        },
+        &CompileOptions::default(),
+    );
+    let expected = "; ModuleID = \'foo\'
+source_filename = \"foo\"
+target triple = \"i686-pc-linux-gnu\"
+
+; Function Attrs: argmemonly nounwind willreturn
+declare void @llvm.memset.p0i8.i32(i8* nocapture writeonly, i8, i32, i32 immarg, i1) #0
+
+declare i8* @calloc(i32, i32)
+
+declare void @free(i8*)
+
+declare i32 @write(i32, i8*, i32)
 
-declare i32 @getchar()
+declare i32 @read(i32, i8*, i32)
 
 define i32 @main() {
 init:
-  %cells = call i8* @malloc(i32 6)
+  %cells = call i8* @calloc(i32 11, i32 1)
   %offset_cell_ptr = getelementptr i8, i8* %cells, i32 0
-  call void @llvm.memset.p0i8.i32(i8* %offset_cell_ptr, i8 1, i32 2, i32 1, i1 true)
-  %offset_cell_ptr1 = getelementptr i8, i8* %cells, i32 2
-  call void @llvm.memset.p0i8.i32(i8* %offset_cell_ptr1, i8 2, i32 1, i32 1, i1 true)
-  %offset_cell_ptr2 = getelementptr i8, i8* %cells, i32 3
-  call void @llvm.memset.p0i8.i32(i8* %offset_cell_ptr2, i8 0, i32 3, i32 1, i1 true)
+  call void @llvm.memset.p0i8.i32(i8* %offset_cell_ptr, i8 3, i32 10, i32 1, i1 true)
   %cell_index_ptr = alloca i32
   store i32 0, i32* %cell_index_ptr
   br label %after_init
@@ -532,9 +1157,6 @@ beginning:                                        ; No predecessors!
   br label %after_init
 
 after_init:                                       ; preds = %init, %beginning
-  %cell_index = load i32, i32* %cell_index_ptr
-  %new_cell_index = add i32 %cell_index, 1
-  store i32 %new_cell_index, i32* %cell_index_ptr
   call void @free(i8* %cells)
   ret i32 0
 }
@@ -557,6 +1179,7 @@ fn compile_static_outputs() {
             cell_ptr: 0,
             outputs: vec![5, 10],
         },
+        &CompileOptions::default(),
     );
     let expected = "; ModuleID = \'foo\'
 source_filename = \"foo\"
@@ -567,25 +1190,44 @@ target triple = \"i686-pc-linux-gnu\"
 ; Function Attrs: argmemonly nounwind willreturn
 declare void @llvm.memset.p0i8.i32(i8* nocapture writeonly, i8, i32, i32 immarg, i1) #0
 
-declare i8* @malloc(i32)
+declare i8* @calloc(i32, i32)
 
 declare void @free(i8*)
 
 declare i32 @write(i32, i8*, i32)
 
-declare i32 @putchar(i32)
-
-declare i32 @getchar()
+declare i32 @read(i32, i8*, i32)
 
 define i32 @main() {
 init:
-  %0 = call i32 @write(i32 1, i8* getelementptr inbounds ([2 x i8], [2 x i8]* @known_outputs, i32 0, i32 0), i32 2)
+  call void @write_all(i8* getelementptr inbounds ([2 x i8], [2 x i8]* @known_outputs, i32 0, i32 0), i32 2)
   br label %beginning
 
 beginning:                                        ; preds = %init
   ret i32 0
 }
 
+define internal void @write_all(i8* %0, i32 %1) {
+entry:
+  br label %write_header
+
+write_header:                                     ; preds = %write_body, %entry
+  %write_pos = phi i32 [ 0, %entry ], [ %new_write_pos, %write_body ]
+  %write_remaining = sub i32 %1, %write_pos
+  %has_remaining = icmp sgt i32 %write_remaining, 0
+  br i1 %has_remaining, label %write_body, label %write_after
+
+write_body:                                       ; preds = %write_header
+  %write_ptr = getelementptr i8, i8* %0, i32 %write_pos
+  %written = call i32 @write(i32 1, i8* %write_ptr, i32 %write_remaining)
+  %new_write_pos = add i32 %write_pos, %written
+  %write_succeeded = icmp sgt i32 %written, 0
+  br i1 %write_succeeded, label %write_header, label %write_after
+
+write_after:                                      ; preds = %write_body, %write_header
+  ret void
+}
+
 attributes #0 = { argmemonly nounwind willreturn }
 ";
 
@@ -608,6 +1250,7 @@ fn compile_ptr_increment() {
             cell_ptr: 0,
             outputs: vec![],
         },
+        &CompileOptions::default(),
     );
     let expected = "; ModuleID = \'foo\'
 source_filename = \"foo\"
@@ -616,21 +1259,17 @@ target triple = \"i686-pc-linux-gnu\"
 ; Function Attrs: argmemonly nounwind willreturn
 declare void @llvm.memset.p0i8.i32(i8* nocapture writeonly, i8, i32, i32 immarg, i1) #0
 
-declare i8* @malloc(i32)
+declare i8* @calloc(i32, i32)
 
 declare void @free(i8*)
 
 declare i32 @write(i32, i8*, i32)
 
-declare i32 @putchar(i32)
-
-declare i32 @getchar()
+declare i32 @read(i32, i8*, i32)
 
 define i32 @main() {
 init:
-  %cells = call i8* @malloc(i32 2)
-  %offset_cell_ptr = getelementptr i8, i8* %cells, i32 0
-  call void @llvm.memset.p0i8.i32(i8* %offset_cell_ptr, i8 0, i32 2, i32 1, i1 true)
+  %cells = call i8* @calloc(i32 2, i32 1)
   %cell_index_ptr = alloca i32
   store i32 0, i32* %cell_index_ptr
   br label %after_init
@@ -639,9 +1278,6 @@ beginning:                                        ; No predecessors!
   br label %after_init
 
 after_init:                                       ; preds = %init, %beginning
-  %cell_index = load i32, i32* %cell_index_ptr
-  %new_cell_index = add i32 %cell_index, 1
-  store i32 %new_cell_index, i32* %cell_index_ptr
   call void @free(i8* %cells)
   ret i32 0
 }
@@ -653,22 +1289,36 @@ attributes #0 = { argmemonly nounwind willreturn }
 }
 
 #[test]
-fn compile_increment() {
-    let instrs = vec![Increment {
-        amount: Wrapping(1),
-        offset: 0,
-        position: Some(Position { start: 0, end: 0 }),
-    }];
+fn compile_ptr_increment_as_offset() {
+    let instrs = vec![
+        PointerIncrement {
+            amount: 1,
+            position: Some(Position { start: 0, end: 0 }),
+        },
+        Increment {
+            amount: Wrapping(1),
+            offset: 1,
+            position: Some(Position { start: 1, end: 1 }),
+        },
+        Loop {
+            body: vec![PointerIncrement {
+                amount: -1,
+                position: Some(Position { start: 3, end: 3 }),
+            }],
+            position: Some(Position { start: 2, end: 4 }),
+        },
+    ];
     let result = compile_to_module(
         "foo",
         Some("i686-pc-linux-gnu".to_owned()),
         &instrs,
         &ExecutionState {
             start_instr: Some(&instrs[0]),
-            cells: vec![Wrapping(0)],
+            cells: vec![Wrapping(0); 3],
             cell_ptr: 0,
             outputs: vec![],
         },
+        &CompileOptions::default(),
     );
     let expected = "; ModuleID = \'foo\'
 source_filename = \"foo\"
@@ -677,21 +1327,17 @@ target triple = \"i686-pc-linux-gnu\"
 ; Function Attrs: argmemonly nounwind willreturn
 declare void @llvm.memset.p0i8.i32(i8* nocapture writeonly, i8, i32, i32 immarg, i1) #0
 
-declare i8* @malloc(i32)
+declare i8* @calloc(i32, i32)
 
 declare void @free(i8*)
 
 declare i32 @write(i32, i8*, i32)
 
-declare i32 @putchar(i32)
-
-declare i32 @getchar()
+declare i32 @read(i32, i8*, i32)
 
 define i32 @main() {
 init:
-  %cells = call i8* @malloc(i32 1)
-  %offset_cell_ptr = getelementptr i8, i8* %cells, i32 0
-  call void @llvm.memset.p0i8.i32(i8* %offset_cell_ptr, i8 0, i32 1, i32 1, i1 true)
+  %cells = call i8* @calloc(i32 3, i32 1)
   %cell_index_ptr = alloca i32
   store i32 0, i32* %cell_index_ptr
   br label %after_init
@@ -701,11 +1347,28 @@ beginning:                                        ; No predecessors!
 
 after_init:                                       ; preds = %init, %beginning
   %cell_index = load i32, i32* %cell_index_ptr
-  %offset_cell_index = add i32 %cell_index, 0
+  %offset_cell_index = add i32 %cell_index, 2
   %current_cell_ptr = getelementptr i8, i8* %cells, i32 %offset_cell_index
   %cell_value = load i8, i8* %current_cell_ptr
   %new_cell_value = add i8 %cell_value, 1
   store i8 %new_cell_value, i8* %current_cell_ptr
+  %new_cell_index = add i32 %cell_index, 1
+  store i32 %new_cell_index, i32* %cell_index_ptr
+  br label %loop_header
+
+loop_header:                                      ; preds = %loop_body, %after_init
+  %cell_index1 = load i32, i32* %cell_index_ptr
+  %current_cell_ptr2 = getelementptr i8, i8* %cells, i32 %cell_index1
+  %cell_value3 = load i8, i8* %current_cell_ptr2
+  %cell_value_is_zero = icmp eq i8 0, %cell_value3
+  br i1 %cell_value_is_zero, label %loop_after, label %loop_body
+
+loop_body:                                        ; preds = %loop_header
+  %new_cell_index4 = add i32 %cell_index1, -1
+  store i32 %new_cell_index4, i32* %cell_index_ptr
+  br label %loop_header
+
+loop_after:                                       ; preds = %loop_header
   call void @free(i8* %cells)
   ret i32 0
 }
@@ -717,10 +1380,10 @@ attributes #0 = { argmemonly nounwind willreturn }
 }
 
 #[test]
-fn compile_increment_with_offset() {
+fn compile_increment() {
     let instrs = vec![Increment {
         amount: Wrapping(1),
-        offset: 3,
+        offset: 0,
         position: Some(Position { start: 0, end: 0 }),
     }];
     let result = compile_to_module(
@@ -729,10 +1392,11 @@ fn compile_increment_with_offset() {
         &instrs,
         &ExecutionState {
             start_instr: Some(&instrs[0]),
-            cells: vec![Wrapping(0); 4],
+            cells: vec![Wrapping(0)],
             cell_ptr: 0,
             outputs: vec![],
         },
+        &CompileOptions::default(),
     );
     let expected = "; ModuleID = \'foo\'
 source_filename = \"foo\"
@@ -741,21 +1405,17 @@ target triple = \"i686-pc-linux-gnu\"
 ; Function Attrs: argmemonly nounwind willreturn
 declare void @llvm.memset.p0i8.i32(i8* nocapture writeonly, i8, i32, i32 immarg, i1) #0
 
-declare i8* @malloc(i32)
+declare i8* @calloc(i32, i32)
 
 declare void @free(i8*)
 
 declare i32 @write(i32, i8*, i32)
 
-declare i32 @putchar(i32)
-
-declare i32 @getchar()
+declare i32 @read(i32, i8*, i32)
 
 define i32 @main() {
 init:
-  %cells = call i8* @malloc(i32 4)
-  %offset_cell_ptr = getelementptr i8, i8* %cells, i32 0
-  call void @llvm.memset.p0i8.i32(i8* %offset_cell_ptr, i8 0, i32 4, i32 1, i1 true)
+  %cells = call i8* @calloc(i32 1, i32 1)
   %cell_index_ptr = alloca i32
   store i32 0, i32* %cell_index_ptr
   br label %after_init
@@ -765,8 +1425,7 @@ beginning:                                        ; No predecessors!
 
 after_init:                                       ; preds = %init, %beginning
   %cell_index = load i32, i32* %cell_index_ptr
-  %offset_cell_index = add i32 %cell_index, 3
-  %current_cell_ptr = getelementptr i8, i8* %cells, i32 %offset_cell_index
+  %current_cell_ptr = getelementptr i8, i8* %cells, i32 %cell_index
   %cell_value = load i8, i8* %current_cell_ptr
   %new_cell_value = add i8 %cell_value, 1
   store i8 %new_cell_value, i8* %current_cell_ptr
@@ -776,33 +1435,31 @@ after_init:                                       ; preds = %init, %beginning
 
 attributes #0 = { argmemonly nounwind willreturn }
 ";
+
     assert_cstring_eq!(result.to_cstring(), CString::new(expected).unwrap());
 }
 
 #[test]
-fn compile_start_instr_midway() {
-    let instrs = vec![
-        Set {
-            amount: Wrapping(1),
-            offset: 0,
-            position: Some(Position { start: 0, end: 0 }),
-        },
-        Set {
-            amount: Wrapping(2),
-            offset: 0,
-            position: Some(Position { start: 0, end: 0 }),
-        },
-    ];
+fn compile_increment_16_bit() {
+    let instrs = vec![Increment {
+        amount: Wrapping(300),
+        offset: 0,
+        position: Some(Position { start: 0, end: 0 }),
+    }];
     let result = compile_to_module(
         "foo",
         Some("i686-pc-linux-gnu".to_owned()),
         &instrs,
         &ExecutionState {
-            start_instr: Some(&instrs[1]),
+            start_instr: Some(&instrs[0]),
             cells: vec![Wrapping(0)],
             cell_ptr: 0,
             outputs: vec![],
         },
+        &CompileOptions {
+            cell_width: CellWidth::Bits16,
+            ..CompileOptions::default()
+        },
     );
     let expected = "; ModuleID = \'foo\'
 source_filename = \"foo\"
@@ -811,37 +1468,298 @@ target triple = \"i686-pc-linux-gnu\"
 ; Function Attrs: argmemonly nounwind willreturn
 declare void @llvm.memset.p0i8.i32(i8* nocapture writeonly, i8, i32, i32 immarg, i1) #0
 
-declare i8* @malloc(i32)
+declare i8* @calloc(i32, i32)
 
 declare void @free(i8*)
 
 declare i32 @write(i32, i8*, i32)
 
-declare i32 @putchar(i32)
-
-declare i32 @getchar()
+declare i32 @read(i32, i8*, i32)
 
 define i32 @main() {
 init:
-  %cells = call i8* @malloc(i32 1)
-  %offset_cell_ptr = getelementptr i8, i8* %cells, i32 0
-  call void @llvm.memset.p0i8.i32(i8* %offset_cell_ptr, i8 0, i32 1, i32 1, i1 true)
+  %cells = call i8* @calloc(i32 1, i32 2)
+  %typed_cells = bitcast i8* %cells to i16*
   %cell_index_ptr = alloca i32
   store i32 0, i32* %cell_index_ptr
   br label %after_init
 
 beginning:                                        ; No predecessors!
-  %cell_index = load i32, i32* %cell_index_ptr
-  %offset_cell_index = add i32 %cell_index, 0
-  %current_cell_ptr = getelementptr i8, i8* %cells, i32 %offset_cell_index
-  store i8 1, i8* %current_cell_ptr
+  br label %after_init
+
+after_init:                                       ; preds = %init, %beginning
+  %cell_index = load i32, i32* %cell_index_ptr
+  %current_cell_ptr = getelementptr i16, i16* %typed_cells, i32 %cell_index
+  %cell_value = load i16, i16* %current_cell_ptr
+  %new_cell_value = add i16 %cell_value, 300
+  store i16 %new_cell_value, i16* %current_cell_ptr
+  %cells_bytes = bitcast i16* %typed_cells to i8*
+  call void @free(i8* %cells_bytes)
+  ret i32 0
+}
+
+attributes #0 = { argmemonly nounwind willreturn }
+";
+
+    assert_cstring_eq!(result.to_cstring(), CString::new(expected).unwrap());
+}
+
+#[test]
+fn compile_increment_with_offset() {
+    let instrs = vec![Increment {
+        amount: Wrapping(1),
+        offset: 3,
+        position: Some(Position { start: 0, end: 0 }),
+    }];
+    let result = compile_to_module(
+        "foo",
+        Some("i686-pc-linux-gnu".to_owned()),
+        &instrs,
+        &ExecutionState {
+            start_instr: Some(&instrs[0]),
+            cells: vec![Wrapping(0); 4],
+            cell_ptr: 0,
+            outputs: vec![],
+        },
+        &CompileOptions::default(),
+    );
+    let expected = "; ModuleID = \'foo\'
+source_filename = \"foo\"
+target triple = \"i686-pc-linux-gnu\"
+
+; Function Attrs: argmemonly nounwind willreturn
+declare void @llvm.memset.p0i8.i32(i8* nocapture writeonly, i8, i32, i32 immarg, i1) #0
+
+declare i8* @calloc(i32, i32)
+
+declare void @free(i8*)
+
+declare i32 @write(i32, i8*, i32)
+
+declare i32 @read(i32, i8*, i32)
+
+define i32 @main() {
+init:
+  %cells = call i8* @calloc(i32 4, i32 1)
+  %cell_index_ptr = alloca i32
+  store i32 0, i32* %cell_index_ptr
+  br label %after_init
+
+beginning:                                        ; No predecessors!
+  br label %after_init
+
+after_init:                                       ; preds = %init, %beginning
+  %cell_index = load i32, i32* %cell_index_ptr
+  %offset_cell_index = add i32 %cell_index, 3
+  %current_cell_ptr = getelementptr i8, i8* %cells, i32 %offset_cell_index
+  %cell_value = load i8, i8* %current_cell_ptr
+  %new_cell_value = add i8 %cell_value, 1
+  store i8 %new_cell_value, i8* %current_cell_ptr
+  call void @free(i8* %cells)
+  ret i32 0
+}
+
+attributes #0 = { argmemonly nounwind willreturn }
+";
+    assert_cstring_eq!(result.to_cstring(), CString::new(expected).unwrap());
+}
+
+/// With --bounds=check, we check the range of cells accessed by the
+/// instructions before the next loop, rather than each access.
+#[test]
+fn compile_bounds_check() {
+    let instrs = vec![
+        PointerIncrement {
+            amount: -1,
+            position: Some(Position { start: 0, end: 0 }),
+        },
+        Increment {
+            amount: Wrapping(1),
+            offset: 0,
+            position: Some(Position { start: 1, end: 1 }),
+        },
+    ];
+    let result = compile_to_module(
+        "foo",
+        Some("i686-pc-linux-gnu".to_owned()),
+        &instrs,
+        &ExecutionState {
+            start_instr: Some(&instrs[0]),
+            cells: vec![Wrapping(0); 3],
+            cell_ptr: 0,
+            outputs: vec![],
+        },
+        &CompileOptions {
+            bounds: Bounds::Check,
+            source: Some(Rc::from("<+")),
+            ..CompileOptions::default()
+        },
+    );
+    let expected = "; ModuleID = \'foo\'
+source_filename = \"foo\"
+target triple = \"i686-pc-linux-gnu\"
+
+@bounds_error_message = private unnamed_addr constant [46 x i8] c\"Cell index out of bounds at line 1, column 1\\0A\\00\", align 1
+
+; Function Attrs: argmemonly nounwind willreturn
+declare void @llvm.memset.p0i8.i32(i8* nocapture writeonly, i8, i32, i32 immarg, i1) #0
+
+declare i8* @calloc(i32, i32)
+
+declare void @free(i8*)
+
+declare i32 @write(i32, i8*, i32)
+
+declare i32 @read(i32, i8*, i32)
+
+define i32 @main() {
+init:
+  %cells = call i8* @calloc(i32 3, i32 1)
+  %cell_index_ptr = alloca i32
+  store i32 0, i32* %cell_index_ptr
+  br label %after_init
+
+beginning:                                        ; No predecessors!
+  br label %after_init
+
+after_init:                                       ; preds = %init, %beginning
+  %cell_index = load i32, i32* %cell_index_ptr
+  %offset_cell_index = add i32 %cell_index, -1
+  %cell_index_in_bounds = icmp ult i32 %offset_cell_index, 2
+  br i1 %cell_index_in_bounds, label %in_bounds, label %out_of_bounds
+
+in_bounds:                                        ; preds = %after_init
+  %offset_cell_index1 = add i32 %cell_index, -1
+  %current_cell_ptr = getelementptr i8, i8* %cells, i32 %offset_cell_index1
+  %cell_value = load i8, i8* %current_cell_ptr
+  %new_cell_value = add i8 %cell_value, 1
+  store i8 %new_cell_value, i8* %current_cell_ptr
+  call void @free(i8* %cells)
+  ret i32 0
+
+out_of_bounds:                                    ; preds = %after_init
+  %0 = call i32 @write(i32 2, i8* getelementptr inbounds ([46 x i8], [46 x i8]* @bounds_error_message, i32 0, i32 0), i32 45)
+  call void @llvm.trap()
+  unreachable
+}
+
+; Function Attrs: cold noreturn nounwind
+declare void @llvm.trap() #1
+
+attributes #0 = { argmemonly nounwind willreturn }
+attributes #1 = { cold noreturn nounwind }
+";
+    assert_cstring_eq!(result.to_cstring(), CString::new(expected).unwrap());
+}
+
+#[test]
+fn compile_repeated_loop_as_function() {
+    // A loop that increments 16 cells and moves back, so it's large
+    // enough to outline.
+    let mut body = vec![];
+    for _ in 0..16 {
+        body.push(Increment {
+            amount: Wrapping(1),
+            offset: 0,
+            position: None,
+        });
+        body.push(PointerIncrement {
+            amount: 1,
+            position: None,
+        });
+    }
+    body.push(PointerIncrement {
+        amount: -16,
+        position: None,
+    });
+
+    let instrs = vec![
+        Loop {
+            body: body.clone(),
+            position: Some(Position { start: 0, end: 0 }),
+        },
+        Loop {
+            body,
+            position: Some(Position { start: 1, end: 1 }),
+        },
+    ];
+    let result = compile_to_module(
+        "foo",
+        Some("i686-pc-linux-gnu".to_owned()),
+        &instrs,
+        &ExecutionState {
+            start_instr: Some(&instrs[0]),
+            cells: vec![Wrapping(0); 17],
+            cell_ptr: 0,
+            outputs: vec![],
+        },
+        &CompileOptions::default(),
+    );
+    let ir = result.to_cstring().to_string_lossy().into_owned();
+
+    assert_eq!(ir.matches("define internal i32 @loop_0(i8*").count(), 1);
+    assert_eq!(ir.matches("call i32 @loop_0(i8* %cells").count(), 2);
+    assert!(!ir.contains("@loop_1"));
+}
+
+#[test]
+fn compile_start_instr_midway() {
+    let instrs = vec![
+        Set {
+            amount: Wrapping(1),
+            offset: 0,
+            position: Some(Position { start: 0, end: 0 }),
+        },
+        Set {
+            amount: Wrapping(2),
+            offset: 0,
+            position: Some(Position { start: 0, end: 0 }),
+        },
+    ];
+    let result = compile_to_module(
+        "foo",
+        Some("i686-pc-linux-gnu".to_owned()),
+        &instrs,
+        &ExecutionState {
+            start_instr: Some(&instrs[1]),
+            cells: vec![Wrapping(0)],
+            cell_ptr: 0,
+            outputs: vec![],
+        },
+        &CompileOptions::default(),
+    );
+    let expected = "; ModuleID = \'foo\'
+source_filename = \"foo\"
+target triple = \"i686-pc-linux-gnu\"
+
+; Function Attrs: argmemonly nounwind willreturn
+declare void @llvm.memset.p0i8.i32(i8* nocapture writeonly, i8, i32, i32 immarg, i1) #0
+
+declare i8* @calloc(i32, i32)
+
+declare void @free(i8*)
+
+declare i32 @write(i32, i8*, i32)
+
+declare i32 @read(i32, i8*, i32)
+
+define i32 @main() {
+init:
+  %cells = call i8* @calloc(i32 1, i32 1)
+  %cell_index_ptr = alloca i32
+  store i32 0, i32* %cell_index_ptr
+  br label %after_init
+
+beginning:                                        ; No predecessors!
+  %cell_index = load i32, i32* %cell_index_ptr
+  %current_cell_ptr = getelementptr i8, i8* %cells, i32 %cell_index
+  store i8 1, i8* %current_cell_ptr
   br label %after_init
 
 after_init:                                       ; preds = %init, %beginning
   %cell_index1 = load i32, i32* %cell_index_ptr
-  %offset_cell_index2 = add i32 %cell_index1, 0
-  %current_cell_ptr3 = getelementptr i8, i8* %cells, i32 %offset_cell_index2
-  store i8 2, i8* %current_cell_ptr3
+  %current_cell_ptr2 = getelementptr i8, i8* %cells, i32 %cell_index1
+  store i8 2, i8* %current_cell_ptr2
   call void @free(i8* %cells)
   ret i32 0
 }
@@ -851,3 +1769,345 @@ attributes #0 = { argmemonly nounwind willreturn }
 
     assert_cstring_eq!(result.to_cstring(), CString::new(expected).unwrap());
 }
+
+#[test]
+fn compile_scan_memchr() {
+    let instrs = vec![Scan {
+        stride: 1,
+        position: Some(Position { start: 0, end: 2 }),
+    }];
+
+    let result = compile_to_module(
+        "foo",
+        Some("i686-pc-linux-gnu".to_owned()),
+        &instrs,
+        &ExecutionState {
+            start_instr: Some(&instrs[0]),
+            cells: vec![Wrapping(1), Wrapping(1), Wrapping(0)],
+            cell_ptr: 0,
+            outputs: vec![],
+        },
+        &CompileOptions::default(),
+    );
+    let expected = "; ModuleID = \'foo\'
+source_filename = \"foo\"
+target triple = \"i686-pc-linux-gnu\"
+
+; Function Attrs: argmemonly nounwind willreturn
+declare void @llvm.memset.p0i8.i32(i8* nocapture writeonly, i8, i32, i32 immarg, i1) #0
+
+declare i8* @calloc(i32, i32)
+
+declare void @free(i8*)
+
+declare i32 @write(i32, i8*, i32)
+
+declare i32 @read(i32, i8*, i32)
+
+define i32 @main() {
+init:
+  %cells = call i8* @calloc(i32 3, i32 1)
+  %offset_cell_ptr = getelementptr i8, i8* %cells, i32 0
+  store i8 1, i8* %offset_cell_ptr
+  %offset_cell_ptr1 = getelementptr i8, i8* %cells, i32 1
+  store i8 1, i8* %offset_cell_ptr1
+  %cell_index_ptr = alloca i32
+  store i32 0, i32* %cell_index_ptr
+  br label %after_init
+
+beginning:                                        ; No predecessors!
+  br label %after_init
+
+after_init:                                       ; preds = %init, %beginning
+  %cell_index = load i32, i32* %cell_index_ptr
+  %current_cell_ptr = getelementptr i8, i8* %cells, i32 %cell_index
+  %search_len = sub i32 3, %cell_index
+  %zero_cell_ptr = call i8* @memchr(i8* %current_cell_ptr, i32 0, i32 %search_len)
+  %0 = ptrtoint i8* %zero_cell_ptr to i64
+  %1 = ptrtoint i8* %cells to i64
+  %2 = sub i64 %0, %1
+  %zero_cell_offset = sdiv exact i64 %2, ptrtoint (i8* getelementptr (i8, i8* null, i32 1) to i64)
+  %new_cell_index = trunc i64 %zero_cell_offset to i32
+  store i32 %new_cell_index, i32* %cell_index_ptr
+  call void @free(i8* %cells)
+  ret i32 0
+}
+
+declare i8* @memchr(i8*, i32, i32)
+
+declare i8* @memrchr(i8*, i32, i32)
+
+attributes #0 = { argmemonly nounwind willreturn }
+";
+    assert_cstring_eq!(result.to_cstring(), CString::new(expected).unwrap());
+}
+
+#[test]
+fn compile_scan_strided() {
+    let instrs = vec![Scan {
+        stride: 2,
+        position: Some(Position { start: 0, end: 2 }),
+    }];
+
+    let result = compile_to_module(
+        "foo",
+        Some("i686-pc-linux-gnu".to_owned()),
+        &instrs,
+        &ExecutionState {
+            start_instr: Some(&instrs[0]),
+            cells: vec![Wrapping(1), Wrapping(1), Wrapping(0)],
+            cell_ptr: 0,
+            outputs: vec![],
+        },
+        &CompileOptions::default(),
+    );
+    let expected = "; ModuleID = \'foo\'
+source_filename = \"foo\"
+target triple = \"i686-pc-linux-gnu\"
+
+; Function Attrs: argmemonly nounwind willreturn
+declare void @llvm.memset.p0i8.i32(i8* nocapture writeonly, i8, i32, i32 immarg, i1) #0
+
+declare i8* @calloc(i32, i32)
+
+declare void @free(i8*)
+
+declare i32 @write(i32, i8*, i32)
+
+declare i32 @read(i32, i8*, i32)
+
+define i32 @main() {
+init:
+  %cells = call i8* @calloc(i32 3, i32 1)
+  %offset_cell_ptr = getelementptr i8, i8* %cells, i32 0
+  store i8 1, i8* %offset_cell_ptr
+  %offset_cell_ptr1 = getelementptr i8, i8* %cells, i32 1
+  store i8 1, i8* %offset_cell_ptr1
+  %cell_index_ptr = alloca i32
+  store i32 0, i32* %cell_index_ptr
+  br label %after_init
+
+beginning:                                        ; No predecessors!
+  br label %after_init
+
+after_init:                                       ; preds = %init, %beginning
+  %cell_index = load i32, i32* %cell_index_ptr
+  br label %scan_header
+
+scan_header:                                      ; preds = %scan_body, %after_init
+  %scan_index = phi i32 [ %cell_index, %after_init ], [ %next_scan_index, %scan_body ]
+  %scan_cell_ptr = getelementptr i8, i8* %cells, i32 %scan_index
+  %scan_cell_value = load i8, i8* %scan_cell_ptr
+  %cell_value_is_zero = icmp eq i8 0, %scan_cell_value
+  br i1 %cell_value_is_zero, label %scan_after, label %scan_body
+
+scan_body:                                        ; preds = %scan_header
+  %next_scan_index = add i32 %scan_index, 2
+  br label %scan_header
+
+scan_after:                                       ; preds = %scan_header
+  store i32 %scan_index, i32* %cell_index_ptr
+  call void @free(i8* %cells)
+  ret i32 0
+}
+
+declare i8* @memchr(i8*, i32, i32)
+
+declare i8* @memrchr(i8*, i32, i32)
+
+attributes #0 = { argmemonly nounwind willreturn }
+";
+    assert_cstring_eq!(result.to_cstring(), CString::new(expected).unwrap());
+}
+
+#[test]
+fn compile_guarded_tape() {
+    let instrs = vec![PointerIncrement {
+        amount: 1,
+        position: Some(Position { start: 0, end: 0 }),
+    }];
+
+    let result = compile_to_module(
+        "foo",
+        Some("i686-pc-linux-gnu".to_owned()),
+        &instrs,
+        &ExecutionState {
+            start_instr: Some(&instrs[0]),
+            cells: vec![Wrapping(1), Wrapping(0), Wrapping(0)],
+            cell_ptr: 0,
+            outputs: vec![],
+        },
+        &CompileOptions {
+            tape: Tape::Guarded,
+            ..CompileOptions::default()
+        },
+    );
+    let expected = "; ModuleID = \'foo\'
+source_filename = \"foo\"
+target triple = \"i686-pc-linux-gnu\"
+
+; Function Attrs: argmemonly nounwind willreturn
+declare void @llvm.memset.p0i8.i32(i8* nocapture writeonly, i8, i32, i32 immarg, i1) #0
+
+declare i8* @calloc(i32, i32)
+
+declare void @free(i8*)
+
+declare i32 @write(i32, i8*, i32)
+
+declare i32 @read(i32, i8*, i32)
+
+define i32 @main() {
+init:
+  %tape_mapping = call i8* @map_tape()
+  %cells = getelementptr i8, i8* %tape_mapping, i32 65536
+  %offset_cell_ptr = getelementptr i8, i8* %cells, i32 0
+  store i8 1, i8* %offset_cell_ptr
+  %cell_index_ptr = alloca i32
+  store i32 0, i32* %cell_index_ptr
+  br label %after_init
+
+beginning:                                        ; No predecessors!
+  br label %after_init
+
+after_init:                                       ; preds = %init, %beginning
+  %0 = call i32 @munmap(i8* %tape_mapping, i32 268566528)
+  ret i32 0
+}
+
+declare i8* @mmap(i8*, i32, i32, i32, i32, i32)
+
+declare i32 @mprotect(i8*, i32, i32)
+
+declare i32 @munmap(i8*, i32)
+
+declare void @exit(i32)
+
+define internal i8* @map_tape() {
+entry:
+  %tape_mapping = call i8* @mmap(i8* null, i32 268566528, i32 0, i32 16418, i32 -1, i32 0)
+  %cells = getelementptr i8, i8* %tape_mapping, i32 65536
+  %protect_result = call i32 @mprotect(i8* %cells, i32 268435456, i32 3)
+  %mapping_failed = icmp eq i8* %tape_mapping, inttoptr (i64 -1 to i8*)
+  %protect_failed = icmp ne i32 %protect_result, 0
+  %failed = or i1 %mapping_failed, %protect_failed
+  br i1 %failed, label %map_failed, label %mapped
+
+map_failed:                                       ; preds = %entry
+  call void @exit(i32 1)
+  unreachable
+
+mapped:                                           ; preds = %entry
+  ret i8* %tape_mapping
+}
+
+attributes #0 = { argmemonly nounwind willreturn }
+";
+    assert_cstring_eq!(result.to_cstring(), CString::new(expected).unwrap());
+}
+
+/// mmap's sizes and offsets are pointer sized, so they depend on the
+/// target.
+#[test]
+fn compile_guarded_tape_64_bit() {
+    let instrs = vec![PointerIncrement {
+        amount: 1,
+        position: None,
+    }];
+
+    let result = compile_to_module(
+        "foo",
+        Some("x86_64-pc-linux-gnu".to_owned()),
+        &instrs,
+        &ExecutionState {
+            start_instr: Some(&instrs[0]),
+            cells: vec![Wrapping(0); 2],
+            cell_ptr: 0,
+            outputs: vec![],
+        },
+        &CompileOptions {
+            tape: Tape::Guarded,
+            ..CompileOptions::default()
+        },
+    );
+    let ir = result.to_cstring().to_string_lossy().into_owned();
+
+    assert!(ir.contains("declare i8* @mmap(i8*, i64, i32, i32, i32, i64)\n"));
+    assert!(ir.contains("declare i32 @mprotect(i8*, i64, i32)\n"));
+    assert!(ir.contains("declare i32 @munmap(i8*, i64)\n"));
+}
+
+/// Cell indexes are pointer sized, so they don't need sign extending
+/// before every `getelementptr` on 64-bit targets.
+#[test]
+fn compile_cell_index_64_bit() {
+    let instrs = vec![Scan {
+        stride: 1,
+        position: None,
+    }];
+
+    let result = compile_to_module(
+        "foo",
+        Some("x86_64-pc-linux-gnu".to_owned()),
+        &instrs,
+        &ExecutionState {
+            start_instr: Some(&instrs[0]),
+            cells: vec![Wrapping(1), Wrapping(0)],
+            cell_ptr: 0,
+            outputs: vec![],
+        },
+        &CompileOptions::default(),
+    );
+    let ir = result.to_cstring().to_string_lossy().into_owned();
+
+    assert!(ir.contains("%cell_index_ptr = alloca i64\n"));
+    assert!(ir.contains("getelementptr i8, i8* %cells, i64 %cell_index\n"));
+    assert!(ir.contains("declare i8* @memchr(i8*, i32, i64)\n"));
+    assert!(!ir.contains("trunc"));
+
+    // Likewise, the C functions we call take size_t.
+    assert!(ir.contains("call i8* @calloc(i64 2, i64 1)\n"));
+    assert!(ir.contains("declare i64 @write(i32, i8*, i64)\n"));
+    assert!(ir.contains("declare i64 @read(i32, i8*, i64)\n"));
+}
+
+/// The builtin runtime defines the C functions we'd otherwise
+/// declare, and provides `_start`.
+#[test]
+fn compile_builtin_runtime() {
+    let instrs = vec![Write { position: None }];
+
+    let result = compile_to_module(
+        "foo",
+        Some("x86_64-pc-linux-gnu".to_owned()),
+        &instrs,
+        &ExecutionState {
+            start_instr: Some(&instrs[0]),
+            cells: vec![Wrapping(0)],
+            cell_ptr: 0,
+            outputs: vec![],
+        },
+        &CompileOptions {
+            runtime: Runtime::Builtin,
+            ..CompileOptions::default()
+        },
+    );
+    let ir = result.to_cstring().to_string_lossy().into_owned();
+
+    assert!(ir.contains("module asm \"_start:\"\n"));
+    assert!(ir.contains("define i8* @calloc(i64 %count, i64 %size)"));
+    assert!(ir.contains("define i64 @write(i32 %fd, i8* %buf, i64 %count)"));
+    assert!(!ir.contains("declare i8* @calloc"));
+    assert!(!ir.contains("declare i64 @write"));
+}
+
+#[test]
+fn parse_llvm_pass_list() {
+    assert_eq!(parse_llvm_passes("fast"), Ok(FAST_LLVM_PASSES.to_vec()));
+    assert_eq!(
+        parse_llvm_passes("sroa,licm,sroa"),
+        Ok(vec![LlvmPass::Sroa, LlvmPass::Licm, LlvmPass::Sroa])
+    );
+    assert_eq!(parse_llvm_passes(""), Ok(vec![]));
+    assert!(parse_llvm_passes("sroa,nonexistent").is_err());
+}
@@ -2,12 +2,18 @@
 
 //! bfc is a highly optimising compiler for BF.
 
-use crate::diagnostics::{Info, Level};
+use crate::diagnostics::{Info, Level, Warning};
 use getopts::{Matches, Options};
+use std::collections::HashMap;
 use std::env;
 use std::fs::File;
 use std::io::prelude::Read;
+use std::os::unix::fs::PermissionsExt;
 use std::path::Path;
+use std::rc::Rc;
+use std::sync::atomic::{AtomicBool, AtomicUsize, Ordering};
+use std::thread;
+use std::time::{Duration, Instant};
 use tempfile::NamedTempFile;
 
 #[cfg(test)]
@@ -15,11 +21,16 @@ use pretty_assertions::assert_eq;
 
 mod bfir;
 mod bounds;
+mod bytecode;
+mod cache;
 mod diagnostics;
 mod execution;
+mod link;
 mod llvm;
 mod peephole;
+mod profile;
 mod shell;
+mod timing;
 
 #[cfg(test)]
 mod llvm_tests;
@@ -30,7 +41,7 @@ mod soundness_tests;
 
 /// Read the contents of the file at path, and return a string of its
 /// contents. Return a diagnostic if we can't open or read the file.
-fn slurp(path: &str) -> Result<String, Info> {
+fn slurp(path: &str) -> Result<String, Info<'static>> {
     let mut file = match File::open(path) {
         Ok(file) => file,
         Err(message) => {
@@ -71,6 +82,100 @@ fn executable_name(bf_path: &str) -> String {
     name_parts.join(".")
 }
 
+/// Do these options write an executable? The other modes print to
+/// stdout, or run the program.
+fn writes_executable(matches: &Matches) -> bool {
+    !["dump-ir", "dump-llvm", "interpret", "run", "profile-report"]
+        .iter()
+        .any(|name| matches.opt_present(name))
+}
+
+/// Which runtime the compiled program uses, according to `--linker`.
+/// The builtin linker has no C library to link against, so it needs
+/// the builtin runtime.
+fn runtime(matches: &Matches) -> Result<llvm::Runtime, String> {
+    match matches.opt_str("linker").as_deref() {
+        None | Some("clang") => Ok(llvm::Runtime::Libc),
+        Some("builtin") => Ok(llvm::Runtime::Builtin),
+        Some(other) => Err(format!(
+            "Unrecognised --linker value '{}' (expected clang or builtin)",
+            other
+        )),
+    }
+}
+
+/// Check that the other options can be used with `--linker=builtin`.
+fn check_builtin_linker(matches: &Matches) -> Result<(), String> {
+    if matches.opt_present("run") {
+        return Err(
+            "--run doesn't link an executable, so --linker=builtin cannot be used with it"
+                .to_owned(),
+        );
+    }
+    if matches.opt_present("profile") {
+        return Err(
+            "--profile writes its counts with the C library, so --linker=builtin cannot be used with it"
+                .to_owned(),
+        );
+    }
+    if matches.opt_str("strip").as_deref() == Some("no") {
+        return Err(
+            "--linker=builtin doesn't write symbols, so --strip=no cannot be used with it"
+                .to_owned(),
+        );
+    }
+    let triple = match matches.opt_str("target") {
+        Some(triple) => triple,
+        None => llvm::get_default_target_triple()
+            .to_string_lossy()
+            .into_owned(),
+    };
+    if !triple.starts_with("x86_64") || !triple.contains("linux") {
+        return Err(format!(
+            "--linker=builtin is only supported on x86-64 Linux, not {}",
+            triple
+        ));
+    }
+    Ok(())
+}
+
+/// Do these options report on the compilation itself? We don't use
+/// the cache for these, as a cache hit skips the compilation.
+fn reports_on_compilation(matches: &Matches) -> bool {
+    ["ct-exec-report", "time-passes"]
+        .iter()
+        .any(|name| matches.opt_present(name))
+}
+
+/// Print `warning` about the BF program at `path`.
+fn print_warning(path: &str, src: &str, warning: &Warning) {
+    let info = Info {
+        level: Level::Warning,
+        filename: path.to_owned(),
+        message: warning.message.clone(),
+        position: warning.position,
+        source: Some(src),
+    };
+    eprintln!("{}", info);
+}
+
+/// Check that no two of `paths` would be compiled to the same
+/// executable, e.g. foo/prog.bf and bar/prog.bf.
+fn check_executable_names(paths: &[String]) -> Result<(), String> {
+    let mut paths_by_name = HashMap::new();
+    for path in paths {
+        if let Some(other_path) = paths_by_name.insert(executable_name(path), path) {
+            return Err(format!(
+                "{} and {} would both be compiled to {}",
+                other_path,
+                path,
+                executable_name(path)
+            ));
+        }
+    }
+    Ok(())
+}
+
 #[test]
 fn executable_name_bf() {
     assert_eq!(executable_name("foo.bf"), "foo");
@@ -86,8 +191,17 @@ fn executable_name_relative_path() {
     assert_eq!(executable_name("bar/baz.bf"), "baz");
 }
 
+#[test]
+fn check_executable_names_duplicate() {
+    let paths = vec!["foo/prog.bf".to_owned(), "bar/prog.b".to_owned()];
+    assert!(check_executable_names(&paths).is_err());
+
+    let paths = vec!["foo/prog.bf".to_owned(), "bar/other.bf".to_owned()];
+    assert_eq!(check_executable_names(&paths), Ok(()));
+}
+
 fn print_usage(bin_name: &str, opts: Options) {
-    let brief = format!("Usage: {} SOURCE_FILE [options]", bin_name);
+    let brief = format!("Usage: {} SOURCE_FILE... [options]", bin_name);
     print!("{}", opts.usage(&brief));
 }
 
@@ -98,19 +212,202 @@ fn convert_io_error<T>(result: Result<T, std::io::Error>) -> Result<T, String> {
     }
 }
 
+/// Describe how far compile time execution got, pointing at the
+/// instruction where runtime execution will start.
+fn ct_exec_report<'a>(
+    path: &str,
+    src: &'a str,
+    state: &execution::ExecutionState,
+    report: &execution::Report,
+) -> Info<'a> {
+    let stopped = match state.start_instr {
+        None => "completed the program".to_owned(),
+        Some(_) if report.timed_out => "ran out of time here".to_owned(),
+        Some(_) if report.steps >= execution::max_steps() => "ran out of steps here".to_owned(),
+        Some(_) => "stopped here".to_owned(),
+    };
+    Info {
+        level: Level::Note,
+        filename: path.to_owned(),
+        message: if report.inputs > 0 {
+            format!(
+                "Compile time execution ran {} steps, read {} bytes of input and produced {} outputs, then {}.",
+                report.steps, report.inputs, report.outputs, stopped
+            )
+        } else {
+            format!(
+                "Compile time execution ran {} steps and produced {} outputs, then {}.",
+                report.steps, report.outputs, stopped
+            )
+        },
+        position: state.start_instr.and_then(bfir::get_position),
+        source: Some(src),
+    }
+}
+
+/// Describe every option that affects the object file we generate,
+/// so we only reuse cache entries that were compiled the same way.
+fn cache_settings(matches: &Matches, path: &str) -> String {
+    let mut settings = format!("bfc {}\n", VERSION);
+    for name in &[
+        "opt",
+        "llvm-opt",
+        "llvm-passes",
+        "passes",
+        "output-buffer",
+        "eof",
+        "tape",
+        "bounds",
+        "cell-width",
+        "ct-exec-ms",
+        "target",
+        "linker",
+    ] {
+        settings += &format!("{}={:?}\n", name, matches.opt_str(name));
+    }
+    // The profile path is compiled into the executable.
+    settings += &format!("profile={:?}\n", profile_path(matches, path));
+    // The generated code depends on the profile's contents, not its path.
+    if let Some(profile_path) = matches.opt_str("profile-use") {
+        settings += &format!("profile-use={:?}\n", std::fs::read(profile_path).ok());
+    }
+    if let Some(input_path) = matches.opt_str("ct-input") {
+        settings += &format!("ct-input={:?}\n", std::fs::read(input_path).ok());
+    }
+    settings += &format!("max-steps={}\n", execution::max_steps());
+    settings
+}
+
+/// Describe every option that affects compile time execution, so we
+/// only resume from snapshots of the same program. The step and time
+/// limits are deliberately excluded: raising them should resume.
+fn snapshot_settings(matches: &Matches) -> String {
+    let mut settings = format!("bfc {}\n", VERSION);
+    for name in &["opt", "passes", "cell-width"] {
+        settings += &format!("{}={:?}\n", name, matches.opt_str(name));
+    }
+    if let Some(input_path) = matches.opt_str("ct-input") {
+        settings += &format!("ct-input={:?}\n", std::fs::read(input_path).ok());
+    }
+    settings
+}
+
+/// Where a program compiled with `--profile` writes its counts.
+fn profile_path(matches: &Matches, path: &str) -> Option<String> {
+    if matches.opt_present("profile") {
+        Some(format!("{}.profile", executable_name(path)))
+    } else {
+        None
+    }
+}
+
+/// How many of the hottest instructions `--profile-report` shows.
+const PROFILE_REPORT_LENGTH: usize = 10;
+
+/// Show the most executed instructions in the BF program `src`,
+/// according to the profile at `profile_path`.
+fn profile_report(path: &str, src: &str, profile_path: &str) -> Result<(), String> {
+    let entries = profile::read(profile_path)?;
+    profile::check_positions(&entries, src, profile_path)?;
+
+    for entry in entries.iter().take(PROFILE_REPORT_LENGTH) {
+        let info = Info {
+            level: Level::Note,
+            filename: path.to_owned(),
+            message: format!("executed {} times", entry.count),
+            position: Some(entry.position),
+            source: Some(src),
+        };
+        println!("{}", info);
+    }
+    Ok(())
+}
+
 // TODO: return a Vec<Info> that may contain warnings or errors,
 // instead of printing in lots of different place shere.
-fn compile_file(matches: &Matches) -> Result<(), String> {
-    let path = &matches.free[0];
+/// Compile the BF program at `path`.
+fn compile_file(matches: &Matches, path: &str) -> Result<(), String> {
+    let mut time_report = timing::Report::new(path);
+    let result = compile_file_timed(matches, path, &mut time_report);
+
+    if matches.opt_present("time-passes") {
+        if matches.opt_str("time-passes").as_deref() == Some("json") {
+            eprintln!("{}", time_report.to_json());
+        } else {
+            eprint!("{}", time_report.to_text());
+        }
+    }
+
+    result
+}
+
+/// As `compile_file`, recording how long each phase takes in
+/// `time_report`.
+fn compile_file_timed(
+    matches: &Matches,
+    path: &str,
+    time_report: &mut timing::Report,
+) -> Result<(), String> {
+    let time_passes = matches.opt_present("time-passes");
 
-    let src = match slurp(path) {
-        Ok(src) => src,
+    // Runtime error messages need the source too, so share it rather
+    // than copying it.
+    let src: Rc<str> = match slurp(path) {
+        Ok(src) => Rc::from(src),
         Err(info) => {
             return Err(format!("{}", info));
         }
     };
 
-    let mut instrs = match bfir::parse(&src) {
+    if let Some(profile_path) = matches.opt_str("profile-report") {
+        return profile_report(path, &src, &profile_path);
+    }
+
+    let runtime = runtime(matches)?;
+    if runtime == llvm::Runtime::Builtin {
+        check_builtin_linker(matches)?;
+    }
+
+    // We only cache object files, so there's nothing to reuse if
+    // we're not writing an executable. Next to each object file, we
+    // store the warnings from compiling it, so a cache hit shows the
+    // same warnings.
+    let cache_entries = match matches.opt_str("cache-dir") {
+        Some(ref cache_dir) if writes_executable(matches) && !reports_on_compilation(matches) => {
+            let cache_dir = Path::new(cache_dir);
+            let settings = cache_settings(matches, path);
+            Some((
+                cache::CacheEntry::new(cache_dir, &settings, &src),
+                cache::CacheEntry::with_extension(cache_dir, &settings, &src, "warnings"),
+            ))
+        }
+        _ => None,
+    };
+
+    if let Some((ref object_entry, ref warnings_entry)) = cache_entries {
+        let cached_warnings = warnings_entry
+            .read()
+            .and_then(|bytes| cache::warnings_from_bytes(&bytes));
+        if let (Some(cached_path), Some(cached_warnings)) = (object_entry.lookup(), cached_warnings)
+        {
+            for warning in &cached_warnings {
+                print_warning(path, &src, warning);
+            }
+            if runtime == llvm::Runtime::Builtin {
+                let object = convert_io_error(std::fs::read(&cached_path))?;
+                return link_static_executable(path, &object, time_report);
+            }
+            let obj_file_path = cached_path.to_str().expect("path not valid utf-8");
+            return link_executable(matches, path, obj_file_path, time_report);
+        }
+    }
+    let mut warnings = vec![];
+
+    let start = Instant::now();
+    let parsed = bfir::parse(&src);
+    time_report.record("parse", start);
+
+    let mut instrs = match parsed {
         Ok(instrs) => instrs,
         Err(parse_error) => {
             let info = Info {
@@ -118,30 +415,37 @@ fn compile_file(matches: &Matches) -> Result<(), String> {
                 filename: path.to_owned(),
                 message: parse_error.message,
                 position: Some(parse_error.position),
-                source: Some(src),
+                source: Some(&src),
             };
             return Err(format!("{}", info));
         }
     };
 
+    let parsed_nodes = bfir::count_nodes(&instrs);
+
     let opt_level = matches.opt_str("opt").unwrap_or_else(|| String::from("2"));
     if opt_level != "0" {
         let pass_specification = matches.opt_str("passes");
-        let (opt_instrs, warnings) = peephole::optimize(instrs, &pass_specification);
+        let stats = if time_passes {
+            Some(&mut time_report.peephole)
+        } else {
+            None
+        };
+
+        let start = Instant::now();
+        let (opt_instrs, peephole_warnings) =
+            peephole::optimize_with_stats(instrs, &pass_specification, stats);
+        time_report.record("peephole", start);
         instrs = opt_instrs;
 
-        for warning in warnings {
-            let info = Info {
-                level: Level::Warning,
-                filename: path.to_owned(),
-                message: warning.message,
-                position: warning.position,
-                source: Some(src.clone()),
-            };
-            eprintln!("{}", info);
+        for warning in peephole_warnings {
+            print_warning(path, &src, &warning);
+            warnings.push(warning);
         }
     }
 
+    time_report.ast_nodes = Some((parsed_nodes, bfir::count_nodes(&instrs)));
+
     if matches.opt_present("dump-ir") {
         for instr in &instrs {
             println!("{}", instr);
@@ -149,29 +453,224 @@ fn compile_file(matches: &Matches) -> Result<(), String> {
         return Ok(());
     }
 
-    let (state, execution_warning) = if opt_level == "2" {
-        execution::execute(&instrs, execution::max_steps())
+    let output_buffering = match matches.opt_str("output-buffer").as_deref() {
+        None | Some("full") => llvm::OutputBuffering::Full,
+        Some("line") => llvm::OutputBuffering::Line,
+        Some(other) => {
+            return Err(format!(
+                "Unrecognised --output-buffer value '{}' (expected line or full)",
+                other
+            ));
+        }
+    };
+    let eof_behaviour = match matches.opt_str("eof").as_deref() {
+        None | Some("minus-one") => llvm::EofBehaviour::MinusOne,
+        Some("zero") => llvm::EofBehaviour::Zero,
+        Some("unchanged") => llvm::EofBehaviour::Unchanged,
+        Some(other) => {
+            return Err(format!(
+                "Unrecognised --eof value '{}' (expected unchanged, zero or minus-one)",
+                other
+            ));
+        }
+    };
+    let tape = match matches.opt_str("tape").as_deref() {
+        None | Some("fixed") => llvm::Tape::Fixed,
+        Some("guarded") => llvm::Tape::Guarded,
+        Some(other) => {
+            return Err(format!(
+                "Unrecognised --tape value '{}' (expected fixed or guarded)",
+                other
+            ));
+        }
+    };
+    let bounds = match matches.opt_str("bounds").as_deref() {
+        None | Some("unchecked") => llvm::Bounds::Unchecked,
+        Some("check") => llvm::Bounds::Check,
+        Some(other) => {
+            return Err(format!(
+                "Unrecognised --bounds value '{}' (expected unchecked or check)",
+                other
+            ));
+        }
+    };
+    let cell_width = match matches.opt_str("cell-width").as_deref() {
+        None | Some("8") => bfir::CellWidth::Bits8,
+        Some("16") => bfir::CellWidth::Bits16,
+        Some("32") => bfir::CellWidth::Bits32,
+        Some(other) => {
+            return Err(format!(
+                "Unrecognised --cell-width value '{}' (expected 8, 16 or 32)",
+                other
+            ));
+        }
+    };
+    let profile_path = profile_path(matches, path);
+    let profile_counts = match matches.opt_str("profile-use") {
+        Some(profile_path) => {
+            let counts = profile::read_counts(&profile_path)?;
+            if profile::matches_any_loop(&instrs, &counts) {
+                Some(counts)
+            } else {
+                // Otherwise we'd treat every loop as never running.
+                let warning = Warning {
+                    message: format!(
+                        "Ignoring profile {}, as it has no counts for any loop in this program",
+                        profile_path
+                    ),
+                    position: None,
+                };
+                print_warning(path, &src, &warning);
+                warnings.push(warning);
+                None
+            }
+        }
+        None => None,
+    };
+    let ct_input = match matches.opt_str("ct-input") {
+        Some(input_path) => match std::fs::read(&input_path) {
+            Ok(input) => input,
+            Err(e) => return Err(format!("Could not read --ct-input {}: {}", input_path, e)),
+        },
+        None => vec![],
+    };
+    let mut compile_options = llvm::CompileOptions {
+        output_buffering,
+        eof_behaviour,
+        tape,
+        bounds,
+        cell_width,
+        profile_path,
+        profile_counts,
+        initial_input: vec![],
+        source: Some(src.clone()),
+        runtime,
+    };
+
+    if matches.opt_present("interpret") {
+        if matches.opt_present("ct-input") {
+            return Err(
+                "--interpret reads all input at runtime, so --ct-input cannot be used with it"
+                    .to_owned(),
+            );
+        }
+        if matches.opt_present("tape") {
+            return Err(
+                "--interpret sizes the tape to fit the program, so --tape cannot be used with it"
+                    .to_owned(),
+            );
+        }
+        let num_cells = bounds::highest_cell_index(&instrs) + 1;
+        let runtime_error = bytecode::interpret(
+            &instrs,
+            num_cells,
+            compile_options.cell_width,
+            compile_options.output_buffering,
+            compile_options.eof_behaviour,
+        );
+        if let Some(runtime_error) = runtime_error {
+            let info = Info {
+                level: Level::Error,
+                filename: path.to_owned(),
+                message: runtime_error.message,
+                position: runtime_error.position,
+                source: Some(&src),
+            };
+            return Err(format!("{}", info));
+        }
+        return Ok(());
+    }
+
+    let ct_exec_time = match matches.opt_str("ct-exec-ms") {
+        Some(ms) => match ms.parse::<u64>() {
+            Ok(ms) => Some(Duration::from_millis(ms)),
+            Err(_) => {
+                return Err(format!(
+                    "Unrecognised --ct-exec-ms value '{}' (expected a number of milliseconds)",
+                    ms
+                ));
+            }
+        },
+        None => None,
+    };
+
+    let (state, execution_warning, inputs_read) = if opt_level == "2" {
+        let budget = execution::Budget {
+            steps: execution::max_steps(),
+            time: ct_exec_time,
+        };
+        // Resume from the furthest point a previous compilation
+        // reached, so raising the step limit doesn't repeat work.
+        let snapshot_entry = matches.opt_str("cache-dir").map(|cache_dir| {
+            cache::CacheEntry::with_extension(
+                Path::new(&cache_dir),
+                &snapshot_settings(matches),
+                &src,
+                "snapshot",
+            )
+        });
+        let old_snapshot = snapshot_entry
+            .as_ref()
+            .and_then(|entry| entry.read())
+            .and_then(|bytes| execution::Snapshot::from_bytes(&bytes));
+
+        let start = Instant::now();
+        let (state, warning, report, snapshot) = execution::resume_with_budget(
+            &instrs,
+            budget,
+            compile_options.cell_width,
+            &ct_input,
+            old_snapshot.as_ref(),
+        );
+        time_report.record("ct_exec", start);
+
+        if let Some(ref entry) = snapshot_entry {
+            if old_snapshot.map_or(true, |old| old.steps < snapshot.steps) {
+                entry.store_bytes(&snapshot.to_bytes())?;
+            }
+        }
+        if matches.opt_present("ct-exec-report") {
+            eprintln!("{}", ct_exec_report(path, &src, &state, &report));
+        }
+        (state, warning, report.inputs)
     } else {
         let mut init_state = execution::ExecutionState::initial(&instrs[..]);
         // TODO: this will crash on the empty program.
         init_state.start_instr = Some(&instrs[0]);
-        (init_state, None)
+        (init_state, None, 0)
     };
+    // If compile time execution stopped before using all the known
+    // input, the program reads the rest before stdin.
+    compile_options.initial_input = ct_input[inputs_read..].to_vec();
 
     if let Some(execution_warning) = execution_warning {
-        let info = Info {
-            level: Level::Warning,
-            filename: path.to_owned(),
-            message: execution_warning.message,
-            position: execution_warning.position,
-            source: Some(src),
-        };
-        eprintln!("{}", info);
+        print_warning(path, &src, &execution_warning);
+        warnings.push(execution_warning);
     }
 
     llvm::init_llvm();
     let target_triple = matches.opt_str("target");
-    let mut llvm_module = llvm::compile_to_module(path, target_triple.clone(), &instrs, &state);
+    if compile_options.tape == llvm::Tape::Guarded {
+        let triple = match target_triple {
+            Some(ref triple) => triple.clone(),
+            None => llvm::get_default_target_triple()
+                .to_string_lossy()
+                .into_owned(),
+        };
+        if !llvm::target_supports_guarded_tape(&triple) {
+            return Err(format!(
+                "--tape=guarded is only supported on Linux and macOS, not {}",
+                triple
+            ));
+        }
+    }
+    if target_triple.is_some() && matches.opt_present("run") {
+        return Err("--run always runs on the host, so --target cannot be used with it".to_owned());
+    }
+    let start = Instant::now();
+    let mut llvm_module =
+        llvm::compile_to_module(path, target_triple, &instrs, &state, &compile_options);
+    time_report.record("codegen", start);
 
     if matches.opt_present("dump-llvm") {
         let llvm_ir_cstr = llvm_module.to_cstring();
@@ -188,52 +687,171 @@ fn compile_file(matches: &Matches) -> Result<(), String> {
         // TODO: warn on unrecognised input.
         llvm_opt = 3;
     }
+    let llvm_passes = match matches.opt_str("llvm-passes") {
+        Some(spec) => llvm::parse_llvm_passes(&spec)?,
+        None => llvm::default_llvm_passes(llvm_opt),
+    };
+
+    let llvm_instrs_before = if time_passes {
+        llvm::count_instructions(&llvm_module)
+    } else {
+        0
+    };
+    let start = Instant::now();
+    let llvm_stats = if time_passes {
+        Some(&mut time_report.llvm_passes)
+    } else {
+        None
+    };
+    llvm::optimise_ir(&mut llvm_module, &llvm_passes, llvm_stats);
+    time_report.record("llvm_opt", start);
+    if time_passes {
+        time_report.llvm_instrs =
+            Some((llvm_instrs_before, llvm::count_instructions(&llvm_module)));
+    }
+
+    if matches.opt_present("run") {
+        return llvm::run_jit(&mut llvm_module);
+    }
 
-    llvm::optimise_ir(&mut llvm_module, llvm_opt);
+    let start = Instant::now();
+    let object = llvm::emit_object(&mut llvm_module)?;
+    time_report.record("emit_object", start);
+    drop(llvm_module);
 
-    // Compile the LLVM IR to a temporary object file.
+    if let Some((object_entry, warnings_entry)) = cache_entries {
+        warnings_entry.store_bytes(&cache::warnings_to_bytes(&warnings))?;
+        object_entry.store_bytes(&object)?;
+    }
+
+    if runtime == llvm::Runtime::Builtin {
+        return link_static_executable(path, &object, time_report);
+    }
+
+    // The linker needs the object file on disk.
     let object_file = convert_io_error(NamedTempFile::new())?;
+    convert_io_error(std::fs::write(object_file.path(), &object))?;
     let obj_file_path = object_file.path().to_str().expect("path not valid utf-8");
-    llvm::write_object_file(&mut llvm_module, &obj_file_path)?;
+    link_executable(matches, path, obj_file_path, time_report)
+}
 
+/// Link the object file for the BF program at `path`, writing an
+/// executable next to it.
+fn link_executable(
+    matches: &Matches,
+    path: &str,
+    obj_file_path: &str,
+    time_report: &mut timing::Report,
+) -> Result<(), String> {
     let output_name = executable_name(path);
-    link_object_file(&obj_file_path, &output_name, target_triple)?;
 
     let strip_opt = matches.opt_str("strip").unwrap_or_else(|| "yes".to_owned());
-    if strip_opt == "yes" {
-        strip_executable(&output_name)?
+    let strip = strip_opt == "yes";
+    // Apple's linker can't strip all symbols as it links, so we run
+    // strip afterwards there. Elsewhere, the linker does it.
+    let strip_when_linking = strip && std::env::consts::OS != "macos";
+
+    let start = Instant::now();
+    link_object_file(
+        &obj_file_path,
+        &output_name,
+        matches.opt_str("target"),
+        strip_when_linking,
+    )?;
+    time_report.record("link", start);
+
+    if strip && !strip_when_linking {
+        let start = Instant::now();
+        strip_executable(&output_name)?;
+        time_report.record("strip", start);
     }
 
     Ok(())
 }
 
+/// Link `object` with bfc's own linker, writing a static executable
+/// next to the BF program at `path`. There's nothing to strip, as the
+/// executable has no symbol table.
+fn link_static_executable(
+    path: &str,
+    object: &[u8],
+    time_report: &mut timing::Report,
+) -> Result<(), String> {
+    let output_name = executable_name(path);
+
+    let start = Instant::now();
+    let executable = link::link_static(object)?;
+    convert_io_error(std::fs::write(&output_name, &executable))?;
+    convert_io_error(std::fs::set_permissions(
+        &output_name,
+        std::fs::Permissions::from_mode(0o755),
+    ))?;
+    time_report.record("link", start);
+
+    Ok(())
+}
+
+/// The stack size for compilation threads. Optimisation and compile
+/// time execution recurse on nested loops, so use the same stack size
+/// that the main thread typically gets.
+const WORKER_STACK_SIZE: usize = 8 * 1024 * 1024;
+
+/// Compile every source file given, using up to `jobs` threads, and
+/// print any errors. Return false if any file failed to compile.
+fn compile_files(matches: &Matches, jobs: usize) -> bool {
+    let next_file = AtomicUsize::new(0);
+    let failed = AtomicBool::new(false);
+
+    let compile_remaining = || loop {
+        let path = match matches.free.get(next_file.fetch_add(1, Ordering::SeqCst)) {
+            Some(path) => path,
+            None => break,
+        };
+        if let Err(e) = compile_file(matches, path) {
+            eprintln!("{}", e);
+            failed.store(true, Ordering::SeqCst);
+        }
+    };
+
+    if jobs == 1 {
+        compile_remaining();
+    } else {
+        thread::scope(|scope| {
+            for _ in 0..jobs.min(matches.free.len()) {
+                thread::Builder::new()
+                    .stack_size(WORKER_STACK_SIZE)
+                    .spawn_scoped(scope, &compile_remaining)
+                    .expect("could not start compilation thread");
+            }
+        });
+    }
+
+    !failed.load(Ordering::SeqCst)
+}
+
 fn link_object_file(
     object_file_path: &str,
     executable_path: &str,
     target_triple: Option<String>,
+    strip: bool,
 ) -> Result<(), String> {
     // Link the object file.
-    let clang_args = if let Some(ref target_triple) = target_triple {
-        vec![
-            object_file_path,
-            "-target",
-            &target_triple,
-            "-o",
-            &executable_path[..],
-        ]
-    } else {
-        vec![object_file_path, "-o", &executable_path[..]]
-    };
+    let mut clang_args = vec![object_file_path, "-o", &executable_path[..]];
+    if let Some(ref target_triple) = target_triple {
+        clang_args.push("-target");
+        clang_args.push(&target_triple);
+    }
+    if strip {
+        clang_args.push("-s");
+    }
 
     shell::run_shell_command("clang", &clang_args[..])
 }
 
+/// Remove all symbols from the executable. We only need this on
+/// macOS, as other linkers can strip whilst linking.
 fn strip_executable(executable_path: &str) -> Result<(), String> {
-    let strip_args = match std::env::consts::OS {
-        "macos" => vec![&executable_path[..]],
-        _ => vec!["-s", &executable_path[..]],
-    };
-    shell::run_shell_command("strip", &strip_args[..])
+    shell::run_shell_command("strip", &[executable_path])
 }
 
 const VERSION: &str = env!("CARGO_PKG_VERSION");
@@ -247,21 +865,125 @@ fn main() {
     opts.optflag("v", "version", "print bfc version");
     opts.optflag("", "dump-llvm", "print LLVM IR generated");
     opts.optflag("", "dump-ir", "print BF IR generated");
+    opts.optflag(
+        "",
+        "interpret",
+        "run the program with bfc's bytecode interpreter, without using LLVM",
+    );
+    opts.optflag(
+        "",
+        "run",
+        "compile the program in memory and run it, without writing an executable",
+    );
 
     opts.optopt("O", "opt", "optimization level (0 to 2)", "LEVEL");
     opts.optopt("", "llvm-opt", "LLVM optimization level (0 to 3)", "LEVEL");
+    opts.optopt(
+        "",
+        "llvm-passes",
+        "the LLVM passes to run (default: max, or fast with --llvm-opt=1)",
+        "fast|max|PASS,PASS,...",
+    );
     opts.optopt(
         "",
         "passes",
         "limit bfc optimisations to those specified",
         "PASS-SPECIFICATION",
     );
+    opts.optopt(
+        "",
+        "output-buffer",
+        "when the compiled program flushes stdout (default: full)",
+        "line|full",
+    );
+    opts.optopt(
+        "",
+        "eof",
+        "how , updates the current cell at end of input (default: minus-one)",
+        "unchanged|zero|minus-one",
+    );
+    opts.optopt(
+        "",
+        "tape",
+        "how the compiled program allocates cells (default: fixed)",
+        "fixed|guarded",
+    );
+    opts.optopt(
+        "",
+        "bounds",
+        "whether the compiled program checks cell accesses are on the tape (default: unchecked)",
+        "unchecked|check",
+    );
+    opts.optopt(
+        "",
+        "cell-width",
+        "the number of bits in each cell (default: 8)",
+        "8|16|32",
+    );
+    opts.optopt(
+        "",
+        "ct-exec-ms",
+        "stop compile time execution after this many milliseconds (default: no limit)",
+        "MS",
+    );
+    opts.optopt(
+        "",
+        "ct-input",
+        "the start of stdin, which compile time execution may read",
+        "FILE",
+    );
+    opts.optflag(
+        "",
+        "ct-exec-report",
+        "report how far compile time execution got",
+    );
+    opts.optflagopt(
+        "",
+        "time-passes",
+        "report how long each compilation phase took (default: text)",
+        "text|json",
+    );
+    opts.optopt(
+        "j",
+        "jobs",
+        "how many source files to compile at once (default: number of CPUs)",
+        "N",
+    );
+    opts.optopt(
+        "",
+        "cache-dir",
+        "reuse object files and compile time execution from previous compilations",
+        "DIR",
+    );
+    opts.optflag(
+        "",
+        "profile",
+        "count how often each loop runs, writing the counts to EXECUTABLE.profile on exit",
+    );
+    opts.optopt(
+        "",
+        "profile-use",
+        "optimise hot loops more aggressively, according to this profile",
+        "PROFILE",
+    );
+    opts.optopt(
+        "",
+        "profile-report",
+        "show the most executed code in SOURCE_FILE, according to this profile",
+        "PROFILE",
+    );
     opts.optopt(
         "",
         "strip",
         "strip symbols from the binary (default: yes)",
         "yes|no",
     );
+    opts.optopt(
+        "",
+        "linker",
+        "how to link the executable; builtin writes a static executable without the C library (default: clang)",
+        "clang|builtin",
+    );
 
     let default_triple_cstring = llvm::get_default_target_triple();
     let default_triple = default_triple_cstring.to_str().unwrap();
@@ -291,16 +1013,44 @@ fn main() {
         return;
     }
 
-    if matches.free.len() != 1 {
+    if matches.free.is_empty() {
         print_usage(&args[0], opts);
         std::process::exit(1);
     }
 
-    match compile_file(&matches) {
-        Ok(_) => {}
-        Err(e) => {
-            eprintln!("{}", e);
-            std::process::exit(2);
+    let mut jobs = match matches.opt_str("jobs") {
+        Some(jobs) => match jobs.parse::<usize>() {
+            Ok(jobs) if jobs > 0 => jobs,
+            _ => {
+                eprintln!(
+                    "Unrecognised --jobs value '{}' (expected a positive number)",
+                    jobs
+                );
+                std::process::exit(1);
+            }
+        },
+        None => thread::available_parallelism().map_or(1, |n| n.get()),
+    };
+    match matches.opt_str("time-passes").as_deref() {
+        None | Some("text") | Some("json") => {}
+        Some(other) => {
+            eprintln!(
+                "Unrecognised --time-passes value '{}' (expected text or json)",
+                other
+            );
+            std::process::exit(1);
         }
     }
+
+    // These modes use stdin or stdout, so handle files one at a time.
+    if !writes_executable(&matches) {
+        jobs = 1;
+    } else if let Err(e) = check_executable_names(&matches.free) {
+        eprintln!("{}", e);
+        std::process::exit(1);
+    }
+
+    if !compile_files(&matches, jobs) {
+        std::process::exit(2);
+    }
 }
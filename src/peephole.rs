@@ -4,47 +4,138 @@
 use std::collections::{HashMap, HashSet};
 use std::hash::Hash;
 use std::num::Wrapping;
+use std::time::{Duration, Instant};
 
 use itertools::Itertools;
 
 use crate::diagnostics::Warning;
 
 use crate::bfir::AstNode::*;
-use crate::bfir::{get_position, AstNode, Cell, Combine, Position};
+use crate::bfir::{count_nodes, get_position, AstNode, Cell, Combine, Position};
 
 const MAX_OPT_ITERATIONS: u64 = 40;
 
+/// How long each peephole pass took and how it changed the size of
+/// the program, summed over every iteration.
+#[derive(Debug, Default, PartialEq, Eq)]
+pub struct PeepholeStats {
+    /// How many times we ran the enabled passes over the program or a
+    /// loop body.
+    pub iterations: u64,
+    /// Stats for each pass, in the order they first ran.
+    pub passes: Vec<PassStats>,
+    /// The number of AST nodes in the whole program, kept up to date
+    /// as passes rewrite parts of it.
+    nodes: usize,
+}
+
+#[derive(Debug, PartialEq, Eq)]
+pub struct PassStats {
+    pub name: &'static str,
+    pub time: Duration,
+    /// The number of AST nodes in the program before the first run of
+    /// this pass, and after the last run.
+    pub nodes_before: usize,
+    pub nodes_after: usize,
+}
+
+impl PeepholeStats {
+    /// Record a run of pass `name` over part of the program, which
+    /// changed that part from `nodes_before` to `nodes_after` nodes.
+    fn record(
+        &mut self,
+        name: &'static str,
+        time: Duration,
+        nodes_before: usize,
+        nodes_after: usize,
+    ) {
+        let program_before = self.nodes;
+        self.nodes = self.nodes + nodes_after - nodes_before;
+
+        match self.passes.iter_mut().find(|pass| pass.name == name) {
+            Some(pass) => {
+                pass.time += time;
+                pass.nodes_after = self.nodes;
+            }
+            None => self.passes.push(PassStats {
+                name,
+                time,
+                nodes_before: program_before,
+                nodes_after: self.nodes,
+            }),
+        }
+    }
+}
+
 /// Given a sequence of BF instructions, apply peephole optimisations
 /// (repeatedly if necessary).
 pub fn optimize(
     instrs: Vec<AstNode>,
     pass_specification: &Option<String>,
 ) -> (Vec<AstNode>, Vec<Warning>) {
-    // Many of our individual peephole optimisations remove
-    // instructions, creating new opportunities to combine. We run
-    // until we've found a fixed-point where no further optimisations
-    // can be made.
-    let mut prev = instrs.clone();
-    let mut warnings = vec![];
+    optimize_with_stats(instrs, pass_specification, None)
+}
 
-    let (mut result, warning) = optimize_once(instrs, pass_specification);
+/// As `optimize`, but also record how long each pass takes in
+/// `stats`, if given.
+pub fn optimize_with_stats(
+    instrs: Vec<AstNode>,
+    pass_specification: &Option<String>,
+    mut stats: Option<&mut PeepholeStats>,
+) -> (Vec<AstNode>, Vec<Warning>) {
+    let pass_specification = pass_specification.clone().unwrap_or_else(|| {
+        "combine_inc,combine_ptr,known_zero,\
+         multiply,zeroing_loop,scan,combine_set,\
+         dead_loop,redundant_set,read_clobber,\
+         pure_removal,offset_sort"
+            .to_owned()
+    });
+    let passes: Vec<_> = pass_specification.split(',').collect();
 
-    if let Some(warning) = warning {
-        warnings.push(warning);
+    if let Some(ref mut stats) = stats {
+        stats.nodes = count_nodes(&instrs);
     }
 
-    for _ in 0..MAX_OPT_ITERATIONS {
-        if prev == result {
-            return (result, warnings);
-        } else {
-            prev = result.clone();
+    let (result, warning) = optimize_sequence(instrs, &passes, true, &mut stats);
+    (result, warning.into_iter().collect())
+}
+
+/// Optimise a sequence of instructions, either the whole program
+/// (`top_level`) or a loop body, until we reach a fixed point.
+///
+/// Our passes only rewrite the sequence they're given, so we optimise
+/// each loop body once, innermost first, before its parent. Existing
+/// bodies don't change after that. The only bodies we revisit belong
+/// to loops that extract_multiply creates. Many passes remove
+/// instructions, creating new opportunities to combine, so we repeat
+/// until an iteration reports no changes.
+fn optimize_sequence(
+    instrs: Vec<AstNode>,
+    passes: &[&str],
+    top_level: bool,
+    stats: &mut Option<&mut PeepholeStats>,
+) -> (Vec<AstNode>, Option<Warning>) {
+    let mut result: Vec<_> = instrs
+        .into_iter()
+        .map(|instr| match instr {
+            Loop { body, position } => Loop {
+                body: optimize_sequence(body, passes, false, stats).0,
+                position,
+            },
+            other => other,
+        })
+        .collect();
+
+    for _ in 0..=MAX_OPT_ITERATIONS {
+        if let Some(ref mut stats) = *stats {
+            stats.iterations += 1;
+        }
 
-            let (new_result, new_warning) = optimize_once(result, pass_specification);
+        let (new_result, changes) = optimize_once(result, passes, top_level, stats);
+        result = new_result;
 
-            if let Some(warning) = new_warning {
-                warnings.push(warning);
-            }
-            result = new_result;
+        if changes == 0 {
+            return clean_up(result, passes, top_level, stats);
         }
     }
 
@@ -54,85 +145,193 @@ pub fn optimize(
         MAX_OPT_ITERATIONS
     );
 
-    (result, warnings)
+    clean_up(result, passes, top_level, stats)
 }
 
-/// Apply all our peephole optimisations once and return the result.
-fn optimize_once(
+/// Run a single pass, recording its time and effect on program size
+/// in `stats`.
+fn run_pass<T, F>(
+    name: &'static str,
+    pass: F,
     instrs: Vec<AstNode>,
-    pass_specification: &Option<String>,
-) -> (Vec<AstNode>, Option<Warning>) {
-    let pass_specification = pass_specification.clone().unwrap_or_else(|| {
-        "combine_inc,combine_ptr,known_zero,\
-         multiply,zeroing_loop,combine_set,\
-         dead_loop,redundant_set,read_clobber,\
-         pure_removal,offset_sort"
-            .to_owned()
-    });
-    let passes: Vec<_> = pass_specification.split(',').collect();
+    stats: &mut Option<&mut PeepholeStats>,
+) -> (Vec<AstNode>, T)
+where
+    F: FnOnce(Vec<AstNode>) -> (Vec<AstNode>, T),
+{
+    match stats {
+        Some(stats) => {
+            let nodes_before = count_nodes(&instrs);
+            let start = Instant::now();
+            let (result, pass_result) = pass(instrs);
+            stats.record(name, start.elapsed(), nodes_before, count_nodes(&result));
+            (result, pass_result)
+        }
+        None => pass(instrs),
+    }
+}
 
+/// Apply all our peephole optimisations once to a sequence of
+/// instructions, and return the result and the number of changes
+/// made.
+fn optimize_once(
+    instrs: Vec<AstNode>,
+    passes: &[&str],
+    top_level: bool,
+    stats: &mut Option<&mut PeepholeStats>,
+) -> (Vec<AstNode>, usize) {
     let mut instrs = instrs;
+    let mut changes = 0;
 
     if passes.contains(&"combine_inc") {
-        instrs = combine_increments(instrs);
+        let (result, pass_changes) =
+            run_pass("combine_inc", combine_increments_shallow, instrs, stats);
+        instrs = result;
+        changes += pass_changes;
     }
     if passes.contains(&"combine_ptr") {
-        instrs = combine_ptr_increments(instrs);
+        let (result, pass_changes) =
+            run_pass("combine_ptr", combine_ptr_increments_shallow, instrs, stats);
+        instrs = result;
+        changes += pass_changes;
     }
     if passes.contains(&"known_zero") {
-        instrs = annotate_known_zero(instrs);
+        let (result, pass_changes) = run_pass(
+            "known_zero",
+            |instrs| annotate_known_zero_shallow(instrs, top_level),
+            instrs,
+            stats,
+        );
+        instrs = result;
+        changes += pass_changes;
     }
     if passes.contains(&"multiply") {
-        instrs = extract_multiply(instrs);
+        let (mut result, replaced) = run_pass("multiply", extract_multiply_shallow, instrs, stats);
+        // A closed form may be a new loop, whose body we haven't
+        // optimised yet.
+        for &index in &replaced {
+            if let Loop { ref mut body, .. } = result[index] {
+                let new_body = std::mem::take(body);
+                *body = optimize_sequence(new_body, passes, false, stats).0;
+            }
+        }
+        instrs = result;
+        changes += replaced.len();
     }
     if passes.contains(&"zeroing_loop") {
-        instrs = zeroing_loops(instrs);
+        let (result, pass_changes) = run_pass("zeroing_loop", zeroing_loops_shallow, instrs, stats);
+        instrs = result;
+        changes += pass_changes;
+    }
+    if passes.contains(&"scan") {
+        let (result, pass_changes) = run_pass("scan", scan_loops_shallow, instrs, stats);
+        instrs = result;
+        changes += pass_changes;
     }
     if passes.contains(&"combine_set") {
-        instrs = combine_set_and_increments(instrs);
+        let (result, pass_changes) = run_pass(
+            "combine_set",
+            combine_set_and_increments_shallow,
+            instrs,
+            stats,
+        );
+        instrs = result;
+        changes += pass_changes;
     }
     if passes.contains(&"dead_loop") {
-        instrs = remove_dead_loops(instrs);
+        let (result, pass_changes) =
+            run_pass("dead_loop", remove_dead_loops_shallow, instrs, stats);
+        instrs = result;
+        changes += pass_changes;
+    }
+    if passes.contains(&"read_clobber") {
+        let (result, pass_changes) =
+            run_pass("read_clobber", remove_read_clobber_shallow, instrs, stats);
+        instrs = result;
+        changes += pass_changes;
     }
+    if passes.contains(&"offset_sort") {
+        let (result, pass_changes) = run_pass("offset_sort", sort_by_offset_shallow, instrs, stats);
+        instrs = result;
+        changes += pass_changes;
+    }
+
+    (instrs, changes)
+}
+
+/// Remove the instructions that only helped other passes, once a
+/// sequence has reached a fixed point.
+///
+/// remove_redundant_sets takes out the Set 0 instructions that
+/// annotate_known_zero adds, so running both in every iteration would
+/// never settle. Neither this nor remove_pure_code creates work for
+/// the other passes: they only remove instructions that nothing else
+/// in the sequence reads.
+fn clean_up(
+    instrs: Vec<AstNode>,
+    passes: &[&str],
+    top_level: bool,
+    stats: &mut Option<&mut PeepholeStats>,
+) -> (Vec<AstNode>, Option<Warning>) {
+    let mut instrs = instrs;
+
     if passes.contains(&"redundant_set") {
-        instrs = remove_redundant_sets(instrs);
+        let (result, _) = run_pass(
+            "redundant_set",
+            |instrs| remove_redundant_sets_shallow(instrs, top_level),
+            instrs,
+            stats,
+        );
+        instrs = result;
     }
-    if passes.contains(&"read_clobber") {
-        instrs = remove_read_clobber(instrs);
+    if top_level && passes.contains(&"pure_removal") {
+        return run_pass("pure_removal", remove_pure_code, instrs, stats);
     }
-    let warning = if passes.contains(&"pure_removal") {
-        let (removed, pure_warning) = remove_pure_code(instrs);
-        instrs = removed;
-        pure_warning
-    } else {
-        None
-    };
 
-    if passes.contains(&"offset_sort") {
-        instrs = sort_by_offset(instrs);
+    (instrs, None)
+}
+
+/// Counts the rewrites made by a pass.
+#[derive(Default)]
+struct Changes(std::cell::Cell<usize>);
+
+impl Changes {
+    fn record(&self) {
+        self.add(1);
     }
 
-    (instrs, warning)
+    fn add(&self, count: usize) {
+        self.0.set(self.0.get() + count);
+    }
+
+    fn count(&self) -> usize {
+        self.0.get()
+    }
 }
 
-/// Defines a method on iterators to map a function over all loop bodies.
-trait MapLoopsExt: Iterator<Item = AstNode> {
-    fn map_loops<F>(&mut self, f: F) -> Vec<AstNode>
-    where
-        F: Fn(Vec<AstNode>) -> Vec<AstNode>,
-    {
-        self.map(|instr| match instr {
-            Loop { body, position } => Loop {
-                body: f(body),
-                position,
-            },
+/// Run `pass` over every loop body, innermost first, and then over
+/// `instrs` itself. Our passes only rewrite the sequence they're
+/// given, so this is how we apply one to a whole program.
+fn apply_nested<F>(instrs: Vec<AstNode>, pass: &F) -> (Vec<AstNode>, usize)
+where
+    F: Fn(Vec<AstNode>) -> (Vec<AstNode>, usize),
+{
+    let mut changes = 0;
+    let instrs = instrs
+        .into_iter()
+        .map(|instr| match instr {
+            Loop { body, position } => {
+                let (body, body_changes) = apply_nested(body, pass);
+                changes += body_changes;
+                Loop { body, position }
+            }
             other => other,
         })
-        .collect()
-    }
-}
+        .collect();
 
-impl<I> MapLoopsExt for I where I: Iterator<Item = AstNode> {}
+    let (result, sequence_changes) = pass(instrs);
+    (result, changes + sequence_changes)
+}
 
 /// Given an index into a vector of instructions, find the index of
 /// the previous instruction that modified the current cell. If we're
@@ -158,7 +357,7 @@ pub fn previous_cell_change(instrs: &[AstNode], index: usize) -> Option<usize> {
             }
             MultiplyMove { ref changes, .. } => {
                 // These cells are written to.
-                let mut offsets: Vec<isize> = changes.keys().cloned().collect();
+                let mut offsets: Vec<isize> = changes.iter().map(|&(offset, _)| offset).collect();
                 // This cell is zeroed.
                 offsets.push(0);
 
@@ -168,9 +367,10 @@ pub fn previous_cell_change(instrs: &[AstNode], index: usize) -> Option<usize> {
             }
             // No cells changed, so just keep working backwards.
             Write { .. } => {}
-            // These instructions may have modified the cell, so
-            // we return None for "I don't know".
-            Read { .. } | Loop { .. } => return None,
+            // These instructions may have modified the cell (or
+            // moved the pointer by an unknown amount), so we return
+            // None for "I don't know".
+            Read { .. } | Loop { .. } | Scan { .. } => return None,
         }
     }
     None
@@ -201,7 +401,7 @@ pub fn next_cell_change(instrs: &[AstNode], index: usize) -> Option<usize> {
             }
             MultiplyMove { ref changes, .. } => {
                 // These cells are written to.
-                let mut offsets: Vec<isize> = changes.keys().cloned().collect();
+                let mut offsets: Vec<isize> = changes.iter().map(|&(offset, _)| offset).collect();
                 // This cell is zeroed.
                 offsets.push(0);
 
@@ -211,9 +411,10 @@ pub fn next_cell_change(instrs: &[AstNode], index: usize) -> Option<usize> {
             }
             // No cells changed, so just keep working backwards.
             Write { .. } => {}
-            // These instructions may have modified the cell, so
-            // we return None for "I don't know".
-            Read { .. } | Loop { .. } => return None,
+            // These instructions may have modified the cell (or
+            // moved the pointer by an unknown amount), so we return
+            // None for "I don't know".
+            Read { .. } | Loop { .. } | Scan { .. } => return None,
         }
     }
     None
@@ -221,8 +422,16 @@ pub fn next_cell_change(instrs: &[AstNode], index: usize) -> Option<usize> {
 
 /// Combine consecutive increments into a single increment
 /// instruction.
-pub fn combine_increments(instrs: Vec<AstNode>) -> Vec<AstNode> {
-    instrs
+///
+/// Like all our passes, this returns the new instructions and the
+/// number of changes made.
+pub fn combine_increments(instrs: Vec<AstNode>) -> (Vec<AstNode>, usize) {
+    apply_nested(instrs, &combine_increments_shallow)
+}
+
+fn combine_increments_shallow(instrs: Vec<AstNode>) -> (Vec<AstNode>, usize) {
+    let changes = Changes::default();
+    let result = instrs
         .into_iter()
         .coalesce(|prev_instr, instr| {
             // Collapse consecutive increments.
@@ -239,6 +448,7 @@ pub fn combine_increments(instrs: Vec<AstNode>) -> Vec<AstNode> {
                 } = instr
                 {
                     if prev_offset == offset {
+                        changes.record();
                         return Ok(Increment {
                             amount: amount + prev_amount,
                             offset,
@@ -256,15 +466,22 @@ pub fn combine_increments(instrs: Vec<AstNode>) -> Vec<AstNode> {
                 ..
             } = *instr
             {
+                changes.record();
                 return false;
             }
             true
         })
-        .map_loops(combine_increments)
+        .collect();
+    (result, changes.count())
+}
+
+pub fn combine_ptr_increments(instrs: Vec<AstNode>) -> (Vec<AstNode>, usize) {
+    apply_nested(instrs, &combine_ptr_increments_shallow)
 }
 
-pub fn combine_ptr_increments(instrs: Vec<AstNode>) -> Vec<AstNode> {
-    instrs
+fn combine_ptr_increments_shallow(instrs: Vec<AstNode>) -> (Vec<AstNode>, usize) {
+    let changes = Changes::default();
+    let result = instrs
         .into_iter()
         .coalesce(|prev_instr, instr| {
             // Collapse consecutive increments.
@@ -274,6 +491,7 @@ pub fn combine_ptr_increments(instrs: Vec<AstNode>) -> Vec<AstNode> {
             } = prev_instr
             {
                 if let PointerIncrement { amount, position } = instr {
+                    changes.record();
                     return Ok(PointerIncrement {
                         amount: amount + prev_amount,
                         position: prev_pos.combine(position),
@@ -285,17 +503,23 @@ pub fn combine_ptr_increments(instrs: Vec<AstNode>) -> Vec<AstNode> {
         .filter(|instr| {
             // Remove any pointer increments of 0.
             if let PointerIncrement { amount: 0, .. } = *instr {
+                changes.record();
                 return false;
             }
             true
         })
-        .map_loops(combine_ptr_increments)
+        .collect();
+    (result, changes.count())
 }
 
 /// Don't bother updating cells if they're immediately overwritten
 /// by a value from stdin.
 // TODO: this should generate a warning too.
-pub fn remove_read_clobber(instrs: Vec<AstNode>) -> Vec<AstNode> {
+pub fn remove_read_clobber(instrs: Vec<AstNode>) -> (Vec<AstNode>, usize) {
+    apply_nested(instrs, &remove_read_clobber_shallow)
+}
+
+fn remove_read_clobber_shallow(instrs: Vec<AstNode>) -> (Vec<AstNode>, usize) {
     let mut redundant_instr_positions = HashSet::new();
     let mut last_write_index = None;
 
@@ -328,17 +552,26 @@ pub fn remove_read_clobber(instrs: Vec<AstNode>) -> Vec<AstNode> {
         }
     }
 
-    instrs
+    let changes = Changes::default();
+    changes.add(redundant_instr_positions.len());
+
+    let result = instrs
         .into_iter()
         .enumerate()
         .filter(|&(index, _)| !redundant_instr_positions.contains(&index))
         .map(|(_, instr)| instr)
-        .map_loops(remove_read_clobber)
+        .collect();
+    (result, changes.count())
 }
 
 /// Convert [-] to Set 0.
-pub fn zeroing_loops(instrs: Vec<AstNode>) -> Vec<AstNode> {
-    instrs
+pub fn zeroing_loops(instrs: Vec<AstNode>) -> (Vec<AstNode>, usize) {
+    apply_nested(instrs, &zeroing_loops_shallow)
+}
+
+fn zeroing_loops_shallow(instrs: Vec<AstNode>) -> (Vec<AstNode>, usize) {
+    let changes = Changes::default();
+    let result = instrs
         .into_iter()
         .map(|instr| {
             if let Loop { ref body, position } = instr {
@@ -350,6 +583,7 @@ pub fn zeroing_loops(instrs: Vec<AstNode>) -> Vec<AstNode> {
                         ..
                     } = body[0]
                     {
+                        changes.record();
                         return Set {
                             amount: Wrapping(0),
                             offset: 0,
@@ -360,42 +594,81 @@ pub fn zeroing_loops(instrs: Vec<AstNode>) -> Vec<AstNode> {
             }
             instr
         })
-        .map_loops(zeroing_loops)
+        .collect();
+    (result, changes.count())
 }
 
-/// Remove any loops where we know the current cell is zero.
-pub fn remove_dead_loops(instrs: Vec<AstNode>) -> Vec<AstNode> {
-    instrs
-        .clone()
+/// Convert loops that only move the pointer, such as [>] or [<<],
+/// to Scan.
+pub fn scan_loops(instrs: Vec<AstNode>) -> (Vec<AstNode>, usize) {
+    apply_nested(instrs, &scan_loops_shallow)
+}
+
+fn scan_loops_shallow(instrs: Vec<AstNode>) -> (Vec<AstNode>, usize) {
+    let changes = Changes::default();
+    let result = instrs
         .into_iter()
-        .enumerate()
-        .filter(|&(index, ref instr)| {
-            match *instr {
-                Loop { .. } => {}
-                // Keep all instructions that aren't loops.
-                _ => {
-                    return true;
+        .map(|instr| {
+            if let Loop { ref body, position } = instr {
+                if body.len() == 1 {
+                    if let PointerIncrement { amount, .. } = body[0] {
+                        if amount != 0 {
+                            changes.record();
+                            return Scan {
+                                stride: amount,
+                                position,
+                            };
+                        }
+                    }
                 }
             }
+            instr
+        })
+        .collect();
+    (result, changes.count())
+}
 
-            // Find the previous change instruction:
-            if let Some(prev_change_index) = previous_cell_change(&instrs, index) {
-                let prev_instr = &instrs[prev_change_index];
-                // If the previous instruction set to zero, our loop is dead.
-                // TODO: MultiplyMove also zeroes the current cell.
-                if let Set {
-                    amount: Wrapping(0),
-                    offset: 0,
-                    ..
-                } = *prev_instr
-                {
-                    return false;
-                }
+/// Remove any loops where we know the current cell is zero.
+pub fn remove_dead_loops(instrs: Vec<AstNode>) -> (Vec<AstNode>, usize) {
+    apply_nested(instrs, &remove_dead_loops_shallow)
+}
+
+fn remove_dead_loops_shallow(instrs: Vec<AstNode>) -> (Vec<AstNode>, usize) {
+    let mut dead_loop_positions = HashSet::new();
+
+    for (index, instr) in instrs.iter().enumerate() {
+        match *instr {
+            Loop { .. } | Scan { .. } => {}
+            // Keep all instructions that aren't loops.
+            _ => continue,
+        }
+
+        // Find the previous change instruction:
+        if let Some(prev_change_index) = previous_cell_change(&instrs, index) {
+            let prev_instr = &instrs[prev_change_index];
+            // If the previous instruction set to zero, our loop is dead.
+            // TODO: MultiplyMove also zeroes the current cell.
+            if let Set {
+                amount: Wrapping(0),
+                offset: 0,
+                ..
+            } = *prev_instr
+            {
+                dead_loop_positions.insert(index);
             }
-            true
-        })
+        }
+    }
+
+    let changes = Changes::default();
+    changes.add(dead_loop_positions.len());
+
+    let result = instrs
+        .into_iter()
+        .enumerate()
+        .filter(|&(index, _)| !dead_loop_positions.contains(&index))
         .map(|(_, instr)| instr)
-        .map_loops(remove_dead_loops)
+        .collect();
+    (result, changes.count())
 }
 
 /// Reorder flat sequences of instructions so we use offsets and only
@@ -405,9 +678,14 @@ pub fn remove_dead_loops(instrs: Vec<AstNode>) -> Vec<AstNode> {
 /// Increment { amount: 1, offset: 1 }
 /// Increment { amount: 2, offset: 2 }
 /// PointerIncrement(1)
-pub fn sort_by_offset(instrs: Vec<AstNode>) -> Vec<AstNode> {
+pub fn sort_by_offset(instrs: Vec<AstNode>) -> (Vec<AstNode>, usize) {
+    apply_nested(instrs, &sort_by_offset_shallow)
+}
+
+fn sort_by_offset_shallow(instrs: Vec<AstNode>) -> (Vec<AstNode>, usize) {
     let mut sequence = vec![];
     let mut result = vec![];
+    let mut changes = 0;
 
     for instr in instrs {
         match instr {
@@ -416,26 +694,60 @@ pub fn sort_by_offset(instrs: Vec<AstNode>) -> Vec<AstNode> {
             }
             _ => {
                 if !sequence.is_empty() {
-                    result.extend(sort_sequence_by_offset(sequence));
+                    changes += extend_sorted_sequence(&mut result, sequence);
                     sequence = vec![];
                 }
-                if let Loop { body, position } = instr {
-                    result.push(Loop {
-                        body: sort_by_offset(body),
-                        position,
-                    });
-                } else {
-                    result.push(instr);
-                }
+                result.push(instr);
             }
         }
     }
 
     if !sequence.is_empty() {
+        changes += extend_sorted_sequence(&mut result, sequence);
+    }
+
+    (result, changes)
+}
+
+/// Append `sequence` to `result`, sorting it by offset if it isn't
+/// already. Return the number of changes made.
+fn extend_sorted_sequence(result: &mut Vec<AstNode>, sequence: Vec<AstNode>) -> usize {
+    if is_sorted_by_offset(&sequence) {
+        result.extend(sequence);
+        0
+    } else {
         result.extend(sort_sequence_by_offset(sequence));
+        1
     }
+}
 
-    result
+/// Is this sequence of Increment/Set/PointerIncrement instructions
+/// already in the form that `sort_sequence_by_offset` returns?
+fn is_sorted_by_offset(instrs: &[AstNode]) -> bool {
+    let offset_instrs = match instrs.split_last() {
+        Some((&PointerIncrement { amount, .. }, rest)) => {
+            if amount == 0 {
+                return false;
+            }
+            rest
+        }
+        _ => instrs,
+    };
+
+    let mut prev_offset = None;
+    for instr in offset_instrs {
+        let offset = match *instr {
+            Increment { offset, .. } | Set { offset, .. } => offset,
+            _ => return false,
+        };
+        if let Some(prev_offset) = prev_offset {
+            if offset < prev_offset {
+                return false;
+            }
+        }
+        prev_offset = Some(offset);
+    }
+    true
 }
 
 /// Given a `HashMap` with orderable keys, return the values according to
@@ -515,11 +827,17 @@ fn sort_sequence_by_offset(instrs: Vec<AstNode>) -> Vec<AstNode> {
 
 /// Combine set instructions with other set instructions or
 /// increments.
-pub fn combine_set_and_increments(instrs: Vec<AstNode>) -> Vec<AstNode> {
+pub fn combine_set_and_increments(instrs: Vec<AstNode>) -> (Vec<AstNode>, usize) {
+    apply_nested(instrs, &combine_set_and_increments_shallow)
+}
+
+fn combine_set_and_increments_shallow(instrs: Vec<AstNode>) -> (Vec<AstNode>, usize) {
+    let changes = Changes::default();
+
     // It's sufficient to consider immediately adjacent instructions
     // as sort_sequence_by_offset ensures that if the offset is the
     // same, the instruction is adjacent.
-    instrs
+    let result = instrs
         .into_iter()
         .coalesce(|prev_instr, instr| {
             // TODO: Set, Write, Increment -> Set, Write, Set
@@ -538,6 +856,7 @@ pub fn combine_set_and_increments(instrs: Vec<AstNode>) -> Vec<AstNode> {
             ) = (&prev_instr, &instr)
             {
                 if inc_offset == set_offset {
+                    changes.record();
                     return Ok(Set {
                         amount: set_amount,
                         offset: set_offset,
@@ -564,6 +883,7 @@ pub fn combine_set_and_increments(instrs: Vec<AstNode>) -> Vec<AstNode> {
                 } = instr
                 {
                     if inc_offset == set_offset {
+                        changes.record();
                         return Ok(Set {
                             amount: set_amount + inc_amount,
                             offset: set_offset,
@@ -590,6 +910,7 @@ pub fn combine_set_and_increments(instrs: Vec<AstNode>) -> Vec<AstNode> {
             ) = (&prev_instr, &instr)
             {
                 if offset1 == offset2 {
+                    changes.record();
                     return Ok(Set {
                         amount,
                         offset: offset1,
@@ -601,34 +922,60 @@ pub fn combine_set_and_increments(instrs: Vec<AstNode>) -> Vec<AstNode> {
             }
             Err((prev_instr, instr))
         })
-        .map_loops(combine_set_and_increments)
+        .collect();
+    (result, changes.count())
 }
 
-pub fn remove_redundant_sets(instrs: Vec<AstNode>) -> Vec<AstNode> {
-    let mut reduced = remove_redundant_sets_inner(instrs);
-
-    // Remove a set zero at the beginning of the program, since cells
-    // are initialised to zero anyway.
-    if let Some(&Set {
-        amount: Wrapping(0),
-        offset: 0,
-        ..
-    }) = reduced.first()
-    {
-        reduced.remove(0);
-    }
+/// Remove Set 0 instructions where the cell is already zero. Returns
+/// the number of instructions removed.
+pub fn remove_redundant_sets(instrs: Vec<AstNode>) -> (Vec<AstNode>, usize) {
+    let mut changes = 0;
+    let instrs = instrs
+        .into_iter()
+        .map(|instr| match instr {
+            Loop { body, position } => {
+                let (body, body_changes) =
+                    apply_nested(body, &|body| remove_redundant_sets_shallow(body, false));
+                changes += body_changes;
+                Loop { body, position }
+            }
+            other => other,
+        })
+        .collect();
 
-    reduced
+    let (result, sequence_changes) = remove_redundant_sets_shallow(instrs, true);
+    (result, changes + sequence_changes)
 }
 
-fn remove_redundant_sets_inner(instrs: Vec<AstNode>) -> Vec<AstNode> {
+fn remove_redundant_sets_shallow(instrs: Vec<AstNode>, top_level: bool) -> (Vec<AstNode>, usize) {
     let mut redundant_instr_positions = HashSet::new();
 
+    // Remove a set zero at the beginning of the program, since cells
+    // are initialised to zero anyway.
+    if top_level {
+        if let Some(&Set {
+            amount: Wrapping(0),
+            offset: 0,
+            ..
+        }) = instrs.first()
+        {
+            redundant_instr_positions.insert(0);
+        }
+    }
+
     for (index, instr) in instrs.iter().enumerate() {
         match *instr {
-            Loop { .. } | MultiplyMove { .. } => {
-                // There's no point setting to zero after a loop, as
-                // the cell is already zero.
+            // There's no point setting to zero after a loop, as the
+            // cell is already zero. The same goes for a second Set 0,
+            // such as the one we annotated after a dead loop.
+            Loop { .. }
+            | MultiplyMove { .. }
+            | Scan { .. }
+            | Set {
+                amount: Wrapping(0),
+                offset: 0,
+                ..
+            } => {
                 if let Some(next_index) = next_cell_change(&instrs, index) {
                     if let Set {
                         amount: Wrapping(0),
@@ -644,77 +991,124 @@ fn remove_redundant_sets_inner(instrs: Vec<AstNode>) -> Vec<AstNode> {
         }
     }
 
-    instrs
+    let changes = redundant_instr_positions.len();
+
+    let result = instrs
         .into_iter()
         .enumerate()
         .filter(|&(index, _)| !redundant_instr_positions.contains(&index))
         .map(|(_, instr)| instr)
-        .map_loops(remove_redundant_sets_inner)
+        .collect();
+    (result, changes)
 }
 
-pub fn annotate_known_zero(instrs: Vec<AstNode>) -> Vec<AstNode> {
-    let mut result = vec![];
-
-    let position = if instrs.is_empty() {
-        None
-    } else {
-        get_position(&instrs[0]).map(|first_instr_pos| Position {
-            start: first_instr_pos.start,
-            end: first_instr_pos.start,
+/// Add Set 0 instructions where we know the current cell is
+/// zero. Returns the number of instructions added.
+pub fn annotate_known_zero(instrs: Vec<AstNode>) -> (Vec<AstNode>, usize) {
+    let mut changes = 0;
+    let instrs = instrs
+        .into_iter()
+        .map(|instr| match instr {
+            Loop { body, position } => {
+                let (body, body_changes) =
+                    apply_nested(body, &|body| annotate_known_zero_shallow(body, false));
+                changes += body_changes;
+                Loop { body, position }
+            }
+            other => other,
         })
-    };
-
-    // Cells in BF are initialised to zero, so we know the current
-    // cell is zero at the start of execution.
-    let set_instr = Set {
-        amount: Wrapping(0),
-        offset: 0,
-        position,
-    };
-    // Insert the set instruction unless there is one already present.
-    if instrs.first() != Some(&set_instr) {
-        result.push(set_instr);
-    }
+        .collect();
 
-    result.extend(annotate_known_zero_inner(instrs));
-    result
+    let (result, sequence_changes) = annotate_known_zero_shallow(instrs, true);
+    (result, changes + sequence_changes)
 }
 
-fn annotate_known_zero_inner(instrs: Vec<AstNode>) -> Vec<AstNode> {
+fn annotate_known_zero_shallow(instrs: Vec<AstNode>, top_level: bool) -> (Vec<AstNode>, usize) {
     let mut result = vec![];
+    let mut changes = 0;
 
-    for (i, instr) in instrs.iter().enumerate() {
-        let instr = instr.clone();
+    // Cells in BF are initialised to zero, so we know the current
+    // cell is zero at the start of execution.
+    if top_level && !cell_overwritten(&instrs) {
+        let position = instrs
+            .first()
+            .and_then(get_position)
+            .map(|first_instr_pos| Position {
+                start: first_instr_pos.start,
+                end: first_instr_pos.start,
+            });
+        result.push(Set {
+            amount: Wrapping(0),
+            offset: 0,
+            position,
+        });
+        changes += 1;
+    }
 
-        match instr {
-            // After a loop, we know the cell is currently zero.
-            Loop { body, position } => {
-                result.push(Loop {
-                    body: annotate_known_zero_inner(body),
-                    position,
-                });
-                // Treat this set as positioned at the ].
-                let set_pos = position.map(|loop_pos| Position {
-                    start: loop_pos.end,
-                    end: loop_pos.end,
-                });
+    // After a loop, we know the cell is currently zero.
+    let mut known_zero_positions = HashSet::new();
+    for (index, instr) in instrs.iter().enumerate() {
+        if let Loop { .. } | Scan { .. } = *instr {
+            if !cell_overwritten(&instrs[index + 1..]) {
+                known_zero_positions.insert(index);
+            }
+        }
+    }
+    changes += known_zero_positions.len();
+
+    for (index, instr) in instrs.into_iter().enumerate() {
+        let loop_position = get_position(&instr);
+        result.push(instr);
+
+        if known_zero_positions.contains(&index) {
+            // Treat this set as positioned at the ].
+            let set_pos = loop_position.map(|loop_pos| Position {
+                start: loop_pos.end,
+                end: loop_pos.end,
+            });
+            result.push(Set {
+                amount: Wrapping(0),
+                offset: 0,
+                position: set_pos,
+            });
+        }
+    }
 
-                let set_instr = Set {
-                    amount: Wrapping(0),
-                    offset: 0,
-                    position: set_pos,
-                };
-                if instrs.get(i + 1) != Some(&set_instr) {
-                    result.push(set_instr.clone());
-                }
+    (result, changes)
+}
+
+/// Is the current cell overwritten by `instrs` before anything uses
+/// its value?
+///
+/// There's no point annotating a known zero before such instructions,
+/// as combine_set_and_increments or remove_read_clobber would just
+/// remove the annotation again. This follows the same instructions as
+/// `previous_cell_change`, so our annotations are stable.
+pub fn cell_overwritten(instrs: &[AstNode]) -> bool {
+    let mut needed_offset = 0;
+    for instr in instrs {
+        match *instr {
+            Set { offset, .. } if offset == needed_offset => return true,
+            Read { .. } if needed_offset == 0 => return true,
+            Increment { offset, .. } if offset == needed_offset => return false,
+            Increment { .. } | Set { .. } => {}
+            PointerIncrement { amount, .. } => {
+                needed_offset -= amount;
             }
-            _ => {
-                result.push(instr);
+            MultiplyMove { ref changes, .. } => {
+                // A multiply reads and zeroes its own cell, and
+                // writes to the cells in changes.
+                if needed_offset == 0 || changes.iter().any(|&(offset, _)| offset == needed_offset)
+                {
+                    return false;
+                }
             }
+            // remove_read_clobber doesn't look past writes, nor past
+            // reads of other cells.
+            Read { .. } | Write { .. } | Loop { .. } | Scan { .. } => return false,
         }
     }
-
-    result
+    false
 }
 
 /// Remove code at the end of the program that has no side
@@ -726,7 +1120,8 @@ pub fn remove_pure_code(mut instrs: Vec<AstNode>) -> (Vec<AstNode>, Option<Warni
         let last_instr = instrs.pop().unwrap();
 
         match last_instr {
-            Read { .. } | Write { .. } | Loop { .. } => {
+            // A scan can run off the tape, so it isn't pure.
+            Read { .. } | Write { .. } | Loop { .. } | Scan { .. } => {
                 instrs.push(last_instr);
                 break;
             }
@@ -754,85 +1149,197 @@ pub fn remove_pure_code(mut instrs: Vec<AstNode>) -> (Vec<AstNode>, Option<Warni
     (instrs, warning)
 }
 
-/// Does this loop body represent a multiplication operation?
-/// E.g. "[->>>++<<<]" sets cell #3 to 2*cell #0.
-fn is_multiply_loop_body(body: &[AstNode]) -> bool {
-    // A multiply loop may only contain increments and pointer increments.
-    for body_instr in body {
-        match *body_instr {
-            Increment { .. } | PointerIncrement { .. } => {}
-            _ => return false,
-        }
-    }
+/// The combined effect of one iteration of a loop body, relative to
+/// the cell the loop tests.
+#[derive(Debug, Default)]
+struct LoopBodyEffect {
+    /// How much each cell changes by, ignoring any increments before
+    /// a `Set` of the same cell.
+    increments: HashMap<isize, Cell>,
+    /// The value that each cell is set to, followed by any increments
+    /// after the `Set`.
+    sets: HashMap<isize, Cell>,
+    /// The cell of each `MultiplyMove` in the body, and its changes.
+    multiplies: Vec<(isize, Vec<(isize, Cell)>)>,
+}
 
-    // A multiply loop must have a net pointer movement of
-    // zero.
-    let mut net_movement = 0;
-    for body_instr in body {
-        if let PointerIncrement { amount, .. } = *body_instr {
-            net_movement += amount;
+/// Return the effect of a loop body containing only increments,
+/// sets, pointer increments and multiplies, with no net pointer
+/// movement.
+fn loop_body_effect(body: &[AstNode]) -> Option<LoopBodyEffect> {
+    let mut effect = LoopBodyEffect::default();
+    let mut cell_index: isize = 0;
+
+    for instr in body {
+        match *instr {
+            Increment { amount, offset, .. } => {
+                let target = cell_index + offset;
+                if let Some(set_amount) = effect.sets.get_mut(&target) {
+                    *set_amount += amount;
+                } else {
+                    *effect.increments.entry(target).or_insert(Wrapping(0)) += amount;
+                }
+            }
+            Set { amount, offset, .. } => {
+                let target = cell_index + offset;
+                effect.increments.remove(&target);
+                effect.sets.insert(target, amount);
+            }
+            PointerIncrement { amount, .. } => {
+                cell_index += amount;
+            }
+            MultiplyMove { ref changes, .. } => {
+                effect.multiplies.push((cell_index, changes.clone()));
+            }
+            _ => return None,
         }
     }
-    if net_movement != 0 {
-        return false;
-    }
 
-    let changes = cell_changes(body);
-    // A multiply loop must decrement cell #0.
-    if let Some(&Wrapping(-1)) = changes.get(&0) {
+    if cell_index == 0 {
+        Some(effect)
     } else {
-        return false;
+        None
     }
+}
 
-    changes.len() >= 2
+/// The multiplicative inverse of an odd `value`, modulo 2^32. This is
+/// also the inverse modulo every narrower cell width.
+fn mod_inverse(value: Cell) -> Cell {
+    // Newton's method: each iteration doubles the number of correct
+    // low bits, and `value` is its own inverse modulo 8.
+    let mut inverse = value;
+    for _ in 0..4 {
+        inverse *= Wrapping(2) - value * inverse;
+    }
+    inverse
 }
 
-/// Return a hashmap of all the cells that are affected by this
-/// sequence of instructions, and how much they change.
-/// E.g. "->>+++>+" -> {0: -1, 2: 3, 3: 1}
-fn cell_changes(instrs: &[AstNode]) -> HashMap<isize, Cell> {
-    let mut changes = HashMap::new();
-    let mut cell_index: isize = 0;
+/// If this loop can be evaluated without iterating, return the
+/// equivalent instructions.
+///
+/// If the loop adds an odd `step` to cell #0 each iteration, it runs
+/// exactly `n = cell #0 * -(1 / step)` times, wrapping at the cell
+/// width. Every other increment in the body then adds `n * amount`,
+/// so that's a `MultiplyMove` with scaled factors, e.g. "[->>>++<<<]"
+/// sets cell #3 to 2*cell #0.
+///
+/// We also handle bodies containing `Set`s (which give the same result
+/// however many times the loop runs) and `MultiplyMove`s from cells
+/// that nothing else in the body touches (which only have an effect on
+/// the first iteration), e.g. "[>[->+<]<-]". The loop is then replaced
+/// with a loop that performs the whole effect once, and zeroes cell #0
+/// so it exits.
+fn closed_form_loop(body: &[AstNode], position: Option<Position>) -> Option<AstNode> {
+    let effect = loop_body_effect(body)?;
+
+    // Cell #0 must change by an odd amount, otherwise the loop may
+    // never reach zero.
+    let step = *effect.increments.get(&0)?;
+    if step.0 % 2 == 0 || effect.sets.contains_key(&0) {
+        return None;
+    }
 
-    for instr in instrs {
-        match *instr {
-            Increment { amount, offset, .. } => {
-                let current_amount = *changes.get(&(cell_index + offset)).unwrap_or(&Wrapping(0));
-                changes.insert(cell_index, current_amount + amount);
-            }
-            PointerIncrement { amount, .. } => {
-                cell_index += amount;
+    // A multiply is only idempotent if its cell isn't changed by
+    // anything else in the body, and its targets aren't set or used
+    // as another multiply's cell.
+    let multiply_cells: HashSet<isize> = effect.multiplies.iter().map(|&(cell, _)| cell).collect();
+    if multiply_cells.len() != effect.multiplies.len() {
+        return None;
+    }
+    for &(cell, ref changes) in &effect.multiplies {
+        if cell == 0 || effect.increments.contains_key(&cell) || effect.sets.contains_key(&cell) {
+            return None;
+        }
+        for &(offset, _) in changes {
+            let target = cell + offset;
+            if target == 0 || effect.sets.contains_key(&target) || multiply_cells.contains(&target)
+            {
+                return None;
             }
-            // We assume this is only called from is_multiply_loop.
-            _ => unreachable!(),
         }
     }
 
-    changes
+    let iterations_per_unit = -mod_inverse(step);
+    let mut changes: Vec<_> = effect
+        .increments
+        .iter()
+        .filter(|&(&offset, _)| offset != 0)
+        .map(|(&offset, &amount)| (offset, amount * iterations_per_unit))
+        .collect();
+    changes.sort_by_key(|&(offset, _)| offset);
+
+    if effect.multiplies.is_empty() && effect.sets.is_empty() {
+        // A multiply loop must change at least one other cell, or
+        // it's a zeroing loop.
+        if changes.is_empty() {
+            return None;
+        }
+        return Some(MultiplyMove { changes, position });
+    }
+
+    let mut once_body = vec![];
+    for (cell, changes) in effect.multiplies {
+        once_body.push(PointerIncrement {
+            amount: cell,
+            position,
+        });
+        once_body.push(MultiplyMove { changes, position });
+        once_body.push(PointerIncrement {
+            amount: -cell,
+            position,
+        });
+    }
+    if changes.is_empty() {
+        once_body.push(Set {
+            amount: Wrapping(0),
+            offset: 0,
+            position,
+        });
+    } else {
+        once_body.push(MultiplyMove { changes, position });
+    }
+    let mut sets: Vec<_> = effect.sets.into_iter().collect();
+    sets.sort_by_key(|&(offset, _)| offset);
+    for (offset, amount) in sets {
+        once_body.push(Set {
+            amount,
+            offset,
+            position,
+        });
+    }
+
+    Some(Loop {
+        body: once_body,
+        position,
+    })
 }
 
-pub fn extract_multiply(instrs: Vec<AstNode>) -> Vec<AstNode> {
-    instrs
+pub fn extract_multiply(instrs: Vec<AstNode>) -> (Vec<AstNode>, usize) {
+    // Extract inner loops first, so we can evaluate nested multiply
+    // loops in a single pass.
+    apply_nested(instrs, &|instrs| {
+        let (result, replaced) = extract_multiply_shallow(instrs);
+        (result, replaced.len())
+    })
+}
+
+/// Replace loops that have a closed form. Returns the indexes of the
+/// loops we replaced.
+fn extract_multiply_shallow(instrs: Vec<AstNode>) -> (Vec<AstNode>, Vec<usize>) {
+    let mut replaced = vec![];
+    let result = instrs
         .into_iter()
-        .map(|instr| {
-            match instr {
-                Loop { body, position } => {
-                    if is_multiply_loop_body(&body) {
-                        let mut changes = cell_changes(&body);
-                        // MultiplyMove is for where we move to, so ignore
-                        // the cell we're moving from.
-                        changes.remove(&0);
-
-                        MultiplyMove { changes, position }
-                    } else {
-                        Loop {
-                            body: extract_multiply(body),
-                            position,
-                        }
-                    }
+        .enumerate()
+        .map(|(index, instr)| match instr {
+            Loop { body, position } => match closed_form_loop(&body, position) {
+                Some(closed_form) => {
+                    replaced.push(index);
+                    closed_form
                 }
-                i => i,
-            }
+                None => Loop { body, position },
+            },
+            i => i,
         })
-        .collect()
+        .collect();
+    (result, replaced)
 }
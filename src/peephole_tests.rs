@@ -1,4 +1,3 @@
-use std::collections::HashMap;
 use std::num::Wrapping;
 
 use pretty_assertions::assert_eq;
@@ -21,7 +20,7 @@ impl Arbitrary for AstNode {
 // We define a separate function so we can recurse on max_depth.
 // See https://github.com/BurntSushi/quickcheck/issues/23
 fn arbitrary_instr<G: Gen>(g: &mut G, max_depth: usize) -> AstNode {
-    let modulus = if max_depth == 0 { 8 } else { 9 };
+    let modulus = if max_depth == 0 { 9 } else { 10 };
 
     // If max_depth is zero, don't create loops.
     match g.next_u32() % modulus {
@@ -48,17 +47,14 @@ fn arbitrary_instr<G: Gen>(g: &mut G, max_depth: usize) -> AstNode {
             position: Some(Position { start: 0, end: 0 }),
         },
         5 => {
-            let mut changes = HashMap::new();
-            changes.insert(1, Wrapping(-1));
+            let changes = vec![(1, Wrapping(-1))];
             MultiplyMove {
                 changes,
                 position: Some(Position { start: 0, end: 0 }),
             }
         }
         6 => {
-            let mut changes = HashMap::new();
-            changes.insert(1, Wrapping(2));
-            changes.insert(4, Wrapping(10));
+            let changes = vec![(1, Wrapping(2)), (4, Wrapping(10))];
             MultiplyMove {
                 changes,
                 position: Some(Position { start: 0, end: 0 }),
@@ -93,7 +89,11 @@ fn arbitrary_instr<G: Gen>(g: &mut G, max_depth: usize) -> AstNode {
                 position: None,
             }
         }
-        8 => {
+        8 => Scan {
+            stride: if g.next_u32() % 2 == 0 { 1 } else { -2 },
+            position: Some(Position { start: 0, end: 0 }),
+        },
+        9 => {
             assert!(max_depth > 0);
             let loop_length = g.next_u32() % 10;
             let mut body: Vec<_> = vec![];
@@ -111,25 +111,76 @@ fn arbitrary_instr<G: Gen>(g: &mut G, max_depth: usize) -> AstNode {
 
 #[test]
 fn combine_increments_flat() {
-    let initial = parse("++").unwrap();
+    let initial = vec![
+        Increment {
+            amount: Wrapping(1),
+            offset: 0,
+            position: Some(Position { start: 0, end: 0 }),
+        },
+        Increment {
+            amount: Wrapping(1),
+            offset: 0,
+            position: Some(Position { start: 1, end: 1 }),
+        },
+    ];
     let expected = vec![Increment {
         amount: Wrapping(2),
         offset: 0,
         position: Some(Position { start: 0, end: 1 }),
     }];
-    assert_eq!(combine_increments(initial), expected);
+    assert_eq!(combine_increments(initial).0, expected);
+}
+
+#[test]
+fn combine_increments_reports_changes() {
+    // The parser already merges adjacent increments, so separate
+    // them with comments.
+    let initial = parse("+ +>[- -]").unwrap();
+    let (combined, changes) = combine_increments(initial);
+    assert_eq!(changes, 2);
+
+    // Running the pass again has nothing left to combine.
+    assert_eq!(combine_increments(combined).1, 0);
+}
+
+#[test]
+fn optimize_with_stats_records_passes() {
+    let instrs = parse("+ +").unwrap();
+    let mut stats = PeepholeStats::default();
+    optimize_with_stats(instrs, &Some("combine_inc".to_owned()), Some(&mut stats));
+
+    // The second iteration finds nothing left to do.
+    assert_eq!(stats.iterations, 2);
+    assert_eq!(stats.passes.len(), 1);
+    assert_eq!(stats.passes[0].name, "combine_inc");
+    assert_eq!(stats.passes[0].nodes_before, 2);
+    assert_eq!(stats.passes[0].nodes_after, 1);
 }
 
 #[test]
 fn combine_increments_unrelated() {
     let initial = parse("+>+.").unwrap();
     let expected = initial.clone();
-    assert_eq!(combine_increments(initial), expected);
+    assert_eq!(combine_increments(initial).0, expected);
 }
 
 #[test]
 fn combine_increments_nested() {
-    let initial = parse("[++]").unwrap();
+    let initial = vec![Loop {
+        body: vec![
+            Increment {
+                amount: Wrapping(1),
+                offset: 0,
+                position: Some(Position { start: 1, end: 1 }),
+            },
+            Increment {
+                amount: Wrapping(1),
+                offset: 0,
+                position: Some(Position { start: 2, end: 2 }),
+            },
+        ],
+        position: Some(Position { start: 0, end: 3 }),
+    }];
     let expected = vec![Loop {
         body: vec![Increment {
             amount: Wrapping(2),
@@ -138,13 +189,13 @@ fn combine_increments_nested() {
         }],
         position: Some(Position { start: 0, end: 3 }),
     }];
-    assert_eq!(combine_increments(initial), expected);
+    assert_eq!(combine_increments(initial).0, expected);
 }
 
 #[test]
 fn combine_increments_remove_redundant() {
     let initial = parse("+-").unwrap();
-    assert_eq!(combine_increments(initial), vec![]);
+    assert_eq!(combine_increments(initial).0, vec![]);
 }
 
 #[test]
@@ -155,7 +206,7 @@ fn quickcheck_combine_increments_remove_zero_any_offset() {
             offset,
             position: Some(Position { start: 0, end: 0 }),
         }];
-        combine_increments(initial) == vec![]
+        combine_increments(initial).0 == vec![]
     }
     quickcheck(combine_increments_remove_zero_any_offset as fn(isize) -> bool);
 }
@@ -174,17 +225,26 @@ fn combine_increment_sum_to_zero() {
             position: Some(Position { start: 0, end: 0 }),
         },
     ];
-    assert_eq!(combine_increments(initial), vec![]);
+    assert_eq!(combine_increments(initial).0, vec![]);
 }
 
 #[test]
 fn should_combine_ptr_increments() {
-    let initial = parse(">>").unwrap();
+    let initial = vec![
+        PointerIncrement {
+            amount: 1,
+            position: Some(Position { start: 0, end: 0 }),
+        },
+        PointerIncrement {
+            amount: 1,
+            position: Some(Position { start: 1, end: 1 }),
+        },
+    ];
     let expected = vec![PointerIncrement {
         amount: 2,
         position: Some(Position { start: 0, end: 1 }),
     }];
-    assert_eq!(combine_ptr_increments(initial), expected);
+    assert_eq!(combine_ptr_increments(initial).0, expected);
 }
 
 #[test]
@@ -202,7 +262,7 @@ fn combine_set_sum_to_zero() {
         },
     ];
     assert_eq!(
-        combine_set_and_increments(initial),
+        combine_set_and_increments(initial).0,
         vec![Set {
             amount: Wrapping(0),
             offset: 0,
@@ -239,7 +299,7 @@ fn dont_combine_before_read_different_offset() {
             position: Some(Position { start: 0, end: 0 }),
         },
     ];
-    assert_eq!(remove_read_clobber(initial.clone()), initial);
+    assert_eq!(remove_read_clobber(initial.clone()).0, initial);
 }
 
 #[test]
@@ -284,7 +344,7 @@ fn combine_before_read_not_consecutive() {
             position: Some(Position { start: 4, end: 4 }),
         },
     ];
-    assert_eq!(remove_read_clobber(initial), expected);
+    assert_eq!(remove_read_clobber(initial).0, expected);
 }
 
 #[test]
@@ -300,13 +360,12 @@ fn no_combine_before_read_after_write() {
     ];
     // TODO: write an assert_unchanged! macro.
     let expected = initial.clone();
-    assert_eq!(remove_read_clobber(initial), expected);
+    assert_eq!(remove_read_clobber(initial).0, expected);
 }
 
 #[test]
 fn no_combine_before_read_after_multiply() {
-    let mut changes = HashMap::new();
-    changes.insert(1, Wrapping(-1));
+    let changes = vec![(1, Wrapping(-1))];
     let initial = vec![
         MultiplyMove {
             changes,
@@ -315,7 +374,7 @@ fn no_combine_before_read_after_multiply() {
         Read { position: None },
     ];
     let expected = initial.clone();
-    assert_eq!(remove_read_clobber(initial), expected);
+    assert_eq!(remove_read_clobber(initial).0, expected);
 }
 
 #[test]
@@ -326,7 +385,7 @@ fn simplify_zeroing_loop() {
         offset: 0,
         position: Some(Position { start: 0, end: 2 }),
     }];
-    assert_eq!(zeroing_loops(initial), expected);
+    assert_eq!(zeroing_loops(initial).0, expected);
 }
 
 #[test]
@@ -340,7 +399,7 @@ fn simplify_nested_zeroing_loop() {
         }],
         position: Some(Position { start: 0, end: 4 }),
     }];
-    assert_eq!(zeroing_loops(initial), expected);
+    assert_eq!(zeroing_loops(initial).0, expected);
 }
 
 #[test]
@@ -349,7 +408,36 @@ fn dont_simplify_multiple_decrement_loop() {
     // current cell has the value 3, we would actually wrap around
     // (although BF does not specify this).
     let initial = parse("[--]").unwrap();
-    assert_eq!(zeroing_loops(initial.clone()), initial);
+    assert_eq!(zeroing_loops(initial.clone()).0, initial);
+}
+
+#[test]
+fn simplify_scan_loop() {
+    let initial = parse("[>]").unwrap();
+    let expected = vec![Scan {
+        stride: 1,
+        position: Some(Position { start: 0, end: 2 }),
+    }];
+    assert_eq!(scan_loops(initial).0, expected);
+}
+
+#[test]
+fn simplify_nested_strided_scan_loop() {
+    let initial = combine_ptr_increments(parse("[[<<<]]").unwrap()).0;
+    let expected = vec![Loop {
+        body: vec![Scan {
+            stride: -3,
+            position: Some(Position { start: 1, end: 5 }),
+        }],
+        position: Some(Position { start: 0, end: 6 }),
+    }];
+    assert_eq!(scan_loops(initial).0, expected);
+}
+
+#[test]
+fn dont_simplify_scan_loop_with_increment() {
+    let initial = parse("[>+]").unwrap();
+    assert_eq!(scan_loops(initial.clone()).0, initial);
 }
 
 #[test]
@@ -401,7 +489,7 @@ fn remove_dead_loops_after_set() {
         offset: 0,
         position: Some(Position { start: 0, end: 0 }),
     }];
-    assert_eq!(remove_dead_loops(initial), expected);
+    assert_eq!(remove_dead_loops(initial).0, expected);
 }
 
 #[test]
@@ -428,7 +516,7 @@ fn remove_dead_loops_nested() {
         }],
         position: Some(Position { start: 0, end: 0 }),
     }];
-    assert_eq!(remove_dead_loops(initial), expected);
+    assert_eq!(remove_dead_loops(initial).0, expected);
 }
 
 #[test]
@@ -461,15 +549,15 @@ fn remove_dead_loops_not_adjacent() {
             position: Some(Position { start: 0, end: 0 }),
         },
     ];
-    assert_eq!(remove_dead_loops(initial), expected);
+    assert_eq!(remove_dead_loops(initial).0, expected);
 }
 
 #[test]
 fn quickcheck_should_combine_set_and_increment() {
     fn should_combine_set_and_increment(
         offset: isize,
-        set_amount: i8,
-        increment_amount: i8,
+        set_amount: i32,
+        increment_amount: i32,
     ) -> bool {
         let set_amount = Wrapping(set_amount);
         let increment_amount = Wrapping(increment_amount);
@@ -491,9 +579,9 @@ fn quickcheck_should_combine_set_and_increment() {
             offset,
             position: Some(Position { start: 0, end: 0 }),
         }];
-        combine_set_and_increments(initial) == expected
+        combine_set_and_increments(initial).0 == expected
     }
-    quickcheck(should_combine_set_and_increment as fn(isize, i8, i8) -> bool);
+    quickcheck(should_combine_set_and_increment as fn(isize, i32, i32) -> bool);
 }
 
 // TODO: rename our quickcheck property functions to something shorter.
@@ -501,9 +589,9 @@ fn quickcheck_should_combine_set_and_increment() {
 fn quickcheck_combine_set_and_increment_different_offsets() {
     fn combine_set_and_increment_different_offsets(
         set_offset: isize,
-        set_amount: i8,
+        set_amount: i32,
         inc_offset: isize,
-        inc_amount: i8,
+        inc_amount: i32,
     ) -> TestResult {
         if set_offset == inc_offset {
             return TestResult::discard();
@@ -523,10 +611,10 @@ fn quickcheck_combine_set_and_increment_different_offsets() {
         ];
         let expected = initial.clone();
 
-        TestResult::from_bool(combine_set_and_increments(initial) == expected)
+        TestResult::from_bool(combine_set_and_increments(initial).0 == expected)
     }
     quickcheck(
-        combine_set_and_increment_different_offsets as fn(isize, i8, isize, i8) -> TestResult,
+        combine_set_and_increment_different_offsets as fn(isize, i32, isize, i32) -> TestResult,
     );
 }
 
@@ -534,9 +622,9 @@ fn quickcheck_combine_set_and_increment_different_offsets() {
 fn quickcheck_combine_increment_and_set_different_offsets() {
     fn combine_increment_and_set_different_offsets(
         set_offset: isize,
-        set_amount: i8,
+        set_amount: i32,
         inc_offset: isize,
-        inc_amount: i8,
+        inc_amount: i32,
     ) -> TestResult {
         if set_offset == inc_offset {
             return TestResult::discard();
@@ -556,16 +644,16 @@ fn quickcheck_combine_increment_and_set_different_offsets() {
         ];
         let expected = initial.clone();
 
-        TestResult::from_bool(combine_set_and_increments(initial) == expected)
+        TestResult::from_bool(combine_set_and_increments(initial).0 == expected)
     }
     quickcheck(
-        combine_increment_and_set_different_offsets as fn(isize, i8, isize, i8) -> TestResult,
+        combine_increment_and_set_different_offsets as fn(isize, i32, isize, i32) -> TestResult,
     );
 }
 
 #[test]
 fn quickcheck_combine_set_and_set() {
-    fn combine_set_and_set(offset: isize, set_amount_before: i8, set_amount_after: i8) -> bool {
+    fn combine_set_and_set(offset: isize, set_amount_before: i32, set_amount_after: i32) -> bool {
         let initial = vec![
             Set {
                 amount: Wrapping(set_amount_before),
@@ -583,18 +671,18 @@ fn quickcheck_combine_set_and_set() {
             offset,
             position: Some(Position { start: 0, end: 0 }),
         }];
-        combine_set_and_increments(initial) == expected
+        combine_set_and_increments(initial).0 == expected
     }
-    quickcheck(combine_set_and_set as fn(isize, i8, i8) -> bool);
+    quickcheck(combine_set_and_set as fn(isize, i32, i32) -> bool);
 }
 
 #[test]
 fn quickcheck_combine_set_and_set_different_offsets() {
     fn combine_set_and_set_different_offsets(
         offset1: isize,
-        amount1: i8,
+        amount1: i32,
         offset2: isize,
-        amount2: i8,
+        amount2: i32,
     ) -> TestResult {
         if offset1 == offset2 {
             return TestResult::discard();
@@ -614,9 +702,9 @@ fn quickcheck_combine_set_and_set_different_offsets() {
         ];
         let expected = initial.clone();
 
-        TestResult::from_bool(combine_set_and_increments(initial) == expected)
+        TestResult::from_bool(combine_set_and_increments(initial).0 == expected)
     }
-    quickcheck(combine_set_and_set_different_offsets as fn(isize, i8, isize, i8) -> TestResult);
+    quickcheck(combine_set_and_set_different_offsets as fn(isize, i32, isize, i32) -> TestResult);
 }
 
 #[test]
@@ -644,7 +732,7 @@ fn should_combine_set_and_set_nested() {
         }],
         position: Some(Position { start: 0, end: 0 }),
     }];
-    assert_eq!(combine_set_and_increments(initial), expected);
+    assert_eq!(combine_set_and_increments(initial).0, expected);
 }
 
 #[test]
@@ -667,7 +755,7 @@ fn quickcheck_should_combine_increment_and_set() {
             offset,
             position: Some(Position { start: 0, end: 0 }),
         }];
-        combine_set_and_increments(initial) == expected
+        combine_set_and_increments(initial).0 == expected
     }
     quickcheck(should_combine_increment_and_set as fn(isize) -> bool);
 }
@@ -701,13 +789,12 @@ fn should_remove_redundant_set() {
             position: Some(Position { start: 0, end: 0 }),
         },
     ];
-    assert_eq!(remove_redundant_sets(initial), expected);
+    assert_eq!(remove_redundant_sets(initial).0, expected);
 }
 
 #[test]
 fn should_remove_redundant_set_multiply() {
-    let mut changes = HashMap::new();
-    changes.insert(1, Wrapping(1));
+    let changes = vec![(1, Wrapping(1))];
 
     let initial = vec![
         MultiplyMove {
@@ -724,7 +811,7 @@ fn should_remove_redundant_set_multiply() {
         changes,
         position: Some(Position { start: 0, end: 0 }),
     }];
-    assert_eq!(remove_redundant_sets(initial), expected);
+    assert_eq!(remove_redundant_sets(initial).0, expected);
 }
 
 /// After a loop, if we set to a value other than zero, we shouldn't
@@ -742,7 +829,7 @@ fn not_redundant_set_when_nonzero() {
             position: Some(Position { start: 0, end: 0 }),
         },
     ];
-    assert_eq!(remove_redundant_sets(instrs.clone()), instrs);
+    assert_eq!(remove_redundant_sets(instrs.clone()).0, instrs);
 }
 
 fn is_pure(instrs: &[AstNode]) -> bool {
@@ -751,6 +838,9 @@ fn is_pure(instrs: &[AstNode]) -> bool {
             Loop { .. } => {
                 return false;
             }
+            Scan { .. } => {
+                return false;
+            }
             Read { .. } => {
                 return false;
             }
@@ -763,11 +853,80 @@ fn is_pure(instrs: &[AstNode]) -> bool {
     true
 }
 
+#[test]
+fn annotate_known_zero_before_set() {
+    let set = |amount| Set {
+        amount: Wrapping(amount),
+        offset: 0,
+        position: None,
+    };
+    let mut instrs = parse("[-]").unwrap();
+    instrs.push(set(3));
+
+    let (annotated, changes) = annotate_known_zero(instrs.clone());
+    let mut expected = vec![set(0)];
+    expected.extend(instrs);
+    assert_eq!(annotated[1..], expected[1..]);
+    assert_eq!(changes, 1);
+}
+
+#[test]
+fn annotate_known_zero_before_read() {
+    // remove_read_clobber would remove a Set 0 before the read.
+    let instrs = parse("[-],").unwrap();
+    let (annotated, changes) = annotate_known_zero(instrs.clone());
+    assert_eq!(annotated[1..], instrs[..]);
+    assert_eq!(changes, 1);
+}
+
+#[test]
+fn remove_redundant_sets_after_set() {
+    let set_zero = Set {
+        amount: Wrapping(0),
+        offset: 0,
+        position: None,
+    };
+    let write = Write { position: None };
+    let instrs = vec![
+        Read { position: None },
+        set_zero.clone(),
+        write.clone(),
+        set_zero.clone(),
+        write.clone(),
+    ];
+    let expected = vec![Read { position: None }, set_zero, write.clone(), write];
+    assert_eq!(remove_redundant_sets(instrs), (expected, 1));
+}
+
+#[test]
+fn optimize_reaches_fixed_point() {
+    let mut stats = PeepholeStats::default();
+    optimize_with_stats(parse("+[[-]>]").unwrap(), &None, Some(&mut stats));
+    // One iteration for the body of [-], which has nothing to
+    // change. The outer loop body and the program each take one
+    // iteration that makes changes and one that finds nothing left.
+    assert_eq!(stats.iterations, 5);
+}
+
+#[test]
+fn optimize_records_whole_program_sizes() {
+    let mut stats = PeepholeStats::default();
+    optimize_with_stats(parse("+[[-]>]").unwrap(), &None, Some(&mut stats));
+
+    // The first pass runs on the innermost loop body, but we report
+    // the size of the whole program.
+    assert_eq!(stats.passes[0].nodes_before, 5);
+    assert_eq!(stats.passes.last().unwrap().nodes_after, 4);
+}
+
 #[test]
 fn quickcheck_should_annotate_known_zero_at_start() {
     fn should_annotate_known_zero_at_start(instrs: Vec<AstNode>) -> bool {
-        let annotated = annotate_known_zero(instrs);
-        matches!(annotated[0], Set { amount: Wrapping(0), offset: 0, .. })
+        // If the program already starts by setting the cell, we
+        // leave it alone.
+        let starts_with_set = cell_overwritten(&instrs);
+        let annotated = annotate_known_zero(instrs).0;
+        starts_with_set || matches!(annotated[0], Set { amount: Wrapping(0), offset: 0, .. })
     }
     quickcheck(should_annotate_known_zero_at_start as fn(Vec<AstNode>) -> bool);
 }
@@ -775,8 +934,8 @@ fn quickcheck_should_annotate_known_zero_at_start() {
 #[test]
 fn annotate_known_zero_idempotent() {
     fn is_idempotent(instrs: Vec<AstNode>) -> bool {
-        let annotated = annotate_known_zero(instrs);
-        let annotated_again = annotate_known_zero(annotated.clone());
+        let annotated = annotate_known_zero(instrs).0;
+        let annotated_again = annotate_known_zero(annotated.clone()).0;
         if annotated == annotated_again {
             true
         } else {
@@ -812,7 +971,7 @@ fn should_annotate_known_zero() {
             position: Some(Position { start: 2, end: 2 }),
         },
     ];
-    assert_eq!(annotate_known_zero(initial), expected);
+    assert_eq!(annotate_known_zero(initial).0, expected);
 }
 
 #[test]
@@ -844,7 +1003,7 @@ fn should_annotate_known_zero_nested() {
             position: Some(Position { start: 3, end: 3 }),
         },
     ];
-    assert_eq!(annotate_known_zero(initial), expected);
+    assert_eq!(annotate_known_zero(initial).0, expected);
 }
 
 /// When we annotate known zeroes, we have new opportunities for
@@ -905,6 +1064,29 @@ fn should_remove_pure_code() {
     );
 }
 
+#[test]
+fn should_not_remove_trailing_scan() {
+    // Like a loop, a scan might never terminate or might run off the
+    // tape.
+    let initial = parse("+[<]").unwrap();
+    let expected = vec![
+        Set {
+            amount: Wrapping(1),
+            offset: 0,
+            position: Some(Position { start: 0, end: 0 }),
+        },
+        Scan {
+            stride: -1,
+            position: Some(Position { start: 1, end: 3 }),
+        },
+    ];
+
+    let (result, warnings) = optimize(initial, &None);
+
+    assert_eq!(result, expected);
+    assert_eq!(warnings, vec![]);
+}
+
 #[test]
 fn quickcheck_should_remove_dead_pure_code() {
     fn should_remove_dead_pure_code(instrs: Vec<AstNode>) -> TestResult {
@@ -1013,22 +1195,20 @@ fn quickcheck_optimize_should_decrease_size() {
 fn should_extract_multiply_simple() {
     let instrs = parse("[->+++<]").unwrap();
 
-    let mut dest_cells = HashMap::new();
-    dest_cells.insert(1, Wrapping(3));
+    let dest_cells = vec![(1, Wrapping(3))];
     let expected = vec![MultiplyMove {
         changes: dest_cells,
         position: Some(Position { start: 0, end: 7 }),
     }];
 
-    assert_eq!(extract_multiply(instrs), expected);
+    assert_eq!(extract_multiply(instrs).0, expected);
 }
 
 #[test]
 fn should_extract_multiply_nested() {
     let instrs = parse("[[->+<]]").unwrap();
 
-    let mut dest_cells = HashMap::new();
-    dest_cells.insert(1, Wrapping(1));
+    let dest_cells = vec![(1, Wrapping(1))];
     let expected = vec![Loop {
         body: vec![MultiplyMove {
             changes: dest_cells,
@@ -1037,74 +1217,206 @@ fn should_extract_multiply_nested() {
         position: Some(Position { start: 0, end: 7 }),
     }];
 
-    assert_eq!(extract_multiply(instrs), expected);
+    assert_eq!(extract_multiply(instrs).0, expected);
 }
 
 #[test]
 fn should_extract_multiply_negative_number() {
     let instrs = parse("[->--<]").unwrap();
 
-    let mut dest_cells = HashMap::new();
-    dest_cells.insert(1, Wrapping(-2));
+    let dest_cells = vec![(1, Wrapping(-2))];
     let expected = vec![MultiplyMove {
         changes: dest_cells,
         position: Some(Position { start: 0, end: 6 }),
     }];
 
-    assert_eq!(extract_multiply(instrs), expected);
+    assert_eq!(extract_multiply(instrs).0, expected);
 }
 
 #[test]
 fn should_extract_multiply_multiple_cells() {
     let instrs = parse("[->+++>>>+<<<<]").unwrap();
 
-    let mut dest_cells = HashMap::new();
-    dest_cells.insert(1, Wrapping(3));
-    dest_cells.insert(4, Wrapping(1));
+    let dest_cells = vec![(1, Wrapping(3)), (4, Wrapping(1))];
     let expected = vec![MultiplyMove {
         changes: dest_cells,
         position: Some(Position { start: 0, end: 14 }),
     }];
 
-    assert_eq!(extract_multiply(instrs), expected);
+    assert_eq!(extract_multiply(instrs).0, expected);
+}
+
+/// MultiplyMove changes are sorted by offset, regardless of the
+/// order they occur in the loop body.
+#[test]
+fn should_extract_multiply_sorted_by_offset() {
+    let instrs = parse("[->>++<<<+>]").unwrap();
+
+    let dest_cells = vec![(-1, Wrapping(1)), (2, Wrapping(2))];
+    let expected = vec![MultiplyMove {
+        changes: dest_cells,
+        position: Some(Position { start: 0, end: 11 }),
+    }];
+
+    assert_eq!(extract_multiply(instrs).0, expected);
 }
 
 #[test]
 fn should_not_extract_multiply_net_movement() {
     let instrs = parse("[->+++<<]").unwrap();
-    assert_eq!(extract_multiply(instrs.clone()), instrs);
+    assert_eq!(extract_multiply(instrs.clone()).0, instrs);
 }
 
 #[test]
 fn should_not_extract_multiply_from_clear_loop() {
     let instrs = parse("[-]").unwrap();
-    assert_eq!(extract_multiply(instrs.clone()), instrs);
+    assert_eq!(extract_multiply(instrs.clone()).0, instrs);
 }
 
 #[test]
 fn should_not_extract_multiply_with_inner_loop() {
     let instrs = parse("[->+++<[]]").unwrap();
-    assert_eq!(extract_multiply(instrs.clone()), instrs);
+    assert_eq!(extract_multiply(instrs.clone()).0, instrs);
 }
 
-/// We need to decrement the initial cell in order for this to be a
-/// multiply.
+/// Incrementing the initial cell still terminates, it just runs
+/// 256 - cell #0 times (for 8-bit cells).
 #[test]
-fn should_not_extract_multiply_without_decrement() {
+fn should_extract_multiply_with_increment() {
     let instrs = parse("[+>++<]").unwrap();
-    assert_eq!(extract_multiply(instrs.clone()), instrs);
+
+    let dest_cells = vec![(1, Wrapping(-2))];
+    let expected = vec![MultiplyMove {
+        changes: dest_cells,
+        position: Some(Position { start: 0, end: 6 }),
+    }];
+
+    assert_eq!(extract_multiply(instrs).0, expected);
+}
+
+/// If the loop takes odd steps, we can multiply by the inverse of
+/// the step size.
+#[test]
+fn should_extract_multiply_with_odd_step() {
+    let instrs = parse("[--->+<]").unwrap();
+
+    // 3 * -1431655765 == 1 (mod 2^32)
+    let dest_cells = vec![(1, Wrapping(-1431655765))];
+    let expected = vec![MultiplyMove {
+        changes: dest_cells,
+        position: Some(Position { start: 0, end: 7 }),
+    }];
+
+    assert_eq!(extract_multiply(instrs).0, expected);
+}
+
+/// Loops with even steps might never reach zero.
+#[test]
+fn should_not_extract_multiply_with_even_step() {
+    let instrs = parse("[-->+<]").unwrap();
+    assert_eq!(extract_multiply(instrs.clone()).0, instrs);
+}
+
+#[test]
+fn should_extract_multiply_with_set() {
+    let instrs = vec![Loop {
+        body: vec![
+            Set {
+                amount: Wrapping(5),
+                offset: 1,
+                position: Some(Position { start: 1, end: 1 }),
+            },
+            Increment {
+                amount: Wrapping(-1),
+                offset: 0,
+                position: Some(Position { start: 2, end: 2 }),
+            },
+            Increment {
+                amount: Wrapping(1),
+                offset: 2,
+                position: Some(Position { start: 3, end: 3 }),
+            },
+        ],
+        position: Some(Position { start: 0, end: 4 }),
+    }];
+
+    let position = Some(Position { start: 0, end: 4 });
+    let expected = vec![Loop {
+        body: vec![
+            MultiplyMove {
+                changes: vec![(2, Wrapping(1))],
+                position,
+            },
+            Set {
+                amount: Wrapping(5),
+                offset: 1,
+                position,
+            },
+        ],
+        position,
+    }];
+
+    assert_eq!(extract_multiply(instrs).0, expected);
+}
+
+/// An inner multiply loop only has an effect on the first iteration
+/// of the outer loop, so we can evaluate both.
+#[test]
+fn should_extract_nested_multiply() {
+    let instrs = parse("[>[->+<]<-]").unwrap();
+
+    let position = Some(Position { start: 0, end: 10 });
+    let expected = vec![Loop {
+        body: vec![
+            PointerIncrement {
+                amount: 1,
+                position,
+            },
+            MultiplyMove {
+                changes: vec![(1, Wrapping(1))],
+                position,
+            },
+            PointerIncrement {
+                amount: -1,
+                position,
+            },
+            Set {
+                amount: Wrapping(0),
+                offset: 0,
+                position,
+            },
+        ],
+        position,
+    }];
+
+    assert_eq!(extract_multiply(instrs).0, expected);
+}
+
+/// If the outer loop modifies the inner loop's cell, the inner loop
+/// runs on every iteration.
+#[test]
+fn should_not_extract_nested_multiply_with_modified_cell() {
+    let instrs = parse("[>[->+<]+<-]").unwrap();
+    let (result, changes) = extract_multiply(instrs);
+
+    // Only the inner loop is extracted.
+    assert_eq!(changes, 1);
+    match result[0] {
+        Loop { ref body, .. } => assert!(matches!(body[1], MultiplyMove { .. })),
+        _ => unreachable!(),
+    }
 }
 
 #[test]
 fn should_not_extract_multiply_with_read() {
     let instrs = parse("[+>++<,]").unwrap();
-    assert_eq!(extract_multiply(instrs.clone()), instrs);
+    assert_eq!(extract_multiply(instrs.clone()).0, instrs);
 }
 
 #[test]
 fn should_not_extract_multiply_with_write() {
     let instrs = parse("[+>++<.]").unwrap();
-    assert_eq!(extract_multiply(instrs.clone()), instrs);
+    assert_eq!(extract_multiply(instrs.clone()).0, instrs);
 }
 
 #[test]
@@ -1126,7 +1438,7 @@ fn sort_by_offset_increment() {
             position: Some(Position { start: 3, end: 3 }),
         },
     ];
-    assert_eq!(sort_by_offset(instrs), expected);
+    assert_eq!(sort_by_offset(instrs).0, expected);
 }
 
 #[test]
@@ -1151,39 +1463,41 @@ fn sort_by_offset_increment_nested() {
         ]),
         position: Some(Position { start: 0, end: 5 }),
     }];
-    assert_eq!(sort_by_offset(instrs), expected);
+    assert_eq!(sort_by_offset(instrs).0, expected);
 }
 
 #[test]
 fn sort_by_offset_remove_redundant() {
     let initial = parse("><").unwrap();
-    assert_eq!(sort_by_offset(initial), vec![]);
+    assert_eq!(sort_by_offset(initial).0, vec![]);
 }
 
 // If there's a read instruction, we should only combine before and
 // after.
 #[test]
 fn sort_by_offset_read() {
-    let instrs = parse(">>,>>").unwrap();
+    // Use comments so the parser doesn't merge the pointer
+    // increments itself.
+    let instrs = parse("> >,> >").unwrap();
     let expected = vec![
         PointerIncrement {
             amount: 2,
-            position: Some(Position { start: 1, end: 1 }),
+            position: Some(Position { start: 2, end: 2 }),
         },
         Read {
-            position: Some(Position { start: 2, end: 2 }),
+            position: Some(Position { start: 3, end: 3 }),
         },
         PointerIncrement {
             amount: 2,
-            position: Some(Position { start: 4, end: 4 }),
+            position: Some(Position { start: 6, end: 6 }),
         },
     ];
-    assert_eq!(sort_by_offset(instrs), expected);
+    assert_eq!(sort_by_offset(instrs).0, expected);
 }
 
 #[test]
 fn quickcheck_sort_by_offset_set() {
-    fn sort_by_offset_set(amount1: i8, amount2: i8) -> bool {
+    fn sort_by_offset_set(amount1: i32, amount2: i32) -> bool {
         let instrs = vec![
             Set {
                 amount: Wrapping(amount1),
@@ -1217,9 +1531,9 @@ fn quickcheck_sort_by_offset_set() {
                 position: Some(Position { start: 0, end: 0 }),
             },
         ];
-        sort_by_offset(instrs) == expected
+        sort_by_offset(instrs).0 == expected
     }
-    quickcheck(sort_by_offset_set as fn(i8, i8) -> bool);
+    quickcheck(sort_by_offset_set as fn(i32, i32) -> bool);
 }
 
 #[test]
@@ -1250,11 +1564,21 @@ fn quickcheck_sort_by_offset_pointer_increments() {
             amount: amount1 + amount2,
             position: Some(Position { start: 0, end: 0 }),
         }];
-        TestResult::from_bool(sort_by_offset(instrs) == expected)
+        TestResult::from_bool(sort_by_offset(instrs).0 == expected)
     }
     quickcheck(sort_by_offset_pointer_increments as fn(isize, isize) -> TestResult);
 }
 
+#[test]
+fn quickcheck_sort_by_offset_reports_no_changes_when_sorted() {
+    fn sort_by_offset_reports_no_changes_when_sorted(instrs: Vec<AstNode>) -> bool {
+        let (sorted, _) = sort_by_offset(instrs);
+        let (sorted_again, changes) = sort_by_offset(sorted.clone());
+        changes == 0 && sorted_again == sorted
+    }
+    quickcheck(sort_by_offset_reports_no_changes_when_sorted as fn(Vec<AstNode>) -> bool);
+}
+
 // Don't combine instruction positions when they weren't originally
 // adjacent.
 #[test]
@@ -1276,7 +1600,7 @@ fn combine_increments_non_adjacent_instrs() {
         offset: 0,
         position: Some(Position { start: 2, end: 2 }),
     }];
-    assert_eq!(combine_increments(instrs), expected);
+    assert_eq!(combine_increments(instrs).0, expected);
 }
 
 // Don't combine instruction positions when they weren't originally
@@ -1300,7 +1624,7 @@ fn combine_set_and_increment_non_adjacent_instrs() {
         offset: 0,
         position: Some(Position { start: 2, end: 2 }),
     }];
-    assert_eq!(combine_set_and_increments(instrs), expected);
+    assert_eq!(combine_set_and_increments(instrs).0, expected);
 }
 
 /// Ensure that we combine after sorting, since sorting creates new
@@ -1380,8 +1704,7 @@ fn prev_mutate_ignores_offset_at_index() {
 
 #[test]
 fn prev_mutate_multiply_offset_matches() {
-    let mut changes = HashMap::new();
-    changes.insert(-1, Wrapping(-1));
+    let changes = vec![(-1, Wrapping(-1))];
 
     let instrs = vec![
         MultiplyMove {
@@ -1401,8 +1724,7 @@ fn prev_mutate_multiply_offset_matches() {
 
 #[test]
 fn prev_mutate_multiply_offset_doesnt_match() {
-    let mut changes = HashMap::new();
-    changes.insert(1, Wrapping(2));
+    let changes = vec![(1, Wrapping(2))];
 
     let instrs = vec![
         MultiplyMove {
@@ -1424,8 +1746,7 @@ fn prev_mutate_multiply_offset_doesnt_match() {
 /// of the current value.
 #[test]
 fn prev_mutate_multiply_ignore_offset() {
-    let mut changes = HashMap::new();
-    changes.insert(1, Wrapping(-1));
+    let changes = vec![(1, Wrapping(-1))];
 
     let instrs = vec![
         MultiplyMove {
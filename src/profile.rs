@@ -0,0 +1,169 @@
+//! Reading the execution counts written by programs compiled with
+//! `--profile`.
+
+use std::collections::HashMap;
+use std::convert::TryInto;
+use std::fs;
+
+#[cfg(test)]
+use pretty_assertions::assert_eq;
+
+use crate::bfir::{get_position, AstNode, Position};
+use crate::llvm::PROFILE_RECORD_SIZE;
+
+/// How many times the instruction at `position` was executed.
+#[derive(Debug, PartialEq, Eq)]
+pub struct ProfileEntry {
+    pub position: Position,
+    pub count: u64,
+}
+
+/// Parse the records in a profile, returning the entries with a
+/// position, most executed first. Entries that never ran are
+/// omitted.
+pub fn parse(bytes: &[u8]) -> Result<Vec<ProfileEntry>, String> {
+    if bytes.len() % PROFILE_RECORD_SIZE != 0 {
+        return Err(format!(
+            "Profile is {} bytes, which is not a multiple of {}",
+            bytes.len(),
+            PROFILE_RECORD_SIZE
+        ));
+    }
+
+    let mut entries = vec![];
+    for record in bytes.chunks(PROFILE_RECORD_SIZE) {
+        let field = |i: usize| u64::from_ne_bytes(record[i * 8..(i + 1) * 8].try_into().unwrap());
+        let (start, end, count) = (field(0), field(1), field(2));
+
+        if start == u64::MAX || count == 0 {
+            continue;
+        }
+        entries.push(ProfileEntry {
+            position: Position {
+                start: start as usize,
+                end: end as usize,
+            },
+            count,
+        });
+    }
+
+    // Sort by count, and then by position so the output is stable.
+    entries.sort_by(|a, b| {
+        b.count
+            .cmp(&a.count)
+            .then(a.position.start.cmp(&b.position.start))
+    });
+    Ok(entries)
+}
+
+/// Read and parse the profile at `path`.
+pub fn read(path: &str) -> Result<Vec<ProfileEntry>, String> {
+    match fs::read(path) {
+        Ok(bytes) => parse(&bytes),
+        Err(e) => Err(format!("Could not read profile {}: {}", path, e)),
+    }
+}
+
+/// Check that every entry in the profile at `path` is a position in
+/// `src`, so we don't report positions from another program.
+pub fn check_positions(entries: &[ProfileEntry], src: &str, path: &str) -> Result<(), String> {
+    for entry in entries {
+        let Position { start, end } = entry.position;
+        if start > end || end >= src.len() {
+            return Err(format!(
+                "Profile {} has source bytes {}-{}, but the program is {} bytes",
+                path,
+                start,
+                end,
+                src.len()
+            ));
+        }
+    }
+    Ok(())
+}
+
+/// Read the profile at `path`, returning the execution count of each
+/// source position.
+pub fn read_counts(path: &str) -> Result<HashMap<Position, u64>, String> {
+    Ok(read(path)?
+        .into_iter()
+        .map(|entry| (entry.position, entry.count))
+        .collect())
+}
+
+/// Does any loop in `instrs` have a count in `counts`? If not, the
+/// profile is probably from another program, or from an older
+/// version of this one.
+pub fn matches_any_loop(instrs: &[AstNode], counts: &HashMap<Position, u64>) -> bool {
+    instrs.iter().any(|instr| match *instr {
+        AstNode::Loop { ref body, .. } => {
+            get_position(instr).map_or(false, |position| counts.contains_key(&position))
+                || matches_any_loop(body, counts)
+        }
+        _ => false,
+    })
+}
+
+#[cfg(test)]
+fn record(start: u64, end: u64, count: u64) -> Vec<u8> {
+    let mut bytes = vec![];
+    for field in &[start, end, count] {
+        bytes.extend_from_slice(&field.to_ne_bytes());
+    }
+    bytes
+}
+
+#[test]
+fn parse_sorts_by_count() {
+    let mut bytes = record(0, 5, 3);
+    bytes.extend(record(2, 4, 10));
+    bytes.extend(record(u64::MAX, u64::MAX, 100));
+    bytes.extend(record(7, 7, 0));
+
+    assert_eq!(
+        parse(&bytes),
+        Ok(vec![
+            ProfileEntry {
+                position: Position { start: 2, end: 4 },
+                count: 10,
+            },
+            ProfileEntry {
+                position: Position { start: 0, end: 5 },
+                count: 3,
+            },
+        ])
+    );
+}
+
+#[test]
+fn parse_truncated_profile() {
+    let bytes = record(0, 5, 3);
+    assert!(parse(&bytes[..20]).is_err());
+}
+
+#[test]
+fn check_positions_in_source() {
+    let entries = parse(&record(0, 2, 1)).unwrap();
+    assert_eq!(check_positions(&entries, "+++", "foo.profile"), Ok(()));
+    assert!(check_positions(&entries, "++", "foo.profile").is_err());
+}
+
+#[test]
+fn check_positions_reversed() {
+    let entries = parse(&record(2, 1, 1)).unwrap();
+    assert!(check_positions(&entries, "+++", "foo.profile").is_err());
+}
+
+#[test]
+fn matches_any_loop_nested() {
+    let instrs = crate::bfir::parse("+[>[-]<-]").unwrap();
+    let mut counts = HashMap::new();
+    assert!(!matches_any_loop(&instrs, &counts));
+
+    counts.insert(Position { start: 0, end: 0 }, 1);
+    assert!(!matches_any_loop(&instrs, &counts));
+
+    let inner_position = Position { start: 3, end: 5 };
+    counts.insert(inner_position, 4);
+    assert!(matches_any_loop(&instrs, &counts));
+}
@@ -1,6 +1,18 @@
+use std::env;
+use std::fs;
+use std::num::Wrapping;
+use std::path::{Path, PathBuf};
+use std::process::{Command, Stdio};
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::Mutex;
+use std::thread;
+use std::time::Instant;
+
 use quickcheck::{quickcheck, TestResult};
+use tempfile::tempdir;
 
-use crate::bfir::AstNode;
+use crate::bfir::AstNode::*;
+use crate::bfir::{parse, AstNode};
 use crate::execution::Outcome::*;
 use crate::execution::{execute_with_state, ExecutionState};
 use crate::peephole::*;
@@ -12,28 +24,50 @@ fn transform_is_sound<F>(
     dummy_read_value: Option<i8>,
 ) -> TestResult
 where
-    F: Fn(Vec<AstNode>) -> Vec<AstNode>,
+    F: Fn(Vec<AstNode>) -> (Vec<AstNode>, usize),
 {
-    let max_steps = 1000;
+    match check_transform(&instrs, transform, check_cells, dummy_read_value, 1000) {
+        Ok(Some(_)) => TestResult::passed(),
+        Ok(None) => TestResult::discard(),
+        Err(message) => {
+            println!("{}", message);
+            TestResult::failed()
+        }
+    }
+}
 
+/// Check that `transform` doesn't change the behaviour of `instrs`
+/// within `max_steps` steps. Returns the number of changes
+/// `transform` made, or `Ok(None)` if `instrs` doesn't terminate
+/// nicely, so there's nothing to compare.
+fn check_transform<F>(
+    instrs: &[AstNode],
+    transform: F,
+    check_cells: bool,
+    dummy_read_value: Option<i8>,
+    max_steps: u64,
+) -> Result<Option<usize>, String>
+where
+    F: Fn(Vec<AstNode>) -> (Vec<AstNode>, usize),
+{
     // First, we execute the program given.
-    let mut state = ExecutionState::initial(&instrs[..]);
-    let result = execute_with_state(&instrs[..], &mut state, max_steps, dummy_read_value);
+    let mut state = ExecutionState::initial(instrs);
+    let result = execute_with_state(instrs, &mut state, max_steps, dummy_read_value);
 
     // Optimisations may change malformed programs to well-formed
     // programs, so we ignore programs that don't terminate nicely.
     match result {
-        RuntimeError(_) | OutOfSteps => return TestResult::discard(),
+        RuntimeError(_) | OutOfSteps => return Ok(None),
         _ => (),
     }
 
     // Next, we execute the program after transformation.
-    let optimised_instrs = transform(instrs.clone());
+    let (optimised_instrs, changes) = transform(instrs.to_vec());
     // Deliberately start our state from the original instrs, so we
     // get the same number of cells. Otherwise we could get in messy
     // situations where a dead loop that makes us think we use
     // MAX_CELLS so state2 has fewer cells.
-    let mut state2 = ExecutionState::initial(&instrs[..]);
+    let mut state2 = ExecutionState::initial(instrs);
     let result2 = execute_with_state(
         &optimised_instrs[..],
         &mut state2,
@@ -51,31 +85,28 @@ where
         // Any other situation means that the first program terminated
         // but the optimised program did not.
         (_, _) => {
-            println!("Optimised program did not terminate properly!");
-            return TestResult::failed();
+            return Err("Optimised program did not terminate properly!".to_owned());
         }
     }
 
     // Likewise we should have written the same outputs.
     if state.outputs != state2.outputs {
-        println!(
+        return Err(format!(
             "Different outputs! Original outputs: {:?} Optimised: {:?}",
             state.outputs, state2.outputs
-        );
-        return TestResult::failed();
+        ));
     }
 
     // If requested, compare that the cells at the end are the same
     // too. This is true of most, but not all, of our optimisations.
     if check_cells && state.cells != state2.cells {
-        println!(
+        return Err(format!(
             "Different cell states! Optimised state: {:?} Optimised: {:?}",
             state.cells, state2.cells
-        );
-        return TestResult::failed();
+        ));
     }
 
-    TestResult::passed()
+    Ok(Some(changes))
 }
 
 #[test]
@@ -110,6 +141,48 @@ fn extract_multiply_is_sound() {
     quickcheck(is_sound as fn(Vec<AstNode>) -> TestResult)
 }
 
+/// Build nested loops with odd steps, which only show up rarely in
+/// arbitrary programs.
+#[test]
+fn extract_nested_multiply_is_sound() {
+    fn is_sound(outer: i8, inner: i8, step: i8, amount: i8, set_amount: i8) -> TestResult {
+        let increment = |amount: i8, offset| Increment {
+            amount: Wrapping(i32::from(amount)),
+            offset,
+            position: None,
+        };
+        let set = |amount: i8, offset| Set {
+            amount: Wrapping(i32::from(amount)),
+            offset,
+            position: None,
+        };
+        let pointer_increment = |amount| PointerIncrement {
+            amount,
+            position: None,
+        };
+
+        let instrs = vec![
+            set(outer, 0),
+            set(inner, 1),
+            Loop {
+                body: vec![
+                    pointer_increment(1),
+                    Loop {
+                        body: vec![increment(-1, 0), increment(amount, 1)],
+                        position: None,
+                    },
+                    pointer_increment(-1),
+                    set(set_amount, 3),
+                    increment(step | 1, 0),
+                ],
+                position: None,
+            },
+        ];
+        transform_is_sound(instrs, extract_multiply, true, None)
+    }
+    quickcheck(is_sound as fn(i8, i8, i8, i8, i8) -> TestResult)
+}
+
 #[test]
 fn simplify_loops_is_sound() {
     fn is_sound(instrs: Vec<AstNode>) -> TestResult {
@@ -118,6 +191,14 @@ fn simplify_loops_is_sound() {
     quickcheck(is_sound as fn(Vec<AstNode>) -> TestResult)
 }
 
+#[test]
+fn scan_loops_is_sound() {
+    fn is_sound(instrs: Vec<AstNode>) -> TestResult {
+        transform_is_sound(instrs, scan_loops, true, None)
+    }
+    quickcheck(is_sound as fn(Vec<AstNode>) -> TestResult)
+}
+
 #[test]
 fn combine_set_and_increments_is_sound() {
     fn is_sound(instrs: Vec<AstNode>) -> TestResult {
@@ -160,7 +241,12 @@ fn remove_pure_code_is_sound() {
         // We can't compare cells after this pass. Consider `.+` to
         // `.` -- the outputs are the same, but the cell state is
         // different at termination.
-        transform_is_sound(instrs, |instrs| remove_pure_code(instrs).0, false, None)
+        transform_is_sound(
+            instrs,
+            |instrs| (remove_pure_code(instrs).0, 0),
+            false,
+            None,
+        )
     }
     quickcheck(is_sound as fn(Vec<AstNode>) -> TestResult)
 }
@@ -175,8 +261,8 @@ fn sort_by_offset_is_sound() {
 
 #[test]
 fn test_overall_optimize_is_sound() {
-    fn optimize_ignore_warnings(instrs: Vec<AstNode>) -> Vec<AstNode> {
-        optimize(instrs, &None).0
+    fn optimize_ignore_warnings(instrs: Vec<AstNode>) -> (Vec<AstNode>, usize) {
+        (optimize(instrs, &None).0, 0)
     }
 
     fn optimizations_sound_together(instrs: Vec<AstNode>, read_value: Option<i8>) -> TestResult {
@@ -188,3 +274,362 @@ fn test_overall_optimize_is_sound() {
 
     quickcheck(optimizations_sound_together as fn(Vec<AstNode>, Option<i8>) -> TestResult);
 }
+
+/// Peephole passes checked by `fuzz_soundness`, and whether they
+/// preserve the cells at termination.
+const FUZZ_PASSES: &[(&str, fn(Vec<AstNode>) -> (Vec<AstNode>, usize), bool)] = &[
+    ("combine_inc", combine_increments, true),
+    ("combine_ptr", combine_ptr_increments, true),
+    ("known_zero", annotate_known_zero, true),
+    ("multiply", extract_multiply, true),
+    ("zeroing_loop", zeroing_loops, true),
+    ("scan", scan_loops, true),
+    ("combine_set", combine_set_and_increments, true),
+    ("dead_loop", remove_dead_loops, true),
+    ("redundant_set", remove_redundant_sets, true),
+    ("read_clobber", remove_read_clobber, false),
+    ("pure_removal", remove_pure_code_changes, false),
+    ("offset_sort", sort_by_offset, true),
+];
+
+/// bfc options for each backend we compare against compile time
+/// execution. No options means compiling and running an executable.
+const FUZZ_BACKENDS: &[(&str, &[&str])] = &[
+    ("interpret", &["--interpret"]),
+    ("jit", &["--run"]),
+    ("native", &[]),
+];
+
+/// Loops that the peephole passes look for, which random BF rarely
+/// contains.
+const FUZZ_IDIOMS: &[&str] = &[
+    "[-]",
+    "[->+<]",
+    "[-<+>]",
+    "[->>+++<<]",
+    "[--->+<]",
+    "[+>-<]",
+    "[>]",
+    "[<]",
+    "[>>]",
+    "[>[->+<]<-]",
+];
+
+/// Compiled programs read EOF from an empty stdin, which is -1 by
+/// default, so compile time execution reads the same value.
+const FUZZ_READ_VALUE: Option<i8> = Some(-1);
+
+fn remove_pure_code_changes(instrs: Vec<AstNode>) -> (Vec<AstNode>, usize) {
+    let original = instrs.clone();
+    let (result, _) = remove_pure_code(instrs);
+    let changes = if result == original { 0 } else { 1 };
+    (result, changes)
+}
+
+/// A small deterministic PRNG (xorshift64*), so every fuzzed program
+/// can be regenerated from its index.
+struct FuzzRng(u64);
+
+impl FuzzRng {
+    fn new(seed: u64) -> Self {
+        // Scramble the seed (splitmix64), so consecutive indexes
+        // give unrelated programs.
+        let mut z = seed.wrapping_add(0x9e37_79b9_7f4a_7c15);
+        z = (z ^ (z >> 30)).wrapping_mul(0xbf58_476d_1ce4_e5b9);
+        z = (z ^ (z >> 27)).wrapping_mul(0x94d0_49bb_1331_11eb);
+        FuzzRng((z ^ (z >> 31)) | 1)
+    }
+
+    /// A random number in `0..n`.
+    fn below(&mut self, n: u64) -> u64 {
+        self.0 ^= self.0 >> 12;
+        self.0 ^= self.0 << 25;
+        self.0 ^= self.0 >> 27;
+        self.0.wrapping_mul(0x2545_f491_4f6c_dd1d) % n
+    }
+}
+
+/// Generate BF source rather than BFIR, so failures can be
+/// reproduced by running bfc on the source.
+fn fuzz_source(rng: &mut FuzzRng, max_depth: u32, src: &mut String) {
+    // If max_depth is zero, don't create loops.
+    let choices = if max_depth == 0 { 8 } else { 9 };
+
+    for _ in 0..rng.below(12) {
+        match rng.below(choices) {
+            0 => src.push_str(&"+".repeat(1 + rng.below(8) as usize)),
+            1 => src.push_str(&"-".repeat(1 + rng.below(8) as usize)),
+            2 => src.push_str(&">".repeat(1 + rng.below(3) as usize)),
+            3 => src.push_str(&"<".repeat(1 + rng.below(3) as usize)),
+            4 => src.push('.'),
+            5 => src.push(','),
+            6 | 7 => src.push_str(FUZZ_IDIOMS[rng.below(FUZZ_IDIOMS.len() as u64) as usize]),
+            _ => {
+                src.push('[');
+                fuzz_source(rng, max_depth - 1, src);
+                src.push(']');
+            }
+        }
+    }
+}
+
+fn fuzz_program(index: u64) -> String {
+    let mut src = String::new();
+    fuzz_source(&mut FuzzRng::new(index), 3, &mut src);
+    src
+}
+
+/// Run `src` with the bfc executable at `bfc_path` and `args`, and
+/// return what it wrote to stdout. With no `args`, we compile an
+/// executable and return what that writes.
+fn run_backend(bfc_path: &Path, src: &str, args: &[&str]) -> Result<Vec<u8>, String> {
+    let dir = tempdir().map_err(|e| format!("Could not create temporary directory: {}", e))?;
+    fs::write(dir.path().join("fuzz.bf"), src)
+        .map_err(|e| format!("Could not write fuzz.bf: {}", e))?;
+
+    // Don't execute anything at compile time, so we test the code we
+    // generate rather than outputs that we've already computed.
+    let output = Command::new(bfc_path)
+        .args(args)
+        .arg("fuzz.bf")
+        .current_dir(dir.path())
+        .env("BFC_MAX_STEPS", "0")
+        .stdin(Stdio::null())
+        .output()
+        .map_err(|e| format!("Could not run {}: {}", bfc_path.display(), e))?;
+    if !output.status.success() {
+        return Err(format!(
+            "bfc {:?} failed: {}",
+            args,
+            String::from_utf8_lossy(&output.stderr)
+        ));
+    }
+    if !args.is_empty() {
+        return Ok(output.stdout);
+    }
+
+    let output = Command::new(dir.path().join("fuzz"))
+        .stdin(Stdio::null())
+        .output()
+        .map_err(|e| format!("Could not run compiled program: {}", e))?;
+    if !output.status.success() {
+        return Err(format!("Compiled program failed: {}", output.status));
+    }
+    Ok(output.stdout)
+}
+
+/// Check that every peephole pass, the whole optimiser and every
+/// backend agree with compile time execution of `src`. Passes that
+/// changed the program are counted in `coverage`.
+///
+/// Returns `Ok(false)` if `src` doesn't terminate nicely within
+/// `max_steps`, so there's nothing to compare.
+fn fuzz_one(
+    src: &str,
+    max_steps: u64,
+    bfc_path: Option<&Path>,
+    coverage: &mut [u64],
+) -> Result<bool, String> {
+    let instrs = parse(src).expect("fuzzed programs should have balanced brackets");
+    let mut state = ExecutionState::initial(&instrs[..]);
+    match execute_with_state(&instrs[..], &mut state, max_steps, FUZZ_READ_VALUE) {
+        Completed(_) => (),
+        _ => return Ok(false),
+    }
+
+    for (i, &(name, pass, check_cells)) in FUZZ_PASSES.iter().enumerate() {
+        let changes = check_transform(&instrs, pass, check_cells, FUZZ_READ_VALUE, max_steps)
+            .map_err(|message| format!("{}: {}", name, message))?;
+        if changes.unwrap_or(0) > 0 {
+            coverage[i] += 1;
+        }
+    }
+    check_transform(
+        &instrs,
+        |instrs| (optimize(instrs, &None).0, 0),
+        false,
+        FUZZ_READ_VALUE,
+        max_steps,
+    )
+    .map_err(|message| format!("optimize: {}", message))?;
+
+    if let Some(bfc_path) = bfc_path {
+        for &(name, args) in FUZZ_BACKENDS {
+            let outputs = run_backend(bfc_path, src, args)
+                .map_err(|message| format!("{}: {}", name, message))?;
+            if outputs != state.outputs {
+                return Err(format!(
+                    "{}: Different outputs! Compile time outputs: {:?} Backend: {:?}",
+                    name, state.outputs, outputs
+                ));
+            }
+        }
+    }
+
+    Ok(true)
+}
+
+/// Read a setting for `fuzz_soundness` from the environment.
+fn fuzz_setting<T: std::str::FromStr>(name: &str, default: T) -> T {
+    env::var(name)
+        .ok()
+        .and_then(|value| value.parse().ok())
+        .unwrap_or(default)
+}
+
+#[derive(Default)]
+struct FuzzResults {
+    checked: u64,
+    discarded: u64,
+    coverage: Vec<u64>,
+    /// The index, source and error of each unsound program.
+    failures: Vec<(u64, String, String)>,
+}
+
+impl FuzzResults {
+    fn merge(&mut self, other: FuzzResults) {
+        self.checked += other.checked;
+        self.discarded += other.discarded;
+        self.coverage.resize(FUZZ_PASSES.len(), 0);
+        for (total, count) in self.coverage.iter_mut().zip(other.coverage) {
+            *total += count;
+        }
+        self.failures.extend(other.failures);
+    }
+}
+
+/// Differentially test many generated programs, using every core.
+/// This is too slow for every `cargo test`, so run it explicitly:
+///
+/// ```text
+/// $ cargo build --release
+/// $ cargo test --release fuzz_soundness -- --ignored --nocapture
+/// ```
+///
+/// It's configured with environment variables: `BFC_FUZZ_PROGRAMS`,
+/// `BFC_FUZZ_STEPS`, `BFC_FUZZ_JOBS`, `BFC_FUZZ_SHARD` (e.g. `2/8`,
+/// to split the programs between machines) and `BFC_FUZZ_BFC`, the
+/// bfc executable used to check `--interpret`, `--run` and compiled
+/// programs.
+#[test]
+#[ignore]
+fn fuzz_soundness() {
+    let programs: u64 = fuzz_setting("BFC_FUZZ_PROGRAMS", 10_000);
+    let max_steps: u64 = fuzz_setting("BFC_FUZZ_STEPS", 100_000);
+    let jobs: usize = fuzz_setting(
+        "BFC_FUZZ_JOBS",
+        thread::available_parallelism().map_or(1, |n| n.get()),
+    );
+    let shard: String = fuzz_setting("BFC_FUZZ_SHARD", "0/1".to_owned());
+    let (shard, num_shards) = match shard.split_once('/') {
+        Some((shard, num_shards)) => (
+            shard.parse::<u64>().expect("invalid BFC_FUZZ_SHARD"),
+            num_shards.parse::<u64>().expect("invalid BFC_FUZZ_SHARD"),
+        ),
+        None => panic!("BFC_FUZZ_SHARD should be of the form INDEX/COUNT"),
+    };
+    assert!(shard < num_shards, "BFC_FUZZ_SHARD index is out of range");
+
+    let bfc_path: PathBuf = fuzz_setting("BFC_FUZZ_BFC", PathBuf::from("target/release/bfc"));
+    let bfc_path = if bfc_path.is_file() {
+        Some(bfc_path)
+    } else {
+        eprintln!(
+            "No bfc executable at {}, so only checking peephole passes.",
+            bfc_path.display()
+        );
+        None
+    };
+
+    // Each shard takes every `num_shards`th program.
+    let next_index = AtomicU64::new(shard);
+    let results = Mutex::new(FuzzResults::default());
+    let start = Instant::now();
+
+    let fuzz_remaining = || {
+        let mut worker_results = FuzzResults {
+            coverage: vec![0; FUZZ_PASSES.len()],
+            ..FuzzResults::default()
+        };
+        loop {
+            let index = next_index.fetch_add(num_shards, Ordering::SeqCst);
+            if index >= programs {
+                break;
+            }
+
+            let src = fuzz_program(index);
+            match fuzz_one(
+                &src,
+                max_steps,
+                bfc_path.as_deref(),
+                &mut worker_results.coverage,
+            ) {
+                Ok(true) => worker_results.checked += 1,
+                Ok(false) => worker_results.discarded += 1,
+                Err(message) => worker_results.failures.push((index, src, message)),
+            }
+        }
+        results.lock().unwrap().merge(worker_results);
+    };
+
+    thread::scope(|scope| {
+        for _ in 0..jobs {
+            thread::Builder::new()
+                .stack_size(8 * 1024 * 1024)
+                .spawn_scoped(scope, &fuzz_remaining)
+                .expect("could not start fuzzing thread");
+        }
+    });
+
+    let results = results.into_inner().unwrap();
+    let elapsed = start.elapsed().as_secs_f64();
+    let total = results.checked + results.discarded + results.failures.len() as u64;
+    eprintln!(
+        "Fuzzed {} programs in {:.1}s ({:.0} programs/s) on {} threads. {} didn't terminate and were discarded.",
+        total,
+        elapsed,
+        total as f64 / elapsed,
+        jobs,
+        results.discarded
+    );
+    eprintln!("Programs changed by each pass:");
+    for (&(name, _, _), &count) in FUZZ_PASSES.iter().zip(&results.coverage) {
+        eprintln!(
+            "  {:<14}{:>8} ({:.1}%)",
+            name,
+            count,
+            100.0 * count as f64 / results.checked.max(1) as f64
+        );
+    }
+
+    for (index, src, message) in &results.failures {
+        eprintln!("Program #{} is unsound: {}\n{}", index, message, src);
+    }
+    assert!(
+        results.failures.is_empty(),
+        "{} fuzzed programs were unsound",
+        results.failures.len()
+    );
+}
+
+#[test]
+fn fuzz_program_is_reproducible() {
+    for index in 0..100 {
+        let src = fuzz_program(index);
+        assert_eq!(src, fuzz_program(index));
+        assert!(parse(&src).is_ok());
+    }
+}
+
+#[test]
+fn fuzz_one_checks_passes() {
+    let mut coverage = vec![0; FUZZ_PASSES.len()];
+
+    let checked = fuzz_one("++[->+<]>.", 1000, None, &mut coverage);
+    assert_eq!(checked, Ok(true));
+    // At least known_zero and multiply apply to this program.
+    assert!(coverage.iter().filter(|&&count| count > 0).count() >= 2);
+
+    // Infinite loops are discarded.
+    assert_eq!(fuzz_one("+[]", 1000, None, &mut coverage), Ok(false));
+}
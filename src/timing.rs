@@ -0,0 +1,194 @@
+//! Wall time and size statistics for each phase of compilation, as
+//! shown by `--time-passes`.
+
+use std::fmt::Write;
+use std::fs;
+use std::time::{Duration, Instant};
+
+#[cfg(test)]
+use pretty_assertions::assert_eq;
+
+use crate::peephole::{PassStats, PeepholeStats};
+
+#[derive(Debug, Default)]
+pub struct Report {
+    pub filename: String,
+    /// How long each phase took, in the order they ran.
+    pub phases: Vec<(&'static str, Duration)>,
+    pub peephole: PeepholeStats,
+    /// Stats for each LLVM pass, in the order they ran. Sizes are in
+    /// LLVM instructions.
+    pub llvm_passes: Vec<PassStats>,
+    /// AST nodes after parsing, and after peephole optimisation.
+    pub ast_nodes: Option<(usize, usize)>,
+    /// LLVM instructions before and after LLVM optimisation.
+    pub llvm_instrs: Option<(usize, usize)>,
+}
+
+impl Report {
+    pub fn new(filename: &str) -> Self {
+        Report {
+            filename: filename.to_owned(),
+            ..Report::default()
+        }
+    }
+
+    /// Record that `phase` ran from `start` until now.
+    pub fn record(&mut self, phase: &'static str, start: Instant) {
+        self.phases.push((phase, start.elapsed()));
+    }
+
+    pub fn to_text(&self) -> String {
+        let mut s = format!("Time report for {}:\n", self.filename);
+        for &(phase, time) in &self.phases {
+            let _ = writeln!(s, "  {:<24}{:>10.3}ms", phase, millis(time));
+            if phase == "peephole" {
+                for pass in &self.peephole.passes {
+                    let _ = writeln!(
+                        s,
+                        "    {:<22}{:>10.3}ms  nodes: {} -> {}",
+                        pass.name,
+                        millis(pass.time),
+                        pass.nodes_before,
+                        pass.nodes_after
+                    );
+                }
+            }
+            if phase == "llvm_opt" {
+                for pass in &self.llvm_passes {
+                    let _ = writeln!(
+                        s,
+                        "    {:<22}{:>10.3}ms  instructions: {} -> {}",
+                        pass.name,
+                        millis(pass.time),
+                        pass.nodes_before,
+                        pass.nodes_after
+                    );
+                }
+            }
+        }
+
+        if self.peephole.iterations > 0 {
+            let _ = writeln!(s, "  peephole iterations: {}", self.peephole.iterations);
+        }
+        if let Some((parsed, optimised)) = self.ast_nodes {
+            let _ = writeln!(
+                s,
+                "  AST nodes: {} parsed, {} after peephole optimisation",
+                parsed, optimised
+            );
+        }
+        if let Some((before, after)) = self.llvm_instrs {
+            let _ = writeln!(
+                s,
+                "  LLVM instructions: {} before optimisation, {} after",
+                before, after
+            );
+        }
+        if let Some(rss) = peak_rss_kib() {
+            let _ = writeln!(s, "  peak RSS: {} KiB", rss);
+        }
+        s
+    }
+
+    pub fn to_json(&self) -> String {
+        let phases: Vec<_> = self
+            .phases
+            .iter()
+            .map(|&(phase, time)| format!("{{\"name\":\"{}\",\"ms\":{:.3}}}", phase, millis(time)))
+            .collect();
+        let passes: Vec<_> = self.peephole.passes.iter().map(pass_json).collect();
+        let llvm_passes: Vec<_> = self.llvm_passes.iter().map(llvm_pass_json).collect();
+
+        format!(
+            "{{\"file\":{},\"phases\":[{}],\"peephole\":{{\"iterations\":{},\"passes\":[{}]}},\
+             \"ast_nodes\":{},\"llvm_instructions\":{},\"llvm_passes\":[{}],\"peak_rss_kib\":{}}}",
+            json_string(&self.filename),
+            phases.join(","),
+            self.peephole.iterations,
+            passes.join(","),
+            match self.ast_nodes {
+                Some((parsed, optimised)) => {
+                    format!("{{\"parsed\":{},\"optimised\":{}}}", parsed, optimised)
+                }
+                None => "null".to_owned(),
+            },
+            match self.llvm_instrs {
+                Some((before, after)) => format!("{{\"before\":{},\"after\":{}}}", before, after),
+                None => "null".to_owned(),
+            },
+            llvm_passes.join(","),
+            match peak_rss_kib() {
+                Some(rss) => rss.to_string(),
+                None => "null".to_owned(),
+            }
+        )
+    }
+}
+
+fn millis(time: Duration) -> f64 {
+    time.as_secs_f64() * 1000.0
+}
+
+fn pass_json(pass: &PassStats) -> String {
+    format!(
+        "{{\"name\":\"{}\",\"ms\":{:.3},\"nodes_before\":{},\"nodes_after\":{}}}",
+        pass.name,
+        millis(pass.time),
+        pass.nodes_before,
+        pass.nodes_after
+    )
+}
+
+fn llvm_pass_json(pass: &PassStats) -> String {
+    format!(
+        "{{\"name\":\"{}\",\"ms\":{:.3},\"instructions_before\":{},\"instructions_after\":{}}}",
+        pass.name,
+        millis(pass.time),
+        pass.nodes_before,
+        pass.nodes_after
+    )
+}
+
+/// Quote `s` as a JSON string.
+fn json_string(s: &str) -> String {
+    let mut result = "\"".to_owned();
+    for c in s.chars() {
+        match c {
+            '"' => result += "\\\"",
+            '\\' => result += "\\\\",
+            c if (c as u32) < 0x20 => {
+                let _ = write!(result, "\\u{:04x}", c as u32);
+            }
+            c => result.push(c),
+        }
+    }
+    result.push('"');
+    result
+}
+
+/// The peak resident set size of this process, if the OS tells us.
+fn peak_rss_kib() -> Option<u64> {
+    let status = fs::read_to_string("/proc/self/status").ok()?;
+    let line = status.lines().find(|line| line.starts_with("VmHWM:"))?;
+    line.split_whitespace().nth(1)?.parse().ok()
+}
+
+#[test]
+fn json_string_escapes() {
+    assert_eq!(json_string("a\"b\\c\n"), "\"a\\\"b\\\\c\\u000a\"");
+}
+
+#[test]
+fn json_report_phases() {
+    let mut report = Report::new("foo.bf");
+    report.phases.push(("parse", Duration::from_micros(1500)));
+    report.ast_nodes = Some((10, 4));
+
+    let json = report.to_json();
+    assert!(json.starts_with(
+        "{\"file\":\"foo.bf\",\"phases\":[{\"name\":\"parse\",\"ms\":1.500}],\
+         \"peephole\":{\"iterations\":0,\"passes\":[]},\
+         \"ast_nodes\":{\"parsed\":10,\"optimised\":4},\"llvm_instructions\":null,"
+    ));
+}